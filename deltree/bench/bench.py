@@ -0,0 +1,472 @@
+#!/usr/bin/env python3
+
+# deltree benchmark: generate synthetic trees and time each delete
+# engine on them.
+#
+# run every shape with every engine this system supports, 3 times each
+#   ./bench.py --deltree ../build/release/deltree
+# quick smoke run at 1% of the normal size, results as json
+#   ./bench.py --deltree ../build/release/deltree --scale 0.01 --format json
+# unlinks in directory order against inode order, on the wide tree
+#   ./bench.py --deltree ../build/release/deltree --shapes wide --orders dir inode
+# deltree's own overhead: the same shapes in memory, 20us per unlink
+#   ./bench.py --deltree ../build/release/deltree --engines memfs --memfs-opts unlink=20
+# kill each delete after 5s and time the rerun, without the journal
+#   ./bench.py --deltree ../build/release/deltree --kill-after 5 --opts=--no-journal
+# just create a tree to play with
+#   ./bench.py --gen build --dir /tmp/tree
+#
+# Results go to stdout (or -o), progress to stderr. Each run deletes
+# a freshly generated tree; generating is not part of the timing.
+
+import argparse
+import csv
+import json
+import os
+import platform
+import shlex
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+
+IS_WINDOWS = platform.system() == 'Windows'
+IS_LINUX = platform.system() == 'Linux'
+
+TOMB_DIR = '.deltree-tombstones'
+TOMB_LOCK = '.lock'
+
+COLUMNS = ['shape', 'engine', 'order', 'run', 'files', 'dirs', 'bytes', 'caches',
+           'wall_s', 'ops_per_s', 'peak_rss_kb', 'reclaim_s', 'killed_s',
+           'resume_s', 'status']
+
+
+def log(msg):
+    print(msg, file=sys.stderr, flush=True)
+
+
+#
+# tree generators, each returns (files, dirs, bytes) it created below root
+#
+
+def touch(path, size=0):
+    fd = os.open(path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+    try:
+        if size:
+            os.write(fd, b'\0' * size)
+    finally:
+        os.close(fd)
+
+
+def gen_deep(root, scale):
+    # one long chain of directories, a couple of files on every level,
+    # like node_modules or a runaway recursive copy. Names are short so
+    # the chain stays under PATH_MAX.
+    depth = max(2, int(1000 * scale))
+    files = 0
+    path = root
+    for i in range(depth):
+        path = os.path.join(path, 'd')
+        os.mkdir(path)
+        for j in range(2):
+            touch(os.path.join(path, 'f%d' % j), 64)
+            files += 1
+    return files, depth, files * 64
+
+
+def gen_wide(root, scale):
+    # a single flat directory, 1M empty entries at full scale. Stresses
+    # enumeration and the directory's own lock more than anything else.
+    count = max(1, int(1000000 * scale))
+    path = os.path.join(root, 'flat')
+    os.mkdir(path)
+    for i in range(count):
+        touch(os.path.join(path, 'entry%07d' % i))
+    return count, 1, 0
+
+
+def gen_build(root, scale):
+    # what a C/C++ build leaves behind: modules of nested source dirs,
+    # each with a pile of small .o and .d files, plus a few libraries
+    modules = max(1, int(100 * scale))
+    files = dirs = size = 0
+    for m in range(modules):
+        mod = os.path.join(root, 'mod%03d' % m)
+        for sub in ('core', 'util', 'io', 'test'):
+            obj = os.path.join(mod, sub, 'obj')
+            os.makedirs(obj)
+            dirs += 3 if sub == 'core' else 2
+            for i in range(60):
+                osize = 2048 + (i * 7919) % 63488  # 2-64 KB, spread out
+                touch(os.path.join(obj, 'src%03d.o' % i), osize)
+                touch(os.path.join(obj, 'src%03d.d' % i), 300)
+                files += 2
+                size += osize + 300
+        touch(os.path.join(mod, 'lib%03d.a' % m), 1 << 20)
+        files += 1
+        size += 1 << 20
+    return files, dirs, size
+
+
+def gen_huge(root, scale):
+    # a handful of big files, where the cost is freeing extents rather
+    # than metadata. Space is really allocated, sparse files would be
+    # too easy.
+    count = 4
+    fsize = max(1 << 20, int((1 << 30) * scale))
+    path = os.path.join(root, 'big')
+    os.mkdir(path)
+    chunk = b'\0' * (1 << 20)
+    for i in range(count):
+        name = os.path.join(path, 'huge%d.bin' % i)
+        fd = os.open(name, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+        try:
+            if hasattr(os, 'posix_fallocate'):
+                os.posix_fallocate(fd, 0, fsize)
+            else:
+                for _ in range(fsize // len(chunk)):
+                    os.write(fd, chunk)
+        finally:
+            os.close(fd)
+    return count, 1, count * fsize
+
+
+SHAPES = {
+    'deep': gen_deep,
+    'wide': gen_wide,
+    'build': gen_build,
+    'huge': gen_huge,
+}
+
+
+def mem_build_dirs(n):
+    # directories fs_mem.c makes for build:n, 100 files and up to 8
+    # subdirectories in each
+    rest = n - min(n, 100)
+    subs = min(8, (rest + 99) // 100)
+    return 1 + sum(mem_build_dirs(rest // subs + (i < rest % subs))
+                   for i in range(subs))
+
+
+def mem_spec(shape, scale):
+    """deltree --memfs spec for about the same tree as the generator
+    makes on disk, return (spec, files, dirs) or None"""
+    if shape == 'wide':
+        count = max(1, int(1000000 * scale))
+        return 'wide:%d' % count, count, 1
+    if shape == 'deep':
+        depth = max(2, int(1000 * scale))
+        return 'deep:%d' % depth, depth * 2, depth
+    if shape == 'build':
+        files = max(1, int(100 * scale)) * 481
+        return 'build:%d' % files, files, mem_build_dirs(files)
+    return None  # huge is about freeing extents, nothing to see
+
+
+def generate(shape, root, scale):
+    os.makedirs(root)
+    files, dirs, size = SHAPES[shape](root, scale)
+    return files, dirs + 1, size  # and root itself
+
+
+#
+# running deltree
+#
+
+def available_engines(deltree):
+    engines = ['native', 'tombstone']
+    if IS_WINDOWS:
+        engines.insert(0, 'shell')
+    if IS_LINUX:
+        # deltree says so on stderr if it has to fall back to syscalls
+        p = subprocess.run([deltree, '-yn', '--engine=uring', os.devnull],
+                           stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                           universal_newlines=True)
+        if 'io_uring not available' not in p.stderr:
+            engines.append('uring')
+    return engines
+
+
+def drop_caches():
+    """Drop the page, dentry and inode caches if we are allowed to.
+    Returns 'cold' if they were dropped, 'warm' otherwise."""
+    if not IS_LINUX:
+        return 'warm'
+    try:
+        os.sync()
+        with open('/proc/sys/vm/drop_caches', 'w') as f:
+            f.write('3\n')
+        return 'cold'
+    except OSError:
+        return 'warm'
+
+
+def run_deltree(deltree, engine, target, extra, kill_after=None):
+    """Delete target, return (wall seconds, peak rss in KB or None,
+    exit status). With kill_after, kill it after that many seconds if
+    it is still running."""
+    cmd = [deltree, '-y', '--engine=' + engine] + extra + [target]
+    begin = time.perf_counter()
+    p = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+    timer = None
+    if kill_after:
+        timer = threading.Timer(kill_after, p.kill)
+        timer.start()
+    try:
+        return wait_deltree(p, begin)
+    finally:
+        if timer:
+            timer.cancel()
+
+
+def sample_hwm(pid, peak, done):
+    """note the VmHWM of process pid in peak[0] (KB) until done is set
+    or it exits. Sampled while it runs, the peak of its last few ms
+    can be missed."""
+    path = '/proc/%d/status' % pid
+    while True:
+        try:
+            with open(path) as f:
+                for line in f:
+                    if line.startswith('VmHWM:'):
+                        peak[0] = int(line.split()[1])
+                        break
+                else:
+                    return  # exited, a zombie has no memory left
+        except OSError:
+            return
+        if done.wait(0.005):
+            return
+
+
+def wait_deltree(p, begin):
+    """wait for the deltree started at begin, see run_deltree()"""
+    if hasattr(os, 'wait4'):
+        # ru_maxrss counts the memory of the process before it exec'ed
+        # deltree too, which was a fork of us. On Linux VmHWM has only
+        # deltree's own.
+        peak, done, sampler = [None], threading.Event(), None
+        if IS_LINUX:
+            sampler = threading.Thread(target=sample_hwm,
+                                       args=(p.pid, peak, done))
+            sampler.start()
+        _, status, usage = os.wait4(p.pid, 0)
+        wall = time.perf_counter() - begin
+        p.returncode = os.waitstatus_to_exitcode(status) \
+            if hasattr(os, 'waitstatus_to_exitcode') else status >> 8
+        if sampler:
+            done.set()
+            sampler.join()
+            return wall, peak[0], p.returncode
+        rss = usage.ru_maxrss
+        if platform.system() == 'Darwin':
+            rss //= 1024  # bytes there, KB on Linux
+        return wall, rss, p.returncode
+    p.wait()
+    return time.perf_counter() - begin, None, p.returncode
+
+
+def tomb_dirs(path):
+    """tombstone directories deltree may have used for path"""
+    found = []
+    cur = os.path.abspath(path)
+    while True:
+        tomb = os.path.join(cur, TOMB_DIR)
+        if os.path.isdir(tomb):
+            found.append(tomb)
+        parent = os.path.dirname(cur)
+        if parent == cur:
+            return found
+        cur = parent
+
+
+def wait_reclaim(target, timeout):
+    """wait for the background reclaimer to empty the tombstone
+    directories, return how long it took or None on timeout"""
+    begin = time.perf_counter()
+    while time.perf_counter() - begin < timeout:
+        busy = False
+        for tomb in tomb_dirs(os.path.dirname(target)):
+            try:
+                if [e for e in os.listdir(tomb) if e != TOMB_LOCK]:
+                    busy = True
+            except OSError:
+                pass
+        if not busy:
+            return time.perf_counter() - begin
+        time.sleep(0.05)
+    return None
+
+
+def bench_one(args, shape, engine, order, extra):
+    """run one shape with one engine and unlink order args.repeat
+    times, return the result rows"""
+    name = '%s/%s' % (shape, engine)
+    if order != 'auto':
+        extra = extra + ['--order=' + order]
+        name += '/' + order
+    memfs = engine == 'memfs'
+    if memfs:
+        spec = mem_spec(shape, args.scale)
+        if not spec:
+            log('%s: no in-memory version, skipped' % name)
+            return []
+        extra = extra + ['--memfs=' + ','.join([spec[0]] + args.memfs_opts)]
+        engine = 'native'
+    rows = []
+    walls = []
+    for run in range(1, args.repeat + 1):
+        target = os.path.join(args.dir, '%s-%d' % (name.replace('/', '-'),
+                                                    run))
+        if memfs:
+            # a name, deltree makes the tree itself
+            files, dirs, size = spec[1], spec[2], 0
+            caches = ''
+        else:
+            log('%s run %d: generating ...' % (name, run))
+            files, dirs, size = generate(shape, target, args.scale)
+            caches = 'warm' if args.no_drop_caches else drop_caches()
+
+        log('%s run %d: deleting %d files, %d dirs (%s)'
+            % (name, run, files, dirs, caches))
+        killed = resume = None
+        wall, rss, rc = run_deltree(args.deltree, engine, target, extra,
+                                    args.kill_after)
+        if args.kill_after and rc != 0 and wall >= args.kill_after:
+            # killed halfway, time the run that picks it up
+            killed = wall
+            log('%s run %d: killed after %.1fs, running again'
+                % (name, run, wall))
+            resume, rss2, rc = run_deltree(args.deltree, engine, target,
+                                           extra)
+            wall += resume
+            if rss is None or (rss2 is not None and rss2 > rss):
+                rss = rss2
+        reclaim = None
+        if engine == 'tombstone':
+            # don't let the reclaimer run into the next delete
+            reclaim = wait_reclaim(target, args.timeout)
+
+        status = 'ok'
+        if rc != 0 or (not memfs and os.path.lexists(target)):
+            status = 'failed'
+        elif engine == 'tombstone' and reclaim is None:
+            status = 'reclaim-timeout'
+        walls.append(wall)
+        rows.append({
+            'shape': shape, 'engine': 'memfs' if memfs else engine,
+            'order': order, 'run': run,
+            'files': files, 'dirs': dirs, 'bytes': size,
+            'caches': caches, 'wall_s': round(wall, 4),
+            'ops_per_s': round((files + dirs) / wall) if wall else '',
+            'peak_rss_kb': rss if rss is not None else '',
+            'reclaim_s': round(reclaim, 4) if reclaim is not None else '',
+            'killed_s': round(killed, 4) if killed is not None else '',
+            'resume_s': round(resume, 4) if resume is not None else '',
+            'status': status,
+        })
+    if len(walls) > 1:
+        med = statistics.median(walls)
+        rows.append(dict(rows[-1], run='median', caches='',
+                         wall_s=round(med, 4),
+                         ops_per_s=round((files + dirs) / med) if med else '',
+                         peak_rss_kb='', reclaim_s='', killed_s='',
+                         resume_s='', status=''))
+    return rows
+
+
+def bench(args):
+    engines = args.engines or available_engines(args.deltree)
+    shapes = args.shapes or list(SHAPES)
+    extra = []
+    if args.threads:
+        extra.append('-j%d' % args.threads)
+    if args.opts:
+        extra += shlex.split(args.opts)
+    rows = []
+
+    os.makedirs(args.dir, exist_ok=True)
+    for shape in shapes:
+        for engine in engines:
+            for order in args.orders:
+                rows += bench_one(args, shape, engine, order, extra)
+    return rows
+
+
+def write_rows(rows, fmt, out):
+    if fmt == 'json':
+        json.dump(rows, out, indent=1)
+        out.write('\n')
+        return
+    w = csv.DictWriter(out, fieldnames=COLUMNS,
+                       delimiter='\t' if fmt == 'tsv' else ',',
+                       lineterminator='\n')
+    w.writeheader()
+    w.writerows(rows)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='deltree benchmark')
+    parser.add_argument('--deltree', help='deltree binary to benchmark')
+    parser.add_argument('--dir', default=os.path.join('build', 'bench'),
+                        help='where to generate trees, on the filesystem '
+                             'under test [build/bench]')
+    parser.add_argument('--shapes', nargs='+', choices=sorted(SHAPES),
+                        help='tree shapes to run [all]')
+    parser.add_argument('--engines', nargs='+',
+                        choices=['shell', 'native', 'uring', 'tombstone',
+                                 'memfs'],
+                        help='engines to run [all available], memfs is '
+                             'native on the in-memory filesystem')
+    parser.add_argument('--memfs-opts', nargs='+', default=[],
+                        help='latency and failure options for memfs, like '
+                             'unlink=20 fail=0.001, see src/fs_mem.c')
+    parser.add_argument('--orders', nargs='+', default=['auto'],
+                        choices=['auto', 'dir', 'inode'],
+                        help='unlink orders to compare, passed to deltree '
+                             'as --order [auto]')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs per shape and engine [3]')
+    parser.add_argument('--scale', type=float, default=1.0,
+                        help='tree size factor, 1.0 means 1M entries for '
+                             'wide and 1 GB files for huge [1.0]')
+    parser.add_argument('-j', '--threads', type=int,
+                        help='pass -j to deltree')
+    parser.add_argument('--opts', help='more deltree options, quoted, '
+                                       'like --opts=--no-journal')
+    parser.add_argument('--kill-after', type=float,
+                        help='kill each delete after this many seconds and '
+                             'run it again to finish, wall_s is the sum')
+    parser.add_argument('--no-drop-caches', action='store_true',
+                        help="don't drop caches before each delete")
+    parser.add_argument('--timeout', type=float, default=600,
+                        help='seconds to wait for a tombstone reclaimer [600]')
+    parser.add_argument('--format', choices=['csv', 'tsv', 'json'],
+                        default='tsv', help='result format [tsv]')
+    parser.add_argument('-o', '--output', help='result file [stdout]')
+    parser.add_argument('--gen', choices=sorted(SHAPES),
+                        help='only generate a tree of this shape in --dir')
+    args = parser.parse_args()
+
+    if args.gen:
+        files, dirs, size = generate(args.gen, args.dir, args.scale)
+        log('%s: %d files, %d dirs, %d bytes' % (args.dir, files, dirs, size))
+        return 0
+
+    if not args.deltree:
+        parser.error('--deltree is required')
+    args.deltree = os.path.abspath(args.deltree)
+
+    rows = bench(args)
+    if args.output:
+        with open(args.output, 'w', newline='') as f:
+            write_rows(rows, args.format, f)
+    else:
+        write_rows(rows, args.format, sys.stdout)
+    return 0 if all(r['status'] in ('ok', '') for r in rows) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
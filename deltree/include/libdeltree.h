@@ -0,0 +1,154 @@
+// libdeltree.h
+//
+// The deltree engine as a library, for programs that delete trees
+// themselves: a build system clearing its output, a cache evicting
+// entries, a test harness cleaning up.
+//
+// A delete runs in the background. DeltreeStart() returns at once,
+// DeltreePoll() reads its live counters without slowing it down, a
+// callback says when it is done, and DeltreeCancel() stops it soon
+// with whatever it hasn't reached left in place. Failures are counted
+// by error code, with the paths of the first few of each kept for
+// DeltreeErrorGet(). If some may be transient (a file held open) what
+// is left is gone over again.
+//
+// Deletes started in the same DeltreeGroup share a rate limit, and
+// DeltreeGroupPoll() adds up their counters.
+//
+// This header only needs the C library. Paths are wchar_t on Windows
+// and char everywhere else, as with the deltree command line.
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define LIBDELTREE_VERSION      "1.0.0"
+
+#ifdef _WIN32
+typedef wchar_t DeltreeChar;
+#else
+typedef char DeltreeChar;
+#endif
+
+
+// DeltreeOptions.order
+#define DELTREE_ORDER_AUTO      0   // by inode where the filesystem gains
+#define DELTREE_ORDER_DIR       1   // as the directory listing returns them
+#define DELTREE_ORDER_INODE     2   // sorted by inode number
+
+// DeltreeError.what
+#define DELTREE_OPENDIR         0   // opening or reading a directory
+#define DELTREE_UNLINK          1   // removing a file
+#define DELTREE_RMDIR           2   // removing a directory
+
+// DeltreeWait() of a delete DeltreeCancel() stopped
+#define DELTREE_CANCELLED       (-1)
+
+
+/**
+ * how to delete, set up with DeltreeOptionsInit() before changing any
+ * of it
+ */
+typedef struct DeltreeOptions_ {
+   size_t size;          // sizeof(DeltreeOptions) the caller knows
+   int threads;          // worker threads, 0 for the default. The most
+                         // that may run with adaptive.
+   int adaptive;         // tune the number of running workers as we go
+   int queueDepth;       // io_uring unlinks in flight per worker on
+                         // Linux, 0 for plain syscalls
+   int order;            // DELTREE_ORDER_*
+   uint64_t maxMemory;   // bytes queued directories may take, 0 for
+                         // the default
+   int stats;            // count the bytes freed, a stat per file
+   int emptyOnly;        // only remove empty directories, keep files
+                         // and the target itself
+   int journal;          // note how far big directories were read, so
+                         // a delete that was killed resumes there
+   int pathsPerError;    // paths kept per error code, for
+                         // DeltreeErrorGet()
+   int retries;          // times to go over what is left again when
+                         // failures may be transient
+} DeltreeOptions;
+
+
+/**
+ * live counters of a delete or a group
+ */
+typedef struct DeltreeProgress_ {
+   uint64_t files;       // files (and links) removed
+   uint64_t dirs;        // directories removed
+   uint64_t bytes;       // size of the files removed, with stats
+   uint64_t errors;      // operations that failed
+   double seconds;       // since it started
+   int done;             // the delete is over, DeltreeWait() won't block
+} DeltreeProgress;
+
+
+/**
+ * how a delete ended
+ */
+typedef struct DeltreeResult_ {
+   uint64_t files;
+   uint64_t dirs;
+   uint64_t bytes;       // with DeltreeOptions.stats
+   uint64_t errors;
+   int lastError;        // native error code of the last failure
+   double seconds;
+   int cancelled;        // stopped by DeltreeCancel()
+   uint64_t resumed;     // directories an earlier run had started
+   int retries;          // times it went over what was left again
+   uint64_t leftFiles;   // what failures left behind, counted after
+   uint64_t leftDirs;    // the delete. 0 if cancelled.
+   uint64_t leftBytes;
+} DeltreeResult;
+
+
+/**
+ * one failure
+ */
+typedef struct DeltreeError_ {
+   const DeltreeChar *path;   // below the target, or the target's
+                              // path as DeltreeStart() got it
+   int code;                  // native error code
+   int what;                  // DELTREE_*
+   uint64_t count;            // failures with this code in all
+} DeltreeError;
+
+
+typedef struct DeltreeOp_ DeltreeOp;
+typedef struct DeltreeGroup_ DeltreeGroup;
+
+// called once a delete is over, on the thread that ran it. It must
+// not wait for or free op.
+typedef void (*DeltreeDoneFunc)(DeltreeOp *op, const DeltreeResult *res,
+                                void *ctx);
+
+
+const char   *DeltreeVersion(void);
+void          DeltreeOptionsInit(DeltreeOptions *opts);
+
+DeltreeGroup *DeltreeGroupCreate(double maxOpsPerSec, double maxBytesPerSec);
+void          DeltreeGroupPoll(DeltreeGroup *group, DeltreeProgress *p);
+void          DeltreeGroupFree(DeltreeGroup *group);
+
+int           DeltreeStart(const DeltreeChar *path,
+                           const DeltreeOptions *opts, DeltreeGroup *group,
+                           DeltreeDoneFunc done, void *ctx, DeltreeOp **op);
+void          DeltreePoll(DeltreeOp *op, DeltreeProgress *p);
+void          DeltreeCancel(DeltreeOp *op);
+int           DeltreeWait(DeltreeOp *op, DeltreeResult *res);
+size_t        DeltreeErrorCount(DeltreeOp *op, uint64_t *dropped);
+const DeltreeError *DeltreeErrorGet(DeltreeOp *op, size_t i);
+void          DeltreeFree(DeltreeOp *op);
+
+
+#ifdef __cplusplus
+}
+#endif
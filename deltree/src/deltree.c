@@ -3,25 +3,78 @@
 
 #include <stdio.h>
 #include <errno.h>
-#include <io.h>
 #include <assert.h>
 #include <time.h>
 
-#include <windows.h>
-#include <conio.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
 
+#include "platform.h"
+#include "engine.h"
+#include "tombstone.h"
+#include "sched.h"
+#include "scan.h"
+#include "stats.h"
+#include "progress.h"
+#include "stream.h"
+#include "purge.h"
+#include "rate.h"
+#include "journal.h"
+#include "report.h"
+#include "fs.h"
 
-#define DELTREE_VER    L"1.0.3"
 
-#ifndef FALSE
-#define FALSE          0
-#endif
+#define DELTREE_VER    _T("1.1.0")
 
-#ifndef TRUE
-#define TRUE           1
+// options start with - everywhere, and also with / on Windows
+#ifdef _WIN32
+#define IS_OPTION(s)   ((s)[0] == _T('-') || (s)[0] == _T('/'))
+#else
+#define IS_OPTION(s)   ((s)[0] == _T('-'))
 #endif
 
-typedef char           Bool;
+/**
+ * the available delete engines
+ */
+typedef enum {
+   ENGINE_NATIVE,  // our own parallel tree walker
+   ENGINE_SHELL,   // SHFileOperation(), what Explorer uses (Windows only)
+   ENGINE_URING,   // native engine with io_uring batched unlinks (Linux)
+   ENGINE_TOMBSTONE,  // rename out of the way, reclaim in the background
+} EngineType;
+
+/**
+ * what --stats prints after the deletes
+ */
+typedef enum {
+   STATS_NONE,
+   STATS_TEXT,     // a readable summary per target
+   STATS_JSON,     // one JSON document on stdout, status lines on stderr
+} StatsMode;
+
+#define DEFAULT_QUEUE_DEPTH  256
+#define DEFAULT_PER_DEVICE   2     // targets deleted at once on one device
+#define DEFAULT_RETRIES      2     // passes over what transient failures left
+#define REPORT_PATHS         10    // failed paths listed per error code
+
+#define EXIT_PARTIAL         2     // some of what was asked is left
+
+// name of an engine as --engine spells it
+static const TCHAR *
+EngineName(EngineType engine)  // IN
+{
+   switch (engine) {
+   case ENGINE_SHELL:
+      return _T("shell");
+   case ENGINE_URING:
+      return _T("uring");
+   case ENGINE_TOMBSTONE:
+      return _T("tombstone");
+   default:
+      return _T("native");
+   }
+}
 
 /**
  * holding all the variables processed by cmd line options
@@ -30,6 +83,31 @@ typedef struct AppInputs_ {
    Bool noPrompt;  // do not prompt for confirmation
    Bool silent;    // do not show progress dialog
    Bool simulate;  // simulate operation
+   Bool noProgress;  // --no-progress
+   Bool noJournal; // --no-journal, a killed delete starts over
+   int  retries;   // --retries, passes over what transient failures left
+   Bool emptyOnly; // --empty-dirs, sweep empty directories only
+   Bool listNul;   // -0, list entries end with NUL instead of newline
+   const TCHAR *listFile;  // --from, read the targets from here
+   uint64_t maxBytes;  // --max-size, trim targets instead of deleting
+   uint64_t maxFiles;  // --max-files, same
+   Bool purgeByMtime;  // --purge-by=mtime
+   Bool background;  // --background, idle cpu and I/O priority
+   uint64_t maxOps;  // --max-ops, unlinks and rmdirs per second
+   uint64_t maxMeta; // --max-meta, metadata bytes per second
+   DtRate *rate;   // shared by everything we delete, or NULL
+   const DtFs *fs; // --memfs, delete in-memory trees, or NULL
+   EngineType engine;  // which engine does the deleting
+   int  threads;   // worker threads for the native engine, 0 = default
+   int  queueDepth;  // io_uring unlinks in flight per worker
+   DtOrder order;  // --order, how each directory's files are unlinked
+   uint64_t maxMemory;  // --max-memory, for directories waiting
+   int  perDevice; // targets deleted at once on one device
+   const TCHAR *reclaimDir;  // run as a tombstone reclaimer for this dir
+   StatsMode stats;  // --stats output
+   DtItemStats *items;  // per delList entry, with --stats
+   DtProgress *progress;  // live progress line, or NULL
+   FILE *out;      // where status lines go
    int *delList;   // index to argv that are not an option (- or /)
    int  delSize;   // number of items in deleteList
 } AppInputs;
@@ -42,18 +120,375 @@ typedef struct AppInputs_ {
  * @return None
  */
 void
-Usage(const wchar_t *argv0)  // IN
+Usage(const TCHAR *argv0)  // IN
+{
+   _tprintf(_T("deltree v%s [%s, %s] (gcc %s)\n\n")
+            _T("Usage: %s [options] <path> ...\n\n")
+            _T("Options:\n")
+            _T("  -y          yes, suppresses prompting for confirmation\n")
+            _T("  -s          silent, do not display any progress dialog\n")
+            _T("  -n          do nothing, count what would be deleted\n")
+            _T("  -f          force, no prompting/silent (for rm compatibility)\n")
+            _T("  -r          ignored (for rm compatibility)\n")
+            _T("  -j <n>      use n worker threads, default auto: start with a\n")
+            _T("              few and tune the number while deleting\n")
+            _T("  --from=F    delete the paths listed in file F, one per line,\n")
+            _T("              - for stdin. Needs -y\n")
+            _T("  -0          list entries end with NUL (find -print0), implies\n")
+            _T("              --from=- unless given\n")
+#if defined(_WIN32)
+            _T("  --engine=E  delete engine: native (default) or shell\n")
+#elif defined(__linux__)
+            _T("  --engine=E  delete engine: native (default) or uring\n")
+            _T("  --queue-depth=N\n")
+            _T("              io_uring unlinks in flight per thread (default %d)\n")
+#else
+            _T("  --engine=E  delete engine: native (default)\n")
+#endif
+            _T("  --order=O   order of the unlinks in a directory: inode, dir\n")
+            _T("              (as listed) or auto (default), inode on ext4/xfs\n")
+            _T("  --max-memory=S\n")
+            _T("              memory for directories waiting to be read (K, M,\n")
+            _T("              G), default %dM\n")
+            _T("  --engine=tombstone\n")
+            _T("              move targets aside instantly, delete in the background\n")
+            _T("  --per-device=N\n")
+            _T("              delete up to N targets at once on each device (default %d)\n")
+            _T("  --stats[=F] timings, latencies and bytes freed per target, F is\n")
+            _T("              text (default) or json (on stdout, status on stderr)\n")
+            _T("  --no-progress\n")
+            _T("              don't show the live progress line\n")
+            _T("  --no-journal\n")
+            _T("              don't note progress for resuming a killed delete\n")
+            _T("  --retries=N go over what is left up to N more times when the\n")
+            _T("              failures may pass, like busy files (default %d)\n")
+            _T("  --empty-dirs\n")
+            _T("              remove only the empty directories below each target\n")
+            _T("  --memfs=SPEC\n")
+            _T("              delete in-memory trees generated as SPEC says, named\n")
+            _T("              by the paths, like wide:1e6,unlink=20\n")
+            _T("              (fs_mem.c), or holding the entries --from lists\n")
+            _T("  --max-size=S\n")
+            _T("              purge, delete the least recently used files until\n")
+            _T("              each target holds at most S bytes (K, M, G, T)\n")
+            _T("  --max-files=N\n")
+            _T("              purge until each target holds at most N files\n")
+            _T("  --purge-by=T\n")
+            _T("              rank files by atime (default) or mtime\n")
+            _T("  --background\n")
+            _T("              idle cpu and I/O priority, yield to everything else\n")
+            _T("  --max-ops=N delete at most N files and dirs per second\n")
+            _T("  --max-meta=S\n")
+            _T("              write at most S bytes of metadata per second (K, M),\n")
+            _T("              estimated at %d bytes plus the name per entry\n")
+            _T("\nDelete directories and all the subdirectories and files in it.\n")
+            _T("Exits with 0 if everything was deleted, %d if only part of it.\n"),
+            DELTREE_VER, _T(__DATE__), _T(__TIME__), _T(__VERSION__), argv0,
+#ifdef __linux__
+            DEFAULT_QUEUE_DEPTH,
+#endif
+            DT_MAX_MEMORY >> 20, DEFAULT_PER_DEVICE, DEFAULT_RETRIES,
+            DT_META_ENTRY, EXIT_PARTIAL);
+}
+
+
+/**
+ * Get the value of an option that takes an argument, either the rest
+ * of the current segment (-j8) or the next argument (-j 8).
+ *
+ * @param argc argc from main()
+ * @param argv argv from main()
+ * @param i index of current argument, advanced if next one is used
+ * @param j index of the option character in argv[i]
+ * @return the value, or NULL if missing
+ */
+static const TCHAR *
+OptionValue(int argc,         // IN
+            TCHAR **argv,     // IN
+            int *i,           // IN/OUT
+            int j)            // IN
 {
-   wprintf_s(L"deltree v%ws [%hs, %hs] (gcc %hs)\n\n"
-             L"Usage: %ws [options] <path> ...\n\n"
-             L"Options:\n"
-             L"  -y    yes, suppresses prompting for confirmation\n"
-             L"  -s    silent, do not display any progress dialog\n"
-             L"  -n    do nothing, simulate the operation\n"
-             L"  -f    force, no prompting/silent (for rm compatibility)\n"
-             L"  -r    ignored (for rm compatibility)\n"
-             L"\nDelete directories and all the subdirectories and files in it.\n",
-             DELTREE_VER, __DATE__, __TIME__, __VERSION__, argv0);
+   if (argv[*i][j + 1] != _T('\0')) {
+      return &argv[*i][j + 1];
+   }
+   if (*i + 1 < argc) {
+      return argv[++(*i)];
+   }
+   return NULL;
+}
+
+
+/**
+ * Parse a positive integer option value
+ *
+ * @param val string to parse
+ * @param max largest value accepted
+ * @param out receives the value
+ * @return TRUE if val is a valid number in 1..max
+ */
+static Bool
+ParseCount(const TCHAR *val,  // IN
+           long max,          // IN
+           int *out)          // OUT
+{
+   TCHAR *end;
+   long n;
+
+   if (!val || !val[0]) {
+      return FALSE;
+   }
+   n = _tcstol(val, &end, 10);
+   if (*end != _T('\0') || n <= 0 || n > max) {
+      return FALSE;
+   }
+   *out = (int) n;
+   return TRUE;
+}
+
+
+/**
+ * Parse a size or count option value, a number with an optional K, M,
+ * G or T suffix (powers of 1024) if suffix is set
+ *
+ * @param val string to parse
+ * @param suffix accept a unit
+ * @param out receives the value
+ * @return TRUE if val is a valid number
+ */
+static Bool
+ParseSize(const TCHAR *val,   // IN
+          Bool suffix,        // IN
+          uint64_t *out)      // OUT
+{
+   TCHAR *end;
+   unsigned long long n;
+   int shift = 0;
+
+   if (!val || val[0] < _T('0') || val[0] > _T('9')) {
+      return FALSE;
+   }
+   n = _tcstoull(val, &end, 10);
+   if (suffix && *end != _T('\0')) {
+      switch (*end++) {
+      case _T('k'):
+      case _T('K'):
+         shift = 10;
+         break;
+      case _T('m'):
+      case _T('M'):
+         shift = 20;
+         break;
+      case _T('g'):
+      case _T('G'):
+         shift = 30;
+         break;
+      case _T('t'):
+      case _T('T'):
+         shift = 40;
+         break;
+      default:
+         return FALSE;
+      }
+      if (*end == _T('b') || *end == _T('B')) {
+         end++;
+      }
+   }
+   if (*end != _T('\0') || n > (DT_NO_LIMIT - 1) >> shift) {
+      return FALSE;
+   }
+   *out = (uint64_t) n << shift;
+   return TRUE;
+}
+
+
+/**
+ * Process a --name=value style option
+ *
+ * @param argv0 program name for error messages
+ * @param opt option text after the leading --
+ * @param args AppInputs struct to be filled
+ * @return TRUE on success
+ */
+static Bool
+ParseLongOption(const TCHAR *argv0,  // IN
+                const TCHAR *opt,    // IN
+                AppInputs *args)     // OUT
+{
+   const TCHAR *val = _tcschr(opt, _T('='));
+   size_t len = val ? (size_t) (val - opt) : _tcslen(opt);
+
+   if (val) {
+      val++;
+   }
+
+   if (len == 6 && _tcsncmp(opt, _T("engine"), len) == 0 && val) {
+      if (_tcsicmp(val, _T("native")) == 0) {
+         args->engine = ENGINE_NATIVE;
+         return TRUE;
+      }
+#ifdef _WIN32
+      if (_tcsicmp(val, _T("shell")) == 0) {
+         args->engine = ENGINE_SHELL;
+         return TRUE;
+      }
+#endif
+      if (_tcsicmp(val, _T("tombstone")) == 0) {
+         args->engine = ENGINE_TOMBSTONE;
+         return TRUE;
+      }
+#ifdef __linux__
+      if (_tcsicmp(val, _T("uring")) == 0) {
+         args->engine = ENGINE_URING;
+         return TRUE;
+      }
+#endif
+      _ftprintf(stderr, _T("%s: unknown engine '%s'\n"), argv0, val);
+      return FALSE;
+   }
+   if (len == 11 && _tcsncmp(opt, _T("queue-depth"), len) == 0) {
+      if (!ParseCount(val, 32768, &args->queueDepth)) {
+         _ftprintf(stderr, _T("%s: --queue-depth needs a number\n"), argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 5 && _tcsncmp(opt, _T("order"), len) == 0 && val) {
+      if (_tcsicmp(val, _T("auto")) == 0) {
+         args->order = DT_ORDER_AUTO;
+         return TRUE;
+      }
+      if (_tcsicmp(val, _T("dir")) == 0) {
+         args->order = DT_ORDER_DIR;
+         return TRUE;
+      }
+      if (_tcsicmp(val, _T("inode")) == 0) {
+         args->order = DT_ORDER_INODE;
+         return TRUE;
+      }
+      _ftprintf(stderr, _T("%s: --order is auto, dir or inode\n"), argv0);
+      return FALSE;
+   }
+   if (len == 5 && _tcsncmp(opt, _T("stats"), len) == 0) {
+      if (!val || _tcsicmp(val, _T("text")) == 0) {
+         args->stats = STATS_TEXT;
+         return TRUE;
+      }
+      if (_tcsicmp(val, _T("json")) == 0) {
+         args->stats = STATS_JSON;
+         return TRUE;
+      }
+      _ftprintf(stderr, _T("%s: --stats is text or json\n"), argv0);
+      return FALSE;
+   }
+   if (len == 4 && _tcsncmp(opt, _T("from"), len) == 0) {
+      if (!val || !val[0]) {
+         _ftprintf(stderr, _T("%s: --from needs a file, - for stdin\n"), argv0);
+         return FALSE;
+      }
+      args->listFile = val;
+      return TRUE;
+   }
+   if (len == 8 && _tcsncmp(opt, _T("max-size"), len) == 0) {
+      if (!ParseSize(val, TRUE, &args->maxBytes)) {
+         _ftprintf(stderr, _T("%s: --max-size needs a size, like 10G\n"),
+                   argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 9 && _tcsncmp(opt, _T("max-files"), len) == 0) {
+      if (!ParseSize(val, FALSE, &args->maxFiles)) {
+         _ftprintf(stderr, _T("%s: --max-files needs a number\n"), argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 8 && _tcsncmp(opt, _T("purge-by"), len) == 0 && val) {
+      if (_tcsicmp(val, _T("atime")) == 0 || _tcsicmp(val, _T("mtime")) == 0) {
+         args->purgeByMtime = _tcsicmp(val, _T("mtime")) == 0;
+         return TRUE;
+      }
+      _ftprintf(stderr, _T("%s: --purge-by is atime or mtime\n"), argv0);
+      return FALSE;
+   }
+   if (len == 10 && _tcsncmp(opt, _T("background"), len) == 0 && !val) {
+      args->background = TRUE;
+      return TRUE;
+   }
+   if (len == 7 && _tcsncmp(opt, _T("max-ops"), len) == 0) {
+      if (!ParseSize(val, FALSE, &args->maxOps) || args->maxOps == 0) {
+         _ftprintf(stderr, _T("%s: --max-ops needs a number\n"), argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 8 && _tcsncmp(opt, _T("max-meta"), len) == 0) {
+      if (!ParseSize(val, TRUE, &args->maxMeta) || args->maxMeta == 0) {
+         _ftprintf(stderr, _T("%s: --max-meta needs a size, like 4M\n"),
+                   argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 10 && _tcsncmp(opt, _T("max-memory"), len) == 0) {
+      if (!ParseSize(val, TRUE, &args->maxMemory) ||
+          args->maxMemory < (1 << 20)) {
+         _ftprintf(stderr, _T("%s: --max-memory needs a size of 1M or ")
+                           _T("more\n"), argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 11 && _tcsncmp(opt, _T("no-progress"), len) == 0 && !val) {
+      args->noProgress = TRUE;
+      return TRUE;
+   }
+   if (len == 10 && _tcsncmp(opt, _T("empty-dirs"), len) == 0 && !val) {
+      args->emptyOnly = TRUE;
+      return TRUE;
+   }
+   if (len == 5 && _tcsncmp(opt, _T("memfs"), len) == 0 && val) {
+      if (!FsMemSetup(val)) {
+         _ftprintf(stderr, _T("%s: bad --memfs spec, try wide:1e6 or ")
+                           _T("build:1e5,unlink=20,fail=0.01\n"), argv0);
+         return FALSE;
+      }
+      args->fs = FsMem();
+      return TRUE;
+   }
+   if (len == 10 && _tcsncmp(opt, _T("no-journal"), len) == 0 && !val) {
+      args->noJournal = TRUE;
+      return TRUE;
+   }
+   if (len == 7 && _tcsncmp(opt, _T("retries"), len) == 0) {
+      if (val && _tcscmp(val, _T("0")) == 0) {
+         args->retries = 0;
+      } else if (!ParseCount(val, 10, &args->retries)) {
+         _ftprintf(stderr, _T("%s: --retries needs a number up to 10\n"),
+                   argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 10 && _tcsncmp(opt, _T("per-device"), len) == 0) {
+      if (!ParseCount(val, 64, &args->perDevice)) {
+         _ftprintf(stderr, _T("%s: --per-device needs a number\n"), argv0);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (len == 7 && _tcsncmp(opt, _T("reclaim"), len) == 0 && val && val[0]) {
+      // internal, used when we start a detached reclaimer
+      args->reclaimDir = val;
+      return TRUE;
+   }
+   if (len == 4 && _tcsncmp(opt, _T("help"), len) == 0) {
+      Usage(argv0);
+      return FALSE;
+   }
+
+   _ftprintf(stderr, _T("%s: invalid option -- '%s'\n"), argv0, opt);
+   return FALSE;
 }
 
 
@@ -67,11 +502,13 @@ Usage(const wchar_t *argv0)  // IN
  */
 Bool
 ParseArgs(int argc,         // IN
-          wchar_t **argv,   // IN
+          TCHAR **argv,     // IN
           AppInputs *args)  // OUT
 {
    int i, j;   // index for looping argv and individual options
    int k = 0;  // index for saving non option args
+   const TCHAR *val;
+   Bool endOfOptions = FALSE;  // seen "--"
 
    assert(args);
 
@@ -83,10 +520,10 @@ ParseArgs(int argc,         // IN
    // allocate memory for delete list
    args->delList = (int *) calloc(argc, sizeof(int));
    if (!args->delList) {
-      wchar_t buf[512];
-      _wcserror_s(buf, ARRAYSIZE(buf), errno);
-      fwprintf_s(stderr, L"%ws: calloc failed: %ws\n",
-                 argv[0], buf);
+      TCHAR buf[512];
+      DtStrError(errno, buf, ARRAYSIZE(buf));
+      _ftprintf(stderr, _T("%s: calloc failed: %s\n"),
+                argv[0], buf);
       return FALSE;
    }
 
@@ -94,41 +531,64 @@ ParseArgs(int argc,         // IN
    // handle both - and / for options, and we want to support mixing
    // options and path in any order.
    for (i = 1; i < argc; i++) {
-      if (argv[i][0] == L'-' || argv[i][0] == L'/') {
+      if (!endOfOptions && argv[i][0] == _T('-') && argv[i][1] == _T('-')) {
+         // "--" ends the options, "--name=value" is a long option
+         if (argv[i][2] == _T('\0')) {
+            endOfOptions = TRUE;
+         } else if (!ParseLongOption(argv[0], argv[i] + 2, args)) {
+            return FALSE;
+         }
+      } else if (!endOfOptions && IS_OPTION(argv[i])) {
          // support multiple options in one segment
-         for (j = 1; argv[i][j] != L'\0'; j++) {
+         for (j = 1; argv[i][j] != _T('\0'); j++) {
             switch (argv[i][j]) {
-            case L'y':  // disable prompting
-            case L'Y':
+            case _T('y'):  // disable prompting
+            case _T('Y'):
                args->noPrompt = TRUE;
                break;
-            case L'f':  // force (no prompt/silent, for rm compatibility)
-            case L'F':
+            case _T('f'):  // force (no prompt/silent, for rm compatibility)
+            case _T('F'):
                args->noPrompt = TRUE;
                args->silent = TRUE;
                break;
-            case L's':
-            case L'S':
+            case _T('s'):
+            case _T('S'):
                args->silent = TRUE;
                break;
-            case L'n':
-            case L'N':
+            case _T('n'):
+            case _T('N'):
                args->simulate = TRUE;
                break;
-            case L'r':  // ignored (for rm compatibility)
-            case L'R':
+            case _T('0'):  // NUL separated list
+               args->listNul = TRUE;
+               break;
+            case _T('r'):  // ignored (for rm compatibility)
+            case _T('R'):
                break;
-            case L'h':
-            case L'H':
-            case L'?':
+            case _T('j'):  // number of worker threads, -j8 or -j 8
+            case _T('J'):
+               val = OptionValue(argc, argv, &i, j);
+               if (val && _tcsicmp(val, _T("auto")) == 0) {
+                  args->threads = 0;
+               } else if (!ParseCount(val, 1024, &args->threads)) {
+                  _ftprintf(stderr, _T("%s: -j needs a thread count\n"),
+                            argv[0]);
+                  return FALSE;
+               }
+               goto next_arg;
+            case _T('h'):
+            case _T('H'):
+            case _T('?'):
                Usage(argv[0]);
                return FALSE;
             default:
-               fwprintf_s(stderr, L"%ws: invalid option -- '%wc'\n",
-                          argv[0], argv[i][j]);
+               _ftprintf(stderr, _T("%s: invalid option -- '%c'\n"),
+                         argv[0], argv[i][j]);
                return FALSE;
             }
          }
+      next_arg:
+         ;
       } else {
          args->delList[k++] = i;  // save non option args to list
          assert(k < argc);
@@ -136,9 +596,12 @@ ParseArgs(int argc,         // IN
    }
 
    args->delSize = k;
+   if (args->listNul && !args->listFile) {
+      args->listFile = _T("-");
+   }
 
    /* Check for mandatory arguments */
-   if (args->delSize == 0) {
+   if (args->delSize == 0 && !args->reclaimDir && !args->listFile) {
       Usage(argv[0]);
       return FALSE;
    }
@@ -151,30 +614,39 @@ ParseArgs(int argc,         // IN
  * Display a prompt and asks the user y/n.
  *
  * @param path path to show in the prompt
+ * @param emptyOnly ask about sweeping empty directories instead
+ * @param out where to show it
  * @return 0: no, 1: yes, 2: remaining, -1: quit
  */
 int
-PromptUser(const wchar_t *path)
+PromptUser(const TCHAR *path,  // IN
+           Bool emptyOnly,     // IN
+           FILE *out)          // IN
 {
    int rc = 0;
 
    // prompt like classic DOS deltree
-   wprintf_s(L"Delete directory \"%ws\" and all its subdirectories? [yNrq] ", path);
-   wchar_t x = _getwch();
-   wprintf_s(L"%wc\n", x);
+   if (emptyOnly) {
+      _ftprintf(out, _T("Remove the empty directories in \"%s\"? [yNrq] "), path);
+   } else {
+      _ftprintf(out, _T("Delete directory \"%s\" and all its subdirectories? [yNrq] "), path);
+   }
+   fflush(out);
+   TCHAR x = (TCHAR) _gettch();
+   _ftprintf(out, _T("%c\n"), x);
 
    switch (x) {
-   case L'y':
-   case L'Y':
+   case _T('y'):
+   case _T('Y'):
       rc = 1;
       break;
    case 3:   // ctrl-c
-   case L'q':
-   case L'Q':
+   case _T('q'):
+   case _T('Q'):
       rc = -1;
       break;
-   case L'r':
-   case L'R':
+   case _T('r'):
+   case _T('R'):
       rc = 2;
       break;
    }
@@ -183,76 +655,312 @@ PromptUser(const wchar_t *path)
 }
 
 
+#ifdef _WIN32
+
+/**
+ * Delete a path with SHFileOperation(), the same API Explorer uses
+ *
+ * @param path path to delete
+ * @param args argument object
+ * @param aborted set if the user cancelled the operation
+ * @return ERROR_SUCCESS or the SHFileOperation() error
+ */
+static int
+ShellDelete(const TCHAR *path,      // IN
+            const AppInputs *args,  // IN
+            Bool *aborted)          // OUT
+{
+   int res;
+   FILEOP_FLAGS fFlags = FOF_NOCONFIRMATION;
+
+   // double null terminate input path
+   size_t dirLength = _tcslen(path);
+   TCHAR *removeDir = (TCHAR *) malloc(sizeof(TCHAR) * (dirLength + 2));
+   if (!removeDir) {
+      return ERROR_NOT_ENOUGH_MEMORY;
+   }
+   memcpy(removeDir, path, sizeof(TCHAR) * (dirLength + 1));
+   removeDir[dirLength + 1] = _T('\0');
+
+   // Populate the SHFILEOPSTRUCT and delete the folder
+   if (args->silent) {
+      fFlags = FOF_NO_UI;
+   }
+   SHFILEOPSTRUCT fileOp = {NULL, FO_DELETE, removeDir, NULL,
+                            fFlags, FALSE, NULL, NULL};
+
+   res = SHFileOperation(&fileOp);
+   *aborted = fileOp.fAnyOperationsAborted == TRUE;
+
+   free(removeDir);
+
+   return res;
+}
+
+#endif
+
+
+/**
+ * Print the status line of an item. Concurrent deletes finish in any
+ * order, so they print the whole line in one call (stdio keeps those
+ * from interleaving). A delete running alone has already printed the
+ * start of the line before it began, unless there is a progress line.
+ *
+ * @param path path being deleted
+ * @param args argument object
+ * @param i index of the item in overall list
+ * @param alone the start of the line is already out
+ * @param status outcome, like "[done]"
+ * @param timeSpent seconds the delete took, < 0 to leave out
+ * @param report failures to list below the line, may be NULL
+ */
+static void
+PrintStatus(const TCHAR *path,        // IN
+            const AppInputs *args,    // IN
+            int i,                    // IN
+            Bool alone,               // IN
+            const TCHAR *status,      // IN
+            double timeSpent,         // IN
+            const DtReport *report)   // IN
+{
+   TCHAR secs[32] = _T("");
+
+   if (timeSpent >= 0) {
+      _sntprintf(secs, ARRAYSIZE(secs), _T(" (%.3fs)"), timeSpent);
+      secs[ARRAYSIZE(secs) - 1] = _T('\0');
+   }
+   ProgressSuspend(args->progress);
+   if (alone && !args->progress) {
+      _ftprintf(args->out, _T("%s%s\n"), status, secs);
+   } else {
+      _ftprintf(args->out, _T("[%d/%d] Deleting %s ... %s%s\n"),
+                i, args->delSize, path, status, secs);
+   }
+   if (report) {
+      ReportPrint(args->out, report);
+   }
+   ProgressResume(args->progress);
+}
+
+
+/**
+ * Count what deleting path would remove, for -n
+ *
+ * @param path path to scan
+ * @param args argument object
+ * @param i index of current item in overall list
+ * @param threads worker threads to use, 0 for default
+ * @param alone no other item is running at the same time
+ * @param begin DtNow() when we started
+ * @param partial set if some of it could be read but not all
+ * @return TRUE if the whole tree could be read
+ */
+static Bool
+SimulateItem(const TCHAR *path,      // IN
+             const AppInputs *args,  // IN
+             int i,                  // IN
+             int threads,            // IN
+             Bool alone,             // IN
+             double begin,           // IN
+             Bool *partial)          // OUT
+{
+   DtScanResult scan;
+   TCHAR size[32], status[160];
+   Bool ok;
+
+   ok = DtScanTree(path, args->fs, threads, TRUE, &scan);
+   *partial = !ok && scan.files + scan.dirs > 0;
+
+   StatsFormatBytes(scan.bytes, size, ARRAYSIZE(size));
+   _sntprintf(status, ARRAYSIZE(status),
+              _T("[simulate] %llu files, %llu dirs, %s"),
+              (unsigned long long) scan.files,
+              (unsigned long long) scan.dirs, size);
+   status[ARRAYSIZE(status) - 1] = _T('\0');
+   if (scan.errors) {
+      size_t len = _tcslen(status);
+      _sntprintf(status + len, ARRAYSIZE(status) - len,
+                 _T(", %llu unreadable (%d)"),
+                 (unsigned long long) scan.errors, scan.lastError);
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+   }
+   PrintStatus(path, args, i, alone, status, DtNow() - begin, NULL);
+
+   if (args->items) {
+      DtItemStats *it = &args->items[i - 1];
+      it->status = _T("simulate");
+      it->error = scan.lastError;
+      it->secs = DtNow() - begin;
+      it->res.files = scan.files;
+      it->res.dirs = scan.dirs;
+      it->res.bytes = scan.bytes;
+      it->res.errors = scan.errors;
+      it->res.lastError = scan.lastError;
+   }
+
+   if (scan.deepest) {
+      _ftprintf(args->out, _T("      deepest (%d): %s\n"),
+                scan.maxDepth, scan.deepest);
+   }
+   DtScanFree(&scan);
+
+   return ok;
+}
+
+
 /**
  * Run deltree on a particular directory
  *
  * @param path path to delete
  * @param args argument object
  * @param i index of current item in overall list
+ * @param threads worker threads to use, 0 for default
+ * @param alone no other delete is running at the same time
+ * @param partial set if it failed after removing some of it
  * @return TRUE on success, FALSE otherwise.
  */
 Bool
-DeleteItem(const wchar_t *path,    // IN
+DeleteItem(const TCHAR *path,      // IN
            const AppInputs *args,  // IN
-           int i)                  // IN
+           int i,                  // IN
+           int threads,            // IN
+           Bool alone,             // IN
+           Bool *partial)          // OUT
 
 {
    Bool rc = FALSE;
+   Bool aborted = FALSE;
+   Bool handled = FALSE;
    int res;
-   FILEOP_FLAGS fFlags = FOF_NOCONFIRMATION;
-   clock_t begin, end;
-   double timeSpent;
+   double begin, timeSpent;
+   TCHAR status[128], left[32];
+   size_t len;
+   DtResult result = {0};
+   DtReport report;
+
+   *partial = FALSE;
 
    if (!path || !path[0]) {
       return rc;
    }
 
-   // double null terminate input path
-   size_t dirLength = wcslen(path);
-   wchar_t *removeDir = (wchar_t *) malloc(sizeof(wchar_t) * (dirLength + 2));
-   if (!removeDir) {
-      wchar_t buf[512];
-      _wcserror_s(buf, ARRAYSIZE(buf), errno);
-      fwprintf_s(stderr, L"malloc failed: %ws\n", buf);
-      return rc;
+   if (alone && !args->progress) {
+      _ftprintf(args->out, _T("[%d/%d] Deleting %s ... "),
+                i, args->delSize, path);
+      fflush(args->out);
    }
-   wcscpy_s(removeDir, dirLength + 2, path);
-   removeDir[dirLength + 1] = L'\0';
 
-   wprintf_s(L"[%d/%d] Deleting %ws ... ", i, args->delSize, path);
-   fflush(stdout);
+   ReportInit(&report, REPORT_PATHS);
+   begin = DtNow(); // save start time
+   if (args->simulate) {
+      return SimulateItem(path, args, i, threads, alone, begin, partial);
+   }
 
-   // Populate the SHFILEOPSTRUCT and delete the folder
-   if (args->silent) {
-      fFlags = FOF_NO_UI;
+#ifdef _WIN32
+   if (args->engine == ENGINE_SHELL) {
+      res = ShellDelete(path, args, &aborted);
+      handled = TRUE;
    }
-   SHFILEOPSTRUCT fileOp = {NULL, FO_DELETE, removeDir, NULL,
-                            fFlags, FALSE, NULL, NULL};
+#endif
+   if (args->engine == ENGINE_TOMBSTONE && TombstoneBury(path) == 0) {
+      // gone from where it was, the reclaimer does the rest. If it
+      // can't be moved aside we delete it the normal way below.
+      res = 0;
+      handled = TRUE;
+   }
+   if (!handled) {
+      DtOptions opts = {0};
+      DtJournal *journal = args->noJournal || args->emptyOnly ? NULL :
+                           JournalOpen(path);
 
-   if (!args->simulate) {
-      begin = clock(); // save start time
-      res = SHFileOperation(&fileOp);
-      end = clock();   // save end time
-      timeSpent = (double) (end - begin) / CLOCKS_PER_SEC;
-      if (fileOp.fAnyOperationsAborted == TRUE) {
-         wprintf_s(L"[aborted] (%.3fs)\n", timeSpent);
-      } else if (res != ERROR_SUCCESS) {
-         wprintf_s(L"[failed/%d] (%.3fs)\n", res, timeSpent);
-      } else {
-         wprintf_s(L"[done] (%.3fs)\n", timeSpent);
-         rc = TRUE;
+      opts.threads = threads;
+      // -j pins the number, otherwise threads is just the ceiling
+      opts.adaptive = args->threads == 0;
+      if (args->engine == ENGINE_URING) {
+         opts.queueDepth = args->queueDepth;
+      }
+      opts.order = args->order;
+      opts.maxMemory = args->maxMemory;
+      opts.stats = args->stats != STATS_NONE;
+      opts.progress = args->progress;
+      opts.rate = args->rate;
+      opts.journal = journal;
+      opts.fs = args->fs;
+      opts.emptyOnly = args->emptyOnly;
+      opts.report = &report;
+      opts.retries = args->retries;
+      res = DtDeleteTree(path, &opts, &result) ? 0 : result.lastError;
+      JournalClose(journal, res == 0);
+   }
+   timeSpent = DtNow() - begin;
+
+   if (args->items) {
+      DtItemStats *it = &args->items[i - 1];
+      it->status = aborted ? _T("aborted") : res ? _T("failed") : _T("done");
+      it->error = res;
+      it->secs = timeSpent;
+      it->res = result;
+   }
+
+   if (aborted) {
+      PrintStatus(path, args, i, alone, _T("[aborted]"), timeSpent, NULL);
+   } else if (res != 0) {
+      _sntprintf(status, ARRAYSIZE(status), _T("[failed/%d]"), res);
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+      len = _tcslen(status);
+      if (result.errors) {
+         _sntprintf(status + len, ARRAYSIZE(status) - len,
+                    _T(" %llu error(s)"), (unsigned long long) result.errors);
+         status[ARRAYSIZE(status) - 1] = _T('\0');
+         len = _tcslen(status);
       }
+      if (result.leftFiles || result.leftDirs) {
+         StatsFormatBytes(result.leftBytes, left, ARRAYSIZE(left));
+         _sntprintf(status + len, ARRAYSIZE(status) - len,
+                    _T(", left %llu files, %llu dirs, %s"),
+                    (unsigned long long) result.leftFiles,
+                    (unsigned long long) result.leftDirs, left);
+         status[ARRAYSIZE(status) - 1] = _T('\0');
+      }
+      PrintStatus(path, args, i, alone, status, timeSpent, &report);
+      *partial = result.files + result.dirs > 0;
+   } else if (args->emptyOnly) {
+      _sntprintf(status, ARRAYSIZE(status), _T("[done] %llu empty dirs ")
+                 _T("removed"), (unsigned long long) result.dirs);
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+      PrintStatus(path, args, i, alone, status, timeSpent, NULL);
+      rc = TRUE;
    } else {
-      wprintf_s(L"[simulate]\n");
+      _sntprintf(status, ARRAYSIZE(status), _T("[done%s%s]"),
+                 result.resumed ? _T(", resumed") : _T(""),
+                 result.retries ? _T(", retried") : _T(""));
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+      PrintStatus(path, args, i, alone, status, timeSpent, NULL);
       rc = TRUE;
    }
 
-   free(removeDir);
-
+   ReportFree(&report);
    return rc;
 }
 
 
+/**
+ * Scheduler callback, deletes one confirmed target
+ *
+ * @param job the target
+ * @param ctx the AppInputs
+ */
+static void
+DeleteJob(DtJob *job,  // IN/OUT
+          void *ctx)   // IN
+{
+   const AppInputs *args = (const AppInputs *) ctx;
+
+   job->ok = DeleteItem(job->path, args, job->index, job->threads,
+                        job->alone, &job->partial);
+}
+
+
 /**
  * Check if a file/directory exists
  *
@@ -260,8 +968,9 @@ DeleteItem(const wchar_t *path,    // IN
  * @return TRUE on success, FALSE otherwise.
  */
 Bool
-FileExists(const wchar_t *item)  // IN
+FileExists(const TCHAR *item)  // IN
 {
+#ifdef _WIN32
     DWORD dw;
     LPVOID lpMsgBuf;
 
@@ -294,7 +1003,7 @@ FileExists(const wchar_t *item)  // IN
                   (LPTSTR) &lpMsgBuf,
                   0, NULL );
 
-    fwprintf_s(stderr, L"%ws: %ws", item, lpMsgBuf);
+    _ftprintf(stderr, _T("%s: %s"), item, (LPTSTR) lpMsgBuf);
 
     LocalFree(lpMsgBuf);
 
@@ -304,6 +1013,389 @@ FileExists(const wchar_t *item)  // IN
     // wchar_t buf[512];
     // _wcserror_s(buf, ARRAYSIZE(buf), errno);
     // fwprintf_s(stderr, L"%ws: %ws\n", item, buf);
+#else
+    struct stat st;
+    TCHAR buf[512];
+
+    // lstat() so a dangling symlink still counts, we delete the link
+    if (lstat(item, &st) == 0) {
+        return TRUE;
+    }
+
+    DtStrError(errno, buf, ARRAYSIZE(buf));
+    _ftprintf(stderr, _T("%s: %s\n"), item, buf);
+
+    return FALSE;
+#endif
+}
+
+
+/**
+ * Generate the in-memory tree for a path with --memfs
+ *
+ * @param item path to delete
+ * @return TRUE on success, FALSE otherwise.
+ */
+static Bool
+MakeMemTree(const TCHAR *item)  // IN
+{
+   uint64_t files, dirs;
+   TCHAR buf[512];
+   int err;
+
+   err = FsMemMake(item, &files, &dirs);
+   if (err) {
+      DtStrError(err, buf, ARRAYSIZE(buf));
+      _ftprintf(stderr, _T("%s: %s\n"), item, buf);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
+/**
+ * Report a list entry that couldn't be deleted
+ *
+ * @param path the entry, NULL if the list itself failed
+ * @param err native error code
+ * @param ctx the AppInputs
+ */
+static void
+ListError(const TCHAR *path,  // IN
+          int err,            // IN
+          void *ctx)          // IN
+{
+   const AppInputs *args = (const AppInputs *) ctx;
+   TCHAR buf[512];
+
+   DtStrError(err, buf, ARRAYSIZE(buf));
+   ProgressSuspend(args->progress);
+   if (path) {
+      _ftprintf(stderr, _T("%s: %s\n"), path, buf);
+   } else {
+      _ftprintf(stderr, _T("%s: reading list: %s\n"), args->listFile, buf);
+   }
+   ProgressResume(args->progress);
+}
+
+
+/**
+ * Delete the targets listed in --from as they are read, for lists too
+ * long for a command line. With --memfs the paths given are the trees
+ * the list names entries in.
+ *
+ * @param argv0 path to exe, argv[0]
+ * @param argv command line, the trees are in args->delList
+ * @param args argument object
+ * @return 0 if everything listed was deleted, EXIT_PARTIAL if only some
+ *         of it, 1 if nothing
+ */
+static int
+DeleteList(const TCHAR *argv0,  // IN
+           TCHAR **argv,        // IN
+           AppInputs *args)     // IN
+{
+   DtStreamResult res;
+   DtOptions opts = {0};
+   DtReport report;
+   FILE *in = stdin;
+   Bool ok;
+   double begin, timeSpent;
+   int i;
+
+   if (args->delSize > 0 && !args->fs) {
+      _ftprintf(stderr, _T("%s: paths can't be given with --from\n"), argv0);
+      return 1;
+   }
+   if (!args->noPrompt) {
+      _ftprintf(stderr, _T("%s: --from deletes without asking, add -y\n"),
+                argv0);
+      return 1;
+   }
+   if (args->engine != ENGINE_NATIVE) {
+      _ftprintf(stderr, _T("%s: --from only works with --engine=native\n"),
+                argv0);
+      return 1;
+   }
+   if (args->simulate) {
+      _ftprintf(stderr, _T("%s: -n doesn't work with --from\n"), argv0);
+      return 1;
+   }
+   for (i = 0; i < args->delSize; i++) {
+      if (!MakeMemTree(argv[args->delList[i]])) {
+         return 1;
+      }
+   }
+   if (_tcscmp(args->listFile, _T("-")) != 0) {
+      in = _tfopen(args->listFile, _T("rb"));
+      if (!in) {
+         TCHAR buf[512];
+         DtStrError(errno, buf, ARRAYSIZE(buf));
+         _ftprintf(stderr, _T("%s: %s: %s\n"), argv0, args->listFile, buf);
+         return 1;
+      }
+   }
+
+   if (!args->noProgress) {
+      args->progress = ProgressStart(args->out);
+   }
+   ReportInit(&report, REPORT_PATHS);
+   opts.threads = args->threads;
+   opts.adaptive = args->threads == 0;
+   opts.order = args->order;
+   opts.maxMemory = args->maxMemory;
+   opts.stats = args->stats != STATS_NONE;
+   opts.progress = args->progress;
+   opts.rate = args->rate;
+   opts.report = &report;
+   opts.retries = args->retries;
+   opts.fs = args->fs;
+
+   begin = DtNow();
+   ok = StreamDelete(in, args->listNul ? '\0' : '\n', &opts, ListError,
+                     args, &res);
+   timeSpent = DtNow() - begin;
+   ProgressStop(args->progress);
+   args->progress = NULL;
+   if (in != stdin) {
+      fclose(in);
+   }
+
+   _ftprintf(args->out, _T("Total: %llu of %llu listed item(s) deleted, ")
+                        _T("%llu missing, %llu failed, ")
+                        _T("%llu empty dir(s) removed (%.3fs)\n"),
+             (unsigned long long) res.deleted,
+             (unsigned long long) res.entries,
+             (unsigned long long) res.missing,
+             (unsigned long long) res.failed,
+             (unsigned long long) res.swept, timeSpent);
+   ReportPrint(args->out, &report);
+   ReportFree(&report);
+
+   if (args->items) {
+      // the whole list is one target
+      args->items[0].path = args->listFile;
+      args->items[0].status = ok ? _T("done") : _T("failed");
+      args->items[0].error = res.res.lastError;
+      args->items[0].secs = timeSpent;
+      args->items[0].res = res.res;
+      if (args->stats == STATS_TEXT) {
+         StatsPrintText(stdout, args->items, 1);
+      } else {
+         StatsPrintJson(stdout, DELTREE_VER, EngineName(args->engine),
+                        args->items, 1, timeSpent);
+      }
+   }
+   if (ok) {
+      return 0;
+   }
+   return res.deleted > 0 || res.res.files + res.res.dirs > 0 ?
+          EXIT_PARTIAL : 1;
+}
+
+
+/**
+ * Print how long ago a time was, roughly
+ *
+ * @param nanos time in nanoseconds since 1970
+ * @param buf receives the text
+ * @param size size of buf in characters
+ */
+static void
+FormatAge(int64_t nanos,   // IN
+          TCHAR *buf,      // OUT
+          size_t size)     // IN
+{
+   double secs = (double) time(NULL) - (double) nanos / 1e9;
+
+   if (secs < 0) {
+      secs = 0;
+   }
+   if (secs < 2 * 3600) {
+      _sntprintf(buf, size, _T("%.0f minutes"), secs / 60);
+   } else if (secs < 2 * 86400) {
+      _sntprintf(buf, size, _T("%.1f hours"), secs / 3600);
+   } else {
+      _sntprintf(buf, size, _T("%.1f days"), secs / 86400);
+   }
+   buf[size - 1] = _T('\0');
+}
+
+
+/**
+ * Trim one target down to the --max-size/--max-files budget
+ *
+ * @param path directory to purge
+ * @param args argument object
+ * @param i index of the item in overall list
+ * @param partial set if it failed after purging some of it
+ * @return TRUE on success
+ */
+static Bool
+PurgeItem(const TCHAR *path,   // IN
+          AppInputs *args,     // IN
+          int i,               // IN
+          Bool *partial)       // OUT
+{
+   DtPurgeOptions opts = {0};
+   DtPurgeResult res;
+   TCHAR status[256], purged[32], kept[32], age[32];
+   double begin, timeSpent;
+   size_t len;
+   Bool ok;
+
+   if (!args->progress) {
+      _ftprintf(args->out, _T("[%d/%d] Purging %s ... "),
+                i, args->delSize, path);
+      fflush(args->out);
+   }
+
+   opts.maxBytes = args->maxBytes;
+   opts.maxFiles = args->maxFiles;
+   opts.byMtime = args->purgeByMtime;
+   opts.simulate = args->simulate;
+   opts.threads = args->threads;
+   opts.progress = args->progress;
+   opts.rate = args->rate;
+   opts.fs = args->fs;
+
+   begin = DtNow();
+   ok = DtPurgeTree(path, &opts, &res);
+   timeSpent = DtNow() - begin;
+   *partial = !ok && res.purgedFiles + res.dirs > 0;
+
+   StatsFormatBytes(res.purgedBytes, purged, ARRAYSIZE(purged));
+   _sntprintf(status, ARRAYSIZE(status),
+              _T("%s %llu files, %s purged, %llu kept"),
+              args->simulate ? _T("[simulate]") : ok ? _T("[done]") :
+              _T("[failed]"),
+              (unsigned long long) res.purgedFiles, purged,
+              (unsigned long long) (res.files - res.purgedFiles));
+   status[ARRAYSIZE(status) - 1] = _T('\0');
+   len = _tcslen(status);
+   if (args->maxBytes != DT_NO_LIMIT) {
+      // only added up with a size budget
+      StatsFormatBytes(res.bytes - res.purgedBytes, kept, ARRAYSIZE(kept));
+      _sntprintf(status + len, ARRAYSIZE(status) - len, _T(", %s"), kept);
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+      len = _tcslen(status);
+   }
+   if (res.dirs) {
+      _sntprintf(status + len, ARRAYSIZE(status) - len,
+                 _T(", %llu empty dirs removed"),
+                 (unsigned long long) res.dirs);
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+      len = _tcslen(status);
+   }
+   if (res.purgedFiles) {
+      FormatAge(res.newest, age, ARRAYSIZE(age));
+      _sntprintf(status + len, ARRAYSIZE(status) - len,
+                 _T(", all unused for %s"), age);
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+      len = _tcslen(status);
+   }
+   if (res.errors) {
+      _sntprintf(status + len, ARRAYSIZE(status) - len,
+                 _T(", %llu errors (%d)"),
+                 (unsigned long long) res.errors, res.lastError);
+      status[ARRAYSIZE(status) - 1] = _T('\0');
+   }
+
+   ProgressSuspend(args->progress);
+   if (args->progress) {
+      _ftprintf(args->out, _T("[%d/%d] Purging %s ... "),
+                i, args->delSize, path);
+   }
+   _ftprintf(args->out, _T("%s (%.3fs)\n"), status, timeSpent);
+   ProgressResume(args->progress);
+
+   if (args->items) {
+      DtItemStats *it = &args->items[i - 1];
+      it->status = args->simulate ? _T("simulate") :
+                   ok ? _T("done") : _T("failed");
+      it->error = res.lastError;
+      it->secs = timeSpent;
+      it->res.files = res.purgedFiles;
+      it->res.bytes = res.purgedBytes;
+      it->res.dirs = res.dirs;
+      it->res.errors = res.errors;
+      it->res.lastError = res.lastError;
+   }
+
+   return ok;
+}
+
+
+/**
+ * Purge every target instead of deleting it, for --max-size and
+ * --max-files
+ *
+ * @param argv0 path to exe, argv[0]
+ * @param argv command line, the targets are in args->delList
+ * @param args argument object
+ * @return 0 if every target was purged, EXIT_PARTIAL if only some
+ *         of them, 1 if none
+ */
+static int
+PurgeAll(const TCHAR *argv0,   // IN
+         TCHAR **argv,         // IN
+         AppInputs *args)      // IN
+{
+   int i, success = 0, partial = 0;
+   double begin, timeSpent;
+   Bool some;
+
+   if (args->listFile) {
+      _ftprintf(stderr, _T("%s: --from can't be used to purge\n"), argv0);
+      return 1;
+   }
+   if (!args->noPrompt && !args->simulate) {
+      _ftprintf(stderr, _T("%s: purging doesn't ask, add -y (or -n to ")
+                        _T("see what would go)\n"), argv0);
+      return 1;
+   }
+   if (args->engine != ENGINE_NATIVE) {
+      _ftprintf(stderr, _T("%s: purging only works with --engine=native\n"),
+                argv0);
+      return 1;
+   }
+
+   if (!args->noProgress && !args->simulate) {
+      args->progress = ProgressStart(args->out);
+   }
+   begin = DtNow();
+   for (i = 0; i < args->delSize; i++) {
+      const TCHAR *item = argv[args->delList[i]];
+      if (args->items) {
+         args->items[i].path = item;
+      }
+      if (args->fs ? !MakeMemTree(item) : !FileExists(item)) {
+         continue;
+      }
+      if (PurgeItem(item, args, i + 1, &some)) {
+         success++;
+      } else if (some) {
+         partial++;
+      }
+   }
+   timeSpent = DtNow() - begin;
+   ProgressStop(args->progress);
+   args->progress = NULL;
+
+   if (args->delSize > 1) {
+      _ftprintf(args->out, _T("\nTotal: %d item(s) purged (%.3fs)\n"),
+                success, timeSpent);
+   }
+   if (args->stats == STATS_TEXT) {
+      StatsPrintText(stdout, args->items, args->delSize);
+   } else if (args->stats == STATS_JSON) {
+      StatsPrintJson(stdout, DELTREE_VER, EngineName(args->engine),
+                     args->items, args->delSize, timeSpent);
+   }
+   if (success == args->delSize) {
+      return 0;
+   }
+   return success > 0 || partial > 0 ? EXIT_PARTIAL : 1;
 }
 
 
@@ -316,34 +1408,118 @@ FileExists(const wchar_t *item)  // IN
  * @return integer return code
  */
 int
-wmain(int argc,
-      wchar_t *argv[],
-      wchar_t *env[])
+_tmain(int argc,
+       TCHAR *argv[],
+       TCHAR *env[])
 {
+   DtRate rate;
    int i;
    int rc = 0;
-   int success = 0;
+   int success = 0, partial = 0;
+   int numJobs = 0;
    AppInputs args = {0};
-   clock_t begin, end;
-   double timeSpent;
+   DtJob *jobs = NULL;
+   double begin, timeSpent;
 
    // process the command line arguments and fill the args struct
+   args.queueDepth = DEFAULT_QUEUE_DEPTH;
+   args.perDevice = DEFAULT_PER_DEVICE;
+   args.retries = DEFAULT_RETRIES;
+   args.maxBytes = DT_NO_LIMIT;
+   args.maxFiles = DT_NO_LIMIT;
    if (!ParseArgs(argc, argv, &args)) {
       rc = 1;
       goto exit;
    }
 
-   // run deltree on any argument that's not an option/switch
-   begin = clock(); // save start time
+   // with --stats=json stdout is for the JSON only
+   args.out = args.stats == STATS_JSON ? stderr : stdout;
+
+   // deep trees want a descriptor per level
+   DtRaiseFileLimit();
+
+   // before any thread starts, they inherit it
+   if (args.background) {
+      DtLowerPriority();
+   }
+   if (args.maxOps || args.maxMeta) {
+      RateInit(&rate, (double) args.maxOps, (double) args.maxMeta);
+      args.rate = &rate;
+   }
+
+   if (args.reclaimDir) {
+      DtLowerPriority();
+      TombstoneReclaim(args.reclaimDir, NULL);
+      goto exit;
+   }
+
+   if (args.emptyOnly && (args.listFile || args.simulate ||
+                          args.maxBytes != DT_NO_LIMIT ||
+                          args.maxFiles != DT_NO_LIMIT ||
+                          args.engine == ENGINE_SHELL ||
+                          args.engine == ENGINE_TOMBSTONE)) {
+      _ftprintf(stderr, _T("%s: --empty-dirs only sweeps the paths given, ")
+                        _T("with --engine=native\n"), argv[0]);
+      rc = 1;
+      goto exit;
+   }
+   if (args.fs && (args.engine == ENGINE_SHELL ||
+                   args.engine == ENGINE_TOMBSTONE)) {
+      _ftprintf(stderr, _T("%s: --memfs only works with --engine=native\n"),
+                argv[0]);
+      rc = 1;
+      goto exit;
+   }
+
+   if (args.maxBytes != DT_NO_LIMIT || args.maxFiles != DT_NO_LIMIT) {
+      if (args.stats != STATS_NONE) {
+         args.items = (DtItemStats *) calloc(args.delSize, sizeof(DtItemStats));
+      }
+      rc = PurgeAll(argv[0], argv, &args);
+      goto exit;
+   }
+
+   if (args.listFile) {
+      if (args.stats != STATS_NONE) {
+         args.items = (DtItemStats *) calloc(1, sizeof(DtItemStats));
+      }
+      rc = DeleteList(argv[0], argv, &args);
+      goto exit;
+   }
+
+   if (args.rate && args.engine == ENGINE_SHELL) {
+      _ftprintf(stderr, _T("%s: the shell engine can't be rate limited\n"),
+                argv[0]);
+   }
+   if (args.engine == ENGINE_URING && !DtUringSupported()) {
+      _ftprintf(stderr, _T("%s: io_uring not available, using syscalls\n"),
+                argv[0]);
+   }
+
+   jobs = (DtJob *) calloc(args.delSize, sizeof(DtJob));
+   if (args.stats != STATS_NONE) {
+      args.items = (DtItemStats *) calloc(args.delSize, sizeof(DtItemStats));
+   }
+   if (!jobs || (args.stats != STATS_NONE && !args.items)) {
+      _ftprintf(stderr, _T("%s: out of memory\n"), argv[0]);
+      rc = 1;
+      goto exit;
+   }
+   for (i = 0; args.items && i < args.delSize; i++) {
+      args.items[i].path = argv[args.delList[i]];
+   }
+
+   // check and confirm every argument that's not an option/switch
+   // first, so the deletes can then run concurrently
    for (i = 0; i < args.delSize; i++) {
-      const wchar_t *item = argv[args.delList[i]];
-      // check if path exists
-      if (!FileExists(item)) {
+      const TCHAR *item = argv[args.delList[i]];
+      // check if path exists, an in-memory one is made here
+      if (args.fs ? !MakeMemTree(item) : !FileExists(item)) {
          continue;
       }
       // get confirmation if necessary
       if (!args.noPrompt) {
-         int key = PromptUser(item);
+         int key = PromptUser(item, args.emptyOnly, args.out);
          if (key == 0) {  // no
             continue;
          } else if (key == 2) {  // y and remaining
@@ -352,19 +1528,78 @@ wmain(int argc,
             break;
          }
       }
-      // now delete it
-      if (DeleteItem(item, &args, i+1)) {
+      jobs[numJobs].path = item;
+      jobs[numJobs].index = i + 1;
+      numJobs++;
+   }
+
+   // now delete them. The shell engine shows its own progress dialog
+   // and simulate prints more than a line, those run one at a time.
+   // Everything else gets our progress line.
+   if (!args.noProgress && !args.simulate && args.engine != ENGINE_SHELL) {
+      args.progress = ProgressStart(args.out);
+   }
+   begin = DtNow(); // save start time
+   SchedPrepare(jobs, numJobs);
+   SchedRun(jobs, numJobs, args.perDevice,
+            args.simulate || args.engine == ENGINE_SHELL ? 1 : 0,
+            args.threads, DeleteJob, &args);
+   ProgressStop(args.progress);
+   args.progress = NULL;
+
+   // targets inside another one went away with it
+   for (i = 0; i < numJobs; i++) {
+      if (jobs[i].coveredBy >= 0) {
+         const DtJob *outer = &jobs[jobs[i].coveredBy];
+         _ftprintf(args.out, _T("[%d/%d] Deleting %s ... %s (with %s)\n"),
+                   jobs[i].index, args.delSize, jobs[i].path,
+                   args.simulate ? _T("[simulate]") :
+                   outer->ok ? _T("[done]") : _T("[failed]"),
+                   outer->path);
+         jobs[i].ok = outer->ok;
+         jobs[i].partial = outer->partial;
+         if (args.items) {
+            args.items[jobs[i].index - 1].status =
+               args.simulate ? _T("simulate") :
+               outer->ok ? _T("done") : _T("failed");
+            args.items[jobs[i].index - 1].coveredBy = outer->path;
+         }
+      }
+      if (jobs[i].ok) {
          success++;
+      } else if (jobs[i].partial) {
+         partial++;
       }
    }
-   end = clock(); // save end
-   timeSpent = (double) (end - begin) / CLOCKS_PER_SEC;
+   timeSpent = DtNow() - begin;
+   if (success < numJobs) {
+      // a script can tell what is left apart from nothing done
+      rc = success > 0 || partial > 0 ? EXIT_PARTIAL : 1;
+   }
+   SchedFree(jobs, numJobs);
+
+   if (args.engine == ENGINE_TOMBSTONE) {
+      TombstoneSpawnReclaimers();
+   }
    // output overall status if silent mode and > 1 items
    if (args.delSize > 1 && args.noPrompt) {
-      wprintf_s(L"\nTotal: %d item(s) deleted (%.3fs)\n", success, timeSpent);
+      _ftprintf(args.out, _T("\nTotal: %d item(s) deleted (%.3fs)\n"),
+                success, timeSpent);
+   }
+
+   if (args.stats == STATS_TEXT) {
+      StatsPrintText(stdout, args.items, args.delSize);
+   } else if (args.stats == STATS_JSON) {
+      StatsPrintJson(stdout, DELTREE_VER, EngineName(args.engine),
+                     args.items, args.delSize, timeSpent);
    }
 
 exit:
+   if (args.rate) {
+      RateDestroy(args.rate);
+   }
+   free(args.items);
+   free(jobs);
    if (args.delList) {
       free(args.delList);
    }
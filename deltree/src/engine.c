@@ -0,0 +1,1842 @@
+// engine.c
+//
+// Implementation of the parallel delete engine, see engine.h
+//
+
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "engine.h"
+#include "fs.h"
+#include "journal.h"
+#include "progress.h"
+#include "rate.h"
+#include "report.h"
+#include "scan.h"
+#include "tune.h"
+
+
+// default worker count when io_uring does the unlinking
+#define URING_THREADS  4
+
+#define ARENA_CHUNK    (16 * 1024)   // bytes per block of child nodes
+#define ARENA_SPARE    32            // free blocks a worker keeps around
+
+#define ALIGN_UP(n)    (((n) + 15) & ~(size_t) 15)
+
+#define BATCH_FIRST    256           // files sorted at once, to start with
+#define BATCH_MAX      16384         // and at most, bigger dirs take turns
+#define BATCH_NAME_AVG 32            // name characters budgeted per file
+
+#define RESCAN_MAX     4             // reads of a directory that keeps
+                                     // filling up before we give up
+
+#define JOURNAL_EVERY  4096          // entries read between journal notes
+
+#define RETRY_PAUSE    0.1           // seconds before going over what
+                                     // is left again, doubling each time
+
+#define ADAPT_MAX      64            // adaptive ceiling unless told
+#define ADAPT_START    2             // workers an adaptive delete starts with
+#define TUNE_WINDOW_MS 250           // how often the tuner looks
+#define TUNE_MIN_OPS   64            // fewer in a window isn't worth judging,
+#define TUNE_MAX_WINDOW 2.0          // unless it has been this many seconds
+
+
+/**
+ * a block of nodes. The children of a directory are carved out of its
+ * own blocks while it is enumerated, and the blocks go back to the
+ * worker that removes the directory, for reuse.
+ */
+typedef struct DtChunk_ {
+   struct DtChunk_ *next;
+   size_t size;             // bytes for nodes after the header
+   size_t used;
+} DtChunk;
+
+#define CHUNK_HEADER   ALIGN_UP(sizeof(DtChunk))
+
+
+/**
+ * names of the subdirectories a directory read from the start again
+ * must not queue again: they failed, or stay with DtOptions.emptyOnly.
+ * Open addressing, cap is a power of two.
+ */
+typedef struct DtSkip_ {
+   TCHAR **names;           // NULL for a free slot
+   size_t n, cap;
+} DtSkip;
+
+
+/**
+ * a directory that still has to be enumerated or removed. Only the
+ * name is kept, everything is opened and removed relative to the
+ * parent's handle, so the depth of the tree is not limited by the
+ * length of a path.
+ */
+typedef struct DtNode_ {
+   struct DtNode_ *parent;  // NULL for the root of the delete
+   atomic_long pending;     // live children, +1 while being enumerated
+   DtHandle handle;         // kept open for the children, or FS_NO_HANDLE
+                            // if we were out of handles
+   DtChunk *chunks;         // where the children live
+   atomic_int failed;       // something below couldn't be removed
+   atomic_int kept;         // holds a file, or a directory that does,
+                            // with DtOptions.emptyOnly
+   Bool more;               // subdirectories were left for another read,
+                            // we were out of memory
+   atomic_int progress;     // children removed or kept since the last read
+   Bool resumable;          // the next read can seek to resume
+   uint64_t resume;         // FsDirTell() of the first subdirectory left
+   DtSkip *skip;            // or, where it can't, the ones to pass over
+   int retries;             // reads because it wasn't empty after all
+   Bool reread;             // read before in this run, start over
+   TCHAR name[1];           // name in parent, full path for the root
+} DtNode;
+
+
+/**
+ * per worker queue of directories to enumerate. The owner works at
+ * the tail, thieves take from the head.
+ */
+typedef struct DtDeque_ {
+   DtMutex lock;
+   DtNode **items;          // ring buffer, cap is a power of two
+   size_t cap;
+   size_t head;             // next item to steal
+   size_t tail;             // one past the last pushed item
+} DtDeque;
+
+
+/**
+ * a file waiting in a DtBatch
+ */
+typedef struct DtBatchEnt_ {
+   uint64_t ino;
+   uint64_t bytes;          // with stats, sized while listing
+   unsigned long attrs;     // DtDirent.attrs
+   uint32_t name;           // offset in DtBatch.names
+   uint32_t nameLen;
+} DtBatchEnt;
+
+
+/**
+ * the files of the directory being enumerated, collected to be
+ * unlinked in inode order. Grows up to BATCH_MAX files and stays
+ * allocated for the worker's next directory.
+ */
+typedef struct DtBatch_ {
+   DtBatchEnt *ents;
+   size_t n, cap;
+   TCHAR *names;            // NUL terminated, back to back
+   size_t used, room;       // in characters
+} DtBatch;
+
+
+/**
+ * what a worker did so far, for the tuner. Written by the owner only
+ * with relaxed stores, like DtCounters.
+ */
+typedef struct DtFeed_ {
+   atomic_uint_least64_t ops;                    // files and dirs removed
+   atomic_uint_least64_t unlinks[DT_HIST_BUCKETS];  // latency histogram
+} DtFeed;
+
+
+struct DtEngine_;
+
+typedef struct DtWorker_ {
+   struct DtEngine_ *eng;
+   int id;
+   DtDeque deque;
+   uint32_t seed;           // for picking steal victims
+   DtUring *ring;           // batched unlinks, NULL for syscalls
+   DtChunk *spare;          // recycled node blocks
+   int nspare;
+   DtResult res;            // private counters, merged at the end
+   DtCounters *live;        // copy of res for DtOptions.progress, or NULL
+   DtFeed feed;             // for the tuner, with DtOptions.adaptive
+   DtBatch batch;           // files to unlink in inode order
+   DtNode *scanning;        // directory ScanDir() is reading
+   DtReport report;         // our failures, merged at the end
+   DtThread thread;
+} DtWorker;
+
+
+typedef struct DtEngine_ {
+   DtWorker *workers;
+   int nworkers;
+   const DtFs *fs;          // DtOptions.fs, or the disk
+   const TCHAR *path;       // the target, as the caller gave it
+   int maxHandles;          // directory handles all deletes may keep
+   atomic_long queued;      // nodes sitting in any deque
+   atomic_int idle;         // workers waiting for work
+   Bool stats;              // DtOptions.stats
+   DtRate *rate;            // DtOptions.rate
+   DtJournal *journal;      // DtOptions.journal
+   int64_t maxMemory;       // DtOptions.maxMemory
+   Bool byInode;            // sort each directory's unlinks by inode
+   Bool emptyOnly;          // DtOptions.emptyOnly
+   atomic_int *cancel;      // DtOptions.cancel
+   Bool adaptive;           // DtOptions.adaptive
+   atomic_int active;       // workers with a lower id may run, the
+                            // others are parked
+   int started;             // workers with a thread, the caller is 0.
+                            // Grows as the tuner asks for more.
+   DtTuner tuner;
+   DtCond park;             // parked workers and the tuner wait here
+   DtTuneStep tune[DT_TUNE_LOG];  // the tuner's decisions, for DtResult
+   int tuneSteps;
+   int done;                // root removed, protected by lock
+   DtMutex lock;
+   DtCond wake;
+} DtEngine;
+
+
+/*
+ * deque operations
+ */
+
+static void
+DequeInit(DtDeque *q)  // OUT
+{
+   DtMutexInit(&q->lock);
+   q->items = NULL;
+   q->cap = q->head = q->tail = 0;
+}
+
+
+static void
+DequeDestroy(DtDeque *q)  // IN
+{
+   DtMutexDestroy(&q->lock);
+   free(q->items);
+}
+
+
+static Bool
+DequePush(DtDeque *q,     // IN
+          DtNode *node)   // IN
+{
+   Bool rc = TRUE;
+
+   DtMutexLock(&q->lock);
+   if (q->tail - q->head == q->cap) {
+      // full, grow the ring and unwrap it while copying
+      size_t cap = q->cap ? q->cap * 2 : 64;
+      size_t n = q->tail - q->head, i;
+      DtNode **items = (DtNode **) malloc(sizeof(DtNode *) * cap);
+      if (!items) {
+         rc = FALSE;
+         goto exit;
+      }
+      for (i = 0; i < n; i++) {
+         items[i] = q->items[(q->head + i) & (q->cap - 1)];
+      }
+      free(q->items);
+      q->items = items;
+      q->cap = cap;
+      q->head = 0;
+      q->tail = n;
+   }
+   q->items[q->tail++ & (q->cap - 1)] = node;
+
+exit:
+   DtMutexUnlock(&q->lock);
+   return rc;
+}
+
+
+static DtNode *
+DequePop(DtDeque *q)  // IN
+{
+   DtNode *node = NULL;
+
+   DtMutexLock(&q->lock);
+   if (q->tail != q->head) {
+      node = q->items[--q->tail & (q->cap - 1)];
+   }
+   DtMutexUnlock(&q->lock);
+   return node;
+}
+
+
+static DtNode *
+DequeSteal(DtDeque *q)  // IN
+{
+   DtNode *node = NULL;
+
+   DtMutexLock(&q->lock);
+   if (q->tail != q->head) {
+      node = q->items[q->head++ & (q->cap - 1)];
+   }
+   DtMutexUnlock(&q->lock);
+   return node;
+}
+
+
+/*
+ * node helpers
+ */
+
+// directory handles kept open by all running deletes together
+static atomic_int openHandles;
+
+// bytes of node blocks and sort batches all running deletes hold
+static atomic_llong memInUse;
+
+
+// charge size bytes to the memory budget. Unless forced, FALSE if
+// that would go over it.
+static Bool
+MemTake(DtEngine *eng,   // IN
+        size_t size,     // IN
+        Bool force)      // IN
+{
+   if (atomic_fetch_add(&memInUse, (long long) size) + (long long) size >
+       eng->maxMemory && !force) {
+      atomic_fetch_sub(&memInUse, (long long) size);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
+static void
+MemGive(size_t size)  // IN
+{
+   atomic_fetch_sub(&memInUse, (long long) size);
+}
+
+
+static void
+InitNode(DtNode *node,         // OUT
+         DtNode *parent,       // IN
+         const TCHAR *name,    // IN
+         size_t nameLen)       // IN
+{
+   node->parent = parent;
+   atomic_init(&node->pending, 1);  // the enumeration itself
+   node->handle = FS_NO_HANDLE;
+   node->chunks = NULL;
+   atomic_init(&node->failed, FALSE);
+   atomic_init(&node->kept, FALSE);
+   node->more = FALSE;
+   atomic_init(&node->progress, 0);
+   node->resumable = FALSE;
+   node->resume = 0;
+   node->skip = NULL;
+   node->retries = 0;
+   node->reread = FALSE;
+   memcpy(node->name, name, sizeof(TCHAR) * nameLen);
+   node->name[nameLen] = _T('\0');
+}
+
+
+// allocate the root node, path is the whole path
+static DtNode *
+NewRoot(const TCHAR *path)  // IN
+{
+   size_t len = _tcslen(path);
+   DtNode *node;
+
+   node = (DtNode *) malloc(offsetof(DtNode, name) +
+                            sizeof(TCHAR) * (len + 1));
+   if (node) {
+      InitNode(node, NULL, path, len);
+   }
+   return node;
+}
+
+
+// get a block with room for size bytes of nodes, a recycled one if we
+// have it. NULL if there is no memory, or no budget left unless force.
+static DtChunk *
+NewChunk(DtWorker *w,   // IN
+         size_t size,   // IN
+         Bool force)    // IN
+{
+   DtChunk *c;
+
+   if (size <= ARENA_CHUNK - CHUNK_HEADER && w->spare) {
+      c = w->spare;
+      w->spare = c->next;
+      w->nspare--;
+   } else {
+      if (size < ARENA_CHUNK - CHUNK_HEADER) {
+         size = ARENA_CHUNK - CHUNK_HEADER;
+      }
+      if (!MemTake(w->eng, CHUNK_HEADER + size, force)) {
+         return NULL;
+      }
+      c = (DtChunk *) malloc(CHUNK_HEADER + size);
+      if (!c) {
+         MemGive(CHUNK_HEADER + size);
+         return NULL;
+      }
+      c->size = size;
+   }
+   c->used = 0;
+   return c;
+}
+
+
+// give back the blocks of a removed directory
+static void
+FreeChunks(DtWorker *w,   // IN
+           DtChunk *c)    // IN
+{
+   DtChunk *next;
+
+   for (; c; c = next) {
+      next = c->next;
+      // spares count against the budget, only keep them while it
+      // isn't tight
+      if (c->size == ARENA_CHUNK - CHUNK_HEADER && w->nspare < ARENA_SPARE &&
+          atomic_load(&memInUse) < w->eng->maxMemory / 2) {
+         c->next = w->spare;
+         w->spare = c;
+         w->nspare++;
+      } else {
+         MemGive(CHUNK_HEADER + c->size);
+         free(c);
+      }
+   }
+}
+
+
+// bytes a node with a name of nameLen characters takes in a block
+static size_t
+NodeSize(size_t nameLen)  // IN
+{
+   return ALIGN_UP(offsetof(DtNode, name) + sizeof(TCHAR) * (nameLen + 1));
+}
+
+
+// allocate a node for entry name of parent. Only the worker
+// enumerating parent calls this, so its blocks need no lock. NULL if
+// out of memory or budget, see NewChunk().
+static DtNode *
+NewChild(DtWorker *w,          // IN
+         DtNode *parent,       // IN
+         const TCHAR *name,    // IN
+         size_t nameLen,       // IN
+         Bool force)           // IN
+{
+   size_t size = NodeSize(nameLen);
+   DtChunk *c = parent->chunks;
+   DtNode *node;
+
+   if (!c || c->used + size > c->size) {
+      c = NewChunk(w, size, force);
+      if (!c) {
+         return NULL;
+      }
+      c->next = parent->chunks;
+      parent->chunks = c;
+   }
+   node = (DtNode *) ((char *) c + CHUNK_HEADER + c->used);
+   c->used += size;
+   InitNode(node, parent, name, nameLen);
+   return node;
+}
+
+
+// FNV-1a over the characters of name
+static size_t
+HashName(const TCHAR *name)  // IN
+{
+   uint64_t h = 14695981039346656037ull;
+
+   for (; *name; name++) {
+      h ^= (uint64_t) *name;
+      h *= 1099511628211ull;
+   }
+   return (size_t) h;
+}
+
+
+// whether name is in skip
+static Bool
+SkipHas(const DtSkip *skip,   // IN
+        const TCHAR *name)    // IN
+{
+   size_t i = HashName(name) & (skip->cap - 1);
+
+   for (; skip->names[i]; i = (i + 1) & (skip->cap - 1)) {
+      if (_tcscmp(skip->names[i], name) == 0) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+// add name to skip, growing it to stay at most half full
+static Bool
+SkipAdd(DtSkip *skip,         // IN/OUT
+        const TCHAR *name)    // IN
+{
+   TCHAR **names, *copy;
+   size_t cap, i, j;
+
+   if ((skip->n + 1) * 2 > skip->cap) {
+      cap = skip->cap ? skip->cap * 2 : 64;
+      names = (TCHAR **) calloc(cap, sizeof(TCHAR *));
+      if (!names) {
+         return FALSE;
+      }
+      for (j = 0; j < skip->cap; j++) {
+         if (skip->names[j]) {
+            for (i = HashName(skip->names[j]) & (cap - 1); names[i];
+                 i = (i + 1) & (cap - 1)) {
+            }
+            names[i] = skip->names[j];
+         }
+      }
+      free(skip->names);
+      skip->names = names;
+      skip->cap = cap;
+   }
+   if (SkipHas(skip, name)) {
+      return TRUE;
+   }
+   copy = _tcsdup(name);
+   if (!copy) {
+      return FALSE;
+   }
+   for (i = HashName(name) & (skip->cap - 1); skip->names[i];
+        i = (i + 1) & (skip->cap - 1)) {
+   }
+   skip->names[i] = copy;
+   skip->n++;
+   return TRUE;
+}
+
+
+// remember the children of node that stay, failed or kept, before its
+// blocks go. Not charged to the memory budget, it only grows with what
+// is left behind. Without memory for it they are queued again.
+static void
+SkipLeft(DtNode *node)  // IN
+{
+   DtChunk *c;
+   DtNode *child;
+   size_t at;
+
+   if (!node->skip && !(node->skip = (DtSkip *) calloc(1, sizeof(DtSkip)))) {
+      return;
+   }
+   for (c = node->chunks; c; c = c->next) {
+      for (at = 0; at < c->used; at += NodeSize(_tcslen(child->name))) {
+         child = (DtNode *) ((char *) c + CHUNK_HEADER + at);
+         if ((atomic_load(&child->failed) || atomic_load(&child->kept)) &&
+             !SkipAdd(node->skip, child->name)) {
+            return;
+         }
+      }
+   }
+}
+
+
+static void
+SkipFree(DtNode *node)  // IN
+{
+   size_t i;
+
+   if (node->skip) {
+      for (i = 0; i < node->skip->cap; i++) {
+         free(node->skip->names[i]);
+      }
+      free(node->skip->names);
+      free(node->skip);
+      node->skip = NULL;
+   }
+}
+
+
+// open dir when it didn't keep its handle, one component at a time
+// from the closest ancestor that did (or from the root's path)
+static int
+ReopenDir(const DtFs *fs,   // IN
+          DtNode *dir,      // IN
+          DtHandle *h)      // OUT
+{
+   DtNode **chain, *n;
+   DtHandle cur;
+   DtDir *d;
+   int depth = 1, i, err = 0;
+
+   for (n = dir; n->parent && n->parent->handle == FS_NO_HANDLE;
+        n = n->parent) {
+      depth++;
+   }
+   chain = (DtNode **) malloc(sizeof(DtNode *) * depth);
+   if (!chain) {
+      return FS_ENOMEM;
+   }
+   for (i = depth - 1, n = dir; i >= 0; i--, n = n->parent) {
+      chain[i] = n;
+   }
+
+   cur = chain[0]->parent ? chain[0]->parent->handle : FS_NO_HANDLE;
+   for (i = 0; i < depth; i++) {
+      err = fs->openDirAt(cur, chain[i]->name, &d);
+      if (i > 0) {
+         fs->closeHandle(cur);
+      }
+      if (err) {
+         break;
+      }
+      cur = fs->dirDetach(d);
+   }
+   free(chain);
+
+   if (!err) {
+      *h = cur;
+   }
+   return err;
+}
+
+
+// handle the name of node is relative to. *temp says whether it had
+// to be opened just for this and must be closed by the caller.
+static int
+ParentHandle(const DtFs *fs,   // IN
+             DtNode *node,     // IN
+             DtHandle *h,      // OUT
+             Bool *temp)       // OUT
+{
+   DtNode *parent = node->parent;
+
+   *temp = FALSE;
+   if (!parent) {
+      *h = FS_NO_HANDLE;  // the root's name is a path
+      return 0;
+   }
+   if (parent->handle != FS_NO_HANDLE) {
+      *h = parent->handle;
+      return 0;
+   }
+   *temp = TRUE;
+   return ReopenDir(fs, parent, h);
+}
+
+
+// malloc'ed path of node below the root of the delete, "." for the
+// root itself. Only for the journal and error reports, the engine
+// never needs one.
+static TCHAR *
+NodePath(const DtNode *node)  // IN
+{
+   const DtNode *n;
+   TCHAR *path;
+   size_t len = 0, nlen;
+
+   if (!node->parent) {
+      return _tcsdup(_T("."));
+   }
+   for (n = node; n->parent; n = n->parent) {
+      len += _tcslen(n->name) + 1;
+   }
+   path = (TCHAR *) malloc(sizeof(TCHAR) * len);
+   if (!path) {
+      return NULL;
+   }
+   path[--len] = _T('\0');
+   for (n = node; n->parent; n = n->parent) {
+      nlen = _tcslen(n->name);
+      len -= nlen;
+      memcpy(path + len, n->name, sizeof(TCHAR) * nlen);
+      if (len) {
+         path[--len] = DT_PATH_SEP;
+      }
+   }
+   return path;
+}
+
+
+// count a failure of op on name in node (on node itself if name is
+// NULL) in our report
+static void
+RecordError(DtWorker *w,          // IN
+            DtOp op,              // IN
+            const DtNode *node,   // IN
+            const TCHAR *name,    // IN, may be NULL
+            int err)              // IN
+{
+   TCHAR *dir, *path = NULL;
+   size_t len;
+
+   w->res.errors++;
+   if (op == DT_OP_RMDIR && atomic_load(&node->failed)) {
+      // not empty for what failed below, which was reported already
+      // and says more
+      w->report.cascaded++;
+      if (!w->res.lastError) {
+         w->res.lastError = err;
+      }
+      return;
+   }
+   w->res.lastError = err;
+   if (!ReportWants(&w->report, err)) {
+      // only counted
+   } else if (!node->parent) {
+      // the target itself goes by the name we were given
+      path = _tcsdup(name ? name : w->eng->path);
+   } else if ((dir = NodePath(node)) != NULL) {
+      if (!name) {
+         path = dir;
+      } else {
+         len = _tcslen(dir) + _tcslen(name) + 2;
+         path = (TCHAR *) malloc(sizeof(TCHAR) * len);
+         if (path) {
+            _sntprintf(path, len, _T("%s%c%s"), dir, DT_PATH_SEP, name);
+            path[len - 1] = _T('\0');
+         }
+         free(dir);
+      }
+   }
+   ReportAdd(&w->report, op, err, path);
+}
+
+
+// whether DtOptions.cancel asks us to stop
+static Bool
+Cancelled(const DtEngine *eng)  // IN
+{
+   return eng->cancel && atomic_load_explicit(eng->cancel,
+                                              memory_order_relaxed);
+}
+
+
+// make the counters visible to the progress display
+static void
+Publish(DtWorker *w)  // IN
+{
+   DtCounters *c = w->live;
+
+   if (c) {
+      atomic_store_explicit(&c->files, w->res.files, memory_order_relaxed);
+      atomic_store_explicit(&c->dirs, w->res.dirs, memory_order_relaxed);
+      atomic_store_explicit(&c->bytes, w->res.bytes, memory_order_relaxed);
+      atomic_store_explicit(&c->errors, w->res.errors, memory_order_relaxed);
+   }
+   if (w->eng->adaptive) {
+      atomic_store_explicit(&w->feed.ops, w->res.files + w->res.dirs,
+                            memory_order_relaxed);
+   }
+}
+
+
+// count an operation that took secs in its latency histogram
+static void
+RecordOp(DtWorker *w,   // IN
+         DtOp op,       // IN
+         double secs)   // IN
+{
+   uint64_t us = (uint64_t) (secs * 1e6);
+   int b = 0;
+
+   while (us && b < DT_HIST_BUCKETS - 1) {
+      us >>= 1;
+      b++;
+   }
+   if (w->eng->stats) {
+      w->res.hist[op][b]++;
+   }
+   if (op == DT_OP_UNLINK && w->eng->adaptive) {
+      atomic_uint_least64_t *c = &w->feed.unlinks[b];
+      atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) +
+                            1, memory_order_relaxed);
+   }
+}
+
+
+// count the unlink of name (NULL if not known) in the directory
+// being read
+static void
+Unlinked(DtWorker *w,         // IN
+         const TCHAR *name,   // IN
+         int err)             // IN
+{
+   if (FS_WAS_DIR(err)) {
+      // replaced by a directory since we listed it. Not an error, the
+      // rmdir of its parent will find it and read the parent again.
+   } else if (err) {
+      RecordError(w, DT_OP_UNLINK, w->scanning, name, err);
+   } else {
+      w->res.files++;
+   }
+}
+
+
+// io_uring completion of one unlink queued by worker ctx
+static void
+UnlinkDone(void *ctx,  // IN
+           int err)    // IN
+{
+   Unlinked((DtWorker *) ctx, NULL, err);
+}
+
+
+// wait for the rate limit before removing an entry
+static void
+Throttle(DtWorker *w,     // IN
+         size_t nameLen)  // IN
+{
+   double slept = RateOp(w->eng->rate, nameLen);
+
+   if (w->eng->stats) {
+      w->res.phase[DT_PHASE_THROTTLE] += slept;
+      w->res.metaBytes += RATE_META_BYTES(nameLen);
+   }
+}
+
+
+/*
+ * scheduling
+ */
+
+// queue a directory for enumeration and wake someone up to take it
+static Bool
+Queue(DtWorker *w,    // IN
+      DtNode *node)   // IN
+{
+   DtEngine *eng = w->eng;
+
+   if (!DequePush(&w->deque, node)) {
+      RecordError(w, DT_OP_OPENDIR, node, NULL, FS_ENOMEM);
+      return FALSE;
+   }
+   atomic_fetch_add(&eng->queued, 1);
+
+   if (atomic_load(&eng->idle) > 0) {
+      DtMutexLock(&eng->lock);
+      DtCondSignal(&eng->wake);
+      DtMutexUnlock(&eng->lock);
+   }
+   return TRUE;
+}
+
+
+// queue a new subdirectory
+static void
+Spawn(DtWorker *w,    // IN
+      DtNode *node)   // IN
+{
+   if (!Queue(w, node)) {
+      // can't queue it, give up on this subtree. The node goes away
+      // with its parent's blocks.
+      atomic_store(&node->parent->failed, TRUE);
+      atomic_fetch_sub(&node->parent->pending, 1);
+   }
+}
+
+
+// queue a directory whose children are all done to be read again
+static Bool
+Rescan(DtWorker *w,    // IN
+       DtNode *node)   // IN
+{
+   node->more = FALSE;
+   node->reread = TRUE;
+   atomic_store(&node->progress, 0);
+   atomic_store(&node->pending, 1);
+   w->res.rescans++;
+   if (!Queue(w, node)) {
+      atomic_store(&node->failed, TRUE);
+      atomic_store(&node->pending, 0);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
+// find something to do, own work first then other workers'
+static DtNode *
+NextNode(DtWorker *w)  // IN
+{
+   DtEngine *eng = w->eng;
+   DtNode *node;
+   int i, victim;
+
+   node = DequePop(&w->deque);
+   if (node || eng->nworkers == 1) {
+      return node;
+   }
+
+   // xorshift, just needs to spread thieves over victims
+   w->seed ^= w->seed << 13;
+   w->seed ^= w->seed >> 17;
+   w->seed ^= w->seed << 5;
+   victim = (int) (w->seed % (uint32_t) eng->nworkers);
+
+   for (i = 0; i < eng->nworkers; i++, victim++) {
+      if (victim >= eng->nworkers) {
+         victim = 0;
+      }
+      if (victim != w->id &&
+          (node = DequeSteal(&eng->workers[victim].deque)) != NULL) {
+         return node;
+      }
+   }
+   return NULL;
+}
+
+
+// remove the directory of a finished node relative to its parent
+static int
+RemoveNode(const DtFs *fs,   // IN
+           DtNode *node)     // IN
+{
+   DtHandle h;
+   Bool temp;
+   int err;
+
+   err = ParentHandle(fs, node, &h, &temp);
+   if (!err) {
+      err = fs->removeDirAt(h, node->name);
+      if (temp) {
+         fs->closeHandle(h);
+      }
+   }
+   return err;
+}
+
+
+// drop one reference on node. The last one removes the directory and
+// passes the completion on to its parent.
+static void
+FinishNode(DtWorker *w,    // IN
+           DtNode *node)   // IN
+{
+   DtEngine *eng = w->eng;
+   DtNode *parent;
+   Bool keep, again;
+   int err = 0;
+
+   while (node && atomic_fetch_sub(&node->pending, 1) == 1) {
+      // the children are all gone, and the handle has to be closed
+      // before the directory can be removed on Windows
+      if (node->handle != FS_NO_HANDLE) {
+         eng->fs->closeHandle(node->handle);
+         node->handle = FS_NO_HANDLE;
+         atomic_fetch_sub(&openHandles, 1);
+      }
+      // we had no memory for some of its subdirectories, now that the
+      // others are done there is room for them. Unless none of those
+      // went anywhere, then another read won't either.
+      again = node->more && atomic_load(&node->progress) > 0 &&
+              !Cancelled(eng);
+      if (again && !node->resumable) {
+         SkipLeft(node);  // read from the start, don't queue these again
+      }
+      FreeChunks(w, node->chunks);
+      node->chunks = NULL;
+      if (again && Rescan(w, node)) {
+         return;
+      }
+      SkipFree(node);
+
+      // only sweeping empty directories, one with files stays and so
+      // does everything above it. So does the target itself. Once
+      // cancelled whatever is left stays.
+      keep = eng->emptyOnly &&
+             (atomic_load(&node->kept) || !node->parent);
+      if (!keep && Cancelled(eng)) {
+         keep = w->res.cancelled = TRUE;
+      }
+      if (!keep) {
+         Throttle(w, _tcslen(node->name));
+
+         if (eng->stats) {
+            double begin = DtNow(), spent;
+            err = RemoveNode(eng->fs, node);
+            spent = DtNow() - begin;
+            w->res.phase[DT_PHASE_RMDIR] += spent;
+            RecordOp(w, DT_OP_RMDIR, spent);
+         } else {
+            err = RemoveNode(eng->fs, node);
+         }
+         if (FS_NOT_EMPTY(err) && !atomic_load(&node->failed) &&
+             node->retries < RESCAN_MAX) {
+            // everything we found is gone, so entries were added while
+            // we read it (or replaced by directories). Go get them,
+            // wherever they went.
+            node->retries++;
+            node->resumable = FALSE;
+            if (Rescan(w, node)) {
+               return;
+            }
+         }
+      }
+      // marked for a parent that reads us again, see SkipLeft()
+      parent = node->parent;
+      if (keep) {
+         atomic_store(&node->kept, TRUE);
+         if (parent) {
+            atomic_store(&parent->kept, TRUE);
+            atomic_fetch_add(&parent->progress, 1);
+         }
+      } else if (err) {
+         RecordError(w, DT_OP_RMDIR, node, NULL, err);
+         atomic_store(&node->failed, TRUE);
+         if (parent) {
+            atomic_store(&parent->failed, TRUE);
+         }
+      } else {
+         w->res.dirs++;
+         if (parent) {
+            atomic_fetch_add(&parent->progress, 1);
+         }
+      }
+      Publish(w);
+
+      if (!parent) {
+         free(node);  // the others live in their parent's blocks
+         // that was the root, tell everybody to go home
+         DtMutexLock(&eng->lock);
+         eng->done = TRUE;
+         DtCondBroadcast(&eng->wake);
+         DtCondBroadcast(&eng->park);
+         DtMutexUnlock(&eng->lock);
+      }
+      node = parent;
+   }
+}
+
+
+// remove a file found in dir, through the ring if we have one. size
+// is its size if already known, with NULL it is looked up when
+// collecting stats. Returns the seconds it took when collecting stats.
+static double
+UnlinkEntry(DtWorker *w,           // IN
+            DtDir *dir,            // IN
+            const DtDirent *ent,   // IN
+            const uint64_t *size)  // IN
+{
+   uint64_t bytes = 0;
+   double begin, spent;
+   int err;
+
+   Throttle(w, ent->nameLen);
+   if (!w->eng->stats) {
+      if (w->ring && FsUringUnlinkAt(w->ring, dir, ent) == 0) {
+         return 0;
+      }
+      if (w->eng->adaptive) {
+         // the tuner wants the latency
+         begin = DtNow();
+         err = w->eng->fs->unlinkAt(dir, ent);
+         RecordOp(w, DT_OP_UNLINK, DtNow() - begin);
+         Unlinked(w, ent->name, err);
+      } else {
+         Unlinked(w, ent->name, w->eng->fs->unlinkAt(dir, ent));
+      }
+      return 0;
+   }
+
+   if (size) {
+      bytes = *size;
+   } else {
+      w->eng->fs->entrySize(dir, ent, &bytes);
+   }
+   begin = DtNow();
+   if (w->ring && FsUringUnlinkAt(w->ring, dir, ent) == 0) {
+      // completes later, we only know how long queueing it took and
+      // count the bytes now. A failure shows up in errors.
+      w->res.bytes += bytes;
+      return DtNow() - begin;
+   }
+   err = w->eng->fs->unlinkAt(dir, ent);
+   spent = DtNow() - begin;
+   RecordOp(w, DT_OP_UNLINK, spent);
+   Unlinked(w, ent->name, err);
+   if (!err) {
+      w->res.bytes += bytes;
+   }
+   return spent;
+}
+
+
+static int
+CompareInodes(const void *a,  // IN
+              const void *b)  // IN
+{
+   uint64_t ia = ((const DtBatchEnt *) a)->ino;
+   uint64_t ib = ((const DtBatchEnt *) b)->ino;
+
+   return ia < ib ? -1 : ia > ib;
+}
+
+
+// unlink the files collected from dir in inode order and empty the
+// batch. Returns the seconds spent unlinking when collecting stats.
+static double
+BatchFlush(DtWorker *w,   // IN
+           DtDir *dir)    // IN
+{
+   DtBatch *b = &w->batch;
+   DtDirent ent;
+   double spent = 0;
+   size_t i;
+
+   qsort(b->ents, b->n, sizeof(DtBatchEnt), CompareInodes);
+   ent.type = FS_TYPE_FILE;
+   for (i = 0; i < b->n; i++) {
+      ent.name = b->names + b->ents[i].name;
+      ent.nameLen = b->ents[i].nameLen;
+      ent.ino = b->ents[i].ino;
+      ent.attrs = b->ents[i].attrs;
+      spent += UnlinkEntry(w, dir, &ent, &b->ents[i].bytes);
+      Publish(w);
+   }
+   b->n = 0;
+   b->used = 0;
+   return spent;
+}
+
+
+// make room in the batch for another entry with a name of len
+// characters, up to BATCH_MAX of them and within the memory budget.
+// FALSE if it is full.
+static Bool
+BatchGrow(DtWorker *w,   // IN
+          size_t len)    // IN
+{
+   DtBatch *b = &w->batch;
+   size_t cap, room;
+   void *p;
+
+   if (b->n == b->cap) {
+      if (b->cap >= BATCH_MAX) {
+         return FALSE;
+      }
+      cap = b->cap ? b->cap * 2 : BATCH_FIRST;
+      if (!MemTake(w->eng, sizeof(DtBatchEnt) * (cap - b->cap), FALSE)) {
+         return FALSE;
+      }
+      p = realloc(b->ents, sizeof(DtBatchEnt) * cap);
+      if (!p) {
+         MemGive(sizeof(DtBatchEnt) * (cap - b->cap));
+         return FALSE;
+      }
+      b->ents = (DtBatchEnt *) p;
+      b->cap = cap;
+   }
+   if (b->used + len + 1 > b->room) {
+      room = b->room ? b->room * 2 : BATCH_FIRST * BATCH_NAME_AVG;
+      while (room < b->used + len + 1) {
+         room *= 2;
+      }
+      if (room > BATCH_MAX * BATCH_NAME_AVG && b->n > 0) {
+         return FALSE;  // long names, flush early rather than grow
+      }
+      if (!MemTake(w->eng, sizeof(TCHAR) * (room - b->room), FALSE)) {
+         return FALSE;
+      }
+      p = realloc(b->names, sizeof(TCHAR) * room);
+      if (!p) {
+         MemGive(sizeof(TCHAR) * (room - b->room));
+         return FALSE;
+      }
+      b->names = (TCHAR *) p;
+      b->room = room;
+   }
+   return TRUE;
+}
+
+
+// queue a file found in dir to be unlinked in inode order, flushing
+// the batch when it is full. Returns the seconds spent unlinking when
+// collecting stats.
+static double
+BatchAdd(DtWorker *w,           // IN
+         DtDir *dir,            // IN
+         const DtDirent *ent)   // IN
+{
+   DtBatch *b = &w->batch;
+   DtBatchEnt *e;
+   double spent = 0;
+
+   if (!BatchGrow(w, ent->nameLen)) {
+      if (b->n == 0) {
+         // can't even hold one, do without
+         return UnlinkEntry(w, dir, ent, NULL);
+      }
+      spent = BatchFlush(w, dir);
+      if (!BatchGrow(w, ent->nameLen)) {
+         return spent + UnlinkEntry(w, dir, ent, NULL);
+      }
+   }
+
+   e = &b->ents[b->n++];
+   e->ino = ent->ino;
+   e->bytes = 0;
+   if (w->eng->stats) {
+      // the listing may not have it any more by the time we unlink
+      w->eng->fs->entrySize(dir, ent, &e->bytes);
+   }
+   e->attrs = ent->attrs;
+   e->name = (uint32_t) b->used;
+   e->nameLen = (uint32_t) ent->nameLen;
+   memcpy(b->names + b->used, ent->name, sizeof(TCHAR) * ent->nameLen);
+   b->names[b->used + ent->nameLen] = _T('\0');
+   b->used += ent->nameLen + 1;
+   return spent;
+}
+
+
+// finish the unlinks of files read from dir so far, sorted and queued
+// ones alike. Returns the seconds it took when collecting stats.
+static double
+FlushUnlinks(DtWorker *w,   // IN
+             DtDir *dir)    // IN
+{
+   double spent = 0, t;
+
+   if (w->batch.n) {
+      spent += BatchFlush(w, dir);
+   }
+   if (w->ring) {
+      t = w->eng->stats ? DtNow() : 0;
+      FsUringFlush(w->ring);
+      if (w->eng->stats) {
+         spent += DtNow() - t;
+      }
+   }
+   return spent;
+}
+
+
+
+// note in the journal how far dir has been read, if everything before
+// that is gone: the files unlinked and the subdirectories queued from
+// it removed. path caches NodePath(). Returns the seconds spent
+// finishing unlinks when collecting stats.
+static double
+NoteProgress(DtWorker *w,    // IN
+             DtNode *node,   // IN
+             DtDir *dir,     // IN
+             TCHAR **path)   // IN/OUT
+{
+   double spent;
+   uint64_t pos;
+
+   if (!JournalWanted(w->eng->journal) || node->more ||
+       atomic_load(&node->pending) != 1 ||
+       w->eng->fs->dirTell(dir, &pos) != 0) {
+      return 0;
+   }
+   spent = FlushUnlinks(w, dir);
+   if (*path || (*path = NodePath(node))) {
+      JournalNote(w->eng->journal, *path, pos);
+   }
+   return spent;
+}
+
+
+// enumerate a directory: unlink everything that isn't a directory and
+// queue the subdirectories
+static void
+ScanDir(DtWorker *w,    // IN
+        DtNode *node)   // IN
+{
+   const DtFs *fs = w->eng->fs;
+   DtDir *dir;
+   DtDirent ent;
+   DtNode *child;
+   DtHandle parent;
+   Bool temp, decided = FALSE, spawned = FALSE, tells;
+   double begin = 0, unlinking = 0, throttled = 0;
+   uint64_t errors = w->res.errors, pos, at = 0, seen = 0;
+   TCHAR *path = NULL;
+   int err;
+
+   if (Cancelled(w->eng)) {
+      FinishNode(w, node);
+      return;
+   }
+   w->scanning = node;
+   if (w->eng->stats) {
+      begin = DtNow();
+      throttled = w->res.phase[DT_PHASE_THROTTLE];
+   }
+   err = ParentHandle(fs, node, &parent, &temp);
+   if (!err) {
+      err = fs->openDirAt(parent, node->name, &dir);
+      if (temp) {
+         fs->closeHandle(parent);
+      }
+   }
+   if (w->eng->stats) {
+      RecordOp(w, DT_OP_OPENDIR, DtNow() - begin);
+   }
+   if (err) {
+      // gone already is fine, someone else deleted it
+      if (!FS_NOT_FOUND(err)) {
+         RecordError(w, DT_OP_OPENDIR, node, NULL, err);
+         atomic_store(&node->failed, TRUE);
+      }
+      FinishNode(w, node);
+      return;
+   }
+   if (JournalResumable(w->eng->journal) && !node->reread &&
+       (path = NodePath(node)) != NULL &&
+       JournalFind(w->eng->journal, path, &pos) && fs->dirSeek(dir, pos) == 0) {
+      // an earlier run got this far, everything before is gone. If it
+      // isn't, the directory won't be empty and we read it all again.
+      w->res.resumed++;
+   }
+   if (node->resumable) {
+      // read again for what didn't fit last time, which starts here.
+      // If we can't get there we read all of it.
+      node->resumable = FALSE;
+      fs->dirSeek(dir, node->resume);
+   }
+
+   // where each entry starts, for resuming at the first subdirectory
+   // we have no memory for
+   tells = fs->dirTell(dir, &at) == 0;
+   while ((err = fs->readDir(dir, &ent)) == 0) {
+      if (Cancelled(w->eng)) {
+         err = FS_END;
+         break;
+      }
+      if (ent.type == FS_TYPE_DIR && node->skip &&
+          SkipHas(node->skip, ent.name)) {
+         // stays from an earlier read, see SkipLeft()
+      } else if (ent.type == FS_TYPE_DIR) {
+         if (!decided) {
+            // the children will open and remove themselves relative
+            // to us. Decided before the first one can run and fixed
+            // from then on; without a handle they reopen our path.
+            decided = TRUE;
+            if (atomic_fetch_add(&openHandles, 1) < w->eng->maxHandles) {
+               node->handle = fs->dirHandle(dir);
+            } else {
+               atomic_fetch_sub(&openHandles, 1);
+            }
+         }
+         // over the memory budget we leave the rest for another read,
+         // but queue at least one each time so we get somewhere
+         child = NewChild(w, node, ent.name, ent.nameLen, !spawned);
+         if (child) {
+            spawned = TRUE;
+            atomic_fetch_add(&node->pending, 1);
+            Spawn(w, child);
+         } else if (!spawned) {
+            RecordError(w, DT_OP_OPENDIR, node, ent.name, FS_ENOMEM);
+         } else if (!node->more) {
+            node->more = TRUE;
+            node->resumable = tells;
+            node->resume = at;
+         }
+      } else if (w->eng->emptyOnly) {
+         atomic_store(&node->kept, TRUE);  // files are never touched
+      } else if (w->eng->byInode) {
+         unlinking += BatchAdd(w, dir, &ent);
+      } else {
+         unlinking += UnlinkEntry(w, dir, &ent, NULL);
+      }
+      Publish(w);
+      if (w->eng->journal && ++seen % JOURNAL_EVERY == 0) {
+         unlinking += NoteProgress(w, node, dir, &path);
+      }
+      tells = tells && fs->dirTell(dir, &at) == 0;
+   }
+   if (err != FS_END) {
+      RecordError(w, DT_OP_OPENDIR, node, NULL, err);
+   }
+   // queued unlinks are relative to dir, finish them before it goes
+   unlinking += FlushUnlinks(w, dir);
+   free(path);
+   if (node->handle != FS_NO_HANDLE) {
+      fs->dirDetach(dir);  // closed in FinishNode()
+   } else {
+      fs->closeDir(dir);
+   }
+
+   if (w->eng->stats) {
+      // sleeping on the rate limit is neither, it has its own phase
+      throttled = w->res.phase[DT_PHASE_THROTTLE] - throttled;
+      w->res.phase[DT_PHASE_UNLINK] += unlinking;
+      w->res.phase[DT_PHASE_ENUMERATE] += DtNow() - begin - unlinking -
+                                          throttled;
+   }
+   if (w->res.errors != errors) {
+      atomic_store(&node->failed, TRUE);  // don't read it again for this
+   }
+
+   FinishNode(w, node);
+}
+
+
+static void
+WorkerMain(void *arg)  // IN
+{
+   DtWorker *w = (DtWorker *) arg;
+   DtEngine *eng = w->eng;
+   DtNode *node;
+   double begin;
+   int done;
+
+   for (;;) {
+      if (eng->adaptive && w->id >= atomic_load(&eng->active)) {
+         // the tuner doesn't want us right now. Whatever is in our
+         // deque is left to thieves. Not waiting on anyone's work, so
+         // not a phase.
+         DtMutexLock(&eng->lock);
+         while (w->id >= atomic_load(&eng->active) && !eng->done) {
+            DtCondWait(&eng->park, &eng->lock);
+         }
+         done = eng->done;
+         DtMutexUnlock(&eng->lock);
+         if (done) {
+            break;
+         }
+      }
+
+      node = NextNode(w);
+      if (node) {
+         atomic_fetch_sub(&eng->queued, 1);
+         ScanDir(w, node);
+         continue;
+      }
+
+      // nothing to do anywhere, sleep until there is or we're done
+      begin = eng->stats ? DtNow() : 0;
+      DtMutexLock(&eng->lock);
+      atomic_fetch_add(&eng->idle, 1);
+      while (atomic_load(&eng->queued) == 0 && !eng->done) {
+         DtCondWait(&eng->wake, &eng->lock);
+      }
+      atomic_fetch_sub(&eng->idle, 1);
+      done = eng->done;
+      DtMutexUnlock(&eng->lock);
+      if (eng->stats) {
+         w->res.phase[DT_PHASE_WAIT] += DtNow() - begin;
+      }
+
+      if (done) {
+         break;
+      }
+   }
+}
+
+
+// add up the tuner feeds of all workers
+static void
+SampleFeeds(DtEngine *eng,       // IN
+            uint64_t *ops,       // OUT
+            uint64_t *unlinks)   // OUT
+{
+   int i, b;
+
+   *ops = 0;
+   memset(unlinks, 0, sizeof(uint64_t) * DT_HIST_BUCKETS);
+   for (i = 0; i < eng->nworkers; i++) {
+      DtFeed *f = &eng->workers[i].feed;
+      *ops += atomic_load_explicit(&f->ops, memory_order_relaxed);
+      for (b = 0; b < DT_HIST_BUCKETS; b++) {
+         unlinks[b] += atomic_load_explicit(&f->unlinks[b],
+                                            memory_order_relaxed);
+      }
+   }
+}
+
+
+// start the threads of the workers below n that have none yet. If
+// one can't be started the ones above it wait for the next call.
+static void
+StartWorkers(DtEngine *eng,   // IN
+             int n)           // IN
+{
+   DtWorker *w;
+
+   while (eng->started < n) {
+      w = &eng->workers[eng->started];
+      if (!DtThreadCreate(&w->thread, WorkerMain, w)) {
+         break;
+      }
+      eng->started++;
+   }
+}
+
+
+// measure the workers every window and let the tuner move their
+// number, until the delete is done
+static void
+TunerMain(void *arg)  // IN
+{
+   DtEngine *eng = (DtEngine *) arg;
+   uint64_t ops, prevOps = 0, hist[DT_HIST_BUCKETS];
+   uint64_t prevHist[DT_HIST_BUCKETS] = {0};
+   double begin = DtNow(), start = begin, now;
+   DtTuneStep step;
+   int b;
+
+   DtMutexLock(&eng->lock);
+   while (!eng->done) {
+      DtCondTimedWait(&eng->park, &eng->lock, TUNE_WINDOW_MS);
+      now = DtNow();
+      if (eng->done || now - start < TUNE_WINDOW_MS / 1000.0) {
+         continue;
+      }
+      SampleFeeds(eng, &ops, hist);
+      if (ops - prevOps < TUNE_MIN_OPS && now - start < TUNE_MAX_WINDOW) {
+         continue;  // too little to go on, make the window longer
+      }
+
+      for (b = 0; b < DT_HIST_BUCKETS; b++) {
+         uint64_t n = hist[b];
+         hist[b] -= prevHist[b];
+         prevHist[b] = n;
+      }
+      if (TuneWindow(&eng->tuner, (double) (ops - prevOps) / (now - start),
+                     TuneP99(hist), &step)) {
+         step.secs = now - begin;
+         eng->tune[eng->tuneSteps++ % DT_TUNE_LOG] = step;
+         atomic_store(&eng->active, step.to);
+         StartWorkers(eng, step.to);
+         DtCondBroadcast(&eng->park);
+      }
+      prevOps = ops;
+      start = now;
+   }
+   DtMutexUnlock(&eng->lock);
+}
+
+
+/**
+ * Default number of worker threads. Deletes are bound by metadata
+ * I/O rather than cpu, so we run a couple per processor to keep the
+ * device queue busy.
+ */
+int
+DtDefaultThreads(void)
+{
+   int n = DtNumCpus() * 2;
+
+   if (n < 4) {
+      n = 4;
+   } else if (n > 64) {
+      n = 64;
+   }
+   return n;
+}
+
+
+/**
+ * Whether io_uring batching (DtOptions.queueDepth) will actually be
+ * used on this system
+ */
+Bool
+DtUringSupported(void)
+{
+   return FsUringAvailable();
+}
+
+
+// one go over path and everything below it, for DtDeleteTree(). opts
+// and opts->report are always there.
+static Bool
+DeletePass(const TCHAR *path,       // IN
+           const DtOptions *opts,   // IN
+           DtResult *res)           // OUT
+{
+   DtEngine eng;
+   const DtFs *fs = opts->fs ? opts->fs : FsNative();
+   DtNode *root;
+   DtCounters *live;
+   DtThread tuner;
+   Bool tuning = FALSE, byInode;
+   DtOrder order;
+   TCHAR *rootPath;
+   int i, j, k, err;
+   int type = FS_TYPE_DIR;  // an lstat failure counts as opening it
+
+   assert(res);
+   memset(res, 0, sizeof(*res));
+
+   rootPath = fs->rootPath(path);
+   if (!rootPath) {
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      return FALSE;
+   }
+
+   err = fs->lstatType(rootPath, &type);
+   if (!err && type != FS_TYPE_DIR && opts->emptyOnly) {
+      err = FS_ENOTDIR;  // nothing to sweep, and files stay
+   } else if (!err && type != FS_TYPE_DIR) {
+      // a plain file, no need for the thread pool
+      uint64_t bytes = 0;
+      double begin;
+
+      if (opts->stats) {
+         fs->pathSize(rootPath, &bytes);
+         res->metaBytes = RATE_META_BYTES(_tcslen(rootPath));
+      }
+      res->phase[DT_PHASE_THROTTLE] = RateOp(opts->rate, _tcslen(rootPath));
+      begin = DtNow();
+      err = fs->unlink(rootPath);
+      if (opts->stats) {
+         res->phase[DT_PHASE_UNLINK] = DtNow() - begin;
+      }
+      if (!err) {
+         res->files = 1;
+         res->bytes = bytes;
+      }
+   }
+   if (err || type != FS_TYPE_DIR) {
+      if (err) {
+         res->errors = 1;
+         res->lastError = err;
+         ReportAdd(opts->report,
+                   type == FS_TYPE_DIR ? DT_OP_OPENDIR : DT_OP_UNLINK, err,
+                   opts->report->maxPaths ? _tcsdup(path) : NULL);
+      }
+      free(rootPath);
+      return err == 0;
+   }
+
+   order = opts->order;
+   byInode = order == DT_ORDER_INODE ||
+             (order == DT_ORDER_AUTO && fs->sortByInode(rootPath));
+   root = NewRoot(rootPath);
+   free(rootPath);
+   if (!root) {
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      return FALSE;
+   }
+
+   memset(&eng, 0, sizeof(eng));
+   eng.adaptive = opts->adaptive;
+   if (opts->threads > 0) {
+      eng.nworkers = opts->threads;
+   } else if (opts->queueDepth > 0 && fs->uring &&
+              FsUringAvailable()) {
+      // the kernel does the unlinking, a few submitters are enough
+      eng.nworkers = URING_THREADS;
+   } else if (eng.adaptive) {
+      eng.nworkers = ADAPT_MAX;
+   } else {
+      eng.nworkers = DtDefaultThreads();
+   }
+   eng.workers = (DtWorker *) calloc(eng.nworkers, sizeof(DtWorker));
+   if (!eng.workers) {
+      free(root);
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      return FALSE;
+   }
+   atomic_init(&eng.queued, 0);
+   atomic_init(&eng.idle, 0);
+   eng.stats = opts->stats;
+   eng.rate = opts->rate;
+   eng.emptyOnly = opts->emptyOnly;
+   eng.cancel = opts->cancel;
+   // a position noted says everything before it is gone, but sweeping
+   // leaves the files
+   eng.journal = !eng.emptyOnly ? opts->journal : NULL;
+   eng.maxMemory = opts->maxMemory ? (int64_t) opts->maxMemory :
+                   DT_MAX_MEMORY;
+   eng.byInode = byInode;
+   // with adaptive only the first few threads start, the tuner starts
+   // the others if it wants them
+   TuneInit(&eng.tuner, eng.adaptive ? ADAPT_START : eng.nworkers,
+            eng.nworkers);
+   atomic_init(&eng.active, eng.tuner.workers);
+   DtCondInit(&eng.park);
+   eng.fs = fs;
+   eng.path = path;
+   eng.maxHandles = fs->handleBudget();
+   DtMutexInit(&eng.lock);
+   DtCondInit(&eng.wake);
+   live = ProgressAttach(opts->progress, eng.nworkers);
+
+   for (i = 0; i < eng.nworkers; i++) {
+      eng.workers[i].eng = &eng;
+      eng.workers[i].live = live ? &live[i] : NULL;
+      eng.workers[i].id = i;
+      eng.workers[i].seed = 2463534242u + (uint32_t) i * 7919u;
+      DequeInit(&eng.workers[i].deque);
+      ReportInit(&eng.workers[i].report, opts->report->maxPaths);
+      if (opts->queueDepth > 0 && fs->uring) {
+         // NULL if unavailable, that worker just uses syscalls
+         eng.workers[i].ring = FsUringCreate((unsigned) opts->queueDepth,
+                                             UnlinkDone, &eng.workers[i]);
+      }
+   }
+
+   // seed worker 0 with the root. The calling thread becomes worker
+   // 0, so we make progress even if no thread can be started.
+   if (!DequePush(&eng.workers[0].deque, root)) {
+      free(root);
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      eng.done = TRUE;
+   } else {
+      atomic_store(&eng.queued, 1);
+   }
+
+   eng.started = 1;
+   StartWorkers(&eng, eng.tuner.workers);
+   if (eng.adaptive && eng.nworkers > 1) {
+      tuning = DtThreadCreate(&tuner, TunerMain, &eng);
+   }
+
+   WorkerMain(&eng.workers[0]);
+
+   // the tuner is the one starting workers, once it is gone their
+   // number is final
+   if (tuning) {
+      DtThreadJoin(tuner);
+   }
+   for (i = 1; i < eng.started; i++) {
+      DtThreadJoin(eng.workers[i].thread);
+   }
+   res->workers = atomic_load(&eng.active) < eng.started ?
+                  atomic_load(&eng.active) : eng.started;
+   res->inodeOrder = eng.byInode;
+   res->tuneSteps = eng.tuneSteps;
+   memcpy(res->tune, eng.tune, sizeof(res->tune));
+
+   for (i = 0; i < eng.nworkers; i++) {
+      DtResult *r = &eng.workers[i].res;
+      res->files += r->files;
+      res->dirs += r->dirs;
+      res->errors += r->errors;
+      res->rescans += r->rescans;
+      res->resumed += r->resumed;
+      res->cancelled |= r->cancelled;
+      if (r->errors) {
+         res->lastError = r->lastError;
+      }
+      res->bytes += r->bytes;
+      res->metaBytes += r->metaBytes;
+      for (j = 0; j < DT_PHASE_COUNT; j++) {
+         res->phase[j] += r->phase[j];
+      }
+      for (j = 0; j < DT_OP_COUNT; j++) {
+         for (k = 0; k < DT_HIST_BUCKETS; k++) {
+            res->hist[j][k] += r->hist[j][k];
+         }
+      }
+      DequeDestroy(&eng.workers[i].deque);
+      ReportMerge(opts->report, &eng.workers[i].report);
+      FsUringDestroy(eng.workers[i].ring);
+      MemGive(sizeof(DtBatchEnt) * eng.workers[i].batch.cap +
+              sizeof(TCHAR) * eng.workers[i].batch.room);
+      free(eng.workers[i].batch.ents);
+      free(eng.workers[i].batch.names);
+      while (eng.workers[i].spare) {
+         DtChunk *c = eng.workers[i].spare;
+         eng.workers[i].spare = c->next;
+         MemGive(CHUNK_HEADER + c->size);
+         free(c);
+      }
+   }
+
+   ProgressDetach(opts->progress, live);
+   DtCondDestroy(&eng.park);
+   DtCondDestroy(&eng.wake);
+   DtMutexDestroy(&eng.lock);
+   free(eng.workers);
+
+   return res->errors == 0 && !res->cancelled;
+}
+
+
+// add the counts of a later pass to res, which takes its outcome
+static void
+AddPass(DtResult *res,           // IN/OUT
+        const DtResult *pass)    // IN
+{
+   DtResult prev = *res;
+   int j, k;
+
+   *res = *pass;
+   res->files += prev.files;
+   res->dirs += prev.dirs;
+   res->rescans += prev.rescans;
+   res->resumed += prev.resumed;
+   res->bytes += prev.bytes;
+   res->metaBytes += prev.metaBytes;
+   for (j = 0; j < DT_PHASE_COUNT; j++) {
+      res->phase[j] += prev.phase[j];
+   }
+   for (j = 0; j < DT_OP_COUNT; j++) {
+      for (k = 0; k < DT_HIST_BUCKETS; k++) {
+         res->hist[j][k] += prev.hist[j][k];
+      }
+   }
+}
+
+
+/**
+ * Delete path and everything below it. If something failed for a
+ * reason that may pass, DtOptions.retries more passes go over what is
+ * left, and if something is left in the end it is counted.
+ *
+ * @param path file or directory to delete
+ * @param opts engine options, may be NULL
+ * @param res receives counters for what was done
+ * @return TRUE if everything was deleted, FALSE on errors or when
+ *         DtOptions.cancel stopped it
+ */
+Bool
+DtDeleteTree(const TCHAR *path,       // IN
+             const DtOptions *opts,   // IN
+             DtResult *res)           // OUT
+{
+   DtOptions o;
+   DtReport own;
+   DtResult pass;
+   DtScanResult scan;
+   Bool ok;
+
+   assert(res);
+   if (opts) {
+      o = *opts;
+   } else {
+      memset(&o, 0, sizeof(o));
+   }
+   if (!o.report) {
+      ReportInit(&own, 0);  // still needed to tell transient failures
+      o.report = &own;
+   }
+
+   ok = DeletePass(path, &o, res);
+   while (!ok && !res->cancelled && res->retries < o.retries &&
+          ReportTransient(o.report)) {
+      DtSleep(RETRY_PAUSE * (1 << res->retries));
+      if (o.cancel && atomic_load(o.cancel)) {
+         break;
+      }
+      // only the last pass's failures are still true
+      ReportFree(o.report);
+      // positions noted mean all before them went, which isn't so now
+      o.journal = NULL;
+      ok = DeletePass(path, &o, &pass);
+      pass.retries = res->retries + 1;
+      AddPass(res, &pass);
+   }
+
+   if (!ok && !res->cancelled) {
+      // only what failed is there to read. What can't be read isn't
+      // counted.
+      DtScanTree(path, o.fs, o.threads, TRUE, &scan);
+      res->leftFiles = scan.files;
+      res->leftDirs = scan.dirs;
+      res->leftBytes = scan.bytes;
+      DtScanFree(&scan);
+   }
+   if (o.report == &own) {
+      ReportFree(&own);
+   }
+   return ok;
+}
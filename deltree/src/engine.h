@@ -0,0 +1,219 @@
+// engine.h
+//
+// Native parallel tree delete engine.
+//
+// A pool of worker threads walks the tree. Each worker owns a deque of
+// directories waiting to be enumerated: it pushes and pops its own
+// work at the back (depth first, keeps the frontier small) and steals
+// from the front of other workers' deques when it runs dry (which
+// hands out the biggest unexplored subtrees). Files are unlinked by
+// whoever enumerates their directory, and a directory is removed by
+// whichever worker finishes its last child.
+//
+// On Linux the workers can optionally batch their unlinks through
+// io_uring instead of issuing one syscall per file.
+//
+// How many workers actually run can be left to the engine: it starts
+// with a couple and adds or parks workers as it measures what the
+// device underneath handles best, see tune.h.
+//
+// On filesystems that list directories in hash order (ext4, xfs) the
+// files of a directory are collected and unlinked sorted by inode
+// number, which turns scattered inode table writes into sequential
+// ones. Huge directories are sorted a batch at a time.
+//
+// Memory doesn't grow with the fan-out: the directories waiting to be
+// read and the sort batches of all running deletes share one budget.
+// A directory that meets a full budget keeps unlinking its files but
+// stops queueing subdirectories, and is read again for the rest once
+// the ones it did queue are done: from where it stopped, or from the
+// start passing over the ones that stay. If none of those could be
+// removed the rest is left. Directories that gain entries while we
+// read them are read again as well.
+//
+// The same walk can sweep empty directories instead: files are left
+// alone, and a directory is removed when its last child is gone
+// unless something below it holds a file.
+//
+// Failures are collected per worker and merged when the delete is
+// over, grouped by error code. When some of them may be transient
+// (busy files, short of handles) the delete goes over what is left
+// again, after a pause.
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include "platform.h"
+
+
+/**
+ * live counters of one worker for a progress display. Only the owner
+ * writes them, with relaxed stores (plain moves, no locked
+ * instructions), and each worker has its own cache line, so keeping
+ * them costs the delete next to nothing.
+ */
+typedef struct DtCounters_ {
+   atomic_uint_least64_t files;
+   atomic_uint_least64_t dirs;
+   atomic_uint_least64_t bytes;
+   atomic_uint_least64_t errors;
+   char pad[64 - 4 * sizeof(atomic_uint_least64_t)];
+} DtCounters;
+
+// progress display the counters are attached to, see progress.h
+typedef struct DtProgress_ DtProgress;
+
+// shared rate limit, see rate.h
+typedef struct DtRate_ DtRate;
+
+// notes for resuming a killed delete, see journal.h
+typedef struct DtJournal_ DtJournal;
+
+// filesystem primitives to delete with, see fs.h
+typedef struct DtFs_ DtFs;
+
+
+/**
+ * order files in a directory are unlinked in, see DtOptions.order
+ */
+typedef enum {
+   DT_ORDER_AUTO,        // by inode where the filesystem gains from it
+   DT_ORDER_DIR,         // as the directory listing returns them
+   DT_ORDER_INODE,       // sorted by inode number, a batch at a time
+} DtOrder;
+
+
+/**
+ * operations with a latency histogram, see DtResult.hist
+ */
+typedef enum {
+   DT_OP_OPENDIR,
+   DT_OP_UNLINK,         // synchronous unlinks only, io_uring
+                         // completions aren't timed one by one
+   DT_OP_RMDIR,
+   DT_OP_COUNT
+} DtOp;
+
+// failures grouped by error code, see report.h
+typedef struct DtReport_ DtReport;
+
+
+/**
+ * tuning knobs for a delete
+ */
+typedef struct DtOptions_ {
+   int threads;          // number of worker threads, 0 for default.
+                         // The most that may run with adaptive.
+   Bool adaptive;        // tune the number of running workers as we go
+   int queueDepth;       // io_uring unlinks in flight per worker,
+                         // 0 for plain syscalls
+   DtOrder order;        // how each directory's files are unlinked
+   uint64_t maxMemory;   // bytes the queued directories and sort
+                         // batches of all running deletes may take,
+                         // 0 for DT_MAX_MEMORY
+   Bool stats;           // collect timings, latencies and bytes freed,
+                         // costs a clock read per operation and a stat
+                         // per file
+   DtProgress *progress; // publish live counters here, may be NULL
+   DtRate *rate;         // pace unlinks and rmdirs, may be NULL
+   DtJournal *journal;   // resume from and note how far big directories
+                         // were read, may be NULL
+   const DtFs *fs;       // what to delete on, NULL for the disk
+   Bool emptyOnly;       // remove only directories with nothing but
+                         // empty directories below, never files, and
+                         // keep the target itself
+   DtReport *report;     // add the failures to this, may be NULL
+   int retries;          // times to go over what is left again when
+                         // failures may be transient
+   atomic_int *cancel;   // stop soon once it is set, may be NULL
+} DtOptions;
+
+
+// default DtOptions.maxMemory
+#define DT_MAX_MEMORY    (64 << 20)
+
+
+/**
+ * where the workers' time goes, see DtResult.phase
+ */
+typedef enum {
+   DT_PHASE_ENUMERATE,   // opening and reading directories
+   DT_PHASE_UNLINK,      // removing files
+   DT_PHASE_RMDIR,       // removing emptied directories
+   DT_PHASE_THROTTLE,    // sleeping on DtOptions.rate
+   DT_PHASE_WAIT,        // idle while other workers finish the
+                         // subtrees our directories wait on
+   DT_PHASE_COUNT
+} DtPhase;
+
+// bucket i counts operations that took less than 2^i microseconds,
+// the last bucket everything slower
+#define DT_HIST_BUCKETS  24
+
+
+/**
+ * why the number of workers changed, see DtTuneStep
+ */
+typedef enum {
+   DT_TUNE_GROW,         // throughput went up with the last change
+   DT_TUNE_LATENCY,      // unlink p99 far above the best seen, backed off
+   DT_TUNE_LOSS,         // throughput went down, backed off
+} DtTuneReason;
+
+/**
+ * one decision of the adaptive worker count
+ */
+typedef struct DtTuneStep_ {
+   double secs;          // since the delete started
+   int from;             // workers running before
+   int to;               // and after
+   double opsPerSec;     // measured in the window that decided it
+   uint32_t p99us;       // unlink p99 in that window, 0 if not measured
+   DtTuneReason reason;
+} DtTuneStep;
+
+// decisions kept in DtResult, the most recent ones
+#define DT_TUNE_LOG      32
+
+
+/**
+ * what happened during a delete
+ */
+typedef struct DtResult_ {
+   uint64_t files;       // files (and links) removed
+   uint64_t dirs;        // directories removed
+   uint64_t errors;      // operations that failed
+   int lastError;        // native error code of the last failure
+   int workers;          // workers running at the end
+   Bool inodeOrder;      // files were unlinked in inode order
+   uint64_t rescans;     // times a directory was read again, for want
+                         // of memory or because it changed
+   uint64_t resumed;     // directories read from where an earlier run
+                         // stopped, see DtOptions.journal
+   Bool cancelled;       // stopped by DtOptions.cancel, what is left
+                         // is not counted as errors
+   int retries;          // times it went over what was left again,
+                         // errors are those of the last time
+   uint64_t leftFiles;   // what failures left behind, counted after
+   uint64_t leftDirs;    // the delete with a scan. 0 if it was
+   uint64_t leftBytes;   // cancelled or not on the disk.
+
+   // what DtOptions.adaptive decided, tune[i % DT_TUNE_LOG] is the
+   // i'th step
+   int tuneSteps;
+   DtTuneStep tune[DT_TUNE_LOG];
+
+   // only filled in with DtOptions.stats
+   uint64_t bytes;                        // size of the files removed
+   uint64_t metaBytes;                    // metadata written, estimated
+                                          // like DtOptions.rate does
+   double phase[DT_PHASE_COUNT];          // seconds, summed over workers
+   uint64_t hist[DT_OP_COUNT][DT_HIST_BUCKETS];
+} DtResult;
+
+
+int  DtDefaultThreads(void);
+Bool DtUringSupported(void);
+Bool DtDeleteTree(const TCHAR *path, const DtOptions *opts, DtResult *res);
@@ -0,0 +1,46 @@
+// fs.c
+//
+// The table of the native filesystem primitives for the engine and
+// the walks, the same on every platform. The primitives are in
+// fs_posix.c and fs_win32.c.
+//
+
+#include "fs.h"
+
+
+static const DtFs nativeFs = {
+   _T("native"),
+#ifdef __linux__
+   TRUE,
+#else
+   FALSE,
+#endif
+   FsRootPath,
+   FsLstatType,
+   FsPathSize,
+   FsSortByInode,
+   FsUnlink,
+   FsHandleBudget,
+   FsOpenDirAt,
+   FsRemoveDirAt,
+   FsReadDir,
+   FsEntrySize,
+   FsEntryInfo,
+   FsUnlinkAt,
+   FsDirTell,
+   FsDirSeek,
+   FsDirHandle,
+   FsDirDetach,
+   FsCloseDir,
+   FsCloseHandle,
+};
+
+
+/**
+ * The filesystem on disk, what the engine uses unless told otherwise
+ */
+const DtFs *
+FsNative(void)
+{
+   return &nativeFs;
+}
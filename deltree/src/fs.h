@@ -0,0 +1,189 @@
+// fs.h
+//
+// Low level filesystem primitives used by the delete engine. There is
+// one implementation per platform (fs_posix.c, fs_win32.c), selected
+// at compile time. The engine goes through a DtFs table of them, so it
+// can also run on the in-memory filesystem in fs_mem.c.
+//
+// All functions return 0 on success or a native error code (errno on
+// POSIX, GetLastError() on Windows). A target that has already
+// disappeared is not an error, except to FsUnlink(), whose callers
+// need to tell.
+
+
+#pragma once
+
+#include <errno.h>
+
+#include "platform.h"
+
+// FsReadDir() return value when there are no more entries
+#define FS_END         (-1)
+
+// entry types reported by FsReadDir() and FsLstatType()
+#define FS_TYPE_FILE   0   // anything we remove without descending
+#define FS_TYPE_DIR    1   // a real directory that must be emptied first
+
+// FS_NOT_EMPTY: a directory removal found entries left.
+// FS_WAS_DIR: FsUnlinkAt() found a directory where the listing had
+// something else, it was replaced while we read.
+// FS_TRANSIENT: may well work if tried again a little later, someone
+// had the file open or we were short of memory or handles. On Windows
+// a file that is already being deleted is access denied too.
+#ifdef _WIN32
+#define FS_ENOMEM      ERROR_NOT_ENOUGH_MEMORY
+#define FS_ENOTDIR     ERROR_DIRECTORY
+#define FS_EACCES      ERROR_ACCESS_DENIED
+#define FS_ENOTEMPTY   ERROR_DIR_NOT_EMPTY
+#define FS_EBUSY       ERROR_SHARING_VIOLATION
+#define FS_NOT_FOUND(e) ((e) == ERROR_FILE_NOT_FOUND || \
+                         (e) == ERROR_PATH_NOT_FOUND)
+#define FS_NOT_EMPTY(e) ((e) == ERROR_DIR_NOT_EMPTY)
+#define FS_WAS_DIR(e)   ((e) == ERROR_DIR_NOT_EMPTY)
+#define FS_TRANSIENT(e) ((e) == ERROR_SHARING_VIOLATION || \
+                         (e) == ERROR_LOCK_VIOLATION || \
+                         (e) == ERROR_ACCESS_DENIED || \
+                         (e) == ERROR_DIR_NOT_EMPTY || \
+                         (e) == ERROR_NOT_ENOUGH_MEMORY || \
+                         (e) == ERROR_TOO_MANY_OPEN_FILES)
+#else
+#define FS_ENOMEM      ENOMEM
+#define FS_ENOTDIR     ENOTDIR
+#define FS_EACCES      EACCES
+#define FS_ENOTEMPTY   ENOTEMPTY
+#define FS_EBUSY       EBUSY
+#define FS_NOT_FOUND(e) ((e) == ENOENT)
+#define FS_NOT_EMPTY(e) ((e) == ENOTEMPTY || (e) == EEXIST)
+#define FS_WAS_DIR(e)   ((e) == EISDIR)
+#define FS_TRANSIENT(e) ((e) == EBUSY || (e) == EAGAIN || (e) == EINTR || \
+                         (e) == ENOTEMPTY || (e) == EEXIST || \
+                         (e) == ENOMEM || (e) == EMFILE || (e) == ENFILE)
+#endif
+
+// an open directory being enumerated, backend specific
+typedef struct DtDir_ DtDir;
+
+// an open directory that entries can be opened and removed relative
+// to. FS_NO_HANDLE in place of one means the name is a whole path.
+#ifdef _WIN32
+typedef HANDLE DtHandle;
+#define FS_NO_HANDLE   NULL
+#else
+typedef int DtHandle;
+#define FS_NO_HANDLE   (-1)
+#endif
+
+// a single directory entry, valid until the next FsReadDir() call
+typedef struct DtDirent_ {
+   const TCHAR *name;      // entry name, no path
+   size_t nameLen;         // length of name in characters
+   int type;               // FS_TYPE_*
+   uint64_t ino;           // inode number, 0 if the listing has none
+                           // (Windows)
+   unsigned long attrs;    // raw attributes (Windows only)
+} DtDirent;
+
+// what FsEntryInfo() reports about a file. Times are in nanoseconds
+// since 1970 on every platform, with whatever resolution it has.
+typedef struct DtFileInfo_ {
+   uint64_t bytes;
+   int64_t atime;          // last access
+   int64_t mtime;          // last write
+} DtFileInfo;
+
+
+TCHAR *FsRootPath(const TCHAR *path);
+TCHAR *FsFullPath(const TCHAR *path);
+int    FsDeviceId(const TCHAR *path, uint64_t *dev);
+int    FsLstatType(const TCHAR *path, int *type);
+int    FsPathSize(const TCHAR *path, uint64_t *bytes);
+Bool   FsSortByInode(const TCHAR *path);
+int    FsUnlink(const TCHAR *path);
+int    FsRemoveDir(const TCHAR *path);
+
+int    FsOpenDir(const TCHAR *path, DtDir **dir);
+int    FsReadDir(DtDir *dir, DtDirent *ent);
+int    FsEntrySize(DtDir *dir, const DtDirent *ent, uint64_t *bytes);
+int    FsEntryInfo(DtDir *dir, const DtDirent *ent, DtFileInfo *info);
+int    FsUnlinkAt(DtDir *dir, const DtDirent *ent);
+int    FsDirTell(DtDir *dir, uint64_t *pos);
+int    FsDirSeek(DtDir *dir, uint64_t pos);
+void   FsCloseDir(DtDir *dir);
+
+/*
+ * handle relative operations, for walking trees deeper than the path
+ * length limit without ever building a path
+ */
+
+int      FsHandleBudget(void);
+int      FsOpenDirAt(DtHandle parent, const TCHAR *name, DtDir **dir);
+int      FsRemoveDirAt(DtHandle parent, const TCHAR *name);
+DtHandle FsDirHandle(DtDir *dir);
+DtHandle FsDirDetach(DtDir *dir);
+void     FsCloseHandle(DtHandle h);
+
+#ifndef _WIN32
+int    FsDirFd(DtDir *dir);
+#endif
+
+
+/*
+ * batched asynchronous unlinks (io_uring, Linux only). Elsewhere
+ * FsUringAvailable() is FALSE and FsUringCreate() returns NULL.
+ */
+
+typedef struct DtUring_ DtUring;
+
+// completion callback, err is 0 or a native error code
+typedef void (*DtUringDone)(void *ctx, int err);
+
+Bool     FsUringAvailable(void);
+DtUring *FsUringCreate(unsigned depth, DtUringDone done, void *ctx);
+void     FsUringDestroy(DtUring *ring);
+int      FsUringUnlinkAt(DtUring *ring, DtDir *dir, const DtDirent *ent);
+void     FsUringFlush(DtUring *ring);
+
+
+/*
+ * what the delete engine, the scan, the purge and list deletes call,
+ * through a table so they can run on the disk or on the in-memory
+ * filesystem. The members are the Fs* functions above of the same
+ * name.
+ */
+
+typedef struct DtFs_ {
+   const TCHAR *name;
+   Bool uring;             // FsUring*() work on its directories
+   TCHAR   *(*rootPath)(const TCHAR *path);
+   int      (*lstatType)(const TCHAR *path, int *type);
+   int      (*pathSize)(const TCHAR *path, uint64_t *bytes);
+   Bool     (*sortByInode)(const TCHAR *path);
+   int      (*unlink)(const TCHAR *path);
+   int      (*handleBudget)(void);
+   int      (*openDirAt)(DtHandle parent, const TCHAR *name, DtDir **dir);
+   int      (*removeDirAt)(DtHandle parent, const TCHAR *name);
+   int      (*readDir)(DtDir *dir, DtDirent *ent);
+   int      (*entrySize)(DtDir *dir, const DtDirent *ent, uint64_t *bytes);
+   int      (*entryInfo)(DtDir *dir, const DtDirent *ent, DtFileInfo *info);
+   int      (*unlinkAt)(DtDir *dir, const DtDirent *ent);
+   int      (*dirTell)(DtDir *dir, uint64_t *pos);
+   int      (*dirSeek)(DtDir *dir, uint64_t pos);
+   DtHandle (*dirHandle)(DtDir *dir);
+   DtHandle (*dirDetach)(DtDir *dir);
+   void     (*closeDir)(DtDir *dir);
+   void     (*closeHandle)(DtHandle h);
+} DtFs;
+
+const DtFs *FsNative(void);
+
+
+/*
+ * in-memory filesystem (fs_mem.c) with generated trees, latency and
+ * failure injection, for benchmarking and stress testing the engine
+ * without a disk. FsMemSetup() and FsMemMake() must be done before
+ * any delete on it starts.
+ */
+
+Bool        FsMemSetup(const TCHAR *spec);
+int         FsMemMake(const TCHAR *path, uint64_t *files, uint64_t *dirs);
+const DtFs *FsMem(void);
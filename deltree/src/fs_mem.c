@@ -0,0 +1,939 @@
+// fs_mem.c
+//
+// An in-memory filesystem for the engine: trees generated from a spec,
+// with a latency for each kind of operation and failures injected at a
+// given rate. It shows how much of a delete is deltree's own work
+// (scheduling, progress, the journal) rather than the kernel's, and
+// deletes shapes no disk at hand holds (10M entries, 5000 levels deep)
+// the same way every time.
+//
+// The spec is a shape and its size, then options, comma separated:
+//
+//    wide:N       one directory with N files
+//    deep:N       a chain of N directories, two files in each
+//    build:N      N files, 100 to a directory and up to 8
+//                 subdirectories in each
+//    fan:N        one directory with N subdirectories, a file in each
+//    open=US      latency of opening a directory, in microseconds
+//    read=US      of reading 64 entries, what one getdents() returns
+//    unlink=US    of removing a file
+//    rmdir=US     of removing a directory
+//    fail=P       fraction of opens, unlinks and rmdirs that fail
+//    busy=P       fraction of unlinks that fail as busy the first time
+//    locked=P     fraction of files no unlink removes, like immutable ones
+//    seed=N       picks which ones, the same for every run
+//    size=B       bytes every file reports
+//    handles=N    directory handles the engine may keep open
+//    empty=N      fan: N more subdirectories after those, empty
+//    tell=0       directories have no position to seek back to, like
+//                 on Windows
+//
+// Latencies are slept, so the worker blocks like it would on a disk.
+// Short ones round up to what the OS timer can do.
+//
+// Directories are named dN and files fN, and anything in a tree can be
+// named by a path below it, eg. t/d0/f3 for a list delete or a purge.
+// Files were last used at times spread over the MEM_AGES days before
+// the tree was made, the same on every run. Nothing is created once a
+// delete runs, so the trees need no locks: an entry is gone when its
+// MEM_GONE flag is set, and each directory counts the entries it has
+// left. The trees live until the process exits.
+//
+
+#include <stdatomic.h>
+#include <time.h>
+
+#include "fs.h"
+
+
+#define MEM_MAX_ENTRIES 1000000000.0  // largest size in a spec
+#define MEM_READ_BATCH  64            // entries per read latency
+#define MEM_DIR_FILES   100           // files in a build directory
+#define MEM_DIR_FANOUT  8             // subdirectories in one
+#define MEM_DEEP_FILES  2             // files on each deep level
+#define MEM_SELF        UINT64_MAX    // failure key of a directory
+#define MEM_AGES        100           // days file times go back
+#define MEM_NAME_MAX    24            // longest dN or fN name
+
+// MemDir.gone[] flags
+#define MEM_GONE        1             // entry removed
+#define MEM_WAS_BUSY    2             // its unlink failed as busy once
+
+#ifdef _WIN32
+#define MEM_ENOENT      ERROR_PATH_NOT_FOUND
+#define MEM_EEXIST      ERROR_ALREADY_EXISTS
+#define MEM_ENOTSUP     ERROR_NOT_SUPPORTED
+#define MEM_EISDIR      ERROR_ACCESS_DENIED
+#define MEM_HANDLE(d)   ((HANDLE) (intptr_t) ((d)->id + 1))
+#define MEM_ID(h)       ((uint32_t) ((intptr_t) (h) - 1))
+#else
+#define MEM_ENOENT      ENOENT
+#define MEM_EEXIST      EEXIST
+#define MEM_ENOTSUP     ENOTSUP
+#define MEM_EISDIR      EISDIR
+#define MEM_HANDLE(d)   ((int) (d)->id)
+#define MEM_ID(h)       ((uint32_t) (h))
+#endif
+
+
+typedef enum {
+   MEM_OPEN,
+   MEM_READ,
+   MEM_UNLINK,
+   MEM_RMDIR,
+   MEM_OP_COUNT
+} MemOp;
+
+typedef enum {
+   MEM_WIDE,
+   MEM_DEEP,
+   MEM_BUILD,
+   MEM_FAN,
+} MemShape;
+
+
+/**
+ * a directory. Its entries are the subdirectories d0 .. followed by
+ * the files f0 .., gone[] is indexed the same way.
+ */
+typedef struct MemDir_ {
+   struct MemDir_ *parent;  // NULL for a root
+   uint32_t id;             // index in byId[], also the handle
+   uint32_t ndirs;
+   uint32_t nfiles;
+   struct MemDir_ **sub;    // the subdirectories
+   atomic_uchar *gone;      // MEM_GONE and MEM_WAS_BUSY per entry
+   atomic_long left;        // entries not removed yet
+} MemDir;
+
+/**
+ * a tree FsMemMake() built, reachable by path
+ */
+typedef struct MemRoot_ {
+   TCHAR *path;
+   MemDir *dir;
+   atomic_int gone;
+} MemRoot;
+
+/**
+ * an open directory, what the engine gets as a DtDir
+ */
+typedef struct MemOpen_ {
+   MemDir *dir;
+   uint64_t pos;            // next entry to look at
+   uint64_t read;           // entries returned
+   TCHAR name[MEM_NAME_MAX];  // of the last one returned
+} MemOpen;
+
+
+// from FsMemSetup(), fixed while deletes run
+static MemShape shape;
+static uint64_t count;
+static double latency[MEM_OP_COUNT];  // seconds
+static double failRate;
+static double busyRate;
+static double lockedRate;
+static uint64_t seed;
+static uint64_t fileSize;
+static int handles = 4096;          // like a modest descriptor limit
+static Bool tells = TRUE;
+static uint32_t empties;
+static int64_t made;                // when, for the file times
+
+// every directory by id, and the roots. Only FsMemMake() adds to them.
+static MemDir **byId;
+static uint32_t nById, byIdCap;
+static MemRoot *roots;
+static int nroots;
+
+
+// splitmix64 finalizer, spreads similar keys all over
+static uint64_t
+Mix(uint64_t x)  // IN
+{
+   x ^= x >> 30;
+   x *= 0xbf58476d1ce4e5b9ull;
+   x ^= x >> 27;
+   x *= 0x94d049bb133111ebull;
+   x ^= x >> 31;
+   return x;
+}
+
+
+// whether op on an entry of d (or on d, with MEM_SELF) is among rate
+// of them. Decided by the seed alone, so every run picks the same
+// entries.
+static Bool
+Picked(const MemDir *d,   // IN
+       uint64_t entry,    // IN
+       int op,            // IN
+       double rate)       // IN
+{
+   uint64_t h;
+
+   if (rate <= 0) {
+      return FALSE;
+   }
+   h = Mix(seed ^ Mix(((uint64_t) d->id << 32) ^ entry) ^ (uint64_t) op);
+   return (double) (h >> 11) * (1.0 / 9007199254740992.0) < rate;
+}
+
+#define Fails(d, entry, op)  Picked(d, entry, op, failRate)
+// busy= and locked=, told apart from fail= by ops that don't exist
+#define Busy(d, entry)       Picked(d, entry, MEM_OP_COUNT, busyRate)
+#define Locked(d, entry)     Picked(d, entry, MEM_OP_COUNT + 1, lockedRate)
+
+
+static void
+Delay(MemOp op)  // IN
+{
+   if (latency[op] > 0) {
+      DtSleep(latency[op]);
+   }
+}
+
+
+// new directory with room for its entries, registered in byId[]
+static MemDir *
+NewDir(MemDir *parent,      // IN
+       uint32_t subdirs,    // IN
+       uint32_t files)      // IN
+{
+   MemDir *d, **grown;
+   uint64_t n = (uint64_t) subdirs + files;
+
+   if (nById == byIdCap) {
+      grown = (MemDir **) realloc(byId, sizeof(MemDir *) *
+                                  (byIdCap ? byIdCap * 2 : 1024));
+      if (!grown) {
+         return NULL;
+      }
+      byId = grown;
+      byIdCap = byIdCap ? byIdCap * 2 : 1024;
+   }
+   d = (MemDir *) calloc(1, sizeof(MemDir));
+   if (!d) {
+      return NULL;
+   }
+   d->sub = subdirs ? (MemDir **) calloc(subdirs, sizeof(MemDir *)) : NULL;
+   d->gone = n ? (atomic_uchar *) calloc(n, sizeof(atomic_uchar)) : NULL;
+   if ((subdirs && !d->sub) || (n && !d->gone)) {
+      free(d->sub);
+      free(d);
+      return NULL;
+   }
+   d->parent = parent;
+   d->id = nById;
+   d->ndirs = subdirs;
+   d->nfiles = files;
+   atomic_init(&d->left, (long) n);
+   byId[nById++] = d;
+   return d;
+}
+
+
+// a build tree of n files below parent, which is NULL for the root
+static MemDir *
+MakeBuild(MemDir *parent,     // IN
+          uint64_t n,         // IN
+          uint64_t *dcount)   // IN/OUT
+{
+   uint64_t files = n < MEM_DIR_FILES ? n : MEM_DIR_FILES;
+   uint64_t rest = n - files, share;
+   uint32_t subdirs, i;
+   MemDir *d;
+
+   subdirs = (uint32_t) ((rest + MEM_DIR_FILES - 1) / MEM_DIR_FILES);
+   if (subdirs > MEM_DIR_FANOUT) {
+      subdirs = MEM_DIR_FANOUT;
+   }
+   d = NewDir(parent, subdirs, (uint32_t) files);
+   if (!d) {
+      return NULL;
+   }
+   (*dcount)++;
+   for (i = 0; i < subdirs; i++) {
+      share = rest / subdirs + (i < rest % subdirs);
+      if (!(d->sub[i] = MakeBuild(d, share, dcount))) {
+         return NULL;
+      }
+   }
+   return d;
+}
+
+
+// the root with that path, NULL if there is none or it was removed
+static MemRoot *
+FindRoot(const TCHAR *path)  // IN
+{
+   int i;
+
+   for (i = 0; i < nroots; i++) {
+      if (!atomic_load(&roots[i].gone) && _tcscmp(roots[i].path, path) == 0) {
+         return &roots[i];
+      }
+   }
+   return NULL;
+}
+
+
+// the root whose tree path is in, NULL if there is none. *rest is set
+// to what follows its path.
+static MemRoot *
+FindTree(const TCHAR *path,    // IN
+         const TCHAR **rest)   // OUT
+{
+   MemRoot *best = NULL;
+   size_t len, bestLen = 0;
+   int i;
+
+   for (i = 0; i < nroots; i++) {
+      len = _tcslen(roots[i].path);
+      if (atomic_load(&roots[i].gone) || len < bestLen ||
+          _tcsncmp(roots[i].path, path, len) != 0) {
+         continue;
+      }
+      if (path[len] == _T('\0') || path[len] == DT_PATH_SEP ||
+          roots[i].path[len - 1] == DT_PATH_SEP) {
+         best = &roots[i];
+         bestLen = len;
+      }
+   }
+   *rest = path + bestLen;
+   return best;
+}
+
+
+// entry index of name in d, FALSE if d has no such entry
+static Bool
+ParseName(const MemDir *d,      // IN
+          const TCHAR *name,    // IN
+          uint64_t *entry)      // OUT
+{
+   TCHAR *end;
+   unsigned long long i;
+
+   if ((name[0] != _T('d') && name[0] != _T('f')) ||
+       name[1] < _T('0') || name[1] > _T('9')) {
+      return FALSE;
+   }
+   i = _tcstoull(name + 1, &end, 10);
+   if (*end) {
+      return FALSE;
+   }
+   if (name[0] == _T('d')) {
+      *entry = i;
+      return i < d->ndirs;
+   }
+   *entry = d->ndirs + i;
+   return i < d->nfiles;
+}
+
+
+// the entry a path names: the directory it is in and its index there,
+// or a root's directory and MEM_SELF
+static int
+Resolve(const TCHAR *path,   // IN
+        MemDir **in,         // OUT
+        uint64_t *entry)     // OUT
+{
+   TCHAR name[MEM_NAME_MAX];
+   const TCHAR *p, *end;
+   MemRoot *root;
+   MemDir *d;
+   uint64_t i = MEM_SELF;
+
+   if (!(root = FindTree(path, &p))) {
+      return MEM_ENOENT;
+   }
+   d = root->dir;
+   for (;;) {
+      while (*p == DT_PATH_SEP) {
+         p++;
+      }
+      if (!*p) {
+         break;
+      }
+      if (i != MEM_SELF) {
+         // what we have so far is a directory the path goes on into
+         if (i >= d->ndirs) {
+            return FS_ENOTDIR;
+         }
+         d = d->sub[i];
+      }
+      for (end = p; *end && *end != DT_PATH_SEP; end++) {
+      }
+      if (end - p >= MEM_NAME_MAX) {
+         return MEM_ENOENT;
+      }
+      memcpy(name, p, sizeof(TCHAR) * (end - p));
+      name[end - p] = _T('\0');
+      if (!ParseName(d, name, &i) || (atomic_load(&d->gone[i]) & MEM_GONE)) {
+         return MEM_ENOENT;
+      }
+      p = end;
+   }
+   *in = d;
+   *entry = i;
+   return 0;
+}
+
+
+// the directory name refers to relative to parent
+static int
+Lookup(DtHandle parent,     // IN
+       const TCHAR *name,   // IN
+       MemDir **dir,        // OUT
+       uint64_t *entry)     // OUT, its entry in the parent
+{
+   MemDir *p;
+   int err;
+
+   if (parent == FS_NO_HANDLE) {
+      if ((err = Resolve(name, &p, entry)) != 0) {
+         return err;
+      }
+      if (*entry == MEM_SELF) {
+         *dir = p;
+         return 0;
+      }
+   } else {
+      p = byId[MEM_ID(parent)];
+      if (!ParseName(p, name, entry) ||
+          (atomic_load(&p->gone[*entry]) & MEM_GONE)) {
+         return MEM_ENOENT;
+      }
+   }
+   if (*entry >= p->ndirs) {
+      return FS_ENOTDIR;
+   }
+   *dir = p->sub[*entry];
+   return 0;
+}
+
+
+// remove file entry of d, what every unlink comes down to
+static int
+UnlinkEntry(MemDir *d,        // IN
+            uint64_t entry)   // IN
+{
+   Delay(MEM_UNLINK);
+   if (Fails(d, entry, MEM_UNLINK) || Locked(d, entry)) {
+      return FS_EACCES;
+   }
+   if (Busy(d, entry) &&
+       !(atomic_fetch_or(&d->gone[entry], MEM_WAS_BUSY) & MEM_WAS_BUSY)) {
+      return FS_EBUSY;
+   }
+   if (!(atomic_fetch_or(&d->gone[entry], MEM_GONE) & MEM_GONE)) {
+      atomic_fetch_sub(&d->left, 1);
+   }
+   return 0;
+}
+
+
+// last use of file entry of d, spread over MEM_AGES days before the
+// tree was made
+static int64_t
+EntryTime(const MemDir *d,    // IN
+          uint64_t entry)     // IN
+{
+   uint64_t h = Mix(seed ^ Mix(((uint64_t) d->id << 32) ^ entry));
+
+   return made - (int64_t) (h % ((uint64_t) MEM_AGES * 86400 * 1000000000));
+}
+
+
+/*
+ * the DtFs primitives
+ */
+
+static TCHAR *
+MemRootPath(const TCHAR *path)  // IN
+{
+   TCHAR *p = _tcsdup(path);
+   size_t len;
+
+   if (p) {
+      len = _tcslen(p);
+      while (len > 1 && p[len - 1] == DT_PATH_SEP) {
+         p[--len] = _T('\0');
+      }
+   }
+   return p;
+}
+
+
+static int
+MemLstatType(const TCHAR *path,  // IN
+             int *type)          // OUT
+{
+   MemDir *d;
+   uint64_t entry;
+   int err;
+
+   if ((err = Resolve(path, &d, &entry)) != 0) {
+      return err;
+   }
+   *type = entry == MEM_SELF || entry < d->ndirs ? FS_TYPE_DIR
+                                                 : FS_TYPE_FILE;
+   return 0;
+}
+
+
+static int
+MemPathSize(const TCHAR *path,   // IN
+            uint64_t *bytes)     // OUT
+{
+   MemDir *d;
+   uint64_t entry;
+   int err;
+
+   if ((err = Resolve(path, &d, &entry)) != 0) {
+      return err;
+   }
+   *bytes = entry == MEM_SELF || entry < d->ndirs ? 0 : fileSize;
+   return 0;
+}
+
+
+static Bool
+MemSortByInode(const TCHAR *path)  // IN
+{
+   (void) path;
+   return FALSE;
+}
+
+
+static int
+MemUnlink(const TCHAR *path)  // IN
+{
+   MemDir *d;
+   uint64_t entry;
+   int err;
+
+   if ((err = Resolve(path, &d, &entry)) != 0) {
+      return err;
+   }
+   if (entry == MEM_SELF || entry < d->ndirs) {
+      return MEM_EISDIR;
+   }
+   return UnlinkEntry(d, entry);
+}
+
+
+static int
+MemHandleBudget(void)
+{
+   return handles;
+}
+
+
+static int
+MemOpenDirAt(DtHandle parent,     // IN
+             const TCHAR *name,   // IN
+             DtDir **dir)         // OUT
+{
+   MemOpen *o;
+   MemDir *d;
+   uint64_t entry;
+   int err;
+
+   Delay(MEM_OPEN);
+   if ((err = Lookup(parent, name, &d, &entry)) != 0) {
+      return err;
+   }
+   if (Fails(d, MEM_SELF, MEM_OPEN)) {
+      return FS_EACCES;
+   }
+   o = (MemOpen *) calloc(1, sizeof(MemOpen));
+   if (!o) {
+      return FS_ENOMEM;
+   }
+   o->dir = d;
+   *dir = (DtDir *) o;
+   return 0;
+}
+
+
+static int
+MemRemoveDirAt(DtHandle parent,     // IN
+               const TCHAR *name)   // IN
+{
+   MemDir *d;
+   uint64_t entry;
+   int i;
+
+   Delay(MEM_RMDIR);
+   if (Lookup(parent, name, &d, &entry) != 0) {
+      return 0;  // already gone
+   }
+   if (Fails(d, MEM_SELF, MEM_RMDIR)) {
+      return FS_EACCES;
+   }
+   if (atomic_load(&d->left) > 0) {
+      return FS_ENOTEMPTY;
+   }
+   if (!d->parent) {
+      for (i = 0; i < nroots; i++) {
+         if (roots[i].dir == d) {
+            atomic_store(&roots[i].gone, 1);
+         }
+      }
+   } else if (!(atomic_fetch_or(&d->parent->gone[entry], MEM_GONE) &
+                MEM_GONE)) {
+      atomic_fetch_sub(&d->parent->left, 1);
+   }
+   return 0;
+}
+
+
+static int
+MemReadDir(DtDir *dir,     // IN
+           DtDirent *ent)  // OUT
+{
+   MemOpen *o = (MemOpen *) dir;
+   MemDir *d = o->dir;
+   uint64_t total = (uint64_t) d->ndirs + d->nfiles;
+
+   while (o->pos < total && (atomic_load(&d->gone[o->pos]) & MEM_GONE)) {
+      o->pos++;
+   }
+   if (o->pos == total) {
+      return FS_END;
+   }
+   if (o->read++ % MEM_READ_BATCH == 0) {
+      Delay(MEM_READ);
+   }
+
+   if (o->pos < d->ndirs) {
+      _sntprintf(o->name, ARRAYSIZE(o->name), _T("d%llu"),
+                 (unsigned long long) o->pos);
+      ent->type = FS_TYPE_DIR;
+   } else {
+      _sntprintf(o->name, ARRAYSIZE(o->name), _T("f%llu"),
+                 (unsigned long long) (o->pos - d->ndirs));
+      ent->type = FS_TYPE_FILE;
+   }
+   ent->name = o->name;
+   ent->nameLen = _tcslen(o->name);
+   // not in listing order, so --order=inode has something to do
+   ent->ino = Mix(((uint64_t) d->id << 32) ^ o->pos) | 1;
+   ent->attrs = 0;
+   o->pos++;
+   return 0;
+}
+
+
+static int
+MemEntrySize(DtDir *dir,              // IN
+             const DtDirent *ent,     // IN
+             uint64_t *bytes)         // OUT
+{
+   (void) dir;
+   *bytes = ent->type == FS_TYPE_FILE ? fileSize : 0;
+   return 0;
+}
+
+
+static int
+MemEntryInfo(DtDir *dir,              // IN
+             const DtDirent *ent,     // IN
+             DtFileInfo *info)        // OUT
+{
+   MemDir *d = ((MemOpen *) dir)->dir;
+   uint64_t entry;
+
+   if (!ParseName(d, ent->name, &entry)) {
+      return MEM_ENOENT;
+   }
+   info->bytes = ent->type == FS_TYPE_FILE ? fileSize : 0;
+   info->atime = info->mtime = EntryTime(d, entry);
+   return 0;
+}
+
+
+static int
+MemUnlinkAt(DtDir *dir,             // IN
+            const DtDirent *ent)    // IN
+{
+   MemDir *d = ((MemOpen *) dir)->dir;
+   uint64_t entry;
+
+   if (!ParseName(d, ent->name, &entry)) {
+      Delay(MEM_UNLINK);
+      return 0;  // never was, so it is gone
+   }
+   if (entry < d->ndirs) {
+      Delay(MEM_UNLINK);
+      return FS_EACCES;
+   }
+   return UnlinkEntry(d, entry);
+}
+
+
+static int
+MemDirTell(DtDir *dir,      // IN
+           uint64_t *pos)   // OUT
+{
+   if (!tells) {
+      return MEM_ENOTSUP;
+   }
+   *pos = ((MemOpen *) dir)->pos;
+   return 0;
+}
+
+
+static int
+MemDirSeek(DtDir *dir,     // IN
+           uint64_t pos)   // IN
+{
+   MemOpen *o = (MemOpen *) dir;
+   uint64_t total = (uint64_t) o->dir->ndirs + o->dir->nfiles;
+
+   if (!tells) {
+      return MEM_ENOTSUP;
+   }
+   o->pos = pos < total ? pos : total;
+   return 0;
+}
+
+
+static DtHandle
+MemDirHandle(DtDir *dir)  // IN
+{
+   return MEM_HANDLE(((MemOpen *) dir)->dir);
+}
+
+
+static DtHandle
+MemDirDetach(DtDir *dir)  // IN
+{
+   DtHandle h = MemDirHandle(dir);
+
+   free(dir);
+   return h;
+}
+
+
+static void
+MemCloseDir(DtDir *dir)  // IN
+{
+   free(dir);
+}
+
+
+static void
+MemCloseHandle(DtHandle h)  // IN
+{
+   (void) h;  // handles are just ids
+}
+
+
+static const DtFs memFs = {
+   _T("memory"),
+   FALSE,
+   MemRootPath,
+   MemLstatType,
+   MemPathSize,
+   MemSortByInode,
+   MemUnlink,
+   MemHandleBudget,
+   MemOpenDirAt,
+   MemRemoveDirAt,
+   MemReadDir,
+   MemEntrySize,
+   MemEntryInfo,
+   MemUnlinkAt,
+   MemDirTell,
+   MemDirSeek,
+   MemDirHandle,
+   MemDirDetach,
+   MemCloseDir,
+   MemCloseHandle,
+};
+
+
+/**
+ * Configure the in-memory filesystem, see the top of this file
+ *
+ * @param spec shape, size and options, like "wide:1e6,unlink=20"
+ * @return FALSE if spec doesn't parse
+ */
+Bool
+FsMemSetup(const TCHAR *spec)  // IN
+{
+   static const TCHAR *shapes[] = {
+      _T("wide"), _T("deep"), _T("build"), _T("fan")
+   };
+   static const TCHAR *ops[] = {
+      _T("open"), _T("read"), _T("unlink"), _T("rmdir")
+   };
+   const TCHAR *p, *key;
+   TCHAR *end;
+   size_t len;
+   double v;
+   int i;
+
+   p = _tcschr(spec, _T(':'));
+   if (!p) {
+      return FALSE;
+   }
+   len = (size_t) (p - spec);
+   for (i = 0; i < (int) ARRAYSIZE(shapes); i++) {
+      if (_tcslen(shapes[i]) == len && _tcsncmp(spec, shapes[i], len) == 0) {
+         break;
+      }
+   }
+   if (i == (int) ARRAYSIZE(shapes)) {
+      return FALSE;
+   }
+   shape = (MemShape) i;
+   v = _tcstod(p + 1, &end);
+   if (end == p + 1 || !(v >= 1 && v <= MEM_MAX_ENTRIES)) {
+      return FALSE;
+   }
+   count = (uint64_t) v;
+
+   for (p = end; *p == _T(','); p = end) {
+      key = p + 1;
+      p = _tcschr(key, _T('='));
+      if (!p) {
+         return FALSE;
+      }
+      len = (size_t) (p - key);
+      v = _tcstod(p + 1, &end);
+      if (end == p + 1 || !(v >= 0)) {
+         return FALSE;
+      }
+      for (i = 0; i < MEM_OP_COUNT; i++) {
+         if (_tcslen(ops[i]) == len && _tcsncmp(key, ops[i], len) == 0) {
+            latency[i] = v / 1e6;
+            break;
+         }
+      }
+      if (i < MEM_OP_COUNT) {
+         continue;
+      }
+      if (len == 4 && _tcsncmp(key, _T("fail"), len) == 0 && v <= 1) {
+         failRate = v;
+      } else if (len == 4 && _tcsncmp(key, _T("busy"), len) == 0 &&
+                 v <= 1) {
+         busyRate = v;
+      } else if (len == 6 && _tcsncmp(key, _T("locked"), len) == 0 &&
+                 v <= 1) {
+         lockedRate = v;
+      } else if (len == 4 && _tcsncmp(key, _T("seed"), len) == 0) {
+         seed = (uint64_t) v;
+      } else if (len == 4 && _tcsncmp(key, _T("size"), len) == 0) {
+         fileSize = (uint64_t) v;
+      } else if (len == 7 && _tcsncmp(key, _T("handles"), len) == 0 &&
+                 v <= 1 << 20) {
+         handles = (int) v;
+      } else if (len == 5 && _tcsncmp(key, _T("empty"), len) == 0 &&
+                 v <= MEM_MAX_ENTRIES) {
+         empties = (uint32_t) v;
+      } else if (len == 4 && _tcsncmp(key, _T("tell"), len) == 0 &&
+                 v <= 1) {
+         tells = v != 0;
+      } else {
+         return FALSE;
+      }
+   }
+   return *p == _T('\0');
+}
+
+
+/**
+ * Build a tree of the configured shape at path, which it can then be
+ * deleted as
+ *
+ * @param path name of the tree
+ * @param files receives the files in it
+ * @param dirs receives the directories, the root too
+ * @return 0 or a native error code
+ */
+int
+FsMemMake(const TCHAR *path,    // IN
+          uint64_t *files,      // OUT
+          uint64_t *dirs)       // OUT
+{
+   MemRoot *grown;
+   MemDir *d, *top = NULL;
+   TCHAR *name;
+   uint64_t i;
+
+   *files = *dirs = 0;
+   name = MemRootPath(path);
+   if (!name) {
+      return FS_ENOMEM;
+   }
+   if (FindRoot(name)) {
+      free(name);
+      return MEM_EEXIST;
+   }
+   if (!made) {
+      made = (int64_t) time(NULL) * 1000000000;
+   }
+
+   switch (shape) {
+   case MEM_WIDE:
+      top = NewDir(NULL, 0, (uint32_t) count);
+      *dirs = 1;
+      break;
+   case MEM_DEEP:
+      // from the bottom up, each level holding the one below
+      for (i = 0, d = NULL; i < count; i++) {
+         top = NewDir(NULL, d ? 1 : 0, MEM_DEEP_FILES);
+         if (!top) {
+            break;  // what was made stays, like the rest of them
+         }
+         if (d) {
+            top->sub[0] = d;
+            d->parent = top;
+         }
+         d = top;
+      }
+      *dirs = count;
+      break;
+   case MEM_BUILD:
+      top = MakeBuild(NULL, count, dirs);
+      break;
+   case MEM_FAN:
+      top = NewDir(NULL, (uint32_t) count + empties, 0);
+      for (i = 0; top && i < count + empties; i++) {
+         if (!(top->sub[i] = NewDir(top, 0, i < count))) {
+            top = NULL;
+         }
+      }
+      *dirs = count + empties + 1;
+      break;
+   }
+   if (!top) {
+      free(name);
+      return FS_ENOMEM;
+   }
+   *files = shape == MEM_DEEP ? count * MEM_DEEP_FILES : count;
+
+   grown = (MemRoot *) realloc(roots, sizeof(MemRoot) * (nroots + 1));
+   if (!grown) {
+      free(name);
+      return FS_ENOMEM;
+   }
+   roots = grown;
+   roots[nroots].path = name;
+   roots[nroots].dir = top;
+   atomic_init(&roots[nroots].gone, 0);
+   nroots++;
+   return 0;
+}
+
+
+/**
+ * The in-memory filesystem, for DtOptions.fs
+ */
+const DtFs *
+FsMem(void)
+{
+   return &memFs;
+}
@@ -0,0 +1,633 @@
+// fs_posix.c
+//
+// POSIX implementation of the filesystem primitives. Entries are
+// removed relative to the open directory with unlinkat(), and d_type
+// is used so we normally never have to stat anything. On Linux
+// directories are read straight with getdents64() into a buffer much
+// larger than the one readdir() uses, which means a lot fewer system
+// calls on big directories.
+//
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#endif
+
+#include "fs.h"
+
+
+#define FD_RESERVE     64            // descriptors left for everything else
+
+#define EXT4_MAGIC     0xef53        // statfs() f_type, ext2 and ext3 too
+#define XFS_MAGIC      0x58465342
+
+#ifdef __linux__
+
+#define DIRENT_BUF     (64 * 1024)   // bytes read per getdents64()
+
+// what getdents64() fills the buffer with
+struct linux_dirent64 {
+   uint64_t d_ino;
+   int64_t d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[];
+};
+
+struct DtDir_ {
+   int fd;        // the directory, used for the *at() calls
+   size_t pos;    // next record in buf
+   size_t end;    // bytes of buf filled by the last getdents64()
+   char *buf;     // DIRENT_BUF bytes, allocated on the first read
+   int64_t off;   // d_off of the last entry returned, 0 before that
+};
+
+#else
+
+struct DtDir_ {
+   DIR *dir;   // stream from fdopendir() on a copy of fd
+   int fd;     // used for the *at() calls, outlives dir on a detach
+};
+
+#endif
+
+
+/**
+ * Return a malloc'ed copy of path normalized for the engine, ie.
+ * without trailing slashes.
+ *
+ * @param path user supplied path
+ * @return new string or NULL on out of memory
+ */
+char *
+FsRootPath(const char *path)  // IN
+{
+   char *p = strdup(path);
+   size_t len;
+
+   if (!p) {
+      return NULL;
+   }
+   len = strlen(p);
+   while (len > 1 && p[len - 1] == '/') {
+      p[--len] = '\0';
+   }
+   return p;
+}
+
+
+/**
+ * Return a malloc'ed absolute version of path, used to tell whether
+ * one target lies inside another. The parent is resolved with
+ * realpath() but the last component is kept as is, so a symlink
+ * target is the link itself and not what it points to.
+ *
+ * @param path user supplied path
+ * @return new string or NULL on failure
+ */
+char *
+FsFullPath(const char *path)  // IN
+{
+   char *p = FsRootPath(path);
+   char *name, *dir, *full;
+   size_t len;
+
+   if (!p) {
+      return NULL;
+   }
+
+   name = strrchr(p, '/');
+   if (name == p) {
+      dir = "/";
+      name++;
+   } else if (name) {
+      *name++ = '\0';
+      dir = p;
+   } else {
+      dir = ".";
+      name = p;
+   }
+
+   if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      // "/", "." or "..", there is no link to preserve
+      full = realpath(path, NULL);
+      free(p);
+      return full;
+   }
+
+   dir = realpath(dir, NULL);
+   if (!dir) {
+      free(p);
+      return NULL;
+   }
+   len = strlen(dir);
+   full = (char *) malloc(len + strlen(name) + 2);
+   if (full) {
+      strcpy(full, dir);
+      if (len == 0 || dir[len - 1] != '/') {
+         full[len++] = '/';
+      }
+      strcpy(full + len, name);
+   }
+   free(dir);
+   free(p);
+   return full;
+}
+
+
+/**
+ * Find the device path lives on, without following a symlink
+ */
+int
+FsDeviceId(const char *path,  // IN
+           uint64_t *dev)     // OUT
+{
+   struct stat st;
+
+   if (lstat(path, &st) != 0) {
+      return errno;
+   }
+   *dev = (uint64_t) st.st_dev;
+   return 0;
+}
+
+
+/**
+ * Find out whether path is a directory we need to descend into.
+ * Symbolic links are never followed.
+ */
+int
+FsLstatType(const char *path,  // IN
+            int *type)         // OUT
+{
+   struct stat st;
+
+   if (lstat(path, &st) != 0) {
+      return errno;
+   }
+   *type = S_ISDIR(st.st_mode) ? FS_TYPE_DIR : FS_TYPE_FILE;
+   return 0;
+}
+
+
+/**
+ * Size in bytes of a single file, symbolic links are not followed
+ */
+int
+FsPathSize(const char *path,  // IN
+           uint64_t *bytes)   // OUT
+{
+   struct stat st;
+
+   if (lstat(path, &st) != 0) {
+      return errno;
+   }
+   *bytes = (uint64_t) st.st_size;
+   return 0;
+}
+
+
+/**
+ * Whether unlinking the files of a directory in inode order beats the
+ * order the listing comes in, on the filesystem holding path. ext4
+ * and xfs list directories in hash order, so unlinking them as listed
+ * dirties inode table blocks all over the place, while in inode order
+ * each block is written once.
+ */
+Bool
+FsSortByInode(const char *path)  // IN
+{
+#ifdef __linux__
+   struct statfs st;
+
+   if (statfs(path, &st) == 0 &&
+       (st.f_type == EXT4_MAGIC || st.f_type == XFS_MAGIC)) {
+      return TRUE;
+   }
+#endif
+   return FALSE;
+}
+
+
+/**
+ * Remove a single non-directory, ENOENT if it isn't there, as on
+ * Windows: a listed path that's gone must not count as removed
+ */
+int
+FsUnlink(const char *path)  // IN
+{
+   if (unlink(path) != 0) {
+      return errno;
+   }
+   return 0;
+}
+
+
+/**
+ * Remove an empty directory
+ */
+int
+FsRemoveDir(const char *path)  // IN
+{
+   if (rmdir(path) != 0 && errno != ENOENT) {
+      return errno;
+   }
+   return 0;
+}
+
+
+/**
+ * Open a directory for enumeration
+ *
+ * @param path directory to open
+ * @param dir receives the directory object
+ * @return 0 or errno
+ */
+int
+FsOpenDir(const char *path,  // IN
+          DtDir **dir)       // OUT
+{
+   return FsOpenDirAt(FS_NO_HANDLE, path, dir);
+}
+
+
+/**
+ * How many directory handles a walk may keep open at once, half of
+ * the soft descriptor limit. Every open directory of a deep tree is
+ * one descriptor. Raising the limit is up to the program, a library
+ * doesn't change it behind its caller's back.
+ */
+int
+FsHandleBudget(void)
+{
+   struct rlimit rl;
+   rlim_t n;
+
+   if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+      return 0;
+   }
+   n = rl.rlim_cur;
+   if (n == RLIM_INFINITY || n > INT_MAX / 2) {
+      n = INT_MAX / 2;
+   }
+   // the rest is for workers enumerating and io_uring
+   return n > 2 * FD_RESERVE ? (int) (n / 2) : 0;
+}
+
+
+/**
+ * Open a directory relative to another one for enumeration
+ *
+ * @param parent directory name is in, FS_NO_HANDLE if name is a path
+ * @param name directory to open
+ * @param dir receives the directory object
+ * @return 0 or errno
+ */
+int
+FsOpenDirAt(int parent,         // IN
+            const char *name,   // IN
+            DtDir **dir)        // OUT
+{
+   DtDir *d;
+   int fd;
+
+   fd = openat(parent == FS_NO_HANDLE ? AT_FDCWD : parent, name,
+               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0) {
+      return errno;
+   }
+
+   d = (DtDir *) malloc(sizeof(DtDir));
+   if (!d) {
+      close(fd);
+      return ENOMEM;
+   }
+
+   d->fd = fd;
+#ifdef __linux__
+   d->pos = d->end = 0;
+   d->buf = NULL;
+   d->off = 0;
+#else
+   // the stream closes what it is given, keep fd for FsDirDetach()
+   d->dir = NULL;
+   fd = dup(d->fd);
+   if (fd >= 0) {
+      d->dir = fdopendir(fd);
+   }
+   if (!d->dir) {
+      int err = errno;
+      if (fd >= 0) {
+         close(fd);
+      }
+      close(d->fd);
+      free(d);
+      return err;
+   }
+#endif
+
+   *dir = d;
+   return 0;
+}
+
+
+/**
+ * Return the next entry of dir, skipping "." and "..".
+ *
+ * @param dir directory being enumerated
+ * @param ent receives the entry
+ * @return 0 on success, FS_END at the end or an errno
+ */
+int
+FsReadDir(DtDir *dir,     // IN
+          DtDirent *ent)  // OUT
+{
+   const char *name;
+   unsigned char type;
+   struct stat st;
+
+   for (;;) {
+#ifdef __linux__
+      struct linux_dirent64 *de;
+      long n;
+
+      if (dir->pos >= dir->end) {
+         if (!dir->buf && !(dir->buf = (char *) malloc(DIRENT_BUF))) {
+            return ENOMEM;
+         }
+         n = syscall(SYS_getdents64, dir->fd, dir->buf, DIRENT_BUF);
+         if (n < 0) {
+            return errno;
+         } else if (n == 0) {
+            return FS_END;
+         }
+         dir->pos = 0;
+         dir->end = (size_t) n;
+      }
+      de = (struct linux_dirent64 *) (dir->buf + dir->pos);
+      dir->pos += de->d_reclen;
+      dir->off = de->d_off;
+#else
+      struct dirent *de;
+
+      errno = 0;
+      de = readdir(dir->dir);
+      if (!de) {
+         return errno ? errno : FS_END;
+      }
+#endif
+      if (de->d_name[0] == '.' &&
+          (de->d_name[1] == '\0' ||
+           (de->d_name[1] == '.' && de->d_name[2] == '\0'))) {
+         continue;
+      }
+      name = de->d_name;
+      type = de->d_type;
+      ent->ino = (uint64_t) de->d_ino;
+      break;
+   }
+
+   ent->name = name;
+   ent->nameLen = strlen(name);
+   ent->attrs = 0;
+
+   switch (type) {
+   case DT_DIR:
+      ent->type = FS_TYPE_DIR;
+      break;
+   case DT_UNKNOWN:
+      // some filesystems (xfs without ftype, old nfs) don't fill in
+      // d_type, so we have to ask. If the entry vanished, unlinkat()
+      // will sort it out.
+      if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+          S_ISDIR(st.st_mode)) {
+         ent->type = FS_TYPE_DIR;
+      } else {
+         ent->type = FS_TYPE_FILE;
+      }
+      break;
+   default:
+      ent->type = FS_TYPE_FILE;
+      break;
+   }
+
+   return 0;
+}
+
+
+/**
+ * Size in bytes of an entry returned by FsReadDir(). Costs a statx()
+ * (fstatat() elsewhere), so only call it when the size is wanted.
+ */
+int
+FsEntrySize(DtDir *dir,            // IN
+            const DtDirent *ent,   // IN
+            uint64_t *bytes)       // OUT
+{
+#if defined(__linux__) && defined(STATX_SIZE)
+   struct statx stx;
+
+   // don't make network filesystems go back to the server for this
+   if (statx(dir->fd, ent->name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+             STATX_SIZE, &stx) != 0) {
+      return errno == ENOENT ? 0 : errno;
+   }
+   *bytes = stx.stx_size;
+#else
+   struct stat st;
+
+   if (fstatat(dir->fd, ent->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      return errno == ENOENT ? 0 : errno;
+   }
+   *bytes = (uint64_t) st.st_size;
+#endif
+   return 0;
+}
+
+
+/**
+ * Size and times of an entry returned by FsReadDir(), one statx()
+ * that asks for just those (fstatat() elsewhere). Unlike FsEntrySize()
+ * an entry that vanished is reported, there is nothing to rank.
+ */
+int
+FsEntryInfo(DtDir *dir,            // IN
+            const DtDirent *ent,   // IN
+            DtFileInfo *info)      // OUT
+{
+#if defined(__linux__) && defined(STATX_SIZE)
+   struct statx stx;
+
+   if (statx(dir->fd, ent->name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+             STATX_SIZE | STATX_ATIME | STATX_MTIME, &stx) != 0) {
+      return errno;
+   }
+   info->bytes = stx.stx_size;
+   info->atime = stx.stx_atime.tv_sec * 1000000000LL + stx.stx_atime.tv_nsec;
+   info->mtime = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+#else
+   struct stat st;
+
+   if (fstatat(dir->fd, ent->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      return errno;
+   }
+   info->bytes = (uint64_t) st.st_size;
+   info->atime = (int64_t) st.st_atime * 1000000000LL;
+   info->mtime = (int64_t) st.st_mtime * 1000000000LL;
+#endif
+   return 0;
+}
+
+
+/**
+ * Remove a non-directory entry returned by FsReadDir()
+ */
+int
+FsUnlinkAt(DtDir *dir,            // IN
+           const DtDirent *ent)   // IN
+{
+   if (unlinkat(dir->fd, ent->name, 0) != 0 && errno != ENOENT) {
+      return errno;
+   }
+   return 0;
+}
+
+
+/**
+ * Where the reading of dir stands, just after the last entry
+ * FsReadDir() returned. The position stays valid as entries come and
+ * go (ext4 and xfs use hash cookies or fixed offsets), and in other
+ * processes, so it can be handed to FsDirSeek() in a later run.
+ * Linux only, ENOTSUP elsewhere.
+ */
+int
+FsDirTell(DtDir *dir,      // IN
+          uint64_t *pos)   // OUT
+{
+#ifdef __linux__
+   *pos = (uint64_t) dir->off;
+   return 0;
+#else
+   return ENOTSUP;
+#endif
+}
+
+
+/**
+ * Continue reading dir from a position FsDirTell() returned
+ */
+int
+FsDirSeek(DtDir *dir,     // IN
+          uint64_t pos)   // IN
+{
+#ifdef __linux__
+   if (lseek(dir->fd, (off_t) pos, SEEK_SET) == (off_t) -1) {
+      return errno;
+   }
+   dir->pos = dir->end = 0;
+   dir->off = (int64_t) pos;
+   return 0;
+#else
+   return ENOTSUP;
+#endif
+}
+
+
+/**
+ * Return the file descriptor of an open directory, for callers that
+ * issue their own *at() operations against it
+ */
+int
+FsDirFd(DtDir *dir)  // IN
+{
+   return dir->fd;
+}
+
+
+/**
+ * Return the handle of an open directory, for FsOpenDirAt() and
+ * FsRemoveDirAt() on its entries. It stays owned by dir.
+ */
+int
+FsDirHandle(DtDir *dir)  // IN
+{
+   return dir->fd;
+}
+
+
+/**
+ * Finish enumerating a directory but keep its handle, which the caller
+ * closes with FsCloseHandle()
+ */
+int
+FsDirDetach(DtDir *dir)  // IN
+{
+   int fd = dir->fd;
+
+#ifdef __linux__
+   free(dir->buf);
+#else
+   closedir(dir->dir);  // closes its copy only
+#endif
+   free(dir);
+   return fd;
+}
+
+
+/**
+ * Close a handle from FsDirDetach()
+ */
+void
+FsCloseHandle(int h)  // IN
+{
+   if (h != FS_NO_HANDLE) {
+      close(h);
+   }
+}
+
+
+/**
+ * Remove an empty directory relative to its parent
+ *
+ * @param parent directory name is in, FS_NO_HANDLE if name is a path
+ * @param name directory to remove
+ * @return 0 or errno
+ */
+int
+FsRemoveDirAt(int parent,         // IN
+              const char *name)   // IN
+{
+   if (unlinkat(parent == FS_NO_HANDLE ? AT_FDCWD : parent, name,
+                AT_REMOVEDIR) != 0 && errno != ENOENT) {
+      return errno;
+   }
+   return 0;
+}
+
+
+/**
+ * Finish enumerating a directory
+ */
+void
+FsCloseDir(DtDir *dir)  // IN
+{
+#ifdef __linux__
+   close(dir->fd);
+   free(dir->buf);
+#else
+   closedir(dir->dir);
+   close(dir->fd);
+#endif
+   free(dir);
+}
+
+#endif  // !_WIN32
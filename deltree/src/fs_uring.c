@@ -0,0 +1,395 @@
+// fs_uring.c
+//
+// Batched unlinks through io_uring on Linux. Each worker owns a ring
+// and queues IORING_OP_UNLINKAT for the files of the directory it is
+// enumerating, so one io_uring_enter() submits a whole batch instead
+// of one unlinkat() syscall per file.
+//
+// We talk to the kernel directly rather than through liburing, the
+// handful of ring operations we need is not worth a dependency. On
+// other platforms, or kernels without IORING_OP_UNLINKAT, the ring
+// reports itself unavailable and the engine uses plain syscalls.
+//
+
+#include "fs.h"
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+
+#define NAME_SLOT      (NAME_MAX + 1)
+
+struct DtUring_ {
+   int fd;                       // ring file descriptor
+   unsigned depth;               // max unlinks in flight
+
+   // submission queue, shared with the kernel
+   unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+   struct io_uring_sqe *sqes;
+
+   // completion queue, shared with the kernel
+   unsigned *cqHead, *cqTail, *cqMask;
+   struct io_uring_cqe *cqes;
+
+   void *sqRing, *cqRing;        // mappings, cqRing may equal sqRing
+   size_t sqRingSize, cqRingSize, sqesSize;
+
+   unsigned queued;              // filled sqes not yet submitted
+   unsigned inflight;            // submitted, completion not reaped
+
+   // names have to stay put until the kernel has consumed them, so
+   // they are copied into slots which are recycled on completion
+   char *names;                  // depth * NAME_SLOT bytes
+   unsigned *freeSlots;          // stack of free slot indices
+   unsigned nfree;
+
+   DtUringDone done;             // completion callback
+   void *ctx;
+};
+
+
+static int
+SysSetup(unsigned entries, struct io_uring_params *p)
+{
+   return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+SysEnter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+                        NULL, 0);
+}
+
+
+static int
+SysRegister(int fd, unsigned op, void *arg, unsigned nargs)
+{
+   return (int) syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+
+/**
+ * Check once whether this kernel lets us use io_uring for unlinkat.
+ * It may be missing (pre 5.11), disabled by sysctl or blocked by a
+ * seccomp filter, all of which just mean we use syscalls.
+ */
+Bool
+FsUringAvailable(void)
+{
+   static atomic_int state;  // 0 unknown, 1 yes, 2 no
+   struct io_uring_params p;
+   struct io_uring_probe *probe;
+   size_t size;
+   int fd, s;
+
+   s = atomic_load(&state);
+   if (s != 0) {
+      return s == 1;
+   }
+
+   s = 2;
+   memset(&p, 0, sizeof(p));
+   fd = SysSetup(4, &p);
+   if (fd >= 0) {
+      size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+      probe = (struct io_uring_probe *) calloc(1, size);
+      if (probe &&
+          SysRegister(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+          probe->last_op >= IORING_OP_UNLINKAT &&
+          (probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED)) {
+         s = 1;
+      }
+      free(probe);
+      close(fd);
+   }
+
+   atomic_store(&state, s);
+   return s == 1;
+}
+
+
+/**
+ * Create a ring for one worker
+ *
+ * @param depth number of unlinks that can be in flight
+ * @param done called with (ctx, 0 or errno) for every unlink
+ * @param ctx passed to done
+ * @return the ring, or NULL if io_uring can't be used
+ */
+DtUring *
+FsUringCreate(unsigned depth,     // IN
+              DtUringDone done,   // IN
+              void *ctx)          // IN
+{
+   struct io_uring_params p;
+   DtUring *r;
+   unsigned i;
+
+   if (!FsUringAvailable()) {
+      return NULL;
+   }
+
+   r = (DtUring *) calloc(1, sizeof(DtUring));
+   if (!r) {
+      return NULL;
+   }
+   r->fd = -1;
+   r->done = done;
+   r->ctx = ctx;
+
+   memset(&p, 0, sizeof(p));
+   p.flags = IORING_SETUP_CLAMP;
+   r->fd = SysSetup(depth, &p);
+   if (r->fd < 0) {
+      goto fail;
+   }
+   // the kernel rounds up to a power of two and may clamp
+   r->depth = p.sq_entries;
+
+   r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   r->cqRingSize = p.cq_off.cqes +
+                   p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (r->cqRingSize > r->sqRingSize) {
+         r->sqRingSize = r->cqRingSize;
+      }
+      r->cqRingSize = r->sqRingSize;
+   }
+
+   r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+   if (r->sqRing == MAP_FAILED) {
+      r->sqRing = NULL;
+      goto fail;
+   }
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      r->cqRing = r->sqRing;
+   } else {
+      r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd,
+                       IORING_OFF_CQ_RING);
+      if (r->cqRing == MAP_FAILED) {
+         r->cqRing = NULL;
+         goto fail;
+      }
+   }
+
+   r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+   r->sqes = (struct io_uring_sqe *)
+      mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+   if (r->sqes == MAP_FAILED) {
+      r->sqes = NULL;
+      goto fail;
+   }
+
+   r->sqHead  = (unsigned *) ((char *) r->sqRing + p.sq_off.head);
+   r->sqTail  = (unsigned *) ((char *) r->sqRing + p.sq_off.tail);
+   r->sqMask  = (unsigned *) ((char *) r->sqRing + p.sq_off.ring_mask);
+   r->sqArray = (unsigned *) ((char *) r->sqRing + p.sq_off.array);
+   r->cqHead  = (unsigned *) ((char *) r->cqRing + p.cq_off.head);
+   r->cqTail  = (unsigned *) ((char *) r->cqRing + p.cq_off.tail);
+   r->cqMask  = (unsigned *) ((char *) r->cqRing + p.cq_off.ring_mask);
+   r->cqes    = (struct io_uring_cqe *) ((char *) r->cqRing +
+                                         p.cq_off.cqes);
+
+   r->names = (char *) malloc((size_t) r->depth * NAME_SLOT);
+   r->freeSlots = (unsigned *) malloc(r->depth * sizeof(unsigned));
+   if (!r->names || !r->freeSlots) {
+      goto fail;
+   }
+   for (i = 0; i < r->depth; i++) {
+      r->freeSlots[i] = r->depth - 1 - i;
+   }
+   r->nfree = r->depth;
+
+   return r;
+
+fail:
+   FsUringDestroy(r);
+   return NULL;
+}
+
+
+/**
+ * Tear down a ring. Everything queued must have been flushed.
+ */
+void
+FsUringDestroy(DtUring *r)  // IN
+{
+   if (!r) {
+      return;
+   }
+   if (r->sqes) {
+      munmap(r->sqes, r->sqesSize);
+   }
+   if (r->cqRing && r->cqRing != r->sqRing) {
+      munmap(r->cqRing, r->cqRingSize);
+   }
+   if (r->sqRing) {
+      munmap(r->sqRing, r->sqRingSize);
+   }
+   if (r->fd >= 0) {
+      close(r->fd);
+   }
+   free(r->names);
+   free(r->freeSlots);
+   free(r);
+}
+
+
+// hand everything queued to the kernel, optionally waiting for at
+// least one completion
+static void
+Submit(DtUring *r,       // IN
+       unsigned wait)    // IN
+{
+   unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+   int n;
+
+   for (;;) {
+      n = SysEnter(r->fd, r->queued, wait, flags);
+      if (n >= 0) {
+         r->queued -= (unsigned) n;
+         r->inflight += (unsigned) n;
+         return;
+      }
+      if (errno != EINTR) {
+         return;  // caller reaps and retries
+      }
+   }
+}
+
+
+// process whatever completions are posted
+static void
+Reap(DtUring *r)  // IN
+{
+   unsigned head = *r->cqHead;
+   struct io_uring_cqe *cqe;
+   int err;
+
+   while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+      cqe = &r->cqes[head & *r->cqMask];
+      err = cqe->res < 0 ? -cqe->res : 0;
+      if (err == ENOENT) {
+         err = 0;  // already gone is fine
+      }
+      r->freeSlots[r->nfree++] = (unsigned) cqe->user_data;
+      r->inflight--;
+      r->done(r->ctx, err);
+      head++;
+   }
+   __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Queue an unlink of a non-directory entry of dir. The unlink happens
+ * some time before the next FsUringFlush() returns, the result is
+ * reported through the done callback.
+ *
+ * @return 0 if queued, or an errno if the caller should do it itself
+ */
+int
+FsUringUnlinkAt(DtUring *r,            // IN
+                DtDir *dir,            // IN
+                const DtDirent *ent)   // IN
+{
+   struct io_uring_sqe *sqe;
+   unsigned tail, slot;
+   char *name;
+
+   if (ent->nameLen >= NAME_SLOT) {
+      return ENAMETOOLONG;
+   }
+
+   // out of slots: push what we have and wait for some to come back
+   while (r->nfree == 0) {
+      Submit(r, 1);
+      Reap(r);
+      if (r->nfree == 0 && r->inflight == 0) {
+         return EAGAIN;  // the kernel refused everything
+      }
+   }
+
+   slot = r->freeSlots[--r->nfree];
+   name = r->names + (size_t) slot * NAME_SLOT;
+   memcpy(name, ent->name, ent->nameLen + 1);
+
+   tail = *r->sqTail;
+   sqe = &r->sqes[tail & *r->sqMask];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = IORING_OP_UNLINKAT;
+   sqe->fd = FsDirFd(dir);
+   sqe->addr = (uint64_t) (uintptr_t) name;
+   sqe->unlink_flags = 0;
+   sqe->user_data = slot;
+   r->sqArray[tail & *r->sqMask] = tail & *r->sqMask;
+   __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+   r->queued++;
+
+   // submit in batches of half the ring so the kernel can work on one
+   // half while we fill the other
+   if (r->queued >= r->depth / 2) {
+      Submit(r, 0);
+      Reap(r);
+   }
+   return 0;
+}
+
+
+/**
+ * Submit everything queued and wait until all of it has completed.
+ * Must be called before the directory passed to FsUringUnlinkAt() is
+ * closed.
+ */
+void
+FsUringFlush(DtUring *r)  // IN
+{
+   while (r->queued > 0 || r->inflight > 0) {
+      Submit(r, 1);
+      Reap(r);
+      if (r->queued > 0 && r->inflight == 0) {
+         // the kernel won't take them, drop the batch on the floor
+         // and report the failures
+         while (r->queued > 0) {
+            unsigned tail = *r->sqTail - r->queued;
+            struct io_uring_sqe *sqe = &r->sqes[tail & *r->sqMask];
+            r->freeSlots[r->nfree++] = (unsigned) sqe->user_data;
+            r->queued--;
+            r->done(r->ctx, errno ? errno : EIO);
+         }
+         __atomic_store_n(r->sqTail, *r->sqHead, __ATOMIC_RELEASE);
+      }
+   }
+}
+
+#else  // !__linux__
+
+Bool
+FsUringAvailable(void)
+{
+   return FALSE;
+}
+
+DtUring *
+FsUringCreate(unsigned depth, DtUringDone done, void *ctx)
+{
+   return NULL;
+}
+
+void FsUringDestroy(DtUring *r) { }
+int  FsUringUnlinkAt(DtUring *r, DtDir *dir, const DtDirent *ent) { return 0; }
+void FsUringFlush(DtUring *r) { }
+
+#endif
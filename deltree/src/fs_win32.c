@@ -0,0 +1,650 @@
+// fs_win32.c
+//
+// Win32 implementation of the filesystem primitives. Paths are
+// converted to the \\?\ form up front so we are not limited by
+// MAX_PATH. Below the root everything goes through directory handles:
+// entries are opened relative to their parent with NtOpenFile(), read
+// in large batches with GetFileInformationByHandleEx() and deleted by
+// setting the delete disposition on the handle, so no path is ever
+// built and there's no depth limit.
+//
+
+#ifdef _WIN32
+
+#include <winternl.h>
+
+#include "fs.h"
+
+
+#define DIR_BUF        (64 * 1024)   // bytes per directory read
+
+#ifndef FILE_OPEN_REPARSE_POINT
+#define FILE_OPEN_REPARSE_POINT        0x00200000
+#endif
+#ifndef FILE_OPEN_FOR_BACKUP_INTENT
+#define FILE_OPEN_FOR_BACKUP_INTENT    0x00004000
+#endif
+#ifndef FILE_DIRECTORY_FILE
+#define FILE_DIRECTORY_FILE            0x00000001
+#endif
+#ifndef FILE_SYNCHRONOUS_IO_NONALERT
+#define FILE_SYNCHRONOUS_IO_NONALERT   0x00000020
+#endif
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(s)                  ((NTSTATUS) (s) >= 0)
+#endif
+#ifndef OBJ_CASE_INSENSITIVE
+#define OBJ_CASE_INSENSITIVE           0x00000040
+#endif
+
+// from ntdll, looked up at run time so we don't need its import lib
+typedef NTSTATUS (NTAPI *NtOpenFileFunc)(PHANDLE, ACCESS_MASK,
+                                         POBJECT_ATTRIBUTES,
+                                         PIO_STATUS_BLOCK, ULONG, ULONG);
+typedef ULONG (NTAPI *RtlNtStatusToDosErrorFunc)(NTSTATUS);
+
+static NtOpenFileFunc ntOpenFile;
+static RtlNtStatusToDosErrorFunc rtlNtStatusToDosError;
+
+
+struct DtDir_ {
+   HANDLE h;                  // the directory
+   Bool eof;                  // nothing left to read
+   FILE_FULL_DIR_INFO *cur;   // entry last returned, NULL before a read
+   BYTE *buf;                 // DIR_BUF bytes of FILE_FULL_DIR_INFO,
+                              // allocated on the first read
+   WCHAR name[MAX_PATH];      // name of cur, NUL terminated
+};
+
+
+// true if the attributes describe a directory we need to descend
+// into. Junctions and directory symlinks are removed as-is, we never
+// follow them.
+static Bool
+IsRealDir(DWORD attrs)  // IN
+{
+   return (attrs & FILE_ATTRIBUTE_DIRECTORY) &&
+          !(attrs & FILE_ATTRIBUTE_REPARSE_POINT);
+}
+
+
+// treat "already gone" as success
+static int
+NotFoundOk(int err)  // IN
+{
+   if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND) {
+      return 0;
+   }
+   return err;
+}
+
+
+static int
+LastError(void)
+{
+   return NotFoundOk((int) GetLastError());
+}
+
+
+// remove a file or reparse point given its attributes, clearing the
+// read-only bit first like Explorer does
+static int
+RemoveWithAttrs(const TCHAR *path,  // IN
+                DWORD attrs)        // IN
+{
+   BOOL ok;
+
+   if (attrs & FILE_ATTRIBUTE_READONLY) {
+      SetFileAttributes(path, attrs & ~FILE_ATTRIBUTE_READONLY);
+   }
+   if (attrs & FILE_ATTRIBUTE_DIRECTORY) {
+      ok = RemoveDirectory(path);
+   } else {
+      ok = DeleteFile(path);
+   }
+   return ok ? 0 : LastError();
+}
+
+
+static Bool
+LoadNtApi(void)
+{
+   if (!ntOpenFile) {
+      // the same value every time, racing threads just store it twice
+      HMODULE nt = GetModuleHandle(_T("ntdll.dll"));
+      if (!nt) {
+         return FALSE;
+      }
+      rtlNtStatusToDosError = (RtlNtStatusToDosErrorFunc)
+         GetProcAddress(nt, "RtlNtStatusToDosError");
+      ntOpenFile = (NtOpenFileFunc) GetProcAddress(nt, "NtOpenFile");
+   }
+   return ntOpenFile && rtlNtStatusToDosError;
+}
+
+
+// open name relative to parent without following reparse points,
+// parent FS_NO_HANDLE means name is a full path
+static int
+OpenAt(HANDLE parent,        // IN
+       const WCHAR *name,    // IN
+       ACCESS_MASK access,   // IN
+       ULONG options,        // IN: FILE_DIRECTORY_FILE or 0
+       HANDLE *h)            // OUT
+{
+   UNICODE_STRING us;
+   OBJECT_ATTRIBUTES oa;
+   IO_STATUS_BLOCK iosb;
+   NTSTATUS status;
+
+   if (parent == FS_NO_HANDLE) {
+      *h = CreateFile(name, access,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                      NULL, OPEN_EXISTING,
+                      FILE_FLAG_BACKUP_SEMANTICS |
+                      FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+      return *h == INVALID_HANDLE_VALUE ? (int) GetLastError() : 0;
+   }
+   if (!LoadNtApi()) {
+      return ERROR_PROC_NOT_FOUND;
+   }
+
+   us.Buffer = (PWSTR) name;
+   us.Length = (USHORT) (wcslen(name) * sizeof(WCHAR));
+   us.MaximumLength = us.Length;
+   InitializeObjectAttributes(&oa, &us, OBJ_CASE_INSENSITIVE, parent, NULL);
+
+   status = ntOpenFile(h, access | SYNCHRONIZE, &oa, &iosb,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       options | FILE_SYNCHRONOUS_IO_NONALERT |
+                       FILE_OPEN_FOR_BACKUP_INTENT | FILE_OPEN_REPARSE_POINT);
+   if (!NT_SUCCESS(status)) {
+      *h = NULL;
+      return (int) rtlNtStatusToDosError(status);
+   }
+   return 0;
+}
+
+
+// delete name in parent through a handle, clearing the read-only bit
+// first like Explorer does. The entry goes away when h is closed.
+static int
+DeleteAt(HANDLE parent,       // IN
+         const WCHAR *name,   // IN
+         ULONG options)       // IN: FILE_DIRECTORY_FILE or 0
+{
+   FILE_DISPOSITION_INFO disp = { TRUE };
+   FILE_BASIC_INFO basic;
+   HANDLE h;
+   int err;
+
+   err = OpenAt(parent, name,
+                DELETE | FILE_READ_ATTRIBUTES | FILE_WRITE_ATTRIBUTES,
+                options, &h);
+   if (err == ERROR_ACCESS_DENIED) {
+      // may be allowed to delete but not to change attributes
+      err = OpenAt(parent, name, DELETE, options, &h);
+   }
+   if (err) {
+      return NotFoundOk(err);
+   }
+
+   if (!SetFileInformationByHandle(h, FileDispositionInfo,
+                                   &disp, sizeof(disp))) {
+      err = (int) GetLastError();
+      if (err == ERROR_ACCESS_DENIED &&
+          GetFileInformationByHandleEx(h, FileBasicInfo,
+                                       &basic, sizeof(basic)) &&
+          (basic.FileAttributes & FILE_ATTRIBUTE_READONLY)) {
+         basic.FileAttributes &= ~FILE_ATTRIBUTE_READONLY;
+         if (basic.FileAttributes == 0) {
+            basic.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+         }
+         if (SetFileInformationByHandle(h, FileBasicInfo,
+                                        &basic, sizeof(basic)) &&
+             SetFileInformationByHandle(h, FileDispositionInfo,
+                                        &disp, sizeof(disp))) {
+            err = 0;
+         }
+      }
+   }
+   CloseHandle(h);
+   return NotFoundOk(err);
+}
+
+
+/**
+ * Return a malloc'ed, fully qualified \\?\ version of path without a
+ * trailing backslash.
+ *
+ * @param path user supplied path
+ * @return new string or NULL on failure
+ */
+TCHAR *
+FsRootPath(const TCHAR *path)  // IN
+{
+   DWORD len = GetFullPathName(path, 0, NULL, NULL);
+   TCHAR *full, *p;
+   size_t n;
+
+   if (len == 0) {
+      return NULL;
+   }
+   full = (TCHAR *) malloc(sizeof(TCHAR) * len);
+   // room for "\\?\UNC\" in front
+   p = (TCHAR *) malloc(sizeof(TCHAR) * (len + 8));
+   if (!full || !p) {
+      free(full);
+      free(p);
+      return NULL;
+   }
+   GetFullPathName(path, len, full, NULL);
+
+   if (_tcsncmp(full, _T("\\\\?\\"), 4) == 0) {
+      _tcscpy(p, full);
+   } else if (full[0] == _T('\\') && full[1] == _T('\\')) {
+      _tcscpy(p, _T("\\\\?\\UNC\\"));
+      _tcscat(p, full + 2);
+   } else {
+      _tcscpy(p, _T("\\\\?\\"));
+      _tcscat(p, full);
+   }
+   free(full);
+
+   // keep the backslash of a drive root, "\\?\C:\"
+   n = _tcslen(p);
+   while (n > 7 && p[n - 1] == _T('\\')) {
+      p[--n] = _T('\0');
+   }
+   return p;
+}
+
+
+/**
+ * Return a malloc'ed absolute version of path, used to tell whether
+ * one target lies inside another. GetFullPathName() doesn't follow
+ * links, so this is just FsRootPath().
+ */
+TCHAR *
+FsFullPath(const TCHAR *path)  // IN
+{
+   return FsRootPath(path);
+}
+
+
+/**
+ * Find the volume path lives on, without following a reparse point
+ */
+int
+FsDeviceId(const TCHAR *path,  // IN
+           uint64_t *dev)      // OUT
+{
+   BY_HANDLE_FILE_INFORMATION info;
+   HANDLE h;
+   int err = 0;
+
+   h = CreateFile(path, FILE_READ_ATTRIBUTES,
+                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                  NULL, OPEN_EXISTING,
+                  FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                  NULL);
+   if (h == INVALID_HANDLE_VALUE) {
+      return (int) GetLastError();
+   }
+   if (GetFileInformationByHandle(h, &info)) {
+      *dev = info.dwVolumeSerialNumber;
+   } else {
+      err = (int) GetLastError();
+   }
+   CloseHandle(h);
+   return err;
+}
+
+
+/**
+ * Find out whether path is a directory we need to descend into
+ */
+int
+FsLstatType(const TCHAR *path,  // IN
+            int *type)          // OUT
+{
+   DWORD attrs = GetFileAttributes(path);
+
+   if (attrs == INVALID_FILE_ATTRIBUTES) {
+      return (int) GetLastError();
+   }
+   *type = IsRealDir(attrs) ? FS_TYPE_DIR : FS_TYPE_FILE;
+   return 0;
+}
+
+
+/**
+ * Size in bytes of a single file
+ */
+int
+FsPathSize(const TCHAR *path,  // IN
+           uint64_t *bytes)    // OUT
+{
+   WIN32_FILE_ATTRIBUTE_DATA data;
+
+   if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data)) {
+      return (int) GetLastError();
+   }
+   *bytes = ((uint64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+   return 0;
+}
+
+
+/**
+ * Whether unlinking in inode order pays off on the volume holding
+ * path. Never here, the listing (FILE_FULL_DIR_INFO) doesn't carry a
+ * file id to sort by.
+ */
+Bool
+FsSortByInode(const TCHAR *path)  // IN
+{
+   return FALSE;
+}
+
+
+/**
+ * Remove a single non-directory
+ */
+int
+FsUnlink(const TCHAR *path)  // IN
+{
+   DWORD attrs = GetFileAttributes(path);
+
+   if (attrs == INVALID_FILE_ATTRIBUTES) {
+      return LastError();
+   }
+   return RemoveWithAttrs(path, attrs);
+}
+
+
+/**
+ * Remove an empty directory
+ */
+int
+FsRemoveDir(const TCHAR *path)  // IN
+{
+   DWORD attrs;
+
+   if (RemoveDirectory(path)) {
+      return 0;
+   }
+   if (GetLastError() != ERROR_ACCESS_DENIED) {
+      return LastError();
+   }
+
+   // read-only directories can't be removed, clear it and retry
+   attrs = GetFileAttributes(path);
+   if (attrs != INVALID_FILE_ATTRIBUTES &&
+       (attrs & FILE_ATTRIBUTE_READONLY)) {
+      SetFileAttributes(path, attrs & ~FILE_ATTRIBUTE_READONLY);
+      if (RemoveDirectory(path)) {
+         return 0;
+      }
+   }
+   return LastError();
+}
+
+
+/**
+ * Open a directory for enumeration
+ *
+ * @param path directory to open
+ * @param dir receives the directory object
+ * @return 0 or Win32 error
+ */
+int
+FsOpenDir(const TCHAR *path,  // IN
+          DtDir **dir)        // OUT
+{
+   return FsOpenDirAt(FS_NO_HANDLE, path, dir);
+}
+
+
+/**
+ * How many directory handles a walk may keep open at once. Windows
+ * has no small per process limit, this just keeps a runaway tree
+ * from eating kernel memory.
+ */
+int
+FsHandleBudget(void)
+{
+   return 65536;
+}
+
+
+/**
+ * Open a directory relative to another one for enumeration
+ *
+ * @param parent directory name is in, FS_NO_HANDLE if name is a path
+ * @param name directory to open
+ * @param dir receives the directory object
+ * @return 0 or Win32 error
+ */
+int
+FsOpenDirAt(HANDLE parent,       // IN
+            const TCHAR *name,   // IN
+            DtDir **dir)         // OUT
+{
+   DtDir *d;
+   int err;
+
+   d = (DtDir *) calloc(1, sizeof(DtDir));
+   if (!d) {
+      return FS_ENOMEM;
+   }
+   err = OpenAt(parent, name, FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES,
+                FILE_DIRECTORY_FILE, &d->h);
+   if (err) {
+      free(d);
+      return err;
+   }
+
+   *dir = d;
+   return 0;
+}
+
+
+/**
+ * Return the next entry of dir, skipping "." and "..".
+ *
+ * @param dir directory being enumerated
+ * @param ent receives the entry
+ * @return 0 on success, FS_END at the end or a Win32 error
+ */
+int
+FsReadDir(DtDir *dir,     // IN
+          DtDirent *ent)  // OUT
+{
+   FILE_FULL_DIR_INFO *info;
+   size_t len;
+   DWORD err;
+
+   for (;;) {
+      if (dir->cur && dir->cur->NextEntryOffset) {
+         info = (FILE_FULL_DIR_INFO *)
+            ((BYTE *) dir->cur + dir->cur->NextEntryOffset);
+      } else if (dir->eof) {
+         return FS_END;
+      } else if (!dir->buf && !(dir->buf = (BYTE *) malloc(DIR_BUF))) {
+         return FS_ENOMEM;
+      } else if (GetFileInformationByHandleEx(dir->h, FileFullDirectoryInfo,
+                                              dir->buf, DIR_BUF)) {
+         info = (FILE_FULL_DIR_INFO *) dir->buf;
+      } else {
+         err = GetLastError();
+         dir->eof = TRUE;
+         dir->cur = NULL;
+         return err == ERROR_NO_MORE_FILES ? FS_END : (int) err;
+      }
+      dir->cur = info;
+
+      len = info->FileNameLength / sizeof(WCHAR);
+      if ((len == 1 && info->FileName[0] == L'.') ||
+          (len == 2 && info->FileName[0] == L'.' &&
+           info->FileName[1] == L'.')) {
+         continue;
+      }
+      if (len >= ARRAYSIZE(dir->name)) {
+         return ERROR_FILENAME_EXCED_RANGE;
+      }
+      break;
+   }
+
+   // names come without a terminator
+   memcpy(dir->name, info->FileName, info->FileNameLength);
+   dir->name[len] = L'\0';
+
+   ent->name = dir->name;
+   ent->nameLen = len;
+   ent->attrs = info->FileAttributes;
+   ent->ino = 0;  // FILE_FULL_DIR_INFO has no file id
+   ent->type = IsRealDir(ent->attrs) ? FS_TYPE_DIR : FS_TYPE_FILE;
+
+   return 0;
+}
+
+
+/**
+ * Size in bytes of an entry returned by FsReadDir(). The directory
+ * listing already has it, so this is free.
+ */
+int
+FsEntrySize(DtDir *dir,            // IN
+            const DtDirent *ent,   // IN
+            uint64_t *bytes)       // OUT
+{
+   *bytes = (uint64_t) dir->cur->EndOfFile.QuadPart;
+   return 0;
+}
+
+
+// FILETIME ticks (100ns since 1601) to nanoseconds since 1970
+static int64_t
+UnixNanos(LARGE_INTEGER t)  // IN
+{
+   return (t.QuadPart - 116444736000000000LL) * 100;
+}
+
+
+/**
+ * Size and times of an entry returned by FsReadDir(), also straight
+ * from the directory listing. NTFS updates the access time lazily, to
+ * within an hour, if at all (NtfsDisableLastAccessUpdate).
+ */
+int
+FsEntryInfo(DtDir *dir,            // IN
+            const DtDirent *ent,   // IN
+            DtFileInfo *info)      // OUT
+{
+   info->bytes = (uint64_t) dir->cur->EndOfFile.QuadPart;
+   info->atime = UnixNanos(dir->cur->LastAccessTime);
+   info->mtime = UnixNanos(dir->cur->LastWriteTime);
+   return 0;
+}
+
+
+/**
+ * Remove a non-directory entry returned by FsReadDir(). Junctions and
+ * directory symlinks count as those, the link is removed.
+ */
+int
+FsUnlinkAt(DtDir *dir,            // IN
+           const DtDirent *ent)   // IN
+{
+   return DeleteAt(dir->h, ent->name, 0);
+}
+
+
+/**
+ * Where the reading of dir stands. Not supported, a directory listing
+ * on Windows can only start over, not continue from a position.
+ */
+int
+FsDirTell(DtDir *dir,      // IN
+          uint64_t *pos)   // OUT
+{
+   return ERROR_NOT_SUPPORTED;
+}
+
+
+int
+FsDirSeek(DtDir *dir,     // IN
+          uint64_t pos)   // IN
+{
+   return ERROR_NOT_SUPPORTED;
+}
+
+
+/**
+ * Return the handle of an open directory, for FsOpenDirAt() and
+ * FsRemoveDirAt() on its entries. It stays owned by dir.
+ */
+HANDLE
+FsDirHandle(DtDir *dir)  // IN
+{
+   return dir->h;
+}
+
+
+/**
+ * Finish enumerating a directory but keep its handle, which the caller
+ * closes with FsCloseHandle()
+ */
+HANDLE
+FsDirDetach(DtDir *dir)  // IN
+{
+   HANDLE h = dir->h;
+
+   free(dir->buf);
+   free(dir);
+   return h;
+}
+
+
+/**
+ * Close a handle from FsDirDetach()
+ */
+void
+FsCloseHandle(HANDLE h)  // IN
+{
+   if (h != FS_NO_HANDLE) {
+      CloseHandle(h);
+   }
+}
+
+
+/**
+ * Remove an empty directory relative to its parent
+ *
+ * @param parent directory name is in, FS_NO_HANDLE if name is a path
+ * @param name directory to remove
+ * @return 0 or Win32 error
+ */
+int
+FsRemoveDirAt(HANDLE parent,       // IN
+              const TCHAR *name)   // IN
+{
+   if (parent == FS_NO_HANDLE) {
+      return FsRemoveDir(name);
+   }
+   return DeleteAt(parent, name, FILE_DIRECTORY_FILE);
+}
+
+
+/**
+ * Finish enumerating a directory
+ */
+void
+FsCloseDir(DtDir *dir)  // IN
+{
+   CloseHandle(dir->h);
+   free(dir->buf);
+   free(dir);
+}
+
+#endif  // _WIN32
@@ -0,0 +1,475 @@
+// journal.c
+//
+// Implementation of the resume journal, see journal.h
+//
+// The file is text in the native character type: a header line with
+// the target's full path, then one line per position noted,
+//
+//    C <tab> position in hex <tab> path below the target
+//
+// where later lines override earlier ones for the same directory, and
+// the target itself is ".". Reading stops at the first line that is
+// cut short or doesn't parse, which is what a crash leaves behind.
+//
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "journal.h"
+#include "fs.h"
+
+
+#define JOURNAL_MAGIC  _T("deltree journal 1")
+#define JOURNAL_AFTER  2.0          // seconds a delete runs before we note
+#define FLUSH_SECS     1.0          // notes go to disk at most this often,
+#define FLUSH_CHARS    (32 * 1024)  // or once this many are waiting
+
+
+/**
+ * a position an earlier run noted
+ */
+typedef struct JournalPos_ {
+   TCHAR *rel;              // path below the target, NULL for a free slot
+   uint64_t pos;
+} JournalPos;
+
+
+struct DtJournal_ {
+   TCHAR *file;             // the journal
+   TCHAR *target;           // full path of what we delete
+   double begin;            // DtNow() at JournalOpen()
+
+   JournalPos *found;       // from an earlier run, hashed by rel
+   size_t nfound;
+   size_t cap;              // slots in found, a power of two or 0
+
+   DtMutex lock;            // the rest
+   FILE *out;               // open once the first notes are written
+   Bool broken;             // a write failed, stop trying
+   TCHAR *buf;              // notes waiting to be written
+   size_t used, room;       // characters
+   double flushed;          // DtNow() of the last write
+   Bool flushing;           // a worker is writing, others only add
+};
+
+
+// FNV-1a over the characters of s
+static uint64_t
+HashPath(const TCHAR *s)  // IN
+{
+   uint64_t h = 14695981039346656037ull;
+
+   for (; *s; s++) {
+      h ^= (uint64_t) *s;
+      h *= 1099511628211ull;
+   }
+   return h;
+}
+
+
+// malloc'ed directory the journals live in, created if make is set.
+// $XDG_STATE_HOME/deltree or ~/.local/state/deltree on POSIX,
+// %LOCALAPPDATA%\deltree on Windows.
+static TCHAR *
+StateDir(Bool make)  // IN
+{
+   const TCHAR *base;
+   const TCHAR *sub;
+   TCHAR *dir, *p;
+   size_t len;
+
+#ifdef _WIN32
+   base = _tgetenv(_T("LOCALAPPDATA"));
+   sub = _T("\\deltree");
+#else
+   base = _tgetenv(_T("XDG_STATE_HOME"));
+   sub = _T("/deltree");
+   if (!base || !base[0]) {
+      base = _tgetenv(_T("HOME"));
+      sub = _T("/.local/state/deltree");
+   }
+#endif
+   if (!base || !base[0]) {
+      return NULL;
+   }
+
+   len = _tcslen(base) + _tcslen(sub);
+   dir = (TCHAR *) malloc(sizeof(TCHAR) * (len + 1));
+   if (!dir) {
+      return NULL;
+   }
+   _sntprintf(dir, len + 1, _T("%s%s"), base, sub);
+   dir[len] = _T('\0');
+
+   // make each level that is missing, $XDG_STATE_HOME may not exist
+   for (p = dir + 1; make && p; ) {
+      p = _tcschr(p, DT_PATH_SEP);
+      if (p) {
+         *p = _T('\0');
+      }
+#ifdef _WIN32
+      CreateDirectory(dir, NULL);
+#else
+      mkdir(dir, 0700);
+#endif
+      if (p) {
+         *p++ = DT_PATH_SEP;
+      }
+   }
+   return dir;
+}
+
+
+// malloc'ed name of the journal for target
+static TCHAR *
+JournalFile(const TCHAR *target)  // IN
+{
+   TCHAR *dir = StateDir(FALSE), *file = NULL;
+   size_t len;
+
+   if (dir) {
+      len = _tcslen(dir) + 32;
+      file = (TCHAR *) malloc(sizeof(TCHAR) * len);
+      if (file) {
+         _sntprintf(file, len, _T("%s%cjournal-%016llx"), dir, DT_PATH_SEP,
+                    (unsigned long long) HashPath(target));
+         file[len - 1] = _T('\0');
+      }
+      free(dir);
+   }
+   return file;
+}
+
+
+// slot for rel in the positions found
+static JournalPos *
+FindSlot(JournalPos *found,   // IN
+         size_t cap,          // IN
+         const TCHAR *rel)    // IN
+{
+   size_t i = (size_t) HashPath(rel) & (cap - 1);
+
+   while (found[i].rel && _tcscmp(found[i].rel, rel) != 0) {
+      i = (i + 1) & (cap - 1);
+   }
+   return &found[i];
+}
+
+
+// read what an earlier run noted for j->target, if anything
+static void
+Load(DtJournal *j)  // IN/OUT
+{
+   TCHAR *data = NULL, *line, *end, *next, *tab, *rel;
+   JournalPos *slot;
+   size_t n = 0, lines = 0, i, hlen;
+   long size;
+   FILE *f;
+   uint64_t pos;
+
+   f = _tfopen(j->file, _T("rb"));
+   if (!f) {
+      return;
+   }
+   if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 &&
+       fseek(f, 0, SEEK_SET) == 0 &&
+       (data = (TCHAR *) malloc((size_t) size + sizeof(TCHAR)))) {
+      n = fread(data, sizeof(TCHAR), (size_t) size / sizeof(TCHAR), f);
+      data[n] = _T('\0');
+   }
+   fclose(f);
+   if (!data) {
+      return;
+   }
+
+   // the header has to be ours, the name is only a hash
+   hlen = _tcslen(JOURNAL_MAGIC);
+   if (n <= hlen || _tcsncmp(data, JOURNAL_MAGIC, hlen) != 0 ||
+       data[hlen] != _T('\t') ||
+       !(end = _tcschr(data + hlen + 1, _T('\n')))) {
+      goto exit;
+   }
+   *end = _T('\0');
+   if (_tcscmp(data + hlen + 1, j->target) != 0) {
+      goto exit;
+   }
+   line = end + 1;
+
+   for (i = 0; i < n; i++) {
+      lines += data[i] == _T('\n');
+   }
+   for (j->cap = 16; j->cap < lines * 2; j->cap *= 2) {
+   }
+   j->found = (JournalPos *) calloc(j->cap, sizeof(JournalPos));
+   if (!j->found) {
+      j->cap = 0;
+      goto exit;
+   }
+
+   for (; (end = _tcschr(line, _T('\n'))) != NULL; line = next) {
+      next = end + 1;
+      *end = _T('\0');
+      if (line[0] != _T('C') || line[1] != _T('\t')) {
+         break;
+      }
+      pos = _tcstoull(line + 2, &tab, 16);
+      if (tab == line + 2 || *tab != _T('\t') || !tab[1]) {
+         break;
+      }
+      rel = tab + 1;
+      slot = FindSlot(j->found, j->cap, rel);
+      if (!slot->rel) {
+         if (!(slot->rel = _tcsdup(rel))) {
+            break;
+         }
+         j->nfound++;
+      }
+      slot->pos = pos;
+   }
+
+exit:
+   free(data);
+}
+
+
+/**
+ * Start journaling a delete of target, picking up what an earlier run
+ * of it noted
+ *
+ * @param target path being deleted
+ * @return the journal, NULL if we can't keep one
+ */
+DtJournal *
+JournalOpen(const TCHAR *target)  // IN
+{
+   DtJournal *j = (DtJournal *) calloc(1, sizeof(DtJournal));
+
+   if (!j) {
+      return NULL;
+   }
+   j->target = FsFullPath(target);
+   j->file = j->target ? JournalFile(j->target) : NULL;
+   if (!j->file) {
+      free(j->target);
+      free(j);
+      return NULL;
+   }
+   Load(j);
+   j->begin = DtNow();
+   j->flushed = j->begin;
+   DtMutexInit(&j->lock);
+   return j;
+}
+
+
+// append text to the file, creating it with its header first. Called
+// by one worker at a time, see JournalNote().
+static void
+Write(DtJournal *j,        // IN
+      const TCHAR *text,   // IN
+      size_t len)          // IN
+{
+   TCHAR *dir, *header;
+   size_t hlen;
+
+   if (!j->out) {
+      // a journal of ours that we resumed from keeps growing, anything
+      // else is started over
+      if (j->found) {
+         j->out = _tfopen(j->file, _T("ab"));
+      } else if ((dir = StateDir(TRUE)) != NULL) {
+         free(dir);  // only had to be there
+         hlen = _tcslen(JOURNAL_MAGIC) + _tcslen(j->target) + 2;
+         header = (TCHAR *) malloc(sizeof(TCHAR) * (hlen + 1));
+         if (header) {
+            _sntprintf(header, hlen + 1, _T("%s\t%s\n"), JOURNAL_MAGIC,
+                       j->target);
+            j->out = _tfopen(j->file, _T("wb"));
+            if (j->out &&
+                fwrite(header, sizeof(TCHAR), hlen, j->out) != hlen) {
+               fclose(j->out);
+               j->out = NULL;
+            }
+            free(header);
+         }
+      }
+      if (!j->out) {
+         j->broken = TRUE;
+         return;
+      }
+   }
+
+   if (fwrite(text, sizeof(TCHAR), len, j->out) != len ||
+       fflush(j->out) != 0) {
+      j->broken = TRUE;
+      return;
+   }
+   // on disk before we rely on it, in the order written
+#ifdef _WIN32
+   FlushFileBuffers((HANDLE) _get_osfhandle(_fileno(j->out)));
+#else
+   fdatasync(fileno(j->out));
+#endif
+}
+
+
+// write out what is waiting if it is time, or always with force. The
+// lock is held on entry and exit, but not while writing.
+static void
+Flush(DtJournal *j,   // IN
+      Bool force)     // IN
+{
+   TCHAR *text = j->buf;
+   size_t len = j->used;
+   double now = DtNow();
+
+   if (j->flushing || j->broken || !len ||
+       (!force && now - j->flushed < FLUSH_SECS && len < FLUSH_CHARS)) {
+      return;
+   }
+   j->flushing = TRUE;
+   j->buf = NULL;
+   j->used = j->room = 0;
+   DtMutexUnlock(&j->lock);
+
+   Write(j, text, len);
+   free(text);
+
+   DtMutexLock(&j->lock);
+   j->flushing = FALSE;
+   j->flushed = now;
+}
+
+
+/**
+ * Finish journaling
+ *
+ * @param j the journal, may be NULL
+ * @param done the target is gone, the journal is no longer needed
+ */
+void
+JournalClose(DtJournal *j,   // IN
+             Bool done)      // IN
+{
+   size_t i;
+
+   if (!j) {
+      return;
+   }
+   if (!done) {
+      DtMutexLock(&j->lock);
+      Flush(j, TRUE);
+      DtMutexUnlock(&j->lock);
+   }
+   if (j->out) {
+      fclose(j->out);
+   }
+   if (done && (j->out || j->found)) {
+      _tremove(j->file);
+   }
+
+   for (i = 0; i < j->cap; i++) {
+      free(j->found[i].rel);
+   }
+   free(j->found);
+   free(j->buf);
+   free(j->file);
+   free(j->target);
+   DtMutexDestroy(&j->lock);
+   free(j);
+}
+
+
+/**
+ * Number of directories an earlier run left positions for
+ */
+size_t
+JournalResumable(const DtJournal *j)  // IN
+{
+   return j ? j->nfound : 0;
+}
+
+
+/**
+ * Look up where an earlier run got to in a directory
+ *
+ * @param j the journal
+ * @param rel path of the directory below the target, "." for itself
+ * @param pos receives the position for FsDirSeek()
+ * @return TRUE if there is one
+ */
+Bool
+JournalFind(DtJournal *j,        // IN
+            const TCHAR *rel,    // IN
+            uint64_t *pos)       // OUT
+{
+   JournalPos *slot;
+
+   if (!j || !j->nfound) {
+      return FALSE;
+   }
+   slot = FindSlot(j->found, j->cap, rel);
+   if (!slot->rel) {
+      return FALSE;
+   }
+   *pos = slot->pos;
+   return TRUE;
+}
+
+
+/**
+ * Whether the delete has been running long enough for notes to be
+ * worth writing
+ */
+Bool
+JournalWanted(const DtJournal *j)  // IN
+{
+   return j && !j->broken && DtNow() - j->begin >= JOURNAL_AFTER;
+}
+
+
+/**
+ * Note that everything in a directory up to a position is gone. It
+ * reaches the disk with this or a later note, or at JournalClose().
+ *
+ * @param j the journal
+ * @param rel path of the directory below the target, "." for itself
+ * @param pos from FsDirTell()
+ */
+void
+JournalNote(DtJournal *j,        // IN
+            const TCHAR *rel,    // IN
+            uint64_t pos)        // IN
+{
+   size_t need = _tcslen(rel) + 24, room;
+   TCHAR *p;
+   int n;
+
+   DtMutexLock(&j->lock);
+   if (j->broken) {
+      DtMutexUnlock(&j->lock);
+      return;
+   }
+   if (j->used + need > j->room) {
+      room = j->room ? j->room * 2 : 1024;
+      while (room < j->used + need) {
+         room *= 2;
+      }
+      p = (TCHAR *) realloc(j->buf, sizeof(TCHAR) * room);
+      if (!p) {
+         DtMutexUnlock(&j->lock);
+         return;  // only a note, the delete goes on
+      }
+      j->buf = p;
+      j->room = room;
+   }
+   n = _sntprintf(j->buf + j->used, need, _T("C\t%llx\t%s\n"),
+                  (unsigned long long) pos, rel);
+   if (n > 0 && (size_t) n < need) {
+      j->used += (size_t) n;
+   }
+   Flush(j, FALSE);
+   DtMutexUnlock(&j->lock);
+}
@@ -0,0 +1,35 @@
+// journal.h
+//
+// Notes that let a delete which was killed (a timeout, a reboot) be
+// picked up where it stopped.
+//
+// Whatever was deleted stays deleted, so a rerun never repeats
+// finished work. What it does repeat is reading big directories from
+// the start, through all the entries that are already gone. So for
+// directories that take a while, the engine notes how far it has read
+// them with everything before that point removed (FsDirTell()), and a
+// rerun seeks straight past it. A position that is wrong, or stale,
+// costs one more read: the directory isn't empty when we go to remove
+// it, and the engine reads it again from the start.
+//
+// The notes are appended to a file in the user's state directory,
+// named after the target. They are written in batches, at most once a
+// second, and only once a delete has run for a couple of seconds, so
+// short deletes never touch the disk for it. A torn tail after a crash
+// is ignored. The file goes away once the target is deleted.
+
+
+#pragma once
+
+#include "platform.h"
+
+
+typedef struct DtJournal_ DtJournal;
+
+
+DtJournal *JournalOpen(const TCHAR *target);
+void       JournalClose(DtJournal *j, Bool done);
+size_t     JournalResumable(const DtJournal *j);
+Bool       JournalFind(DtJournal *j, const TCHAR *rel, uint64_t *pos);
+Bool       JournalWanted(const DtJournal *j);
+void       JournalNote(DtJournal *j, const TCHAR *rel, uint64_t pos);
@@ -0,0 +1,419 @@
+// libdeltree.c
+//
+// Implementation of the library interface, see libdeltree.h
+//
+// Each delete gets a thread of its own that runs DtDeleteTree() and
+// then the completion callback. Its counters live in a progress object
+// of its own, one that only counts, which is a child of the group's so
+// the group sees them as well.
+//
+
+#include "libdeltree.h"
+#include "platform.h"
+#include "engine.h"
+#include "fs.h"
+#include "journal.h"
+#include "progress.h"
+#include "rate.h"
+#include "report.h"
+
+
+_Static_assert(sizeof(DeltreeChar) == sizeof(TCHAR),
+               "libdeltree paths must be TCHAR");
+_Static_assert(DELTREE_OPENDIR == DT_OP_OPENDIR &&
+               DELTREE_UNLINK == DT_OP_UNLINK &&
+               DELTREE_RMDIR == DT_OP_RMDIR, "DeltreeError.what is a DtOp");
+_Static_assert(DELTREE_ORDER_AUTO == DT_ORDER_AUTO &&
+               DELTREE_ORDER_DIR == DT_ORDER_DIR &&
+               DELTREE_ORDER_INODE == DT_ORDER_INODE,
+               "DeltreeOptions.order is a DtOrder");
+
+
+struct DeltreeGroup_ {
+   DtRate rate;
+   DtRate *limit;          // &rate with a cap, or NULL
+   DtProgress *progress;   // adds up the deletes in the group
+   double begin;
+   atomic_int running;     // deletes not done yet
+};
+
+
+struct DeltreeOp_ {
+   TCHAR *path;
+   DtOptions opts;
+   DeltreeGroup *group;    // may be NULL
+   DtJournal *journal;
+   DeltreeDoneFunc done;
+   void *ctx;
+   atomic_int cancel;      // DtOptions.cancel
+   DtThread thread;
+   Bool joined;
+   double begin;
+   atomic_int finished;    // res and pub are final, the callback returned
+
+   DtReport report;        // DtOptions.report
+   DeltreeError *errors;   // its paths, once it is over
+   size_t nerrors;
+
+   Bool ok;
+   DtResult res;
+   DeltreeResult pub;
+};
+
+
+/**
+ * Version of the library, LIBDELTREE_VERSION when it was built
+ */
+const char *
+DeltreeVersion(void)
+{
+   return LIBDELTREE_VERSION;
+}
+
+
+/**
+ * Fill in the defaults: as many workers as the device handles best,
+ * files in inode order where that helps, no journal, ten paths per
+ * error code and two more passes for transient failures.
+ *
+ * @param opts receives the defaults
+ */
+void
+DeltreeOptionsInit(DeltreeOptions *opts)  // OUT
+{
+   memset(opts, 0, sizeof(*opts));
+   opts->size = sizeof(*opts);
+   opts->adaptive = 1;
+   opts->order = DELTREE_ORDER_AUTO;
+   opts->pathsPerError = 10;
+   opts->retries = 2;
+}
+
+
+/**
+ * Make a group for deletes that share a rate limit
+ *
+ * @param maxOpsPerSec unlinks and rmdirs per second, 0 for no cap
+ * @param maxBytesPerSec metadata bytes written per second, estimated,
+ *                       0 for no cap
+ * @return the group, or NULL if out of memory
+ */
+DeltreeGroup *
+DeltreeGroupCreate(double maxOpsPerSec,     // IN
+                   double maxBytesPerSec)   // IN
+{
+   DeltreeGroup *g = (DeltreeGroup *) calloc(1, sizeof(DeltreeGroup));
+
+   if (!g) {
+      return NULL;
+   }
+   g->progress = ProgressCreate(NULL);
+   if (!g->progress) {
+      free(g);
+      return NULL;
+   }
+   RateInit(&g->rate, maxOpsPerSec, maxBytesPerSec);
+   if (maxOpsPerSec > 0 || maxBytesPerSec > 0) {
+      g->limit = &g->rate;
+   }
+   g->begin = DtNow();
+   atomic_init(&g->running, 0);
+   return g;
+}
+
+
+/**
+ * Add up the counters of every delete started in a group
+ *
+ * @param group the group
+ * @param p receives the totals, done once none is running
+ */
+void
+DeltreeGroupPoll(DeltreeGroup *group,   // IN
+                 DeltreeProgress *p)    // OUT
+{
+   memset(p, 0, sizeof(*p));
+   if (group->progress) {
+      ProgressTotals(group->progress, &p->files, &p->dirs, &p->bytes,
+                     &p->errors);
+   }
+   p->seconds = DtNow() - group->begin;
+   p->done = atomic_load(&group->running) == 0;
+}
+
+
+/**
+ * Free a group. The deletes started in it must be freed first.
+ */
+void
+DeltreeGroupFree(DeltreeGroup *group)  // IN
+{
+   if (!group) {
+      return;
+   }
+   ProgressStop(group->progress);
+   RateDestroy(&group->rate);
+   free(group);
+}
+
+
+// lay the paths of the report out for DeltreeErrorGet()
+static void
+ListErrors(DeltreeOp *op)  // IN/OUT
+{
+   const DtReportGroup *g;
+   size_t n = 0;
+   int i, j;
+
+   for (i = 0; i < op->report.ngroups; i++) {
+      n += op->report.groups[i].npaths;
+   }
+   op->errors = n ? (DeltreeError *) calloc(n, sizeof(DeltreeError)) :
+                NULL;
+   if (!op->errors) {
+      return;
+   }
+   for (i = 0; i < op->report.ngroups; i++) {
+      g = &op->report.groups[i];
+      for (j = 0; j < g->npaths; j++) {
+         DeltreeError *e = &op->errors[op->nerrors++];
+         e->path = g->paths[j].path;
+         e->code = g->err;
+         e->what = (int) g->paths[j].op;
+         e->count = g->count;
+      }
+   }
+}
+
+
+static void
+OpMain(void *arg)  // IN
+{
+   DeltreeOp *op = (DeltreeOp *) arg;
+   DeltreeResult *pub = &op->pub;
+   DeltreeGroup *group = op->group;
+
+   op->ok = DtDeleteTree(op->path, &op->opts, &op->res);
+   // a cancelled delete keeps its notes for the next one
+   JournalClose(op->journal, op->ok);
+   op->journal = NULL;
+   ListErrors(op);
+
+   pub->files = op->res.files;
+   pub->dirs = op->res.dirs;
+   pub->bytes = op->res.bytes;
+   pub->errors = op->res.errors;
+   pub->lastError = op->res.lastError;
+   pub->seconds = DtNow() - op->begin;
+   pub->cancelled = op->res.cancelled;
+   pub->resumed = op->res.resumed;
+   pub->retries = op->res.retries;
+   pub->leftFiles = op->res.leftFiles;
+   pub->leftDirs = op->res.leftDirs;
+   pub->leftBytes = op->res.leftBytes;
+
+   if (op->done) {
+      op->done(op, pub, op->ctx);
+   }
+   atomic_store(&op->finished, TRUE);
+   if (group) {
+      atomic_fetch_sub(&group->running, 1);
+   }
+}
+
+
+/**
+ * Start deleting path and everything below it in the background
+ *
+ * @param path file or directory to delete
+ * @param opts how, from DeltreeOptionsInit(), may be NULL for defaults
+ * @param group group to count and pace it in, may be NULL
+ * @param done called once it is over, may be NULL
+ * @param ctx passed to done
+ * @param op receives the delete, for the other calls and DeltreeFree()
+ * @return 0, or a native error code if it could not be started
+ */
+int
+DeltreeStart(const DeltreeChar *path,       // IN
+             const DeltreeOptions *opts,    // IN
+             DeltreeGroup *group,           // IN
+             DeltreeDoneFunc done,          // IN
+             void *ctx,                     // IN
+             DeltreeOp **op)                // OUT
+{
+   DeltreeOptions o;
+   DeltreeOp *d;
+
+   *op = NULL;
+   DeltreeOptionsInit(&o);
+   if (opts) {
+      // a caller built against an older header knows fewer fields
+      memcpy(&o, opts, opts->size < sizeof(o) ? opts->size : sizeof(o));
+   }
+
+   d = (DeltreeOp *) calloc(1, sizeof(DeltreeOp));
+   if (!d) {
+      return FS_ENOMEM;
+   }
+   d->path = _tcsdup(path);
+   d->opts.progress = ProgressCreate(group ? group->progress : NULL);
+   if (!d->path || !d->opts.progress) {
+      free(d->path);
+      ProgressStop(d->opts.progress);
+      free(d);
+      return FS_ENOMEM;
+   }
+   d->group = group;
+   d->done = done;
+   d->ctx = ctx;
+   ReportInit(&d->report, o.pathsPerError);
+   atomic_init(&d->cancel, 0);
+   atomic_init(&d->finished, FALSE);
+
+   d->opts.threads = o.threads;
+   d->opts.adaptive = o.adaptive != 0;
+   d->opts.queueDepth = o.queueDepth;
+   d->opts.order = (DtOrder) o.order;
+   d->opts.maxMemory = o.maxMemory;
+   d->opts.stats = o.stats != 0;
+   d->opts.emptyOnly = o.emptyOnly != 0;
+   d->opts.rate = group ? group->limit : NULL;
+   d->opts.report = &d->report;
+   d->opts.retries = o.retries;
+   d->opts.cancel = &d->cancel;
+   if (o.journal && !o.emptyOnly) {
+      d->journal = JournalOpen(d->path);
+      d->opts.journal = d->journal;
+   }
+
+   if (group) {
+      atomic_fetch_add(&group->running, 1);
+   }
+   d->begin = DtNow();
+   if (!DtThreadCreate(&d->thread, OpMain, d)) {
+      if (group) {
+         atomic_fetch_sub(&group->running, 1);
+      }
+      JournalClose(d->journal, FALSE);
+      ProgressStop(d->opts.progress);
+      free(d->path);
+      free(d);
+      return FS_ENOMEM;
+   }
+   *op = d;
+   return 0;
+}
+
+
+/**
+ * Read the live counters of a delete, costs it nothing
+ *
+ * @param op the delete
+ * @param p receives the counters
+ */
+void
+DeltreePoll(DeltreeOp *op,        // IN
+            DeltreeProgress *p)   // OUT
+{
+   memset(p, 0, sizeof(*p));
+   p->done = atomic_load(&op->finished);
+   if (p->done) {
+      p->files = op->pub.files;
+      p->dirs = op->pub.dirs;
+      p->bytes = op->pub.bytes;
+      p->errors = op->pub.errors;
+      p->seconds = op->pub.seconds;
+      return;
+   }
+   ProgressTotals(op->opts.progress, &p->files, &p->dirs, &p->bytes,
+                  &p->errors);
+   p->seconds = DtNow() - op->begin;
+}
+
+
+/**
+ * Ask a delete to stop. The workers finish the directory entry they
+ * are on and leave everything else in place, so it ends soon after.
+ */
+void
+DeltreeCancel(DeltreeOp *op)  // IN
+{
+   atomic_store(&op->cancel, 1);
+}
+
+
+/**
+ * Wait for a delete to be over
+ *
+ * @param op the delete
+ * @param res receives how it went, may be NULL
+ * @return 0 if everything is gone, DELTREE_CANCELLED if it was
+ *         cancelled, otherwise the native error code of the last
+ *         failure
+ */
+int
+DeltreeWait(DeltreeOp *op,        // IN
+            DeltreeResult *res)   // OUT
+{
+   if (!op->joined) {
+      DtThreadJoin(op->thread);
+      op->joined = TRUE;
+   }
+   if (res) {
+      *res = op->pub;
+   }
+   return op->pub.cancelled ? DELTREE_CANCELLED :
+          op->ok ? 0 : op->pub.lastError;
+}
+
+
+/**
+ * Number of failures whose path was kept, for DeltreeErrorGet()
+ *
+ * @param op the delete, after DeltreeWait() or in its callback
+ * @param dropped receives the failures only counted, may be NULL
+ * @return failures kept
+ */
+size_t
+DeltreeErrorCount(DeltreeOp *op,        // IN
+                  uint64_t *dropped)    // OUT
+{
+   if (dropped) {
+      *dropped = op->res.errors - op->nerrors;
+   }
+   return op->nerrors;
+}
+
+
+/**
+ * One failure of a delete that is over. They come grouped by error
+ * code.
+ *
+ * @param op the delete, after DeltreeWait() or in its callback
+ * @param i index below DeltreeErrorCount()
+ * @return the failure, valid until DeltreeFree(), or NULL
+ */
+const DeltreeError *
+DeltreeErrorGet(DeltreeOp *op,   // IN
+                size_t i)        // IN
+{
+   return i < op->nerrors ? &op->errors[i] : NULL;
+}
+
+
+/**
+ * Free a delete, waiting for it first if it is still running
+ */
+void
+DeltreeFree(DeltreeOp *op)  // IN
+{
+   if (!op) {
+      return;
+   }
+   DeltreeWait(op, NULL);
+   ProgressStop(op->opts.progress);
+   free(op->errors);  // the paths belong to the report
+   ReportFree(&op->report);
+   free(op->path);
+   free(op);
+}
@@ -0,0 +1,356 @@
+// platform.c
+//
+// Implementation of the portability layer, see platform.h
+//
+
+#include "platform.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+
+// thread entry points have a platform specific signature, so we
+// start every thread through a trampoline that calls func(arg)
+typedef struct ThreadStart_ {
+   DtThreadFunc func;
+   void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+
+static DWORD WINAPI
+ThreadTrampoline(LPVOID param)  // IN
+{
+   ThreadStart start = *(ThreadStart *) param;
+   free(param);
+   start.func(start.arg);
+   return 0;
+}
+
+#else
+
+static void *
+ThreadTrampoline(void *param)  // IN
+{
+   ThreadStart start = *(ThreadStart *) param;
+   free(param);
+   start.func(start.arg);
+   return NULL;
+}
+
+#endif
+
+
+/**
+ * Start a new thread running func(arg)
+ *
+ * @param thread receives the thread handle
+ * @param func thread function
+ * @param arg argument passed to func
+ * @return TRUE on success
+ */
+Bool
+DtThreadCreate(DtThread *thread,   // OUT
+               DtThreadFunc func,  // IN
+               void *arg)          // IN
+{
+   ThreadStart *start = (ThreadStart *) malloc(sizeof(ThreadStart));
+   if (!start) {
+      return FALSE;
+   }
+   start->func = func;
+   start->arg = arg;
+
+#ifdef _WIN32
+   *thread = CreateThread(NULL, 0, ThreadTrampoline, start, 0, NULL);
+   if (*thread == NULL) {
+      free(start);
+      return FALSE;
+   }
+#else
+   if (pthread_create(thread, NULL, ThreadTrampoline, start) != 0) {
+      free(start);
+      return FALSE;
+   }
+#endif
+   return TRUE;
+}
+
+
+/**
+ * Wait for a thread to finish and release its handle
+ */
+void
+DtThreadJoin(DtThread thread)  // IN
+{
+#ifdef _WIN32
+   WaitForSingleObject(thread, INFINITE);
+   CloseHandle(thread);
+#else
+   pthread_join(thread, NULL);
+#endif
+}
+
+
+#ifdef _WIN32
+
+void DtMutexInit(DtMutex *m)    { InitializeCriticalSection(m); }
+void DtMutexDestroy(DtMutex *m) { DeleteCriticalSection(m); }
+void DtMutexLock(DtMutex *m)    { EnterCriticalSection(m); }
+void DtMutexUnlock(DtMutex *m)  { LeaveCriticalSection(m); }
+
+void DtCondInit(DtCond *c)      { InitializeConditionVariable(c); }
+void DtCondDestroy(DtCond *c)   { (void) c; }
+void DtCondSignal(DtCond *c)    { WakeConditionVariable(c); }
+void DtCondBroadcast(DtCond *c) { WakeAllConditionVariable(c); }
+
+void
+DtCondWait(DtCond *c, DtMutex *m)
+{
+   SleepConditionVariableCS(c, m, INFINITE);
+}
+
+void
+DtCondTimedWait(DtCond *c, DtMutex *m, int ms)
+{
+   SleepConditionVariableCS(c, m, (DWORD) ms);
+}
+
+#else
+
+void DtMutexInit(DtMutex *m)    { pthread_mutex_init(m, NULL); }
+void DtMutexDestroy(DtMutex *m) { pthread_mutex_destroy(m); }
+void DtMutexLock(DtMutex *m)    { pthread_mutex_lock(m); }
+void DtMutexUnlock(DtMutex *m)  { pthread_mutex_unlock(m); }
+
+void DtCondInit(DtCond *c)      { pthread_cond_init(c, NULL); }
+void DtCondDestroy(DtCond *c)   { pthread_cond_destroy(c); }
+void DtCondSignal(DtCond *c)    { pthread_cond_signal(c); }
+void DtCondBroadcast(DtCond *c) { pthread_cond_broadcast(c); }
+
+void
+DtCondWait(DtCond *c, DtMutex *m)
+{
+   pthread_cond_wait(c, m);
+}
+
+void
+DtCondTimedWait(DtCond *c, DtMutex *m, int ms)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += ms / 1000;
+   ts.tv_nsec += (long) (ms % 1000) * 1000000;
+   if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+   }
+   pthread_cond_timedwait(c, m, &ts);
+}
+
+#endif
+
+
+/**
+ * Return the number of processors available to this process
+ */
+int
+DtNumCpus(void)
+{
+#ifdef _WIN32
+   SYSTEM_INFO info;
+   GetSystemInfo(&info);
+   return (int) info.dwNumberOfProcessors;
+#else
+   long n = sysconf(_SC_NPROCESSORS_ONLN);
+   return n > 0 ? (int) n : 1;
+#endif
+}
+
+
+/**
+ * Whether f is an interactive console/terminal rather than a file or
+ * a pipe
+ */
+Bool
+DtIsTerminal(FILE *f)  // IN
+{
+#ifdef _WIN32
+   DWORD mode;
+   HANDLE h = (HANDLE) _get_osfhandle(_fileno(f));
+
+   return h != INVALID_HANDLE_VALUE && GetConsoleMode(h, &mode);
+#else
+   return isatty(fileno(f)) != 0;
+#endif
+}
+
+
+/**
+ * Seconds on a monotonic clock, for measuring elapsed wall time. Unlike
+ * clock() this doesn't add up the cpu time of all our threads.
+ */
+double
+DtNow(void)
+{
+#ifdef _WIN32
+   static LARGE_INTEGER freq;
+   LARGE_INTEGER now;
+
+   if (freq.QuadPart == 0) {
+      QueryPerformanceFrequency(&freq);
+   }
+   QueryPerformanceCounter(&now);
+   return (double) now.QuadPart / (double) freq.QuadPart;
+#else
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#endif
+}
+
+
+/**
+ * Sleep for a while, with sub-millisecond precision where the platform
+ * has it
+ */
+void
+DtSleep(double secs)  // IN
+{
+#ifdef _WIN32
+   Sleep((DWORD) (secs * 1000 + 0.5));
+#else
+   struct timespec ts;
+
+   ts.tv_sec = (time_t) secs;
+   ts.tv_nsec = (long) ((secs - (double) ts.tv_sec) * 1e9);
+   while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+   }
+#endif
+}
+
+
+/**
+ * Drop our cpu and I/O priority to the idle class, so we only use the
+ * disk when nothing else wants it. Threads started afterwards inherit
+ * it, so call this before starting any.
+ */
+void
+DtLowerPriority(void)
+{
+#ifdef _WIN32
+   // also lowers I/O and memory priority, unlike IDLE_PRIORITY_CLASS
+   SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#else
+   setpriority(PRIO_PROCESS, 0, 19);
+#ifdef __linux__
+   // ioprio_set(IOPRIO_WHO_PROCESS, self, IOPRIO_CLASS_IDLE)
+   syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+#endif
+}
+
+
+/**
+ * Raise the soft limit on open descriptors to the hard one, a deep
+ * tree keeps one open per level. For programs, the library works
+ * within whatever limit it finds. Nothing to do on Windows.
+ */
+void
+DtRaiseFileLimit(void)
+{
+#ifndef _WIN32
+   struct rlimit rl;
+
+   if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+   }
+#endif
+}
+
+
+/**
+ * Format a native error code into buf. The code is an errno value on
+ * POSIX and a GetLastError() value on Windows.
+ *
+ * @param err error code
+ * @param buf output buffer
+ * @param size buffer size in characters
+ */
+void
+DtStrError(int err,       // IN
+           TCHAR *buf,    // OUT
+           size_t size)   // IN
+{
+   if (size == 0) {
+      return;
+   }
+#ifdef _WIN32
+   DWORD n = FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM |
+                           FORMAT_MESSAGE_IGNORE_INSERTS,
+                           NULL, (DWORD) err,
+                           MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                           buf, (DWORD) size, NULL);
+   // drop the trailing CR/LF FormatMessage likes to add
+   while (n > 0 && (buf[n - 1] == _T('\r') || buf[n - 1] == _T('\n'))) {
+      buf[--n] = _T('\0');
+   }
+   if (n == 0) {
+      _sntprintf(buf, size, _T("error %d"), err);
+      buf[size - 1] = _T('\0');
+   }
+#else
+   // strerror_r() comes in two flavors, snprintf works with both
+   char tmp[256];
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+   snprintf(buf, size, "%s", strerror_r(err, tmp, sizeof(tmp)));
+#else
+   if (strerror_r(err, tmp, sizeof(tmp)) != 0) {
+      snprintf(tmp, sizeof(tmp), "error %d", err);
+   }
+   snprintf(buf, size, "%s", tmp);
+#endif
+#endif
+}
+
+
+#ifndef _WIN32
+
+/**
+ * Read a single key press without waiting for enter, like _getch()
+ * on Windows. Falls back to a buffered read if stdin isn't a tty.
+ *
+ * @return the character read, or EOF
+ */
+int
+DtGetch(void)
+{
+   struct termios saved, raw;
+   int c;
+
+   if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0) {
+      return getchar();
+   }
+   raw = saved;
+   raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+   raw.c_cc[VMIN] = 1;
+   raw.c_cc[VTIME] = 0;
+   tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+   c = getchar();
+   tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+   return c;
+}
+
+#endif
@@ -0,0 +1,121 @@
+// platform.h
+//
+// Portability layer for deltree. On Windows this pulls in the usual
+// windows.h/tchar.h, on POSIX it provides just enough of the TCHAR
+// names so the rest of the code can be written once, plus thin
+// wrappers for threads, mutexes and condition variables.
+//
+// Paths are always in the native character type: wchar_t on a
+// UNICODE Windows build, char everywhere else.
+
+
+#pragma once
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <tchar.h>
+#include <io.h>
+#include <conio.h>
+
+#define DT_PATH_SEP    _T('\\')
+
+#else  // POSIX
+
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+typedef char           TCHAR;
+
+#define _T(x)          x
+#define _tmain         main
+#define _tprintf       printf
+#define _ftprintf      fprintf
+#define _sntprintf     snprintf
+#define _tcslen        strlen
+#define _tcscmp        strcmp
+#define _tcsncmp       strncmp
+#define _tcsicmp       strcasecmp
+#define _tcschr        strchr
+#define _tcsrchr       strrchr
+#define _tcsdup        strdup
+#define _tcstol        strtol
+#define _tcstoul       strtoul
+#define _tcstoull      strtoull
+#define _tcstod        strtod
+#define _tgetenv       getenv
+#define _tfopen        fopen
+#define _tremove       remove
+#define _gettch        DtGetch
+
+#define ARRAYSIZE(a)   (sizeof(a) / sizeof((a)[0]))
+
+#define DT_PATH_SEP    '/'
+
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifndef FALSE
+#define FALSE          0
+#endif
+
+#ifndef TRUE
+#define TRUE           1
+#endif
+
+typedef char           Bool;
+
+
+/*
+ * threads and synchronization
+ */
+
+#ifdef _WIN32
+typedef HANDLE             DtThread;
+typedef CRITICAL_SECTION   DtMutex;
+typedef CONDITION_VARIABLE DtCond;
+#else
+typedef pthread_t          DtThread;
+typedef pthread_mutex_t    DtMutex;
+typedef pthread_cond_t     DtCond;
+#endif
+
+typedef void (*DtThreadFunc)(void *arg);
+
+Bool DtThreadCreate(DtThread *thread, DtThreadFunc func, void *arg);
+void DtThreadJoin(DtThread thread);
+
+void DtMutexInit(DtMutex *m);
+void DtMutexDestroy(DtMutex *m);
+void DtMutexLock(DtMutex *m);
+void DtMutexUnlock(DtMutex *m);
+
+void DtCondInit(DtCond *c);
+void DtCondDestroy(DtCond *c);
+void DtCondWait(DtCond *c, DtMutex *m);
+void DtCondTimedWait(DtCond *c, DtMutex *m, int ms);  // may wake early
+void DtCondSignal(DtCond *c);
+void DtCondBroadcast(DtCond *c);
+
+
+/*
+ * misc helpers
+ */
+
+int    DtNumCpus(void);
+Bool   DtIsTerminal(FILE *f);
+double DtNow(void);
+void   DtSleep(double secs);
+void   DtLowerPriority(void);
+void   DtRaiseFileLimit(void);
+void   DtStrError(int err, TCHAR *buf, size_t size);
+
+#ifndef _WIN32
+int  DtGetch(void);
+#endif
@@ -0,0 +1,441 @@
+// progress.c
+//
+// Implementation of the progress line, see progress.h
+//
+
+#include "progress.h"
+#include "stats.h"
+
+
+#define TTY_INTERVAL_MS    250    // redraws on a terminal
+#define PLAIN_INTERVAL_MS  5000   // lines in a log file
+
+#define LINE_MAX_CHARS     160
+
+typedef enum {
+   COLOR_NORMAL,
+   COLOR_RED,     // errors
+   COLOR_GRAY,    // rate and elapsed time
+} Color;
+
+
+/**
+ * the counters of one running delete
+ */
+typedef struct Attached_ {
+   struct Attached_ *next;
+   void *mem;              // what to free, counters is aligned in it
+   DtCounters *counters;
+   int n;
+} Attached;
+
+
+struct DtProgress_ {
+   DtMutex lock;           // held while drawing or while suspended
+   DtCond wake;
+   DtThread thread;
+   FILE *out;              // NULL if nothing is drawn, see ProgressCreate()
+   DtProgress *parent;     // also counts what is attached to us
+   Bool tty;               // redraw in place, otherwise plain lines
+   Bool stop;
+   size_t drawn;           // characters of the line on screen, 0 if none
+   Bool redraw;            // line was up when suspended
+   double begin;           // DtNow() at start
+   Attached *live;         // deletes in progress
+   uint64_t done[4];       // files, dirs, bytes, errors of finished ones
+#ifdef _WIN32
+   HANDLE console;         // console to color, NULL for ANSI codes
+   WORD attrs;             // its original colors
+#endif
+};
+
+
+static void
+SetColor(DtProgress *p,  // IN
+         Color color)    // IN
+{
+#ifdef _WIN32
+   // same thing ConsoleColor does: keep the background, swap the
+   // foreground
+   if (p->console) {
+      WORD c = p->attrs & ~(FOREGROUND_BLUE | FOREGROUND_GREEN |
+                            FOREGROUND_RED | FOREGROUND_INTENSITY);
+      fflush(p->out);
+      if (color == COLOR_RED) {
+         c |= FOREGROUND_RED | FOREGROUND_INTENSITY;
+      } else if (color == COLOR_GRAY) {
+         c |= FOREGROUND_INTENSITY;
+      } else {
+         c = p->attrs;
+      }
+      SetConsoleTextAttribute(p->console, c);
+      return;
+   }
+#endif
+   switch (color) {
+   case COLOR_RED:
+      _ftprintf(p->out, _T("\x1b[31m"));
+      break;
+   case COLOR_GRAY:
+      _ftprintf(p->out, _T("\x1b[90m"));
+      break;
+   default:
+      _ftprintf(p->out, _T("\x1b[0m"));
+      break;
+   }
+}
+
+
+// remove the line from the screen, with the lock held
+static void
+Erase(DtProgress *p)  // IN
+{
+   if (!p->drawn) {
+      return;
+   }
+#ifdef _WIN32
+   if (p->console) {
+      size_t i;
+      _ftprintf(p->out, _T("\r"));
+      for (i = 0; i < p->drawn; i++) {
+         _ftprintf(p->out, _T(" "));
+      }
+      _ftprintf(p->out, _T("\r"));
+      fflush(p->out);
+      p->drawn = 0;
+      return;
+   }
+#endif
+   _ftprintf(p->out, _T("\r\x1b[K"));
+   fflush(p->out);
+   p->drawn = 0;
+}
+
+
+// add up everything, with the lock held
+static void
+Sample(DtProgress *p,      // IN
+       uint64_t *files,    // OUT
+       uint64_t *dirs,     // OUT
+       uint64_t *bytes,    // OUT
+       uint64_t *errors)   // OUT
+{
+   Attached *a;
+   int i;
+
+   *files = p->done[0];
+   *dirs = p->done[1];
+   *bytes = p->done[2];
+   *errors = p->done[3];
+   for (a = p->live; a; a = a->next) {
+      for (i = 0; i < a->n; i++) {
+         DtCounters *c = &a->counters[i];
+         *files += atomic_load_explicit(&c->files, memory_order_relaxed);
+         *dirs += atomic_load_explicit(&c->dirs, memory_order_relaxed);
+         *bytes += atomic_load_explicit(&c->bytes, memory_order_relaxed);
+         *errors += atomic_load_explicit(&c->errors, memory_order_relaxed);
+      }
+   }
+}
+
+
+// print the current state, with the lock held
+static void
+Draw(DtProgress *p)  // IN
+{
+   uint64_t files, dirs, bytes, errors;
+   TCHAR counts[LINE_MAX_CHARS], errs[32] = _T(""), tail[48], size[32];
+   double secs = DtNow() - p->begin;
+   int elapsed = (int) secs;
+
+   Sample(p, &files, &dirs, &bytes, &errors);
+
+   if (bytes) {
+      StatsFormatBytes(bytes, size, ARRAYSIZE(size));
+      _sntprintf(counts, ARRAYSIZE(counts), _T("%llu files, %llu dirs, %s"),
+                 (unsigned long long) files, (unsigned long long) dirs, size);
+   } else {
+      _sntprintf(counts, ARRAYSIZE(counts), _T("%llu files, %llu dirs"),
+                 (unsigned long long) files, (unsigned long long) dirs);
+   }
+   counts[ARRAYSIZE(counts) - 1] = _T('\0');
+   if (errors) {
+      _sntprintf(errs, ARRAYSIZE(errs), _T(", %llu errors"),
+                 (unsigned long long) errors);
+      errs[ARRAYSIZE(errs) - 1] = _T('\0');
+   }
+   _sntprintf(tail, ARRAYSIZE(tail), _T("  %.0f/s, %d:%02d"),
+              secs > 0 ? (double) (files + dirs) / secs : 0.0,
+              elapsed / 60, elapsed % 60);
+   tail[ARRAYSIZE(tail) - 1] = _T('\0');
+
+   if (!p->tty) {
+      _ftprintf(p->out, _T("progress: %s%s%s\n"), counts, errs, tail);
+      fflush(p->out);
+      return;
+   }
+
+   Erase(p);
+   _ftprintf(p->out, _T("deleting: %s"), counts);
+   if (errors) {
+      SetColor(p, COLOR_RED);
+      _ftprintf(p->out, _T("%s"), errs);
+   }
+   SetColor(p, COLOR_GRAY);
+   _ftprintf(p->out, _T("%s"), tail);
+   SetColor(p, COLOR_NORMAL);
+   fflush(p->out);
+   p->drawn = 10 + _tcslen(counts) + _tcslen(errs) + _tcslen(tail);
+}
+
+
+static void
+RenderMain(void *arg)  // IN
+{
+   DtProgress *p = (DtProgress *) arg;
+   int interval = p->tty ? TTY_INTERVAL_MS : PLAIN_INTERVAL_MS;
+   double next = p->begin + interval / 1000.0;
+
+   DtMutexLock(&p->lock);
+   while (!p->stop) {
+      DtCondTimedWait(&p->wake, &p->lock, interval);
+      if (p->stop || DtNow() < next) {
+         continue;
+      }
+      next = DtNow() + interval / 1000.0;
+      Draw(p);
+   }
+   DtMutexUnlock(&p->lock);
+}
+
+
+/**
+ * Start showing progress on out
+ *
+ * @param out stream the status lines go to
+ * @return the progress object, or NULL if it can't be shown
+ */
+DtProgress *
+ProgressStart(FILE *out)  // IN
+{
+   DtProgress *p = (DtProgress *) calloc(1, sizeof(DtProgress));
+
+   if (!p) {
+      return NULL;
+   }
+   p->out = out;
+   p->tty = DtIsTerminal(out);
+   p->begin = DtNow();
+#ifdef _WIN32
+   if (p->tty) {
+      CONSOLE_SCREEN_BUFFER_INFO info;
+      HANDLE h = (HANDLE) _get_osfhandle(_fileno(out));
+      if (GetConsoleScreenBufferInfo(h, &info)) {
+         p->console = h;
+         p->attrs = info.wAttributes;
+      }
+   }
+#endif
+   DtMutexInit(&p->lock);
+   DtCondInit(&p->wake);
+
+   if (!DtThreadCreate(&p->thread, RenderMain, p)) {
+      DtCondDestroy(&p->wake);
+      DtMutexDestroy(&p->lock);
+      free(p);
+      return NULL;
+   }
+   return p;
+}
+
+
+/**
+ * Count without showing anything, for ProgressTotals(). Counters
+ * attached to it show up in parent too until they are detached.
+ *
+ * @param parent progress object that also counts ours, may be NULL
+ * @return the progress object, or NULL if out of memory
+ */
+DtProgress *
+ProgressCreate(DtProgress *parent)  // IN
+{
+   DtProgress *p = (DtProgress *) calloc(1, sizeof(DtProgress));
+
+   if (!p) {
+      return NULL;
+   }
+   p->parent = parent;
+   p->begin = DtNow();
+   DtMutexInit(&p->lock);
+   DtCondInit(&p->wake);
+   return p;
+}
+
+
+/**
+ * Stop the renderer and take the line off the screen, or free one
+ * from ProgressCreate()
+ */
+void
+ProgressStop(DtProgress *p)  // IN
+{
+   if (!p) {
+      return;
+   }
+   if (p->out) {
+      DtMutexLock(&p->lock);
+      p->stop = TRUE;
+      DtCondBroadcast(&p->wake);
+      DtMutexUnlock(&p->lock);
+      DtThreadJoin(p->thread);
+      Erase(p);
+   }
+   DtCondDestroy(&p->wake);
+   DtMutexDestroy(&p->lock);
+   free(p);
+}
+
+
+/**
+ * Get zeroed counters for the n workers of a delete. Each sits on its
+ * own cache line.
+ *
+ * @param p progress object, may be NULL
+ * @param n number of workers
+ * @return n counters, or NULL if p is NULL or out of memory
+ */
+DtCounters *
+ProgressAttach(DtProgress *p,  // IN
+               int n)          // IN
+{
+   Attached *a;
+   uintptr_t addr;
+
+   if (!p || n <= 0) {
+      return NULL;
+   }
+   a = (Attached *) malloc(sizeof(Attached));
+   if (!a) {
+      return NULL;
+   }
+   a->mem = calloc(n + 1, sizeof(DtCounters));
+   if (!a->mem) {
+      free(a);
+      return NULL;
+   }
+   addr = ((uintptr_t) a->mem + sizeof(DtCounters) - 1) &
+          ~(uintptr_t) (sizeof(DtCounters) - 1);
+   a->counters = (DtCounters *) addr;
+   a->n = n;
+
+   DtMutexLock(&p->lock);
+   a->next = p->live;
+   p->live = a;
+   DtMutexUnlock(&p->lock);
+
+   if (p->parent) {
+      // the same counters, the parent just doesn't own them
+      Attached *alias = (Attached *) malloc(sizeof(Attached));
+      if (alias) {
+         *alias = *a;
+         alias->mem = NULL;
+         DtMutexLock(&p->parent->lock);
+         alias->next = p->parent->live;
+         p->parent->live = alias;
+         DtMutexUnlock(&p->parent->lock);
+      }
+   }
+   return a->counters;
+}
+
+
+// fold counters into the totals of p and forget them
+static void
+Fold(DtProgress *p,          // IN
+     DtCounters *counters)   // IN
+{
+   Attached **pa, *a;
+   int i;
+
+   DtMutexLock(&p->lock);
+   for (pa = &p->live; *pa; pa = &(*pa)->next) {
+      a = *pa;
+      if (a->counters != counters) {
+         continue;
+      }
+      for (i = 0; i < a->n; i++) {
+         p->done[0] += atomic_load(&a->counters[i].files);
+         p->done[1] += atomic_load(&a->counters[i].dirs);
+         p->done[2] += atomic_load(&a->counters[i].bytes);
+         p->done[3] += atomic_load(&a->counters[i].errors);
+      }
+      *pa = a->next;
+      free(a->mem);
+      free(a);
+      break;
+   }
+   DtMutexUnlock(&p->lock);
+}
+
+
+/**
+ * A delete is done with its counters, keep what they counted
+ */
+void
+ProgressDetach(DtProgress *p,          // IN
+               DtCounters *counters)   // IN
+{
+   if (!p || !counters) {
+      return;
+   }
+   if (p->parent) {
+      Fold(p->parent, counters);  // before p frees them
+   }
+   Fold(p, counters);
+}
+
+
+/**
+ * What everything attached so far has counted
+ */
+void
+ProgressTotals(DtProgress *p,      // IN
+               uint64_t *files,    // OUT
+               uint64_t *dirs,     // OUT
+               uint64_t *bytes,    // OUT
+               uint64_t *errors)   // OUT
+{
+   DtMutexLock(&p->lock);
+   Sample(p, files, dirs, bytes, errors);
+   DtMutexUnlock(&p->lock);
+}
+
+
+/**
+ * Take the line off the screen so something else can be printed.
+ * It stays away until ProgressResume().
+ */
+void
+ProgressSuspend(DtProgress *p)  // IN
+{
+   if (p) {
+      DtMutexLock(&p->lock);
+      p->redraw = p->drawn != 0;
+      Erase(p);
+   }
+}
+
+
+/**
+ * Put the line back after ProgressSuspend()
+ */
+void
+ProgressResume(DtProgress *p)  // IN
+{
+   if (p) {
+      if (p->tty && p->redraw) {
+         Draw(p);
+      }
+      DtMutexUnlock(&p->lock);
+   }
+}
@@ -0,0 +1,34 @@
+// progress.h
+//
+// Console progress line for native deletes.
+//
+// Each running delete attaches one DtCounters per worker. A single
+// renderer thread sums them a few times per second and redraws one
+// status line in place, in color on a console or ANSI terminal. When
+// the output is a file or a pipe it prints a plain line every few
+// seconds instead.
+//
+// Anything else printing to the same stream while the line is up must
+// do so between ProgressSuspend() and ProgressResume().
+//
+// ProgressCreate() makes one that only counts, for callers that poll
+// ProgressTotals() themselves.
+
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+
+DtProgress *ProgressStart(FILE *out);
+void        ProgressStop(DtProgress *p);
+DtProgress *ProgressCreate(DtProgress *parent);
+void        ProgressTotals(DtProgress *p, uint64_t *files, uint64_t *dirs,
+                           uint64_t *bytes, uint64_t *errors);
+
+DtCounters *ProgressAttach(DtProgress *p, int n);
+void        ProgressDetach(DtProgress *p, DtCounters *counters);
+
+void        ProgressSuspend(DtProgress *p);
+void        ProgressResume(DtProgress *p);
@@ -0,0 +1,695 @@
+// purge.c
+//
+// Implementation of the budgeted purge, see purge.h
+//
+// The second walk works like the one in scan.c, workers sharing one
+// stack of directories still to be read and opening each relative to
+// its parent. Every file gets a statx() for
+// its size and times, but only files older than the newest pick in the
+// heap (once it holds enough) go any further, and those reach the heap
+// lock in batches. On a tree that is only a little over budget almost
+// nothing does.
+//
+// A pick remembers its directory and its name. Picks are deleted by
+// their full path, which is cheaper than reopening the directories
+// above them, unless the path is too long for the system to take.
+// Then they are deleted relative to their directory like the walk
+// reads them.
+//
+
+#include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#include "purge.h"
+#include "scan.h"
+#include "fs.h"
+#include "progress.h"
+#include "rate.h"
+
+
+#define PUSH_BATCH     64    // subdirectories handed out at a time
+#define OFFER_BATCH    64    // candidates taken to the heap at once
+
+// longest path the system takes, \\?\ paths on Windows
+#ifdef _WIN32
+#define PATH_LIMIT     32767
+#else
+#define PATH_LIMIT     PATH_MAX
+#endif
+
+
+/**
+ * a file picked for purging
+ */
+typedef struct PurgeFile_ {
+   int64_t time;            // last access or last write
+   uint64_t bytes;
+   DtScanDir *dir;          // where it is, held
+   TCHAR *name;             // malloc'ed, NULL once it failed to go
+} PurgeFile;
+
+
+/**
+ * the oldest files seen so far, just enough of them to get under the
+ * budget. A max heap on time: the newest pick is on top, ready to be
+ * dropped when something older comes along.
+ */
+typedef struct PurgeHeap_ {
+   DtMutex lock;
+   PurgeFile *files;
+   size_t count;
+   size_t cap;
+   uint64_t bytes;          // size of all the picks
+   uint64_t needBytes;      // the picks must add up to this much
+   uint64_t needFiles;      // and be at least this many
+   atomic_llong cutoff;     // files this new or newer can't get in,
+                            // INT64_MAX until the heap holds enough
+} PurgeHeap;
+
+
+struct Purger_;
+
+typedef struct PurgeWorker_ {
+   struct Purger_ *pg;
+   PurgeFile batch[OFFER_BATCH];  // picks not offered to the heap yet
+   int n;
+   DtPurgeResult res;       // private counters, merged at the end
+   DtCounters *live;        // for the progress line, or NULL
+   DtThread thread;
+} PurgeWorker;
+
+
+typedef struct Purger_ {
+   DtMutex lock;            // the walk
+   DtCond wake;
+   DtScanDir *stack;        // directories nobody has picked up yet
+   int busy;                // workers reading a directory
+   Bool byMtime;
+   PurgeHeap heap;
+   atomic_size_t next;      // next pick to delete
+   DtRate *rate;            // DtPurgeOptions.rate
+   const DtFs *fs;          // DtPurgeOptions.fs, or the disk
+} Purger;
+
+
+static void
+RecordError(PurgeWorker *w,  // IN
+            int err)         // IN
+{
+   w->res.errors++;
+   w->res.lastError = err;
+}
+
+
+/*
+ * the heap of picks
+ */
+
+static void
+FreePick(PurgeFile *f)  // IN
+{
+   free(f->name);
+   ScanDirRelease(f->dir);
+}
+
+
+static Bool
+Enough(const PurgeHeap *h,  // IN
+       uint64_t bytes,      // IN
+       size_t count)        // IN
+{
+   return bytes >= h->needBytes && count >= h->needFiles;
+}
+
+
+static void
+HeapUp(PurgeFile *files,  // IN/OUT
+       size_t i)          // IN
+{
+   PurgeFile f = files[i];
+
+   while (i > 0 && files[(i - 1) / 2].time < f.time) {
+      files[i] = files[(i - 1) / 2];
+      i = (i - 1) / 2;
+   }
+   files[i] = f;
+}
+
+
+static void
+HeapDown(PurgeFile *files,  // IN/OUT
+         size_t count)      // IN
+{
+   PurgeFile f = files[0];
+   size_t i = 0, child;
+
+   while ((child = 2 * i + 1) < count) {
+      if (child + 1 < count && files[child + 1].time > files[child].time) {
+         child++;
+      }
+      if (files[child].time <= f.time) {
+         break;
+      }
+      files[i] = files[child];
+      i = child;
+   }
+   files[i] = f;
+}
+
+
+// take a batch of picks, keeping only as many as the budget needs.
+// Returns 0 or FS_ENOMEM, the picks are consumed either way.
+static int
+HeapOffer(PurgeHeap *h,      // IN/OUT
+          PurgeFile *batch,  // IN
+          int n)             // IN
+{
+   int i, err = 0;
+
+   DtMutexLock(&h->lock);
+   for (i = 0; i < n; i++) {
+      if (Enough(h, h->bytes, h->count) && batch[i].time >= h->files[0].time) {
+         FreePick(&batch[i]);  // the cutoff moved since it was picked
+         continue;
+      }
+      if (h->count == h->cap) {
+         size_t cap = h->cap ? h->cap * 2 : 1024;
+         PurgeFile *files = (PurgeFile *) realloc(h->files,
+                                                  cap * sizeof(PurgeFile));
+         if (!files) {
+            FreePick(&batch[i]);
+            err = FS_ENOMEM;
+            continue;
+         }
+         h->files = files;
+         h->cap = cap;
+      }
+      h->files[h->count] = batch[i];
+      h->bytes += batch[i].bytes;
+      HeapUp(h->files, h->count++);
+
+      // drop the newest while the rest still does the job
+      while (h->count > 0 &&
+             Enough(h, h->bytes - h->files[0].bytes, h->count - 1)) {
+         h->bytes -= h->files[0].bytes;
+         FreePick(&h->files[0]);
+         h->files[0] = h->files[--h->count];
+         HeapDown(h->files, h->count);
+      }
+   }
+   atomic_store_explicit(&h->cutoff, Enough(h, h->bytes, h->count) ?
+                         h->files[0].time : INT64_MAX, memory_order_relaxed);
+   DtMutexUnlock(&h->lock);
+
+   return err;
+}
+
+
+static void
+FlushPicks(PurgeWorker *w)  // IN
+{
+   int err;
+
+   if (w->n) {
+      err = HeapOffer(&w->pg->heap, w->batch, w->n);
+      if (err) {
+         RecordError(w, err);
+      }
+      w->n = 0;
+   }
+}
+
+
+/*
+ * the walk
+ */
+
+// hand a list of directories to the other workers
+static void
+PushItems(Purger *pg,        // IN
+          DtScanDir *first,  // IN
+          DtScanDir *last)   // IN
+{
+   DtMutexLock(&pg->lock);
+   last->next = pg->stack;
+   pg->stack = first;
+   DtCondBroadcast(&pg->wake);
+   DtMutexUnlock(&pg->lock);
+}
+
+
+// pick the files of a directory that are old enough and queue its
+// subdirectories
+static void
+PurgeDir(PurgeWorker *w,   // IN
+         DtScanDir *item)  // IN
+{
+   Purger *pg = w->pg;
+   DtScanDir *first = NULL, *last = NULL, *child;
+   int pushed = 0;
+   Bool kept = FALSE;
+   PurgeFile *f;
+   DtDir *dir;
+   DtDirent ent;
+   DtFileInfo info;
+   int64_t time;
+   int err;
+
+   err = ScanDirOpen(item, &dir);
+   if (err) {
+      if (!FS_NOT_FOUND(err)) {
+         RecordError(w, err);
+      }
+      ScanDirDone(item);
+      return;
+   }
+
+   while ((err = pg->fs->readDir(dir, &ent)) == 0) {
+      if (ent.type == FS_TYPE_DIR) {
+         if (!kept) {
+            ScanDirKeep(item, dir);
+            kept = TRUE;
+         }
+         child = ScanDirNew(pg->fs, item, ent.name, ent.nameLen);
+         if (!child) {
+            RecordError(w, FS_ENOMEM);
+            continue;
+         }
+         child->next = first;
+         first = child;
+         if (!last) {
+            last = child;
+         }
+         if (++pushed == PUSH_BATCH) {
+            PushItems(pg, first, last);
+            first = last = NULL;
+            pushed = 0;
+         }
+         continue;
+      }
+
+      err = pg->fs->entryInfo(dir, &ent, &info);
+      if (err) {
+         if (!FS_NOT_FOUND(err)) {
+            RecordError(w, err);
+         }
+         continue;
+      }
+      time = pg->byMtime ? info.mtime : info.atime;
+      if (time >= atomic_load_explicit(&pg->heap.cutoff,
+                                       memory_order_relaxed)) {
+         continue;  // newer than everything that has to go
+      }
+
+      f = &w->batch[w->n];
+      f->name = _tcsdup(ent.name);
+      if (!f->name) {
+         RecordError(w, FS_ENOMEM);
+         continue;
+      }
+      ScanDirHold(item);
+      f->dir = item;
+      f->time = time;
+      f->bytes = info.bytes;
+      if (++w->n == OFFER_BATCH) {
+         FlushPicks(w);
+      }
+   }
+   if (err != FS_END) {
+      RecordError(w, err);
+   }
+   ScanDirClose(item, dir);
+
+   if (first) {
+      PushItems(pg, first, last);
+   }
+   ScanDirDone(item);
+}
+
+
+static void
+WalkMain(void *arg)  // IN
+{
+   PurgeWorker *w = (PurgeWorker *) arg;
+   Purger *pg = w->pg;
+   DtScanDir *item;
+
+   DtMutexLock(&pg->lock);
+   for (;;) {
+      while (!pg->stack && pg->busy > 0) {
+         DtCondWait(&pg->wake, &pg->lock);
+      }
+      if (!pg->stack) {
+         break;  // nothing queued and nobody can queue more
+      }
+      item = pg->stack;
+      pg->stack = item->next;
+      pg->busy++;
+      DtMutexUnlock(&pg->lock);
+
+      PurgeDir(w, item);
+
+      DtMutexLock(&pg->lock);
+      if (--pg->busy == 0 && !pg->stack) {
+         DtCondBroadcast(&pg->wake);
+      }
+   }
+   DtMutexUnlock(&pg->lock);
+
+   FlushPicks(w);
+}
+
+
+/*
+ * the purge
+ */
+
+// delete a pick, by path unless that is too long
+static int
+UnlinkPick(const PurgeFile *f)  // IN
+{
+   const DtFs *fs = f->dir->fs;
+   size_t nameLen = _tcslen(f->name);
+   DtDirent ent;
+   DtDir *dir;
+   TCHAR *path;
+   int err;
+
+   if (f->dir->pathLen + 1 + nameLen < PATH_LIMIT) {
+      path = ScanDirPath(f->dir, f->name, nameLen);
+      if (!path) {
+         return FS_ENOMEM;
+      }
+      err = fs->unlink(path);
+      free(path);
+      return err;
+   }
+
+   err = ScanDirOpen(f->dir, &dir);
+   if (!err) {
+      memset(&ent, 0, sizeof(ent));
+      ent.name = f->name;
+      ent.nameLen = nameLen;
+      ent.type = FS_TYPE_FILE;
+      err = fs->unlinkAt(dir, &ent);
+      fs->closeDir(dir);
+   }
+   return err;
+}
+
+
+// remove a directory of the walk, by path unless that is too long
+static int
+RemovePickDir(DtScanDir *sd)  // IN
+{
+   const DtFs *fs = sd->fs;
+   DtDir *parent;
+   TCHAR *path;
+   int err;
+
+   if (sd->pathLen < PATH_LIMIT) {
+      path = ScanDirPath(sd, NULL, 0);
+      if (!path) {
+         return FS_ENOMEM;
+      }
+      err = fs->removeDirAt(FS_NO_HANDLE, path);
+      free(path);
+      return err;
+   }
+
+   err = ScanDirOpen(sd->parent, &parent);
+   if (!err) {
+      err = fs->removeDirAt(fs->dirHandle(parent), sd->name);
+      fs->closeDir(parent);
+   }
+   return err;
+}
+
+
+// remove picks, oldest first, until there are none left
+static void
+DeleteMain(void *arg)  // IN
+{
+   PurgeWorker *w = (PurgeWorker *) arg;
+   PurgeHeap *h = &w->pg->heap;
+   PurgeFile *f;
+   size_t i;
+   int err;
+
+   while ((i = atomic_fetch_add(&w->pg->next, 1)) < h->count) {
+      f = &h->files[i];
+      RateOp(w->pg->rate, _tcslen(f->name));
+      err = UnlinkPick(f);
+      if (FS_NOT_FOUND(err)) {
+         // gone since the scan, nothing for us to do
+         free(f->name);
+         f->name = NULL;
+         continue;
+      }
+      if (err) {
+         RecordError(w, err);
+         free(f->name);
+         f->name = NULL;
+         if (w->live) {
+            atomic_store_explicit(&w->live->errors, w->res.errors,
+                                  memory_order_relaxed);
+         }
+         continue;
+      }
+      w->res.purgedFiles++;
+      w->res.purgedBytes += f->bytes;
+      if (w->live) {
+         atomic_store_explicit(&w->live->files, w->res.purgedFiles,
+                               memory_order_relaxed);
+         atomic_store_explicit(&w->live->bytes, w->res.purgedBytes,
+                               memory_order_relaxed);
+      }
+   }
+}
+
+
+// start threads - 1 workers on func and be the first one ourselves
+static void
+RunWorkers(PurgeWorker *workers,  // IN
+           int threads,           // IN
+           DtThreadFunc func)     // IN
+{
+   int i, started;
+
+   for (i = 1; i < threads; i++) {
+      if (!DtThreadCreate(&workers[i].thread, func, &workers[i])) {
+         break;
+      }
+   }
+   started = i;
+
+   func(&workers[0]);
+
+   for (i = 1; i < started; i++) {
+      DtThreadJoin(workers[i].thread);
+   }
+}
+
+
+static int
+ComparePicks(const void *a,  // IN
+             const void *b)  // IN
+{
+   int64_t ta = ((const PurgeFile *) a)->time;
+   int64_t tb = ((const PurgeFile *) b)->time;
+
+   return ta < tb ? -1 : ta > tb;
+}
+
+
+// deepest first, the same directories next to each other
+static int
+CompareParents(const void *a,  // IN
+               const void *b)  // IN
+{
+   const DtScanDir *pa = *(const DtScanDir * const *) a;
+   const DtScanDir *pb = *(const DtScanDir * const *) b;
+
+   if (pa->depth != pb->depth) {
+      return pa->depth > pb->depth ? -1 : 1;
+   }
+   return pa < pb ? -1 : pa > pb;
+}
+
+
+// remove the directories the purge emptied, and their parents if that
+// empties them too, but never the top
+static void
+SweepParents(PurgeWorker *w)  // IN
+{
+   PurgeHeap *h = &w->pg->heap;
+   DtScanDir **parents, *sd;
+   size_t i, n = 0;
+
+   parents = (DtScanDir **) malloc(sizeof(DtScanDir *) * (h->count + 1));
+   if (!parents) {
+      RecordError(w, FS_ENOMEM);
+      return;
+   }
+   for (i = 0; i < h->count; i++) {
+      if (h->files[i].name && h->files[i].dir->parent) {
+         parents[n++] = h->files[i].dir;
+      }
+   }
+   qsort(parents, n, sizeof(DtScanDir *), CompareParents);
+
+   for (i = 0; i < n; i++) {
+      // anything but empty is fine, it stays. A deeper one may have
+      // taken it along already, those are marked.
+      for (sd = parents[i]; sd->parent && !sd->mark; sd = sd->parent) {
+         RateOp(w->pg->rate, sd->nameLen);
+         if (RemovePickDir(sd) != 0) {
+            break;
+         }
+         sd->mark = 1;
+         w->res.dirs++;
+      }
+   }
+   if (w->live) {
+      atomic_store_explicit(&w->live->dirs, w->res.dirs,
+                            memory_order_relaxed);
+   }
+
+   free(parents);
+}
+
+
+/**
+ * Delete the least recently used files of a tree until what is left
+ * fits the budget, then the directories that left empty.
+ *
+ * @param path directory to trim, it is never removed itself
+ * @param opts budget and knobs
+ * @param res receives what was found and purged
+ * @return TRUE if everything could be read and every pick deleted
+ */
+Bool
+DtPurgeTree(const TCHAR *path,            // IN
+            const DtPurgeOptions *opts,   // IN
+            DtPurgeResult *res)           // OUT
+{
+   Purger pg;
+   PurgeHeap *h = &pg.heap;
+   PurgeWorker *workers;
+   DtScanResult scan;
+   DtCounters *live;
+   const DtFs *fs;
+   TCHAR *rootPath;
+   size_t i;
+   int t, threads, err, type;
+
+   assert(opts && res);
+   memset(res, 0, sizeof(*res));
+   fs = opts->fs ? opts->fs : FsNative();
+
+   rootPath = fs->rootPath(path);
+   if (!rootPath) {
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      return FALSE;
+   }
+   err = fs->lstatType(rootPath, &type);
+   if (!err && type != FS_TYPE_DIR) {
+      err = FS_ENOTDIR;
+   }
+   if (err) {
+      free(rootPath);
+      res->errors = 1;
+      res->lastError = err;
+      return FALSE;
+   }
+
+   threads = opts->threads > 0 ? opts->threads : DtDefaultThreads();
+
+   // first find out how far over budget we are
+   DtScanTree(rootPath, fs, threads, opts->maxBytes != DT_NO_LIMIT, &scan);
+   DtScanFree(&scan);
+   res->files = scan.files;
+   res->bytes = scan.bytes;
+
+   memset(&pg, 0, sizeof(pg));
+   if (opts->maxBytes != DT_NO_LIMIT && scan.bytes > opts->maxBytes) {
+      h->needBytes = scan.bytes - opts->maxBytes;
+   }
+   if (opts->maxFiles != DT_NO_LIMIT && scan.files > opts->maxFiles) {
+      h->needFiles = scan.files - opts->maxFiles;
+   }
+   if (!h->needBytes && !h->needFiles) {
+      free(rootPath);
+      res->errors = scan.errors;
+      res->lastError = scan.lastError;
+      return scan.errors == 0;
+   }
+
+   workers = (PurgeWorker *) calloc(threads, sizeof(PurgeWorker));
+   pg.stack = ScanDirNew(fs, NULL, rootPath, _tcslen(rootPath));
+   if (!workers || !pg.stack) {
+      free(workers);
+      free(pg.stack);
+      free(rootPath);
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      return FALSE;
+   }
+   pg.byMtime = opts->byMtime;
+   pg.rate = opts->rate;
+   pg.fs = fs;
+   atomic_init(&h->cutoff, INT64_MAX);
+   atomic_init(&pg.next, 0);
+   DtMutexInit(&pg.lock);
+   DtCondInit(&pg.wake);
+   DtMutexInit(&h->lock);
+   for (t = 0; t < threads; t++) {
+      workers[t].pg = &pg;
+   }
+
+   // then pick the oldest files that make up the difference
+   RunWorkers(workers, threads, WalkMain);
+
+   if (h->count) {
+      res->newest = h->files[0].time;
+   }
+   qsort(h->files, h->count, sizeof(PurgeFile), ComparePicks);
+
+   if (opts->simulate) {
+      res->purgedFiles = h->count;
+      res->purgedBytes = h->bytes;
+   } else {
+      live = ProgressAttach(opts->progress, threads);
+      for (t = 0; live && t < threads; t++) {
+         workers[t].live = &live[t];
+      }
+      RunWorkers(workers, threads, DeleteMain);
+      SweepParents(&workers[0]);
+      ProgressDetach(opts->progress, live);
+   }
+
+   for (t = 0; t < threads; t++) {
+      DtPurgeResult *r = &workers[t].res;
+      res->purgedFiles += r->purgedFiles;
+      res->purgedBytes += r->purgedBytes;
+      res->dirs += r->dirs;
+      res->errors += r->errors;
+      if (r->errors) {
+         res->lastError = r->lastError;
+      }
+   }
+
+   for (i = 0; i < h->count; i++) {
+      FreePick(&h->files[i]);
+   }
+   free(h->files);
+   DtMutexDestroy(&h->lock);
+   DtCondDestroy(&pg.wake);
+   DtMutexDestroy(&pg.lock);
+   free(workers);
+   free(rootPath);
+
+   return res->errors == 0;
+}
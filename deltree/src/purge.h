@@ -0,0 +1,56 @@
+// purge.h
+//
+// Trims a tree down to a size or file count budget, the way a build
+// or package cache is meant to be cleaned: the least recently used
+// files go first, and directories left empty by that go with them.
+//
+// The tree is walked twice, once to find how much is over budget and
+// once to pick what goes. The picks are kept in a heap that never
+// holds much more than what has to be deleted, so memory follows the
+// amount purged and not the size of the tree.
+
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+#include "fs.h"
+
+
+// no budget on this dimension
+#define DT_NO_LIMIT    UINT64_MAX
+
+
+/**
+ * what to keep
+ */
+typedef struct DtPurgeOptions_ {
+   uint64_t maxBytes;    // keep at most this many bytes of files
+   uint64_t maxFiles;    // and at most this many files
+   Bool byMtime;         // rank by last write instead of last access
+   Bool simulate;        // only find out what would be purged
+   int threads;          // worker threads, 0 for default
+   DtProgress *progress; // publish live counters here, may be NULL
+   DtRate *rate;         // pace unlinks and rmdirs, may be NULL
+   const DtFs *fs;       // what the tree is on, NULL for the disk
+} DtPurgeOptions;
+
+
+/**
+ * what a purge did
+ */
+typedef struct DtPurgeResult_ {
+   uint64_t files;       // files in the tree before
+   uint64_t bytes;       // and their size
+   uint64_t purgedFiles; // files removed, or that would be
+   uint64_t purgedBytes;
+   uint64_t dirs;        // directories removed because they ended up empty
+   int64_t newest;       // time of the newest file purged, nanoseconds
+                         // since 1970, 0 if none
+   uint64_t errors;      // operations that failed
+   int lastError;        // native error code of the last failure
+} DtPurgeResult;
+
+
+Bool DtPurgeTree(const TCHAR *path, const DtPurgeOptions *opts,
+                 DtPurgeResult *res);
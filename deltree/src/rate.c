@@ -0,0 +1,97 @@
+// rate.c
+//
+// Implementation of the shared rate limit, see rate.h
+//
+
+#include "rate.h"
+
+
+#define BURST_SECS     0.1   // tokens the bucket holds, in seconds worth
+
+
+/**
+ * Set up a bucket, full
+ *
+ * @param r the bucket
+ * @param opsPerSec operations per second, 0 for no cap
+ * @param bytesPerSec metadata bytes per second, 0 for no cap
+ */
+void
+RateInit(DtRate *r,             // OUT
+         double opsPerSec,      // IN
+         double bytesPerSec)    // IN
+{
+   DtMutexInit(&r->lock);
+   r->opsPerSec = opsPerSec;
+   r->bytesPerSec = bytesPerSec;
+   r->ops = opsPerSec * BURST_SECS;
+   r->bytes = bytesPerSec * BURST_SECS;
+   r->last = DtNow();
+}
+
+
+void
+RateDestroy(DtRate *r)  // IN
+{
+   DtMutexDestroy(&r->lock);
+}
+
+
+// add what accrued since the last call, up to a burst. Never less
+// than one operation's worth, or a tiny rate could never pay for one.
+static double
+Refill(double tokens,   // IN
+       double rate,     // IN
+       double secs,     // IN
+       double cost)     // IN
+{
+   double cap = rate * BURST_SECS;
+
+   if (cap < cost) {
+      cap = cost;
+   }
+   tokens += rate * secs;
+   return tokens > cap ? cap : tokens;
+}
+
+
+/**
+ * Pay for one unlink or rmdir, sleeping as long as the caps require.
+ *
+ * @param r the bucket, NULL for no limit
+ * @param nameLen length of the entry's name
+ * @return seconds slept
+ */
+double
+RateOp(DtRate *r,        // IN
+       size_t nameLen)   // IN
+{
+   double cost = (double) RATE_META_BYTES(nameLen);
+   double now, wait = 0, w;
+
+   if (!r) {
+      return 0;
+   }
+
+   DtMutexLock(&r->lock);
+   now = DtNow();
+   if (r->opsPerSec > 0) {
+      r->ops = Refill(r->ops, r->opsPerSec, now - r->last, 1) - 1;
+      if (r->ops < 0) {
+         wait = -r->ops / r->opsPerSec;
+      }
+   }
+   if (r->bytesPerSec > 0) {
+      r->bytes = Refill(r->bytes, r->bytesPerSec, now - r->last, cost) - cost;
+      if (r->bytes < 0 && (w = -r->bytes / r->bytesPerSec) > wait) {
+         wait = w;
+      }
+   }
+   r->last = now;
+   DtMutexUnlock(&r->lock);
+
+   if (wait > 0) {
+      DtSleep(wait);
+   }
+   return wait;
+}
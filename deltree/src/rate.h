@@ -0,0 +1,41 @@
+// rate.h
+//
+// A token bucket that every worker of a run shares, to cap how many
+// operations and how many bytes of metadata writes per second deltree
+// causes. A delete that would otherwise saturate a disk's journal then
+// stays at a predictable, polite pace.
+//
+// Tokens may go negative: a worker that takes more than is there
+// sleeps off its share of the debt outside the lock, so concurrent
+// workers queue up fairly without holding each other up.
+
+
+#pragma once
+
+#include "platform.h"
+
+
+// estimated metadata bytes an unlink or rmdir writes besides the
+// directory entry itself: about one inode
+#define DT_META_ENTRY  256
+
+
+/**
+ * the bucket, set up with RateInit()
+ */
+typedef struct DtRate_ {
+   DtMutex lock;
+   double opsPerSec;      // 0 for no cap
+   double bytesPerSec;    // 0 for no cap
+   double ops;            // tokens available, negative while in debt
+   double bytes;
+   double last;           // DtNow() of the last refill
+} DtRate;
+
+
+void   RateInit(DtRate *r, double opsPerSec, double bytesPerSec);
+void   RateDestroy(DtRate *r);
+double RateOp(DtRate *r, size_t nameLen);
+
+// metadata bytes RateOp() charges for an entry
+#define RATE_META_BYTES(nameLen)  (DT_META_ENTRY + (nameLen))
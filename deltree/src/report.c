@@ -0,0 +1,242 @@
+// report.c
+//
+// Implementation of the failure report, see report.h
+//
+
+#include "report.h"
+#include "fs.h"
+
+
+static const TCHAR *opNames[DT_OP_COUNT] = {
+   _T("open"), _T("unlink"), _T("rmdir"),
+};
+
+
+/**
+ * Set up an empty report
+ *
+ * @param r the report
+ * @param maxPaths paths to keep per error code, 0 to only count
+ */
+void
+ReportInit(DtReport *r,     // OUT
+           int maxPaths)    // IN
+{
+   memset(r, 0, sizeof(*r));
+   r->maxPaths = maxPaths > 0 ? maxPaths : 0;
+}
+
+
+/**
+ * Free what a report keeps, it is empty again after
+ */
+void
+ReportFree(DtReport *r)  // IN/OUT
+{
+   int i, j;
+
+   for (i = 0; i < r->ngroups; i++) {
+      for (j = 0; j < r->groups[i].npaths; j++) {
+         free(r->groups[i].paths[j].path);
+      }
+      free(r->groups[i].paths);
+   }
+   free(r->groups);
+   ReportInit(r, r->maxPaths);
+}
+
+
+// the group for err, added if there is none yet. NULL if out of memory.
+static DtReportGroup *
+FindGroup(DtReport *r,  // IN/OUT
+          int err)      // IN
+{
+   DtReportGroup *g;
+   int i;
+
+   // only a handful of distinct codes ever show up
+   for (i = 0; i < r->ngroups; i++) {
+      if (r->groups[i].err == err) {
+         return &r->groups[i];
+      }
+   }
+   g = (DtReportGroup *) realloc(r->groups,
+                                 sizeof(DtReportGroup) * (r->ngroups + 1));
+   if (!g) {
+      return NULL;
+   }
+   r->groups = g;
+   g = &r->groups[r->ngroups++];
+   memset(g, 0, sizeof(*g));
+   g->err = err;
+   return g;
+}
+
+
+/**
+ * Whether a failure with err would keep its path, so the caller can
+ * skip making one when it wouldn't
+ */
+Bool
+ReportWants(const DtReport *r,  // IN
+            int err)            // IN
+{
+   int i;
+
+   if (r->maxPaths == 0) {
+      return FALSE;
+   }
+   for (i = 0; i < r->ngroups; i++) {
+      if (r->groups[i].err == err) {
+         return r->groups[i].npaths < r->maxPaths;
+      }
+   }
+   return TRUE;
+}
+
+
+// keep path in g if there is room, free it otherwise
+static void
+KeepPath(const DtReport *r,   // IN
+         DtReportGroup *g,    // IN/OUT
+         DtOp op,             // IN
+         TCHAR *path)         // IN
+{
+   if (!path || g->npaths >= r->maxPaths) {
+      free(path);
+      return;
+   }
+   if (!g->paths) {
+      g->paths = (DtReportPath *) malloc(sizeof(DtReportPath) *
+                                         r->maxPaths);
+      if (!g->paths) {
+         free(path);
+         return;
+      }
+   }
+   g->paths[g->npaths].path = path;
+   g->paths[g->npaths].op = op;
+   g->npaths++;
+}
+
+
+/**
+ * Count a failure
+ *
+ * @param r the report
+ * @param op what failed
+ * @param err native error code
+ * @param path malloc'ed path it failed on, taken over, may be NULL
+ */
+void
+ReportAdd(DtReport *r,    // IN/OUT
+          DtOp op,        // IN
+          int err,        // IN
+          TCHAR *path)    // IN
+{
+   DtReportGroup *g = FindGroup(r, err);
+
+   if (!g) {
+      free(path);
+      return;
+   }
+   g->count++;
+   KeepPath(r, g, op, path);
+}
+
+
+/**
+ * Move everything from one report into another
+ *
+ * @param into report that gets it all
+ * @param from report that is empty after
+ */
+void
+ReportMerge(DtReport *into,   // IN/OUT
+            DtReport *from)   // IN/OUT
+{
+   DtReportGroup *g, *f;
+   int i, j;
+
+   for (i = 0; i < from->ngroups; i++) {
+      f = &from->groups[i];
+      g = FindGroup(into, f->err);
+      for (j = 0; j < f->npaths; j++) {
+         if (g) {
+            KeepPath(into, g, f->paths[j].op, f->paths[j].path);
+         } else {
+            free(f->paths[j].path);
+         }
+      }
+      f->npaths = 0;
+      if (g) {
+         g->count += f->count;
+      }
+   }
+   into->cascaded += from->cascaded;
+   ReportFree(from);
+}
+
+
+/**
+ * Whether any of the failures may go away if we try again
+ */
+Bool
+ReportTransient(const DtReport *r)  // IN
+{
+   int i;
+
+   for (i = 0; i < r->ngroups; i++) {
+      if (FS_TRANSIENT(r->groups[i].err)) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+/**
+ * Print the failures, the most frequent first, an indented line per
+ * error code followed by the paths kept for it
+ */
+void
+ReportPrint(FILE *out,            // IN
+            const DtReport *r)    // IN
+{
+   const DtReportGroup *g;
+   Bool *shown;
+   TCHAR msg[256];
+   int i, j, k = 0;
+
+   shown = (Bool *) calloc(r->ngroups ? r->ngroups : 1, sizeof(Bool));
+   if (!shown) {
+      return;
+   }
+   for (i = 0; i < r->ngroups; i++) {
+      // a handful of groups, picking the biggest each time will do
+      for (g = NULL, j = 0; j < r->ngroups; j++) {
+         if (!shown[j] && (!g || r->groups[j].count > g->count)) {
+            g = &r->groups[j];
+            k = j;
+         }
+      }
+      shown[k] = TRUE;
+
+      DtStrError(g->err, msg, ARRAYSIZE(msg));
+      _ftprintf(out, _T("   %s (%d): %llu time(s)\n"), msg, g->err,
+                (unsigned long long) g->count);
+      for (j = 0; j < g->npaths; j++) {
+         _ftprintf(out, _T("      %-6s %s\n"), opNames[g->paths[j].op],
+                   g->paths[j].path);
+      }
+      if (g->count > (uint64_t) g->npaths && g->npaths) {
+         _ftprintf(out, _T("      ... and %llu more\n"),
+                   (unsigned long long) (g->count - g->npaths));
+      }
+   }
+   if (r->cascaded) {
+      _ftprintf(out, _T("   %llu dir(s) not removed for failures below ")
+                     _T("them\n"), (unsigned long long) r->cascaded);
+   }
+   free(shown);
+}
@@ -0,0 +1,53 @@
+// report.h
+//
+// What went wrong in a delete, deduplicated: failures are grouped by
+// error code, and each group counts all of them but keeps the paths of
+// only the first few. A directory that can't be removed because
+// something below it failed is counted, not reported again.
+//
+// Each worker of the engine fills a report of its own, so failing
+// costs no lock, and they are merged once the delete is over.
+
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+
+/**
+ * one failure whose path was kept
+ */
+typedef struct DtReportPath_ {
+   TCHAR *path;          // below the target, the target as given
+   DtOp op;
+} DtReportPath;
+
+/**
+ * the failures with one error code
+ */
+typedef struct DtReportGroup_ {
+   int err;              // native error code
+   uint64_t count;       // all of them
+   int npaths;           // the first ones, at most DtReport.maxPaths
+   DtReportPath *paths;
+} DtReportGroup;
+
+/**
+ * the report, set up with ReportInit()
+ */
+typedef struct DtReport_ {
+   int maxPaths;         // paths kept per group
+   int ngroups;
+   DtReportGroup *groups;
+   uint64_t cascaded;    // directories left because of failures below
+} DtReport;
+
+
+void ReportInit(DtReport *r, int maxPaths);
+void ReportFree(DtReport *r);
+Bool ReportWants(const DtReport *r, int err);
+void ReportAdd(DtReport *r, DtOp op, int err, TCHAR *path);
+void ReportMerge(DtReport *into, DtReport *from);
+Bool ReportTransient(const DtReport *r);
+void ReportPrint(FILE *out, const DtReport *r);
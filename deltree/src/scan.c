@@ -0,0 +1,600 @@
+// scan.c
+//
+// Implementation of the counting tree walk, see scan.h
+//
+// Unlike the delete engine there is no ordering to preserve, so the
+// workers simply share one stack of directories still to be read.
+// Each directory costs one trip through the lock (its subdirectories
+// are pushed in a batch), files cost nothing but a counter increment.
+//
+// A directory keeps its handle for its subdirectories to be opened
+// relative to, as long as the handles all walks keep stay within the
+// filesystem's handleBudget(). One that meets the budget closes its
+// handle, and its subdirectories are reached from the closest
+// ancestor that kept one, a component at a time.
+//
+
+#include <assert.h>
+
+#include "scan.h"
+#include "engine.h"
+
+
+#define PUSH_BATCH     64    // subdirectories handed out at a time
+
+
+struct Scanner_;
+
+typedef struct ScanWorker_ {
+   struct Scanner_ *scan;
+   DtScanResult res;        // private counters, merged at the end
+   DtThread thread;
+} ScanWorker;
+
+
+typedef struct Scanner_ {
+   DtMutex lock;
+   DtCond wake;
+   DtScanDir *stack;        // directories nobody has picked up yet
+   int busy;                // workers reading a directory
+   Bool wantBytes;          // stat files for their size
+} Scanner;
+
+
+// directory handles the walks keep open, the engine counts its own
+static atomic_int openHandles;
+
+
+/*
+ * the directories of a walk
+ */
+
+// whether a name in sd is separated from its path, "/" and "C:"
+// already end in one
+static Bool
+NeedSep(const DtScanDir *sd)  // IN
+{
+   return sd->parent || sd->name[sd->nameLen - 1] != DT_PATH_SEP;
+}
+
+
+/**
+ * Allocate a directory of a walk, holding a reference on its parent
+ * for each of the counts.
+ *
+ * @param fs filesystem it is on, the parent's for all but the top
+ * @param parent directory it is in, NULL for the top
+ * @param name its name, or the full path of the top
+ * @param nameLen length of name
+ * @return the directory, or NULL if out of memory
+ */
+DtScanDir *
+ScanDirNew(const DtFs *fs,       // IN
+           DtScanDir *parent,    // IN
+           const TCHAR *name,    // IN
+           size_t nameLen)       // IN
+{
+   DtScanDir *sd;
+
+   sd = (DtScanDir *) malloc(offsetof(DtScanDir, name) +
+                             sizeof(TCHAR) * (nameLen + 1));
+   if (!sd) {
+      return NULL;
+   }
+   sd->next = NULL;
+   sd->parent = parent;
+   sd->fs = fs;
+   atomic_init(&sd->refs, 1);
+   atomic_init(&sd->walking, 1);
+   sd->handle = FS_NO_HANDLE;
+   sd->depth = parent ? parent->depth + 1 : 0;
+   sd->mark = 0;
+   sd->pathLen = parent ? parent->pathLen + NeedSep(parent) + nameLen
+                        : nameLen;
+   sd->nameLen = nameLen;
+   memcpy(sd->name, name, sizeof(TCHAR) * nameLen);
+   sd->name[nameLen] = _T('\0');
+
+   if (parent) {
+      atomic_fetch_add(&parent->refs, 1);
+      atomic_fetch_add(&parent->walking, 1);
+   }
+   return sd;
+}
+
+
+// open sd when its parent didn't keep a handle, one component at a
+// time from the closest ancestor that did (or from the top's path)
+static int
+ReopenDir(DtScanDir *sd,   // IN
+          DtHandle *h)     // OUT
+{
+   const DtFs *fs = sd->fs;
+   DtScanDir **chain, *n;
+   DtHandle cur;
+   DtDir *d;
+   int depth = 1, i, err = 0;
+
+   for (n = sd; n->parent && n->parent->handle == FS_NO_HANDLE;
+        n = n->parent) {
+      depth++;
+   }
+   chain = (DtScanDir **) malloc(sizeof(DtScanDir *) * depth);
+   if (!chain) {
+      return FS_ENOMEM;
+   }
+   for (i = depth - 1, n = sd; i >= 0; i--, n = n->parent) {
+      chain[i] = n;
+   }
+
+   cur = chain[0]->parent ? chain[0]->parent->handle : FS_NO_HANDLE;
+   for (i = 0; i < depth; i++) {
+      err = fs->openDirAt(cur, chain[i]->name, &d);
+      if (i > 0) {
+         fs->closeHandle(cur);
+      }
+      if (err) {
+         break;
+      }
+      cur = fs->dirDetach(d);
+   }
+   free(chain);
+
+   if (!err) {
+      *h = cur;
+   }
+   return err;
+}
+
+
+/**
+ * Open a directory of a walk for reading, relative to its parent's
+ * handle, or to one opened for the purpose if the parent has none.
+ *
+ * @param sd directory to open
+ * @param dir receives the open directory, for sd->fs->closeDir() or
+ *            ScanDirClose()
+ * @return 0 or native error code
+ */
+int
+ScanDirOpen(DtScanDir *sd,   // IN
+            DtDir **dir)     // OUT
+{
+   const DtFs *fs = sd->fs;
+   DtHandle h;
+   int err;
+
+   if (!sd->parent) {
+      return fs->openDirAt(FS_NO_HANDLE, sd->name, dir);
+   }
+   if (sd->parent->handle != FS_NO_HANDLE) {
+      return fs->openDirAt(sd->parent->handle, sd->name, dir);
+   }
+   err = ReopenDir(sd->parent, &h);
+   if (!err) {
+      err = fs->openDirAt(h, sd->name, dir);
+      fs->closeHandle(h);
+   }
+   return err;
+}
+
+
+/**
+ * Keep the handle of a directory being read for its subdirectories,
+ * if the budget allows. Call it before the first one is made.
+ */
+void
+ScanDirKeep(DtScanDir *sd,   // IN
+            DtDir *dir)      // IN
+{
+   if (atomic_fetch_add(&openHandles, 1) < sd->fs->handleBudget()) {
+      sd->handle = sd->fs->dirHandle(dir);
+   } else {
+      atomic_fetch_sub(&openHandles, 1);
+   }
+}
+
+
+/**
+ * Done reading a directory, close it unless it kept its handle
+ */
+void
+ScanDirClose(DtScanDir *sd,   // IN
+             DtDir *dir)      // IN
+{
+   if (sd->handle != FS_NO_HANDLE) {
+      sd->fs->dirDetach(dir);
+   } else {
+      sd->fs->closeDir(dir);
+   }
+}
+
+
+/**
+ * Done with a directory and all of its subdirectories that were made.
+ * The last of those closes the handle and lets the parent know.
+ */
+void
+ScanDirDone(DtScanDir *sd)  // IN
+{
+   DtScanDir *parent;
+
+   while (sd && atomic_fetch_sub(&sd->walking, 1) == 1) {
+      parent = sd->parent;
+      if (sd->handle != FS_NO_HANDLE) {
+         sd->fs->closeHandle(sd->handle);
+         sd->handle = FS_NO_HANDLE;
+         atomic_fetch_sub(&openHandles, 1);
+      }
+      ScanDirRelease(sd);
+      sd = parent;
+   }
+}
+
+
+/**
+ * Keep a directory in memory after the walk is done with it, eg. for
+ * files picked in it. Drop it with ScanDirRelease().
+ */
+void
+ScanDirHold(DtScanDir *sd)  // IN
+{
+   atomic_fetch_add(&sd->refs, 1);
+}
+
+
+/**
+ * Drop a reference, the last one frees sd and drops one on its parent
+ */
+void
+ScanDirRelease(DtScanDir *sd)  // IN
+{
+   DtScanDir *parent;
+
+   while (sd && atomic_fetch_sub(&sd->refs, 1) == 1) {
+      parent = sd->parent;
+      free(sd);
+      sd = parent;
+   }
+}
+
+
+/**
+ * Spell out the full path of name in sd, or of sd itself. Only for
+ * reports and for paths short enough to hand to the system, a walk
+ * never needs one.
+ *
+ * @param sd directory
+ * @param name entry in it, or NULL for sd
+ * @param nameLen length of name
+ * @return malloc'ed path, or NULL if out of memory
+ */
+TCHAR *
+ScanDirPath(const DtScanDir *sd,  // IN
+            const TCHAR *name,    // IN
+            size_t nameLen)       // IN
+{
+   size_t len = sd->pathLen;
+   TCHAR *path;
+
+   if (name) {
+      len += NeedSep(sd) + nameLen;
+   }
+   path = (TCHAR *) malloc(sizeof(TCHAR) * (len + 1));
+   if (!path) {
+      return NULL;
+   }
+   if (name) {
+      if (NeedSep(sd)) {
+         path[sd->pathLen] = DT_PATH_SEP;
+      }
+      memcpy(path + len - nameLen, name, sizeof(TCHAR) * nameLen);
+   }
+   for (; sd; sd = sd->parent) {
+      memcpy(path + sd->pathLen - sd->nameLen, sd->name,
+             sizeof(TCHAR) * sd->nameLen);
+      if (sd->parent && NeedSep(sd->parent)) {
+         path[sd->parent->pathLen] = DT_PATH_SEP;
+      }
+   }
+   path[len] = _T('\0');
+
+   return path;
+}
+
+
+/*
+ * the scan
+ */
+
+static void
+RecordError(ScanWorker *w,  // IN
+            int err)        // IN
+{
+   w->res.errors++;
+   w->res.lastError = err;
+}
+
+
+// remember dir + name if it is deeper than anything seen so far
+static void
+RecordDepth(ScanWorker *w,          // IN
+            const DtScanDir *dir,   // IN
+            const DtDirent *ent)    // IN
+{
+   TCHAR *path;
+
+   if (dir->depth + 1 <= w->res.maxDepth) {
+      return;
+   }
+   path = ScanDirPath(dir, ent->name, ent->nameLen);
+   if (path) {
+      free(w->res.deepest);
+      w->res.deepest = path;
+      w->res.maxDepth = dir->depth + 1;
+   }
+}
+
+
+// hand a list of directories to the other workers
+static void
+PushItems(Scanner *scan,     // IN
+          DtScanDir *first,  // IN
+          DtScanDir *last)   // IN
+{
+   DtMutexLock(&scan->lock);
+   last->next = scan->stack;
+   scan->stack = first;
+   DtCondBroadcast(&scan->wake);
+   DtMutexUnlock(&scan->lock);
+}
+
+
+// count everything in a directory and queue its subdirectories
+static void
+ScanDir(ScanWorker *w,   // IN
+        DtScanDir *item) // IN
+{
+   DtScanDir *first = NULL, *last = NULL, *child;
+   int pushed = 0;
+   Bool kept = FALSE;
+   DtDir *dir;
+   DtDirent ent;
+   uint64_t bytes;
+   int err;
+
+   err = ScanDirOpen(item, &dir);
+   if (err) {
+      RecordError(w, err);
+      ScanDirDone(item);
+      return;
+   }
+   w->res.dirs++;
+
+   while ((err = item->fs->readDir(dir, &ent)) == 0) {
+      RecordDepth(w, item, &ent);
+      if (ent.type != FS_TYPE_DIR) {
+         w->res.files++;
+         if (w->scan->wantBytes) {
+            bytes = 0;
+            err = item->fs->entrySize(dir, &ent, &bytes);
+            if (err) {
+               RecordError(w, err);
+            }
+            w->res.bytes += bytes;
+         }
+         continue;
+      }
+
+      if (!kept) {
+         ScanDirKeep(item, dir);
+         kept = TRUE;
+      }
+      child = ScanDirNew(item->fs, item, ent.name, ent.nameLen);
+      if (!child) {
+         RecordError(w, FS_ENOMEM);
+         continue;
+      }
+      child->next = first;
+      first = child;
+      if (!last) {
+         last = child;
+      }
+      if (++pushed == PUSH_BATCH) {
+         // a huge directory shouldn't keep everybody else waiting
+         PushItems(w->scan, first, last);
+         first = last = NULL;
+         pushed = 0;
+      }
+   }
+   if (err != FS_END) {
+      RecordError(w, err);
+   }
+   ScanDirClose(item, dir);
+
+   if (first) {
+      PushItems(w->scan, first, last);
+   }
+   ScanDirDone(item);
+}
+
+
+static void
+WorkerMain(void *arg)  // IN
+{
+   ScanWorker *w = (ScanWorker *) arg;
+   Scanner *scan = w->scan;
+   DtScanDir *item;
+
+   DtMutexLock(&scan->lock);
+   for (;;) {
+      while (!scan->stack && scan->busy > 0) {
+         DtCondWait(&scan->wake, &scan->lock);
+      }
+      if (!scan->stack) {
+         break;  // nothing queued and nobody can queue more
+      }
+      item = scan->stack;
+      scan->stack = item->next;
+      scan->busy++;
+      DtMutexUnlock(&scan->lock);
+
+      ScanDir(w, item);
+
+      DtMutexLock(&scan->lock);
+      if (--scan->busy == 0 && !scan->stack) {
+         DtCondBroadcast(&scan->wake);
+      }
+   }
+   DtMutexUnlock(&scan->lock);
+}
+
+
+/**
+ * Count the files, directories and optionally bytes below path.
+ *
+ * @param path file or directory to scan
+ * @param fs filesystem it is on, NULL for the disk
+ * @param threads number of worker threads, 0 for default
+ * @param wantBytes also add up file sizes, which costs a stat per file
+ *                  on POSIX
+ * @param res receives the totals, release with DtScanFree()
+ * @return TRUE if everything could be read
+ */
+Bool
+DtScanTree(const TCHAR *path,   // IN
+           const DtFs *fs,      // IN
+           int threads,         // IN
+           Bool wantBytes,      // IN
+           DtScanResult *res)   // OUT
+{
+   Scanner scan;
+   ScanWorker *workers;
+   TCHAR *rootPath;
+   size_t rootLen;
+   int i, err, type, started;
+
+   assert(res);
+   memset(res, 0, sizeof(*res));
+   if (!fs) {
+      fs = FsNative();
+   }
+
+   rootPath = fs->rootPath(path);
+   if (!rootPath) {
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      return FALSE;
+   }
+   rootLen = _tcslen(rootPath);
+
+   err = fs->lstatType(rootPath, &type);
+   if (!err && type != FS_TYPE_DIR) {
+      res->files = 1;
+      if (wantBytes) {
+         err = fs->pathSize(rootPath, &res->bytes);
+      }
+   }
+   if (err || type != FS_TYPE_DIR) {
+      if (err) {
+         res->errors = 1;
+         res->lastError = err;
+      }
+      free(rootPath);
+      return err == 0;
+   }
+
+   if (threads <= 0) {
+      threads = DtDefaultThreads();
+   }
+   workers = (ScanWorker *) calloc(threads, sizeof(ScanWorker));
+   memset(&scan, 0, sizeof(scan));
+   scan.stack = ScanDirNew(fs, NULL, rootPath, rootLen);
+   if (!workers || !scan.stack) {
+      free(workers);
+      free(scan.stack);
+      free(rootPath);
+      res->errors = 1;
+      res->lastError = FS_ENOMEM;
+      return FALSE;
+   }
+   scan.wantBytes = wantBytes;
+   DtMutexInit(&scan.lock);
+   DtCondInit(&scan.wake);
+
+   for (i = 0; i < threads; i++) {
+      workers[i].scan = &scan;
+   }
+
+   // the calling thread is worker 0
+   for (i = 1; i < threads; i++) {
+      if (!DtThreadCreate(&workers[i].thread, WorkerMain, &workers[i])) {
+         break;
+      }
+   }
+   started = i;
+
+   WorkerMain(&workers[0]);
+
+   for (i = 1; i < started; i++) {
+      DtThreadJoin(workers[i].thread);
+   }
+
+   for (i = 0; i < threads; i++) {
+      DtScanResult *r = &workers[i].res;
+      res->files += r->files;
+      res->dirs += r->dirs;
+      res->bytes += r->bytes;
+      res->errors += r->errors;
+      if (r->errors) {
+         res->lastError = r->lastError;
+      }
+      if (r->maxDepth > res->maxDepth) {
+         free(res->deepest);
+         res->deepest = r->deepest;
+         res->maxDepth = r->maxDepth;
+      } else {
+         free(r->deepest);
+      }
+   }
+
+   // show the deepest path the way the user spelled the top
+   if (res->deepest) {
+      const TCHAR *rest = res->deepest + rootLen;
+      size_t len = _tcslen(path), restLen = _tcslen(rest);
+      Bool pathSep = len > 0 && path[len - 1] == DT_PATH_SEP;
+      Bool restSep = rest[0] == DT_PATH_SEP;
+      TCHAR *p = (TCHAR *) malloc(sizeof(TCHAR) * (len + restLen + 2));
+
+      if (p) {
+         memcpy(p, path, sizeof(TCHAR) * len);
+         if (pathSep && restSep) {
+            rest++;
+            restLen--;
+         } else if (!pathSep && !restSep) {
+            p[len++] = DT_PATH_SEP;
+         }
+         memcpy(p + len, rest, sizeof(TCHAR) * (restLen + 1));
+         free(res->deepest);
+         res->deepest = p;
+      }
+   }
+
+   DtCondDestroy(&scan.wake);
+   DtMutexDestroy(&scan.lock);
+   free(workers);
+   free(rootPath);
+
+   return res->errors == 0;
+}
+
+
+/**
+ * Release what DtScanTree() allocated
+ */
+void
+DtScanFree(DtScanResult *res)  // IN
+{
+   free(res->deepest);
+   res->deepest = NULL;
+}
@@ -0,0 +1,74 @@
+// scan.h
+//
+// Parallel, read-only walk of a tree that counts what a delete would
+// remove. It uses the same primitives as the delete engine, so entry
+// types come from the directory listing (d_type) and nothing is
+// stat'ed unless byte totals are asked for. That keeps it cheap enough
+// to run ahead of a real delete, eg. to estimate how long it will take.
+//
+// Directories are opened relative to their parent's handle, as in the
+// engine, so a tree deeper than a path can spell is read all the way
+// down. The purge walks the same way, with the DtScanDir helpers below.
+// Both go through a DtFs table like the engine, so they run on the
+// in-memory filesystem too.
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include "platform.h"
+#include "fs.h"
+
+
+/**
+ * what a scan found
+ */
+typedef struct DtScanResult_ {
+   uint64_t files;       // files (and links)
+   uint64_t dirs;        // directories, including the top one
+   uint64_t bytes;       // total file size, if asked for
+   uint64_t errors;      // directories or entries we couldn't read
+   int lastError;        // native error code of the last failure
+   int maxDepth;         // levels below the top of the deepest entry
+   TCHAR *deepest;       // path of the deepest entry, or NULL
+} DtScanResult;
+
+
+Bool DtScanTree(const TCHAR *path, const DtFs *fs, int threads,
+                Bool wantBytes, DtScanResult *res);
+void DtScanFree(DtScanResult *res);
+
+
+/**
+ * a directory of a walk, named relative to its parent. A child keeps
+ * its parent in memory, and the parent's handle open until the child
+ * is read, along with all of the child's subdirectories.
+ */
+typedef struct DtScanDir_ {
+   struct DtScanDir_ *next;     // on the stack of directories to read
+   struct DtScanDir_ *parent;   // NULL for the top
+   const DtFs *fs;              // what it is on
+   atomic_int refs;             // keep it in memory: the walk's, one per
+                                // child and any ScanDirHold()
+   atomic_int walking;          // keep the handle: its own read and one
+                                // per child that isn't done yet
+   DtHandle handle;             // kept for the children, or FS_NO_HANDLE
+   int depth;                   // levels below the top
+   int mark;                    // for the caller, 0 to start with
+   size_t pathLen;              // length of the full path
+   size_t nameLen;
+   TCHAR name[1];               // the whole path for the top
+} DtScanDir;
+
+
+DtScanDir *ScanDirNew(const DtFs *fs, DtScanDir *parent, const TCHAR *name,
+                      size_t nameLen);
+int        ScanDirOpen(DtScanDir *sd, DtDir **dir);
+void       ScanDirKeep(DtScanDir *sd, DtDir *dir);
+void       ScanDirClose(DtScanDir *sd, DtDir *dir);
+void       ScanDirDone(DtScanDir *sd);
+void       ScanDirHold(DtScanDir *sd);
+void       ScanDirRelease(DtScanDir *sd);
+TCHAR     *ScanDirPath(const DtScanDir *sd, const TCHAR *name,
+                       size_t nameLen);
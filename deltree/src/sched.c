@@ -0,0 +1,290 @@
+// sched.c
+//
+// Implementation of the multi target scheduler, see sched.h
+//
+
+#include <stdatomic.h>
+
+#include "sched.h"
+#include "engine.h"
+#include "fs.h"
+
+
+// paths compare case insensitively on Windows
+#ifdef _WIN32
+#define FOLD(c)        _totlower(c)
+#else
+#define FOLD(c)        (c)
+#endif
+
+/**
+ * the jobs on one device
+ */
+typedef struct SchedGroup_ {
+   uint64_t dev;         // device id from FsDeviceId()
+   int *jobs;            // indexes into the job array, argument order
+   int count;            // number of jobs
+   int slots;            // how many of them may run at once
+   atomic_int next;      // next job to hand out
+} SchedGroup;
+
+/**
+ * one thread working through the jobs of a group
+ */
+typedef struct SchedRunner_ {
+   DtJob *jobs;
+   SchedGroup *group;
+   DtJobFunc func;
+   void *ctx;
+   DtThread thread;
+   Bool started;
+} SchedRunner;
+
+
+// order paths so everything inside a directory sorts right after
+// it: the separator compares lower than any other character, which
+// keeps "a", "a\b" together ahead of "a-b"
+static int
+PathCompare(const void *a,  // IN
+            const void *b)  // IN
+{
+   const DtJob *ja = *(const DtJob **) a;
+   const DtJob *jb = *(const DtJob **) b;
+   const TCHAR *p = ja->fullPath, *q = jb->fullPath;
+   int cp, cq;
+
+   for (;; p++, q++) {
+      cp = *p == DT_PATH_SEP ? 1 : FOLD(*p);
+      cq = *q == DT_PATH_SEP ? 1 : FOLD(*q);
+      if (cp != cq) {
+         return cp < cq ? -1 : 1;
+      }
+      if (cp == 0) {
+         break;
+      }
+   }
+   // same path given twice, the first one wins
+   return ja->index - jb->index;
+}
+
+
+// true if inner is outer or lies somewhere below it
+static Bool
+IsInside(const TCHAR *outer,  // IN
+         const TCHAR *inner)  // IN
+{
+   size_t i;
+
+   for (i = 0; outer[i]; i++) {
+      if (FOLD(outer[i]) != FOLD(inner[i])) {
+         return FALSE;
+      }
+   }
+   return inner[i] == _T('\0') || inner[i] == DT_PATH_SEP ||
+          (i > 0 && outer[i - 1] == DT_PATH_SEP);  // outer is a root
+}
+
+
+/**
+ * Find out where each target lives and which targets are already
+ * covered by another one.
+ *
+ * @param jobs targets, path and index filled in
+ * @param n number of jobs
+ */
+void
+SchedPrepare(DtJob *jobs,  // IN/OUT
+             int n)        // IN
+{
+   DtJob **sorted;
+   DtJob *outer = NULL;
+   int i, k = 0;
+
+   for (i = 0; i < n; i++) {
+      jobs[i].fullPath = FsFullPath(jobs[i].path);
+      jobs[i].coveredBy = -1;
+      jobs[i].dev = 0;
+      FsDeviceId(jobs[i].path, &jobs[i].dev);
+   }
+
+   // without the memory to sort, every target just runs on its own
+   sorted = (DtJob **) malloc(sizeof(DtJob *) * n);
+   if (!sorted) {
+      return;
+   }
+   for (i = 0; i < n; i++) {
+      if (jobs[i].fullPath) {
+         sorted[k++] = &jobs[i];
+      }
+   }
+   qsort(sorted, k, sizeof(DtJob *), PathCompare);
+
+   for (i = 0; i < k; i++) {
+      if (outer && IsInside(outer->fullPath, sorted[i]->fullPath)) {
+         sorted[i]->coveredBy = (int) (outer - jobs);
+      } else {
+         outer = sorted[i];
+      }
+   }
+   free(sorted);
+}
+
+
+static void
+RunnerMain(void *arg)  // IN
+{
+   SchedRunner *r = (SchedRunner *) arg;
+   int i;
+
+   while ((i = atomic_fetch_add(&r->group->next, 1)) < r->group->count) {
+      r->func(&r->jobs[r->group->jobs[i]], r->ctx);
+   }
+}
+
+
+/**
+ * Run func on every job that isn't covered by another one and wait
+ * for all of them.
+ *
+ * @param jobs targets, after SchedPrepare()
+ * @param n number of jobs
+ * @param perDevice most jobs running at once on one device
+ * @param maxJobs most jobs running at once overall, 0 for no limit
+ * @param threads worker threads the user asked for, 0 for default
+ * @param func does the delete
+ * @param ctx passed to func
+ */
+void
+SchedRun(DtJob *jobs,       // IN/OUT
+         int n,             // IN
+         int perDevice,     // IN
+         int maxJobs,       // IN
+         int threads,       // IN
+         DtJobFunc func,    // IN
+         void *ctx)         // IN
+{
+   SchedGroup *groups;
+   SchedRunner *runners = NULL;
+   int *order;           // job indexes grouped by device
+   int numGroups = 0, total = 0, round, i, g, r;
+   Bool more;
+
+   groups = (SchedGroup *) calloc(n, sizeof(SchedGroup));
+   order = (int *) calloc(n, sizeof(int));
+   if (!groups || !order) {
+      goto sequential;
+   }
+
+   // group the remaining jobs by device, keeping argument order
+   for (i = 0; i < n; i++) {
+      if (jobs[i].coveredBy >= 0) {
+         continue;
+      }
+      for (g = 0; g < numGroups && groups[g].dev != jobs[i].dev; g++) {
+      }
+      if (g == numGroups) {
+         groups[g].dev = jobs[i].dev;
+         numGroups++;
+      }
+      groups[g].count++;
+   }
+
+   // lay the job lists out back to back in order
+   for (g = 0, i = 0; g < numGroups; i += groups[g].count, g++) {
+      groups[g].jobs = order + i;
+      groups[g].count = 0;
+   }
+   for (i = 0; i < n; i++) {
+      if (jobs[i].coveredBy >= 0) {
+         continue;
+      }
+      for (g = 0; groups[g].dev != jobs[i].dev; g++) {
+      }
+      groups[g].jobs[groups[g].count++] = i;
+   }
+
+   // hand out slots round robin so a busy device can't use up maxJobs
+   for (round = 0, more = TRUE; round < perDevice && more; round++) {
+      more = FALSE;
+      for (g = 0; g < numGroups; g++) {
+         if (round < groups[g].count && (maxJobs <= 0 || total < maxJobs)) {
+            groups[g].slots++;
+            total++;
+            more = TRUE;
+         }
+      }
+   }
+
+   if (total <= 1) {
+      goto sequential;
+   }
+
+   runners = (SchedRunner *) calloc(total, sizeof(SchedRunner));
+   if (!runners) {
+      goto sequential;
+   }
+
+   // each delete gets its share of the worker threads we would have
+   // used for a single one, unless the user said how many
+   if (threads == 0) {
+      threads = DtDefaultThreads() / total;
+      if (threads < 2) {
+         threads = 2;
+      }
+   }
+   for (i = 0; i < n; i++) {
+      jobs[i].threads = threads;
+      jobs[i].alone = FALSE;
+   }
+
+   for (g = 0, r = 0; g < numGroups; g++) {
+      for (i = 0; i < groups[g].slots; i++, r++) {
+         runners[r].jobs = jobs;
+         runners[r].group = &groups[g];
+         runners[r].func = func;
+         runners[r].ctx = ctx;
+         runners[r].started = DtThreadCreate(&runners[r].thread,
+                                             RunnerMain, &runners[r]);
+         if (!runners[r].started) {
+            RunnerMain(&runners[r]);  // out of threads, do it ourselves
+         }
+      }
+   }
+   for (r = 0; r < total; r++) {
+      if (runners[r].started) {
+         DtThreadJoin(runners[r].thread);
+      }
+   }
+   goto exit;
+
+sequential:
+   // one at a time in argument order, with the whole machine
+   for (i = 0; i < n; i++) {
+      if (jobs[i].coveredBy < 0) {
+         jobs[i].threads = threads;
+         jobs[i].alone = TRUE;
+         func(&jobs[i], ctx);
+      }
+   }
+
+exit:
+   free(runners);
+   free(order);
+   free(groups);
+}
+
+
+/**
+ * Release what SchedPrepare() allocated
+ */
+void
+SchedFree(DtJob *jobs,  // IN
+          int n)        // IN
+{
+   int i;
+
+   for (i = 0; i < n; i++) {
+      free(jobs[i].fullPath);
+      jobs[i].fullPath = NULL;
+   }
+}
@@ -0,0 +1,39 @@
+// sched.h
+//
+// Runs the deletes of several command line targets concurrently.
+//
+// Targets are grouped by the device they live on and each device gets
+// at most a fixed number of deletes at a time, so two trees on one
+// disk don't fight over it while a tree on another disk proceeds in
+// parallel. A target inside another one (or given twice) is not run
+// at all, it goes away with the outer one.
+
+
+#pragma once
+
+#include "platform.h"
+
+
+/**
+ * one target to delete
+ */
+typedef struct DtJob_ {
+   const TCHAR *path;    // as given on the command line
+   int index;            // position in the argument list, 1 based
+   TCHAR *fullPath;      // absolute path, to find overlapping targets
+   uint64_t dev;         // device the target lives on
+   int coveredBy;        // job that deletes this one too, or -1
+   int threads;          // worker threads to use, 0 for default
+   Bool alone;           // no other job runs concurrently
+   Bool ok;              // set by the job function
+   Bool partial;         // and this if some of it was removed anyway
+} DtJob;
+
+// deletes job->path, called on a scheduler thread
+typedef void (*DtJobFunc)(DtJob *job, void *ctx);
+
+
+void SchedPrepare(DtJob *jobs, int n);
+void SchedRun(DtJob *jobs, int n, int perDevice, int maxJobs,
+              int threads, DtJobFunc func, void *ctx);
+void SchedFree(DtJob *jobs, int n);
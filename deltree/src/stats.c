@@ -0,0 +1,313 @@
+// stats.c
+//
+// Implementation of the --stats output, see stats.h
+//
+
+#include "stats.h"
+
+
+static const TCHAR *phaseNames[DT_PHASE_COUNT] = {
+   _T("enumerate"), _T("unlink"), _T("rmdir"), _T("throttle"), _T("wait"),
+};
+
+static const TCHAR *opNames[DT_OP_COUNT] = {
+   _T("opendir"), _T("unlink"), _T("rmdir"),
+};
+
+static const TCHAR *tuneReasons[] = {
+   _T("gain"), _T("latency"), _T("loss"),
+};
+
+
+/**
+ * Format a byte count for people, eg. "1.4 GB"
+ *
+ * @param bytes the count
+ * @param buf output buffer
+ * @param size buffer size in characters
+ */
+void
+StatsFormatBytes(uint64_t bytes,  // IN
+                 TCHAR *buf,      // OUT
+                 size_t size)     // IN
+{
+   static const TCHAR *units[] = { _T("KB"), _T("MB"), _T("GB"), _T("TB"),
+                                   _T("PB") };
+   double n = (double) bytes;
+   int u = -1;
+
+   while (n >= 1024 && u + 1 < (int) ARRAYSIZE(units)) {
+      n /= 1024;
+      u++;
+   }
+   if (u < 0) {
+      _sntprintf(buf, size, _T("%llu bytes"), (unsigned long long) bytes);
+   } else {
+      _sntprintf(buf, size, _T("%.1f %s"), n, units[u]);
+   }
+   buf[size - 1] = _T('\0');
+}
+
+
+// number of operations in a histogram
+static uint64_t
+HistCount(const uint64_t *hist)  // IN
+{
+   uint64_t n = 0;
+   int b;
+
+   for (b = 0; b < DT_HIST_BUCKETS; b++) {
+      n += hist[b];
+   }
+   return n;
+}
+
+
+// upper bound in microseconds of the bucket holding the pct'th
+// percentile, 0 if there are no operations
+static uint64_t
+HistPercentile(const uint64_t *hist,  // IN
+               double pct)            // IN
+{
+   uint64_t total = HistCount(hist), seen = 0;
+   int b;
+
+   if (total == 0) {
+      return 0;
+   }
+   for (b = 0; b < DT_HIST_BUCKETS - 1; b++) {
+      seen += hist[b];
+      if ((double) seen >= total * pct / 100) {
+         break;
+      }
+   }
+   return (uint64_t) 1 << b;
+}
+
+
+static double
+PerSecond(uint64_t n,    // IN
+          double secs)   // IN
+{
+   return secs > 0 ? (double) n / secs : 0;
+}
+
+
+/**
+ * Print a readable summary of every target that was run
+ *
+ * @param out where to print
+ * @param items one per command line target
+ * @param n number of items
+ */
+void
+StatsPrintText(FILE *out,                 // IN
+               const DtItemStats *items,  // IN
+               int n)                     // IN
+{
+   TCHAR size[32], rate[32], meta[32];
+   int i, p, op, s;
+
+   for (i = 0; i < n; i++) {
+      const DtItemStats *it = &items[i];
+      const DtResult *r = &it->res;
+
+      if (!it->status || it->coveredBy) {
+         continue;
+      }
+      StatsFormatBytes(r->bytes, size, ARRAYSIZE(size));
+      StatsFormatBytes((uint64_t) PerSecond(r->bytes, it->secs),
+                       rate, ARRAYSIZE(rate));
+      StatsFormatBytes((uint64_t) PerSecond(r->metaBytes, it->secs),
+                       meta, ARRAYSIZE(meta));
+      _ftprintf(out, _T("\n%s: %s, %llu files, %llu dirs, %s, %llu errors ")
+                     _T("in %.3fs\n"),
+                it->path, it->status, (unsigned long long) r->files,
+                (unsigned long long) r->dirs, size,
+                (unsigned long long) r->errors, it->secs);
+      _ftprintf(out, _T("   %.0f ops/s, %s/s, metadata %s/s\n"),
+                PerSecond(r->files + r->dirs, it->secs), rate, meta);
+
+      if (r->tuneSteps) {
+         int first = r->tuneSteps > DT_TUNE_LOG ?
+                     r->tuneSteps - DT_TUNE_LOG : 0;
+         _ftprintf(out, _T("   workers: %d, tuned in %d steps%s\n"),
+                   r->workers, r->tuneSteps,
+                   first ? _T(", the last ones:") : _T(""));
+         for (s = first; s < r->tuneSteps; s++) {
+            const DtTuneStep *st = &r->tune[s % DT_TUNE_LOG];
+            _ftprintf(out, _T("     %7.2fs %3d -> %-3d %-8s %9.0f ops/s")
+                           _T("  p99 %uus\n"),
+                      st->secs, st->from, st->to, tuneReasons[st->reason],
+                      st->opsPerSec, (unsigned) st->p99us);
+         }
+      } else if (r->workers) {
+         _ftprintf(out, _T("   workers: %d\n"), r->workers);
+      }
+      if (r->workers) {
+         _ftprintf(out, _T("   unlink order: %s\n"),
+                   r->inodeOrder ? _T("inode") : _T("directory"));
+      }
+      if (r->rescans) {
+         _ftprintf(out, _T("   directories read again: %llu\n"),
+                   (unsigned long long) r->rescans);
+      }
+      if (r->resumed) {
+         _ftprintf(out, _T("   directories resumed: %llu\n"),
+                   (unsigned long long) r->resumed);
+      }
+      if (r->retries) {
+         _ftprintf(out, _T("   passes over what was left: %d\n"),
+                   r->retries);
+      }
+      if (r->leftFiles || r->leftDirs) {
+         StatsFormatBytes(r->leftBytes, size, ARRAYSIZE(size));
+         _ftprintf(out, _T("   left behind: %llu files, %llu dirs, %s\n"),
+                   (unsigned long long) r->leftFiles,
+                   (unsigned long long) r->leftDirs, size);
+      }
+      _ftprintf(out, _T("   thread time:"));
+      for (p = 0; p < DT_PHASE_COUNT; p++) {
+         _ftprintf(out, _T("%s %s %.3fs"), p ? _T(",") : _T(""),
+                   phaseNames[p], r->phase[p]);
+      }
+      _ftprintf(out, _T("\n   %-12s %10s %8s %8s\n"),
+                _T("latency (us)"), _T("count"), _T("p50"), _T("p99"));
+      for (op = 0; op < DT_OP_COUNT; op++) {
+         _ftprintf(out, _T("   %-12s %10llu %8llu %8llu\n"), opNames[op],
+                   (unsigned long long) HistCount(r->hist[op]),
+                   (unsigned long long) HistPercentile(r->hist[op], 50),
+                   (unsigned long long) HistPercentile(r->hist[op], 99));
+      }
+   }
+}
+
+
+// print s as a JSON string
+static void
+JsonString(FILE *out,        // IN
+           const TCHAR *s)   // IN
+{
+   _ftprintf(out, _T("\""));
+   for (; *s; s++) {
+      if (*s == _T('"') || *s == _T('\\')) {
+         _ftprintf(out, _T("\\%c"), *s);
+      } else if ((unsigned) *s < 0x20) {
+         _ftprintf(out, _T("\\u%04x"), (unsigned) *s);
+      } else {
+         _ftprintf(out, _T("%c"), *s);
+      }
+   }
+   _ftprintf(out, _T("\""));
+}
+
+
+/**
+ * Print everything as one JSON document
+ *
+ * @param out where to print
+ * @param version deltree version
+ * @param engine name of the engine used
+ * @param items one per command line target
+ * @param n number of items
+ * @param secs wall time of the whole run
+ */
+void
+StatsPrintJson(FILE *out,                 // IN
+               const TCHAR *version,      // IN
+               const TCHAR *engine,       // IN
+               const DtItemStats *items,  // IN
+               int n,                     // IN
+               double secs)               // IN
+{
+   int i, p, op, b, s;
+
+   _ftprintf(out, _T("{\n \"version\": "));
+   JsonString(out, version);
+   _ftprintf(out, _T(",\n \"engine\": "));
+   JsonString(out, engine);
+   _ftprintf(out, _T(",\n \"wall_s\": %.6f,\n"), secs);
+
+   // bucket bounds once, every histogram below uses them
+   _ftprintf(out, _T(" \"latency_buckets_us\": ["));
+   for (b = 0; b < DT_HIST_BUCKETS; b++) {
+      _ftprintf(out, _T("%s%llu"), b ? _T(", ") : _T(""),
+                (unsigned long long) 1 << b);
+   }
+   _ftprintf(out, _T("],\n \"targets\": ["));
+
+   for (i = 0; i < n; i++) {
+      const DtItemStats *it = &items[i];
+      const DtResult *r = &it->res;
+
+      _ftprintf(out, _T("%s\n  {\"path\": "), i ? _T(",") : _T(""));
+      JsonString(out, it->path);
+      _ftprintf(out, _T(", \"status\": "));
+      JsonString(out, it->status ? it->status : _T("skipped"));
+      if (it->coveredBy) {
+         _ftprintf(out, _T(", \"covered_by\": "));
+         JsonString(out, it->coveredBy);
+      }
+      if (!it->status || it->coveredBy) {
+         _ftprintf(out, _T("}"));
+         continue;
+      }
+
+      _ftprintf(out, _T(",\n   \"error\": %d, \"wall_s\": %.6f, ")
+                     _T("\"files\": %llu, \"dirs\": %llu, \"bytes\": %llu, ")
+                     _T("\"errors\": %llu,\n")
+                     _T("   \"ops_per_s\": %.1f, \"bytes_per_s\": %.1f, ")
+                     _T("\"meta_bytes\": %llu, \"meta_bytes_per_s\": %.1f,\n")
+                     _T("   \"phases_s\": {"),
+                it->error, it->secs, (unsigned long long) r->files,
+                (unsigned long long) r->dirs, (unsigned long long) r->bytes,
+                (unsigned long long) r->errors,
+                PerSecond(r->files + r->dirs, it->secs),
+                PerSecond(r->bytes, it->secs),
+                (unsigned long long) r->metaBytes,
+                PerSecond(r->metaBytes, it->secs));
+      for (p = 0; p < DT_PHASE_COUNT; p++) {
+         _ftprintf(out, _T("%s\"%s\": %.6f"), p ? _T(", ") : _T(""),
+                   phaseNames[p], r->phase[p]);
+      }
+      _ftprintf(out, _T("},\n   \"workers\": %d, ")
+                     _T("\"unlink_order\": \"%s\", \"rescans\": %llu, ")
+                     _T("\"resumed\": %llu, \"retries\": %d,\n")
+                     _T("   \"left_files\": %llu, \"left_dirs\": %llu, ")
+                     _T("\"left_bytes\": %llu, ")
+                     _T("\"tune_steps\": %d, \"tuning\": ["),
+                r->workers, r->inodeOrder ? _T("inode") : _T("directory"),
+                (unsigned long long) r->rescans,
+                (unsigned long long) r->resumed, r->retries,
+                (unsigned long long) r->leftFiles,
+                (unsigned long long) r->leftDirs,
+                (unsigned long long) r->leftBytes, r->tuneSteps);
+      s = r->tuneSteps > DT_TUNE_LOG ? r->tuneSteps - DT_TUNE_LOG : 0;
+      for (b = s; b < r->tuneSteps; b++) {
+         const DtTuneStep *st = &r->tune[b % DT_TUNE_LOG];
+         _ftprintf(out, _T("%s\n    {\"t_s\": %.3f, \"from\": %d, ")
+                        _T("\"to\": %d, \"reason\": \"%s\", ")
+                        _T("\"ops_per_s\": %.1f, \"p99_us\": %u}"),
+                   b > s ? _T(",") : _T(""), st->secs, st->from, st->to,
+                   tuneReasons[st->reason], st->opsPerSec,
+                   (unsigned) st->p99us);
+      }
+      _ftprintf(out, _T("],\n   \"latency\": {"));
+      for (op = 0; op < DT_OP_COUNT; op++) {
+         _ftprintf(out, _T("%s\n    \"%s\": {\"count\": %llu, ")
+                        _T("\"p50_us\": %llu, \"p99_us\": %llu, ")
+                        _T("\"hist\": ["),
+                   op ? _T(",") : _T(""), opNames[op],
+                   (unsigned long long) HistCount(r->hist[op]),
+                   (unsigned long long) HistPercentile(r->hist[op], 50),
+                   (unsigned long long) HistPercentile(r->hist[op], 99));
+         for (b = 0; b < DT_HIST_BUCKETS; b++) {
+            _ftprintf(out, _T("%s%llu"), b ? _T(", ") : _T(""),
+                      (unsigned long long) r->hist[op][b]);
+         }
+         _ftprintf(out, _T("]}"));
+      }
+      _ftprintf(out, _T("}}"));
+   }
+   _ftprintf(out, _T("\n ]\n}\n"));
+}
@@ -0,0 +1,29 @@
+// stats.h
+//
+// Per target statistics for --stats: a readable summary for people and
+// a JSON document for scripts and dashboards.
+
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+
+/**
+ * how one command line target went
+ */
+typedef struct DtItemStats_ {
+   const TCHAR *path;        // as given on the command line
+   const TCHAR *status;      // "done", "failed", ... NULL if not run
+   const TCHAR *coveredBy;   // target that deleted this one too, or NULL
+   int error;                // native error code, 0 on success
+   double secs;              // wall time of the delete
+   DtResult res;             // engine counters, with DtOptions.stats
+} DtItemStats;
+
+
+void StatsFormatBytes(uint64_t bytes, TCHAR *buf, size_t size);
+void StatsPrintText(FILE *out, const DtItemStats *items, int n);
+void StatsPrintJson(FILE *out, const TCHAR *version, const TCHAR *engine,
+                    const DtItemStats *items, int n, double secs);
@@ -0,0 +1,758 @@
+// stream.c
+//
+// Implementation of streamed list deletes, see stream.h
+//
+
+#ifdef _WIN32
+#include <fcntl.h>
+#endif
+
+#include <stdatomic.h>
+
+#include "stream.h"
+#include "fs.h"
+#include "progress.h"
+#include "rate.h"
+#include "report.h"
+
+
+#define QUEUE_SLOTS    4096          // entries read ahead of the workers
+#define PUSH_BATCH     64            // entries the reader queues at once
+#define POP_BATCH      16            // entries a worker takes at once
+#define READ_CHUNK     (64 * 1024)   // bytes per fread() of the list
+
+#define SWEEP_SLOTS    4096                 // power of two
+#define SWEEP_FLUSH    (SWEEP_SLOTS / 4 * 3)  // sweep when this full
+
+#ifdef _WIN32
+#define IS_SEP(c)      ((c) == _T('\\') || (c) == _T('/'))
+#else
+#define IS_SEP(c)      ((c) == _T('/'))
+#endif
+
+
+/**
+ * entries read but not taken by a worker yet
+ */
+typedef struct StreamQueue_ {
+   DtMutex lock;
+   DtCond notEmpty;
+   DtCond notFull;
+   TCHAR *slots[QUEUE_SLOTS];   // ring of malloc'ed paths
+   size_t head;
+   size_t count;
+   Bool closed;                 // the reader is done
+} StreamQueue;
+
+
+/**
+ * directories that held deleted entries, to remove if they end up
+ * empty. A hash set with open addressing.
+ */
+typedef struct SweepSet_ {
+   DtMutex lock;
+   TCHAR *slots[SWEEP_SLOTS];
+   TCHAR *order[SWEEP_SLOTS];   // scratch for sorting on a sweep
+   int count;
+   atomic_uint generation;      // bumped by every sweep
+   uint64_t swept;
+   DtRate *rate;                // paces the removals, may be NULL
+   const DtFs *fs;              // what they are on
+} SweepSet;
+
+
+typedef struct Stream_ {
+   StreamQueue queue;
+   SweepSet sweep;
+   DtOptions opts;              // for the engine on directory entries
+   DtMutex reportLock;          // for opts.report, the caller's
+   DtStreamError onError;
+   void *ctx;
+} Stream;
+
+
+typedef struct StreamWorker_ {
+   Stream *s;
+   DtStreamResult res;
+   DtResult own;                // what didn't go through the engine
+   DtCounters *live;            // own, for the progress line, or NULL
+   DtReport report;             // failures below the directory at hand
+   TCHAR *lastParent;           // parent of the previous entry, which
+   size_t lastLen;              // is in the sweep set already
+   size_t lastCap;
+   unsigned lastGen;            // sweep generation lastParent was added in
+   DtThread thread;
+} StreamWorker;
+
+
+/**
+ * the reader's state between chunks of the list
+ */
+typedef struct StreamReader_ {
+   Stream *s;
+   StreamWorker *self;          // delete inline, no workers started
+   int sep;
+   char *entry;                 // entry being collected, may span reads
+   size_t len;
+   size_t cap;
+   TCHAR *batch[PUSH_BATCH];    // entries not queued yet
+   int n;
+   uint64_t entries;
+} StreamReader;
+
+
+/*
+ * the queue
+ */
+
+// add n entries, waiting for room as needed
+static void
+QueuePush(StreamQueue *q,    // IN
+          TCHAR **paths,     // IN
+          int n)             // IN
+{
+   int i;
+
+   DtMutexLock(&q->lock);
+   for (i = 0; i < n; i++) {
+      while (q->count == QUEUE_SLOTS) {
+         DtCondBroadcast(&q->notEmpty);
+         DtCondWait(&q->notFull, &q->lock);
+      }
+      q->slots[(q->head + q->count) % QUEUE_SLOTS] = paths[i];
+      q->count++;
+   }
+   DtCondBroadcast(&q->notEmpty);
+   DtMutexUnlock(&q->lock);
+}
+
+
+// take up to max entries, 0 once the queue is closed and drained
+static int
+QueuePop(StreamQueue *q,    // IN
+         TCHAR **paths,     // OUT
+         int max)           // IN
+{
+   int n = 0;
+
+   DtMutexLock(&q->lock);
+   while (q->count == 0 && !q->closed) {
+      DtCondWait(&q->notEmpty, &q->lock);
+   }
+   while (n < max && q->count > 0) {
+      paths[n++] = q->slots[q->head];
+      q->head = (q->head + 1) % QUEUE_SLOTS;
+      q->count--;
+   }
+   DtCondSignal(&q->notFull);
+   DtMutexUnlock(&q->lock);
+   return n;
+}
+
+
+static void
+QueueClose(StreamQueue *q)  // IN
+{
+   DtMutexLock(&q->lock);
+   q->closed = TRUE;
+   DtCondBroadcast(&q->notEmpty);
+   DtMutexUnlock(&q->lock);
+}
+
+
+/*
+ * the empty parent sweep
+ */
+
+// length of the directory part of path, or 0 if there is none we
+// should remove: no separator, the root, "." or ".."
+static size_t
+ParentLen(const TCHAR *path)  // IN
+{
+   size_t len = _tcslen(path), name;
+
+   while (len > 1 && IS_SEP(path[len - 1])) {
+      len--;
+   }
+   while (len > 0 && !IS_SEP(path[len - 1])) {
+      len--;
+   }
+   while (len > 0 && IS_SEP(path[len - 1])) {
+      len--;
+   }
+   if (len == 0) {
+      return 0;
+   }
+#ifdef _WIN32
+   if (len == 2 && path[1] == _T(':')) {
+      return 0;
+   }
+#endif
+
+   for (name = len; name > 0 && !IS_SEP(path[name - 1]); name--) {
+   }
+   if ((len - name == 1 && path[name] == _T('.')) ||
+       (len - name == 2 && path[name] == _T('.') &&
+        path[name + 1] == _T('.'))) {
+      return 0;
+   }
+   return len;
+}
+
+
+// longer first, so a directory comes before its parent
+static int
+LongerFirst(const void *a,  // IN
+            const void *b)  // IN
+{
+   size_t la = _tcslen(*(const TCHAR **) a);
+   size_t lb = _tcslen(*(const TCHAR **) b);
+
+   return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+
+// remove whatever is empty and forget all of them, with the lock held.
+// A directory that still had entries coming is added again by the
+// next one deleted.
+static void
+SweepFlush(SweepSet *set)  // IN
+{
+   int i, n = 0, type;
+
+   for (i = 0; i < SWEEP_SLOTS; i++) {
+      if (set->slots[i]) {
+         set->order[n++] = set->slots[i];
+         set->slots[i] = NULL;
+      }
+   }
+   qsort(set->order, n, sizeof(TCHAR *), LongerFirst);
+
+   for (i = 0; i < n; i++) {
+      // removeDirAt() is happy when it's gone already, don't count those
+      if (set->fs->lstatType(set->order[i], &type) == 0 &&
+          type == FS_TYPE_DIR) {
+         RateOp(set->rate, _tcslen(set->order[i]) - ParentLen(set->order[i]));
+         if (set->fs->removeDirAt(FS_NO_HANDLE, set->order[i]) == 0) {
+            set->swept++;
+         }
+      }
+      free(set->order[i]);
+   }
+   set->count = 0;
+   atomic_fetch_add(&set->generation, 1);
+}
+
+
+// remember the first len characters of path as a sweep candidate
+static void
+SweepAdd(SweepSet *set,       // IN
+         const TCHAR *path,   // IN
+         size_t len)          // IN
+{
+   uint32_t h = 2166136261u;   // FNV-1a
+   size_t i, slot;
+   TCHAR *copy;
+
+   for (i = 0; i < len; i++) {
+      h = (h ^ (uint32_t) path[i]) * 16777619u;
+   }
+
+   DtMutexLock(&set->lock);
+   for (slot = h & (SWEEP_SLOTS - 1); set->slots[slot];
+        slot = (slot + 1) & (SWEEP_SLOTS - 1)) {
+      if (_tcsncmp(set->slots[slot], path, len) == 0 &&
+          set->slots[slot][len] == _T('\0')) {
+         DtMutexUnlock(&set->lock);
+         return;
+      }
+   }
+   copy = (TCHAR *) malloc(sizeof(TCHAR) * (len + 1));
+   if (copy) {
+      memcpy(copy, path, sizeof(TCHAR) * len);
+      copy[len] = _T('\0');
+      set->slots[slot] = copy;
+      if (++set->count >= SWEEP_FLUSH) {
+         SweepFlush(set);
+      }
+   }
+   DtMutexUnlock(&set->lock);
+}
+
+
+// the parent of a deleted entry may be empty now
+static void
+NoteParent(StreamWorker *w,     // IN
+           const TCHAR *path)   // IN
+{
+   size_t len = ParentLen(path);
+   unsigned gen = atomic_load(&w->s->sweep.generation);
+
+   if (len == 0) {
+      return;
+   }
+   // lists are usually grouped by directory, skip the lock for those
+   // unless a sweep has emptied the set since
+   if (w->lastParent && w->lastLen == len && w->lastGen == gen &&
+       memcmp(w->lastParent, path, sizeof(TCHAR) * len) == 0) {
+      return;
+   }
+   if (len + 1 > w->lastCap) {
+      TCHAR *p = (TCHAR *) realloc(w->lastParent, sizeof(TCHAR) * (len + 1));
+      if (!p) {
+         return;
+      }
+      w->lastParent = p;
+      w->lastCap = len + 1;
+   }
+   memcpy(w->lastParent, path, sizeof(TCHAR) * len);
+   w->lastLen = len;
+   w->lastGen = gen;
+
+   SweepAdd(&w->s->sweep, path, len);
+}
+
+
+/*
+ * deleting
+ */
+
+static void
+AddResult(DtResult *to,          // IN/OUT
+          const DtResult *r)     // IN
+{
+   int j, k;
+
+   to->files += r->files;
+   to->dirs += r->dirs;
+   to->errors += r->errors;
+   to->bytes += r->bytes;
+   to->metaBytes += r->metaBytes;
+   if (r->errors) {
+      to->lastError = r->lastError;
+   }
+   for (j = 0; j < DT_PHASE_COUNT; j++) {
+      to->phase[j] += r->phase[j];
+   }
+   for (j = 0; j < DT_OP_COUNT; j++) {
+      for (k = 0; k < DT_HIST_BUCKETS; k++) {
+         to->hist[j][k] += r->hist[j][k];
+      }
+   }
+}
+
+
+// hand the failures below a listed directory to the caller's report,
+// spelled out from the listed path. The engine has them relative to
+// it, all but the failures of the directory itself.
+static void
+MergeReport(Stream *s,            // IN
+            DtReport *r,          // IN/OUT
+            const TCHAR *path)    // IN
+{
+   size_t len = _tcslen(path), plen;
+   Bool sep = len > 0 && !IS_SEP(path[len - 1]);
+   TCHAR *p, *full;
+   int i, j;
+
+   for (i = 0; i < r->ngroups; i++) {
+      for (j = 0; j < r->groups[i].npaths; j++) {
+         p = r->groups[i].paths[j].path;
+         if (_tcscmp(p, path) == 0) {
+            continue;
+         }
+         plen = _tcslen(p);
+         full = (TCHAR *) malloc(sizeof(TCHAR) * (len + sep + plen + 1));
+         if (!full) {
+            continue;  // it still says what failed
+         }
+         memcpy(full, path, sizeof(TCHAR) * len);
+         if (sep) {
+            full[len] = DT_PATH_SEP;
+         }
+         memcpy(full + len + sep, p, sizeof(TCHAR) * (plen + 1));
+         free(p);
+         r->groups[i].paths[j].path = full;
+      }
+   }
+
+   DtMutexLock(&s->reportLock);
+   ReportMerge(s->opts.report, r);
+   DtMutexUnlock(&s->reportLock);
+}
+
+
+// delete a listed directory with the engine
+static int
+DeleteDir(StreamWorker *w,     // IN
+          const TCHAR *path,   // IN
+          DtResult *r)         // OUT
+{
+   DtOptions opts = w->s->opts;
+   int err;
+
+   if (!opts.report) {
+      return DtDeleteTree(path, &opts, r) ? 0 : r->lastError;
+   }
+   // a retry empties the report, which mustn't take the failures of
+   // other entries along
+   opts.report = &w->report;
+   err = DtDeleteTree(path, &opts, r) ? 0 : r->lastError;
+   MergeReport(w->s, &w->report, path);
+   return err;
+}
+
+
+// count a listed file that couldn't be removed in the caller's report
+static void
+ReportEntry(Stream *s,           // IN
+            const TCHAR *path,   // IN
+            int err)             // IN
+{
+   if (!s->opts.report) {
+      return;
+   }
+   DtMutexLock(&s->reportLock);
+   ReportAdd(s->opts.report, DT_OP_UNLINK, err,
+             ReportWants(s->opts.report, err) ? _tcsdup(path) : NULL);
+   DtMutexUnlock(&s->reportLock);
+}
+
+
+// delete one listed entry. Most are files, so just try to unlink it
+// and only look closer when that fails.
+static void
+DeleteEntry(StreamWorker *w,     // IN
+            const TCHAR *path)   // IN
+{
+   const DtOptions *opts = &w->s->opts;
+   const DtFs *fs = w->s->sweep.fs;
+   DtResult r;
+   uint64_t bytes = 0;
+   double begin = 0, slept;
+   size_t nameLen = _tcslen(path) - ParentLen(path);
+   int err, type;
+
+   memset(&r, 0, sizeof(r));
+   slept = RateOp(opts->rate, nameLen);
+   if (opts->stats) {
+      fs->pathSize(path, &bytes);
+      begin = DtNow();
+   }
+   err = fs->unlink(path);
+   if (!err) {
+      if (opts->stats) {
+         r.phase[DT_PHASE_UNLINK] = DtNow() - begin;
+         r.metaBytes = RATE_META_BYTES(nameLen);
+      }
+      r.files = 1;
+      r.bytes = bytes;
+      AddResult(&w->own, &r);
+   } else if (fs->lstatType(path, &type) == 0 && type == FS_TYPE_DIR) {
+      // the engine puts these on the progress line itself
+      err = DeleteDir(w, path, &r);
+   } else if (!FS_NOT_FOUND(err)) {
+      r.errors = 1;
+      r.lastError = err;
+      AddResult(&w->own, &r);
+      ReportEntry(w->s, path, err);
+   }
+   if (FS_NOT_FOUND(err)) {
+      // another entry's tree took it along, or it was never there. Its
+      // parent was none of our doing, leave it be.
+      memset(&r, 0, sizeof(r));
+   }
+   r.phase[DT_PHASE_THROTTLE] += slept;
+   AddResult(&w->res.res, &r);
+
+   if (FS_NOT_FOUND(err)) {
+      w->res.missing++;
+   } else if (err) {
+      w->res.failed++;
+      if (w->s->onError) {
+         w->s->onError(path, err, w->s->ctx);
+      }
+   } else {
+      w->res.deleted++;
+      NoteParent(w, path);
+   }
+
+   if (w->live) {
+      atomic_store_explicit(&w->live->files, w->own.files,
+                            memory_order_relaxed);
+      atomic_store_explicit(&w->live->bytes, w->own.bytes,
+                            memory_order_relaxed);
+      atomic_store_explicit(&w->live->errors, w->own.errors,
+                            memory_order_relaxed);
+   }
+}
+
+
+static void
+WorkerMain(void *arg)  // IN
+{
+   StreamWorker *w = (StreamWorker *) arg;
+   TCHAR *paths[POP_BATCH];
+   int n, i;
+
+   while ((n = QueuePop(&w->s->queue, paths, POP_BATCH)) > 0) {
+      for (i = 0; i < n; i++) {
+         DeleteEntry(w, paths[i]);
+         free(paths[i]);
+      }
+   }
+}
+
+
+/*
+ * reading the list
+ */
+
+// a malloc'ed native copy of an entry
+static TCHAR *
+EntryPath(const char *buf,   // IN
+          size_t len)        // IN
+{
+#ifdef _WIN32
+   // lists are UTF-8, like what find and most build tools write
+   int n = MultiByteToWideChar(CP_UTF8, 0, buf, (int) len, NULL, 0);
+   TCHAR *p = (TCHAR *) malloc(sizeof(TCHAR) * (n + 1));
+
+   if (p) {
+      MultiByteToWideChar(CP_UTF8, 0, buf, (int) len, p, n);
+      p[n] = L'\0';
+   }
+   return p;
+#else
+   char *p = (char *) malloc(len + 1);
+
+   if (p) {
+      memcpy(p, buf, len);
+      p[len] = '\0';
+   }
+   return p;
+#endif
+}
+
+
+// hand the batch to the workers, or delete it here without them
+static void
+ReaderFlush(StreamReader *rd)  // IN
+{
+   int i;
+
+   if (rd->self) {
+      for (i = 0; i < rd->n; i++) {
+         DeleteEntry(rd->self, rd->batch[i]);
+         free(rd->batch[i]);
+      }
+   } else if (rd->n) {
+      QueuePush(&rd->s->queue, rd->batch, rd->n);
+   }
+   rd->n = 0;
+}
+
+
+// the entry collected so far is complete
+static int
+ReaderEmit(StreamReader *rd)  // IN
+{
+   if (rd->sep == '\n' && rd->len && rd->entry[rd->len - 1] == '\r') {
+      rd->len--;
+   }
+   if (rd->len == 0) {
+      return 0;  // blank line or doubled separator
+   }
+   rd->batch[rd->n] = EntryPath(rd->entry, rd->len);
+   rd->len = 0;
+   if (!rd->batch[rd->n]) {
+      return FS_ENOMEM;
+   }
+   rd->entries++;
+   if (++rd->n == PUSH_BATCH) {
+      ReaderFlush(rd);
+   }
+   return 0;
+}
+
+
+// add len bytes to the entry being collected
+static int
+ReaderAppend(StreamReader *rd,   // IN
+             const char *p,      // IN
+             size_t len)         // IN
+{
+   if (rd->len + len + 1 > rd->cap) {
+      size_t cap = (rd->len + len + 1) * 2;
+      char *e = (char *) realloc(rd->entry, cap);
+      if (!e) {
+         return FS_ENOMEM;
+      }
+      rd->entry = e;
+      rd->cap = cap;
+   }
+   memcpy(rd->entry + rd->len, p, len);
+   rd->len += len;
+   return 0;
+}
+
+
+// read the whole list, entries separated by rd->sep
+static int
+ReadList(StreamReader *rd,   // IN
+         FILE *in)           // IN
+{
+   char *chunk, *p, *end, *hit;
+   size_t got;
+   int err = 0;
+
+   chunk = (char *) malloc(READ_CHUNK);
+   if (!chunk) {
+      return FS_ENOMEM;
+   }
+
+   do {
+      got = fread(chunk, 1, READ_CHUNK, in);
+      for (p = chunk, end = chunk + got; p < end && !err; ) {
+         hit = (char *) memchr(p, rd->sep, end - p);
+         err = ReaderAppend(rd, p, (hit ? hit : end) - p);
+         if (!hit) {
+            break;  // continues in the next chunk
+         }
+         p = hit + 1;
+         if (!err) {
+            err = ReaderEmit(rd);
+         }
+      }
+   } while (!err && got == READ_CHUNK);
+
+   if (!err && ferror(in)) {
+#ifdef _WIN32
+      err = ERROR_READ_FAULT;
+#else
+      err = errno ? errno : EIO;
+#endif
+   }
+   if (!err) {
+      err = ReaderEmit(rd);  // no separator after the last one
+   }
+   ReaderFlush(rd);
+   free(chunk);
+   return err;
+}
+
+
+/**
+ * Delete every path listed in a stream. Directories are deleted with
+ * their contents by the engine, one thread each, as the workers
+ * already run in parallel.
+ *
+ * @param in the list
+ * @param sep what ends an entry, '\0' or '\n'
+ * @param opts engine options, threads is the number of workers. The
+ *             failures go to opts->report with their full paths.
+ * @param onError called for each entry that fails, path is NULL if
+ *        the list itself can't be read. May be NULL.
+ * @param ctx passed to onError
+ * @param res receives what was done
+ * @return TRUE if every entry was deleted
+ */
+Bool
+StreamDelete(FILE *in,                 // IN
+             int sep,                  // IN
+             const DtOptions *opts,    // IN
+             DtStreamError onError,    // IN
+             void *ctx,                // IN
+             DtStreamResult *res)      // OUT
+{
+   Stream *s;
+   StreamWorker *workers;
+   StreamReader rd;
+   DtCounters *live;
+   int n, i, started, err;
+
+   memset(res, 0, sizeof(*res));
+
+   n = opts->threads > 0 ? opts->threads : DtDefaultThreads();
+   s = (Stream *) calloc(1, sizeof(Stream));
+   workers = (StreamWorker *) calloc(n, sizeof(StreamWorker));
+   if (!s || !workers) {
+      free(s);
+      free(workers);
+      if (onError) {
+         onError(NULL, FS_ENOMEM, ctx);
+      }
+      return FALSE;
+   }
+
+#ifdef _WIN32
+   _setmode(_fileno(in), _O_BINARY);
+#endif
+   s->opts = *opts;
+   s->opts.threads = 1;
+   s->opts.queueDepth = 0;
+   s->onError = onError;
+   s->ctx = ctx;
+   DtMutexInit(&s->reportLock);
+   DtMutexInit(&s->queue.lock);
+   DtCondInit(&s->queue.notEmpty);
+   DtCondInit(&s->queue.notFull);
+   DtMutexInit(&s->sweep.lock);
+   s->sweep.rate = opts->rate;
+   s->sweep.fs = opts->fs ? opts->fs : FsNative();
+
+   live = ProgressAttach(opts->progress, n);
+   for (i = 0; i < n; i++) {
+      workers[i].s = s;
+      workers[i].live = live ? &live[i] : NULL;
+      ReportInit(&workers[i].report,
+                 opts->report ? opts->report->maxPaths : 0);
+   }
+   for (started = 0; started < n; started++) {
+      if (!DtThreadCreate(&workers[started].thread, WorkerMain,
+                          &workers[started])) {
+         break;
+      }
+   }
+
+   memset(&rd, 0, sizeof(rd));
+   rd.s = s;
+   rd.self = started ? NULL : &workers[0];
+   rd.sep = sep;
+   err = ReadList(&rd, in);
+   free(rd.entry);
+   res->entries = rd.entries;
+   QueueClose(&s->queue);
+   for (i = 0; i < started; i++) {
+      DtThreadJoin(workers[i].thread);
+   }
+   if (err && onError) {
+      onError(NULL, err, ctx);
+   }
+
+   // whatever is left, every entry is done now
+   DtMutexLock(&s->sweep.lock);
+   SweepFlush(&s->sweep);
+   DtMutexUnlock(&s->sweep.lock);
+   res->swept = s->sweep.swept;
+
+   for (i = 0; i < n; i++) {
+      res->deleted += workers[i].res.deleted;
+      res->missing += workers[i].res.missing;
+      res->failed += workers[i].res.failed;
+      AddResult(&res->res, &workers[i].res.res);
+      free(workers[i].lastParent);
+   }
+   res->res.dirs += res->swept;
+   ProgressDetach(opts->progress, live);
+
+   DtMutexDestroy(&s->reportLock);
+   DtMutexDestroy(&s->sweep.lock);
+   DtCondDestroy(&s->queue.notFull);
+   DtCondDestroy(&s->queue.notEmpty);
+   DtMutexDestroy(&s->queue.lock);
+   free(workers);
+   free(s);
+
+   return err == 0 && res->failed == 0;
+}
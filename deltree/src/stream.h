@@ -0,0 +1,37 @@
+// stream.h
+//
+// Deletes a list of targets read from a stream, eg. a build manifest
+// or the output of "find -print0", without ever holding the whole
+// list. A reader feeds entries into a bounded queue and a pool of
+// workers deletes them as they come, so memory stays the same however
+// long the list is.
+//
+// Directories that held listed entries and end up empty are removed
+// too. The candidates are kept in a fixed size table that is swept
+// whenever it fills up and once more at the end.
+
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+
+/**
+ * what a streamed delete did
+ */
+typedef struct DtStreamResult_ {
+   uint64_t entries;     // read from the list
+   uint64_t deleted;     // entries removed
+   uint64_t missing;     // entries that were already gone
+   uint64_t failed;      // entries that couldn't be removed
+   uint64_t swept;       // empty parent directories removed
+   DtResult res;         // engine counters over all entries
+} DtStreamResult;
+
+// reports an entry that failed, called on a worker thread
+typedef void (*DtStreamError)(const TCHAR *path, int err, void *ctx);
+
+
+Bool StreamDelete(FILE *in, int sep, const DtOptions *opts,
+                  DtStreamError onError, void *ctx, DtStreamResult *res);
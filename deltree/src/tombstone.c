@@ -0,0 +1,708 @@
+// tombstone.c
+//
+// Implementation of tombstone deletes, see tombstone.h
+//
+
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <aclapi.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+
+#include "tombstone.h"
+#include "fs.h"
+
+
+#define TOMB_DIR       _T(".deltree-tombstones")
+#define TOMB_LOCK      _T(".lock")
+
+#define MAX_TOMB_DIRS  16    // distinct tombstone dirs per run
+#define RECLAIM_BATCH  256   // tombstones read per pass
+#define RECLAIM_THREADS 2    // be polite, we're in the background
+
+#ifdef _WIN32
+typedef HANDLE LockHandle;
+#define NO_LOCK        INVALID_HANDLE_VALUE
+#else
+typedef int LockHandle;
+#define NO_LOCK        (-1)
+#endif
+
+
+// tombstone directories we buried something in during this run,
+// each gets a reclaimer when we're done. Targets are buried from
+// several threads at once.
+static TCHAR *tombDirs[MAX_TOMB_DIRS];
+static int numTombDirs;
+static atomic_flag tombDirsLock = ATOMIC_FLAG_INIT;
+
+// makes tombstone names unique within this process
+static atomic_uint tombSeq;
+
+
+// return malloc'ed dir + separator + name
+static TCHAR *
+JoinPath(const TCHAR *dir,    // IN
+         const TCHAR *name)   // IN
+{
+   size_t dirLen = _tcslen(dir), nameLen = _tcslen(name);
+   Bool sep = dirLen > 0 && dir[dirLen - 1] != DT_PATH_SEP;
+   TCHAR *p = (TCHAR *) malloc(sizeof(TCHAR) * (dirLen + sep + nameLen + 1));
+
+   if (p) {
+      memcpy(p, dir, sizeof(TCHAR) * dirLen);
+      if (sep) {
+         p[dirLen] = DT_PATH_SEP;
+      }
+      memcpy(p + dirLen + sep, name, sizeof(TCHAR) * (nameLen + 1));
+   }
+   return p;
+}
+
+
+// return malloc'ed parent directory of path, which has no trailing
+// separator
+static TCHAR *
+ParentDir(const TCHAR *path)  // IN
+{
+   const TCHAR *sep = _tcsrchr(path, DT_PATH_SEP);
+   TCHAR *p;
+   size_t len;
+
+   if (!sep) {
+      return _tcsdup(_T("."));
+   }
+   len = sep - path;
+   if (len == 0 || path[len - 1] == _T(':')) {
+      len++;  // keep the separator of "/" or "C:\"
+   }
+   p = (TCHAR *) malloc(sizeof(TCHAR) * (len + 1));
+   if (p) {
+      memcpy(p, path, sizeof(TCHAR) * len);
+      p[len] = _T('\0');
+   }
+   return p;
+}
+
+
+static void
+RememberDir(const TCHAR *dir)  // IN
+{
+   int i;
+
+   // held for a few string compares, a spin lock is plenty
+   while (atomic_flag_test_and_set(&tombDirsLock)) {
+   }
+   for (i = 0; i < numTombDirs; i++) {
+      if (_tcscmp(tombDirs[i], dir) == 0) {
+         goto exit;
+      }
+   }
+   if (numTombDirs < MAX_TOMB_DIRS) {
+      tombDirs[numTombDirs] = _tcsdup(dir);
+      if (tombDirs[numTombDirs]) {
+         numTombDirs++;
+      }
+   }
+exit:
+   atomic_flag_clear(&tombDirsLock);
+}
+
+
+#ifdef _WIN32
+
+// malloc'ed token information of ours, NULL on failure
+static void *
+TokenInfo(TOKEN_INFORMATION_CLASS cls)  // IN
+{
+   HANDLE token;
+   DWORD len = 0;
+   void *info = NULL;
+
+   if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+      return NULL;
+   }
+   GetTokenInformation(token, cls, NULL, 0, &len);
+   if (len && (info = malloc(len)) != NULL &&
+       !GetTokenInformation(token, cls, info, len, &len)) {
+      free(info);
+      info = NULL;
+   }
+   CloseHandle(token);
+   return info;
+}
+
+
+// whether the directory open as h is a tombstone directory we can
+// trust: a real directory, not a junction, that is ours. What we make
+// is owned by our user, or by Administrators when elevated. Anyone
+// who could plant one could read or swap what we bury in it.
+static Bool
+TombDirOk(HANDLE h)  // IN
+{
+   BY_HANDLE_FILE_INFORMATION info;
+   PSECURITY_DESCRIPTOR sd;
+   PSID owner;
+   TOKEN_USER *user;
+   TOKEN_OWNER *def;
+   Bool ok;
+
+   if (!GetFileInformationByHandle(h, &info) ||
+       !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+       (info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+      return FALSE;
+   }
+   if (GetSecurityInfo(h, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION,
+                       &owner, NULL, NULL, NULL, &sd) != ERROR_SUCCESS) {
+      return FALSE;
+   }
+   user = (TOKEN_USER *) TokenInfo(TokenUser);
+   def = (TOKEN_OWNER *) TokenInfo(TokenOwner);
+   ok = (user && EqualSid(owner, user->User.Sid)) ||
+        (def && EqualSid(owner, def->Owner));
+   free(def);
+   free(user);
+   LocalFree(sd);
+   return ok;
+}
+
+
+// open a tombstone directory for TombDirOk(). Without FILE_SHARE_DELETE
+// it can't be renamed or removed, so swapped, while we hold it.
+static HANDLE
+OpenTombDir(const TCHAR *dir)  // IN
+{
+   return CreateFile(dir, FILE_READ_ATTRIBUTES | READ_CONTROL,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                     OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS |
+                     FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+}
+
+
+// make a tombstone directory only our user has access to, the DACL
+// protected from what the parent would hand down
+static int
+MakeTombDir(const TCHAR *dir)  // IN
+{
+   SECURITY_ATTRIBUTES sa;
+   SECURITY_DESCRIPTOR sd;
+   TOKEN_USER *user;
+   PACL acl = NULL;
+   DWORD len;
+   int err = 0;
+
+   user = (TOKEN_USER *) TokenInfo(TokenUser);
+   if (!user) {
+      return (int) GetLastError();
+   }
+   len = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) +
+         GetLengthSid(user->User.Sid);
+   acl = (PACL) malloc(len);
+   if (!acl) {
+      err = FS_ENOMEM;
+   } else if (!InitializeAcl(acl, len, ACL_REVISION) ||
+              !AddAccessAllowedAceEx(acl, ACL_REVISION,
+                                     OBJECT_INHERIT_ACE |
+                                     CONTAINER_INHERIT_ACE,
+                                     FILE_ALL_ACCESS, user->User.Sid) ||
+              !InitializeSecurityDescriptor(&sd,
+                                            SECURITY_DESCRIPTOR_REVISION) ||
+              !SetSecurityDescriptorDacl(&sd, TRUE, acl, FALSE) ||
+              !SetSecurityDescriptorControl(&sd, SE_DACL_PROTECTED,
+                                            SE_DACL_PROTECTED)) {
+      err = (int) GetLastError();
+   } else {
+      sa.nLength = sizeof(sa);
+      sa.lpSecurityDescriptor = &sd;
+      sa.bInheritHandle = FALSE;
+      if (!CreateDirectory(dir, &sa) &&
+          GetLastError() != ERROR_ALREADY_EXISTS) {
+         err = (int) GetLastError();
+      }
+   }
+   free(acl);
+   free(user);
+   return err;
+}
+
+#else
+
+// whether st is a tombstone directory we can trust: a real directory
+// that is ours and nobody else's to look into. Anyone who could plant
+// one could read or swap what we bury in it.
+static Bool
+TombDirOk(const struct stat *st)  // IN
+{
+   return S_ISDIR(st->st_mode) && st->st_uid == geteuid() &&
+          (st->st_mode & 07777) == 0700;
+}
+
+#endif
+
+
+// move target into the tombstone directory under base
+static int
+BuryIn(const TCHAR *base,     // IN
+       const TCHAR *target)   // IN
+{
+   TCHAR *tombDir, *dst = NULL;
+   TCHAR name[64];
+   int err = 0;
+#ifdef _WIN32
+   HANDLE h;
+#else
+   struct stat st;
+   int fd;
+#endif
+
+   tombDir = JoinPath(base, TOMB_DIR);
+   if (!tombDir) {
+      return FS_ENOMEM;
+   }
+
+   // time, pid and a sequence number can't collide with another run
+#ifdef _WIN32
+   _sntprintf(name, ARRAYSIZE(name), _T("%llx-%lx-%x"),
+              (unsigned long long) time(NULL),
+              (unsigned long) GetCurrentProcessId(),
+              atomic_fetch_add(&tombSeq, 1));
+   name[ARRAYSIZE(name) - 1] = _T('\0');
+
+   err = MakeTombDir(tombDir);
+   if (err) {
+      goto exit;
+   }
+
+   // one that was there already has to pass TombDirOk(). It is held
+   // open until the target is in, so a junction or a directory swapped
+   // in between doesn't get it.
+   h = OpenTombDir(tombDir);
+   if (h == INVALID_HANDLE_VALUE) {
+      err = (int) GetLastError();
+      goto exit;
+   }
+   if (!TombDirOk(h)) {
+      CloseHandle(h);
+      err = ERROR_ACCESS_DENIED;
+      goto exit;
+   }
+   SetFileAttributes(tombDir, FILE_ATTRIBUTE_HIDDEN);
+
+   dst = JoinPath(tombDir, name);
+   if (!dst) {
+      err = FS_ENOMEM;
+   } else {
+      // \\?\ form so deep targets can be moved too
+      TCHAR *from = FsRootPath(target);
+      TCHAR *to = FsRootPath(dst);
+      if (!from || !to) {
+         err = FS_ENOMEM;
+      } else if (!MoveFileEx(from, to, 0)) {
+         err = (int) GetLastError();
+      }
+      free(from);
+      free(to);
+   }
+   CloseHandle(h);
+#else
+   snprintf(name, sizeof(name), "%llx-%lx-%x",
+            (unsigned long long) time(NULL), (unsigned long) getpid(),
+            atomic_fetch_add(&tombSeq, 1));
+
+   if (mkdir(tombDir, 0700) != 0 && errno != EEXIST) {
+      err = errno;
+      goto exit;
+   }
+
+   // one that was there already has to pass TombDirOk(). Checked on
+   // the open directory and renamed into that, so a symlink or a
+   // directory swapped in between doesn't get the target.
+   fd = open(tombDir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0) {
+      err = errno;
+      goto exit;
+   }
+   if (fstat(fd, &st) != 0) {
+      err = errno;
+   } else if (!TombDirOk(&st)) {
+      err = EPERM;
+   } else if (renameat(AT_FDCWD, target, fd, name) != 0) {
+      err = errno;
+   }
+   close(fd);
+#endif
+
+   if (!err) {
+      RememberDir(tombDir);
+   }
+
+exit:
+   free(dst);
+   free(tombDir);
+   return err;
+}
+
+
+#ifndef _WIN32
+
+// walk up from dir, the target's parent, while the directory above
+// is on device dev, ours and writable by nobody else, and return the
+// highest such directory (malloc'ed). Anyone can make entries in a
+// world writable or sticky one (/tmp), and we stop at the home
+// directory.
+static char *
+TombRoot(const char *dir,  // IN
+         dev_t dev)        // IN
+{
+   char *cur = realpath(dir, NULL);
+   char *home = getenv("HOME") ? realpath(getenv("HOME"), NULL) : NULL;
+   char *up;
+   struct stat st;
+
+   while (cur && strcmp(cur, "/") != 0 &&
+          !(home && strcmp(cur, home) == 0)) {
+      up = ParentDir(cur);
+      if (!up ||
+          lstat(up, &st) != 0 || st.st_dev != dev ||
+          st.st_uid != geteuid() || (st.st_mode & (S_IWOTH | S_ISVTX)) ||
+          access(up, W_OK | X_OK) != 0) {
+         free(up);
+         break;
+      }
+      free(cur);
+      cur = up;
+   }
+   free(home);
+   return cur;
+}
+
+#endif
+
+
+/**
+ * Move path into a tombstone directory on the same filesystem.
+ *
+ * @param path file or directory to delete
+ * @return 0 on success, or a native error code if it can't be moved
+ *         (different filesystem, permissions) and must be deleted
+ *         the normal way
+ */
+int
+TombstoneBury(const TCHAR *path)  // IN
+{
+   TCHAR *target, *parent = NULL, *root = NULL;
+   int err;
+
+   target = FsRootPath(path);
+   if (!target) {
+      return FS_ENOMEM;
+   }
+   parent = ParentDir(target);
+   if (!parent) {
+      err = FS_ENOMEM;
+      goto exit;
+   }
+
+#ifdef _WIN32
+   {
+      TCHAR vol[MAX_PATH];
+      if (GetVolumePathName(target, vol, MAX_PATH)) {
+         root = _tcsdup(vol);
+      }
+   }
+#else
+   {
+      struct stat st;
+      if (lstat(target, &st) != 0) {
+         err = errno;
+         goto exit;
+      }
+      root = TombRoot(parent, st.st_dev);
+   }
+#endif
+
+   // prefer the shared per-filesystem directory, but settle for one
+   // next to the target if we can't use it
+   err = root ? BuryIn(root, target) : FS_ENOMEM;
+   if (err && (!root || _tcscmp(root, parent) != 0)) {
+      err = BuryIn(parent, target);
+   }
+
+exit:
+   free(root);
+   free(parent);
+   free(target);
+   return err;
+}
+
+
+static LockHandle
+LockDir(const TCHAR *dir)  // IN
+{
+   TCHAR *path = JoinPath(dir, TOMB_LOCK);
+   LockHandle h;
+
+   if (!path) {
+      return NO_LOCK;
+   }
+#ifdef _WIN32
+   // an exclusive open is our lock, it goes away with the process
+   h = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                  FILE_ATTRIBUTE_HIDDEN, NULL);
+#else
+   h = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+   if (h >= 0 && flock(h, LOCK_EX | LOCK_NB) != 0) {
+      close(h);
+      h = NO_LOCK;
+   }
+#endif
+   free(path);
+   return h;
+}
+
+
+static void
+UnlockDir(LockHandle h)  // IN
+{
+#ifdef _WIN32
+   CloseHandle(h);
+#else
+   close(h);
+#endif
+}
+
+
+// dot files in the tombstone directory are ours (the lock), the rest
+// are tombstones
+static Bool
+IsTombstone(const DtDirent *ent)  // IN
+{
+   return ent->name[0] != _T('.');
+}
+
+
+static Bool
+HasTombstones(const TCHAR *dir)  // IN
+{
+   DtDir *d;
+   DtDirent ent;
+   Bool found = FALSE;
+
+   if (FsOpenDir(dir, &d) != 0) {
+      return FALSE;
+   }
+   while (!found && FsReadDir(d, &ent) == 0) {
+      found = IsTombstone(&ent);
+   }
+   FsCloseDir(d);
+   return found;
+}
+
+
+// delete up to RECLAIM_BATCH tombstones, return how many went away
+static int
+ReclaimPass(const TCHAR *dir,       // IN
+            const DtOptions *opts,  // IN
+            Bool *failed)           // OUT
+{
+   TCHAR *names[RECLAIM_BATCH];
+   DtDir *d;
+   DtDirent ent;
+   DtResult res;
+   int i, n = 0, deleted = 0;
+
+   if (FsOpenDir(dir, &d) != 0) {
+      return 0;
+   }
+   while (n < RECLAIM_BATCH && FsReadDir(d, &ent) == 0) {
+      if (IsTombstone(&ent)) {
+         names[n] = JoinPath(dir, ent.name);
+         if (names[n]) {
+            n++;
+         }
+      }
+   }
+   FsCloseDir(d);
+
+   for (i = 0; i < n; i++) {
+      if (DtDeleteTree(names[i], opts, &res)) {
+         deleted++;
+      } else {
+         *failed = TRUE;
+      }
+      free(names[i]);
+   }
+   return deleted;
+}
+
+
+/**
+ * Delete everything in a tombstone directory. Only one reclaimer works
+ * on a directory at a time, others return right away.
+ *
+ * @param dir tombstone directory
+ * @param opts engine options for the deletes, may be NULL
+ * @return number of tombstones deleted
+ */
+int
+TombstoneReclaim(const TCHAR *dir,        // IN
+                 const DtOptions *opts)   // IN
+{
+   DtOptions defaults = {0};
+   LockHandle lock;
+   Bool failed = FALSE;
+   int n, deleted = 0;
+#ifdef _WIN32
+   HANDLE h;
+
+   // --reclaim can name anything, only empty what we would bury in.
+   // Held so it isn't swapped for another while we do.
+   h = OpenTombDir(dir);
+   if (h == INVALID_HANDLE_VALUE) {
+      return 0;
+   }
+   if (!TombDirOk(h)) {
+      CloseHandle(h);
+      return 0;
+   }
+#else
+   struct stat st;
+
+   // --reclaim can name anything, only empty what we would bury in
+   if (lstat(dir, &st) != 0 || !TombDirOk(&st)) {
+      return 0;
+   }
+#endif
+
+   if (!opts) {
+      defaults.threads = RECLAIM_THREADS;
+      opts = &defaults;
+   }
+
+   for (;;) {
+      lock = LockDir(dir);
+      if (lock == NO_LOCK) {
+         break;  // another reclaimer has it
+      }
+      do {
+         n = ReclaimPass(dir, opts, &failed);
+         deleted += n;
+      } while (n > 0);
+      UnlockDir(lock);
+
+      // a new tombstone's reclaimer may have given up because we held
+      // the lock, so look once more now that we've let go
+      if (failed || !HasTombstones(dir)) {
+         break;
+      }
+   }
+#ifdef _WIN32
+   CloseHandle(h);
+#endif
+   return deleted;
+}
+
+
+#ifdef _WIN32
+
+static void
+SpawnReclaimer(const TCHAR *dir)  // IN
+{
+   TCHAR exe[MAX_PATH];
+   TCHAR *cmd;
+   size_t len;
+   STARTUPINFO si;
+   PROCESS_INFORMATION pi;
+
+   if (GetModuleFileName(NULL, exe, MAX_PATH) == 0) {
+      return;
+   }
+   len = _tcslen(exe) + _tcslen(dir) + 32;
+   cmd = (TCHAR *) malloc(sizeof(TCHAR) * len);
+   if (!cmd) {
+      return;
+   }
+   _sntprintf(cmd, len, _T("\"%s\" --reclaim=\"%s\""), exe, dir);
+   cmd[len - 1] = _T('\0');
+
+   memset(&si, 0, sizeof(si));
+   si.cb = sizeof(si);
+   if (CreateProcess(exe, cmd, NULL, NULL, FALSE,
+                     DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP |
+                     IDLE_PRIORITY_CLASS,
+                     NULL, NULL, &si, &pi)) {
+      CloseHandle(pi.hThread);
+      CloseHandle(pi.hProcess);
+   }
+   free(cmd);
+}
+
+#else
+
+static void
+SpawnReclaimer(const char *dir)  // IN
+{
+   pid_t pid;
+   int fd;
+
+   fflush(NULL);
+   pid = fork();
+   if (pid < 0) {
+      return;
+   }
+   if (pid > 0) {
+      waitpid(pid, NULL, 0);
+      return;
+   }
+
+   // child: new session, then fork again so the reclaimer is
+   // reparented to init and can never get a controlling tty
+   setsid();
+   if (fork() != 0) {
+      _exit(0);
+   }
+
+   // let go of our caller's pipes, or a CI step waiting for the
+   // output to close would wait for the reclaimer too
+   fd = open("/dev/null", O_RDWR);
+   if (fd >= 0) {
+      dup2(fd, STDIN_FILENO);
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      if (fd > STDERR_FILENO) {
+         close(fd);
+      }
+   }
+
+   DtLowerPriority();
+   TombstoneReclaim(dir, NULL);
+   _exit(0);
+}
+
+#endif
+
+
+/**
+ * Start a detached reclaimer for every tombstone directory used by
+ * TombstoneBury() in this run. Call once all deletes are done.
+ */
+void
+TombstoneSpawnReclaimers(void)
+{
+   int i;
+
+   for (i = 0; i < numTombDirs; i++) {
+      SpawnReclaimer(tombDirs[i]);
+      free(tombDirs[i]);
+   }
+   numTombDirs = 0;
+}
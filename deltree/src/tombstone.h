@@ -0,0 +1,27 @@
+// tombstone.h
+//
+// Instant deletes: a target is renamed into a hidden tombstone
+// directory on the same filesystem, which is O(1) no matter how big
+// the tree is, and a detached low priority reclaimer process deletes
+// the tombstones afterwards.
+//
+// The tombstone directory is ".deltree-tombstones" in the highest
+// directory above the target on the same filesystem that is ours and
+// nobody else can write to, up to the home directory (the volume root
+// on Windows), so a user's deletes on a filesystem normally share one.
+// We make it private: mode 0700, or a DACL for our user alone on
+// Windows. One found there already must be a private directory of
+// ours, not a link or someone else's, or the target is deleted the
+// normal way. Each reclaimer empties the whole directory, so leftovers
+// from an interrupted reclaimer are picked up by the next one.
+
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+
+int  TombstoneBury(const TCHAR *path);
+void TombstoneSpawnReclaimers(void);
+int  TombstoneReclaim(const TCHAR *dir, const DtOptions *opts);
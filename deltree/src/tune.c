@@ -0,0 +1,127 @@
+// tune.c
+//
+// Implementation of the worker count controller, see tune.h
+//
+
+#include "tune.h"
+
+
+#define GAIN           1.05   // throughput this much better is a gain
+#define LOSS           0.90   // this much worse after growing is a loss
+#define LATENCY_LIMIT  4      // p99 this many times the best backs off
+
+
+/**
+ * Set up a controller
+ *
+ * @param t the controller
+ * @param start workers to run at first
+ * @param max most workers it may ask for
+ */
+void
+TuneInit(DtTuner *t,   // OUT
+         int start,    // IN
+         int max)      // IN
+{
+   memset(t, 0, sizeof(*t));
+   t->max = max > 0 ? max : 1;
+   t->workers = start < 1 ? 1 : start > t->max ? t->max : start;
+   t->slowStart = TRUE;
+}
+
+
+// multiplicative decrease, by a quarter but at least one
+static int
+BackOff(int workers)  // IN
+{
+   int n = workers - (workers / 4 > 1 ? workers / 4 : 1);
+
+   return n < 1 ? 1 : n;
+}
+
+
+/**
+ * Feed the controller one window of measurements
+ *
+ * @param t the controller
+ * @param opsPerSec unlinks and rmdirs per second in the window
+ * @param p99us unlink p99 in the window, 0 if unknown
+ * @param step receives the decision if there is one, secs is left to
+ *             the caller
+ * @return TRUE if the number of workers changes
+ */
+Bool
+TuneWindow(DtTuner *t,          // IN/OUT
+           double opsPerSec,    // IN
+           uint32_t p99us,      // IN
+           DtTuneStep *step)    // OUT
+{
+   int to = t->workers;
+   DtTuneReason reason = DT_TUNE_GROW;
+
+   if (p99us && t->bestP99 &&
+       p99us > (uint64_t) t->bestP99 * LATENCY_LIMIT) {
+      // the device queue is backing up
+      to = BackOff(t->workers);
+      reason = DT_TUNE_LATENCY;
+   } else if (t->prevRate > 0 && opsPerSec < t->prevRate * LOSS && t->grew) {
+      // the last workers we added made it worse
+      to = BackOff(t->workers);
+      reason = DT_TUNE_LOSS;
+   } else if (t->prevRate == 0 || opsPerSec >= t->prevRate * GAIN) {
+      to = t->slowStart ? t->workers * 2 : t->workers + 1;
+   } else {
+      t->slowStart = FALSE;  // flat, stop doubling and stay put
+   }
+   if (to > t->max) {
+      to = t->max;
+   }
+
+   if (p99us && (!t->bestP99 || p99us < t->bestP99)) {
+      t->bestP99 = p99us;
+   }
+   t->prevRate = opsPerSec;
+   if (to == t->workers) {
+      t->grew = FALSE;
+      return FALSE;
+   }
+
+   if (to < t->workers) {
+      t->slowStart = FALSE;
+   }
+   t->grew = to > t->workers;
+   step->from = t->workers;
+   step->to = to;
+   step->opsPerSec = opsPerSec;
+   step->p99us = p99us;
+   step->reason = reason;
+   t->workers = to;
+   return TRUE;
+}
+
+
+/**
+ * Upper bound in microseconds of the bucket holding the 99th
+ * percentile of a latency histogram (DT_HIST_BUCKETS log2 buckets), 0
+ * if it is empty
+ */
+uint32_t
+TuneP99(const uint64_t *hist)  // IN
+{
+   uint64_t total = 0, seen = 0;
+   int b;
+
+   for (b = 0; b < DT_HIST_BUCKETS; b++) {
+      total += hist[b];
+   }
+   if (total == 0) {
+      return 0;
+   }
+   for (b = 0; b < DT_HIST_BUCKETS - 1; b++) {
+      seen += hist[b];
+      if (seen * 100 >= total * 99) {
+         break;
+      }
+   }
+   return (uint32_t) 1 << b;
+}
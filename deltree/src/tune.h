@@ -0,0 +1,38 @@
+// tune.h
+//
+// Picks how many workers a delete should run. The right number is
+// anything from a couple on a spinning disk to dozens on NFS, where
+// every unlink is a round trip, so rather than guess it per machine
+// the engine measures.
+//
+// Every window the controller is shown the throughput and the p99
+// unlink latency the running workers achieved, and moves their number
+// AIMD style: it doubles while that pays off (slow start), then adds
+// one at a time, and cuts back by a quarter as soon as throughput
+// drops or latency blows up, which is what an overloaded device looks
+// like.
+
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+
+/**
+ * controller state
+ */
+typedef struct DtTuner_ {
+   int workers;          // running now
+   int max;              // never more than this
+   Bool slowStart;       // doubling until the first window without gain
+   Bool grew;            // the last change added workers
+   double prevRate;      // ops/s of the previous window, 0 before
+   uint32_t bestP99;     // lowest unlink p99 seen, 0 before
+} DtTuner;
+
+
+void     TuneInit(DtTuner *t, int start, int max);
+Bool     TuneWindow(DtTuner *t, double opsPerSec, uint32_t p99us,
+                    DtTuneStep *step);
+uint32_t TuneP99(const uint64_t *hist);
@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+
+# deltree regression tests: delete in-memory trees (--memfs, see
+# src/fs_mem.c) with failures and limits that are hard to set up on a
+# disk, and check what deltree says and how it exits. Lists (--from)
+# and purges run on them too. Tombstones are renamed, which the trees
+# in memory can't be, so those are reclaimed from a scratch directory.
+#
+# run them all, or the ones named
+#   ./test.py --deltree ../build/release/deltree
+#   ./test.py --deltree ../build/release/deltree journal-resume
+#
+# Journals go to a scratch state directory, never the user's.
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+EXIT_OK = 0
+EXIT_NOTHING = 1         # nothing deleted
+EXIT_PARTIAL = 2         # some of it left
+
+
+class Failed(Exception):
+    pass
+
+
+def log(msg):
+    print(msg, file=sys.stderr, flush=True)
+
+
+def run(args, spec, opts=(), paths=('/t',), timeout=60, kill_after=None,
+        stdin=None):
+    # run deltree on in-memory trees, or on the disk without a spec,
+    # returns (exit code, output). stdin is fed to it, for --from=-.
+    # With kill_after it is killed then, like a reboot would, and the
+    # exit code is None.
+    cmd = [args.deltree, '-y', '--no-progress']
+    if spec:
+        cmd.append('--memfs=' + spec)
+    cmd += list(opts) + list(paths)
+    p = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT, env=args.env,
+                         universal_newlines=True)
+    try:
+        out, _ = p.communicate(stdin or '', timeout=kill_after or timeout)
+    except subprocess.TimeoutExpired:
+        p.kill()
+        out, _ = p.communicate()
+        if not kill_after:
+            raise Failed('still running after %gs: %s\n%s' %
+                         (timeout, ' '.join(cmd), out))
+        return None, out
+    return p.returncode, out
+
+
+def expect(rc, out, want, *texts):
+    if rc != want:
+        raise Failed('exit code %s, expected %d\n%s' % (rc, want, out))
+    for t in texts:
+        if t not in out:
+            raise Failed('no "%s" in the output\n%s' % (t, out))
+
+
+def timed(fn, *a, **kw):
+    # fn's result and the seconds it took
+    begin = time.time()
+    res = fn(*a, **kw)
+    return res, time.time() - begin
+
+
+#
+# the tests, each raises Failed
+#
+
+def test_clean(args):
+    # the plain case, everything goes
+    rc, out = run(args, 'build:2e4')
+    expect(rc, out, EXIT_OK, '[done]')
+
+
+def test_fail_partial(args):
+    # some unlinks fail for good: part of the tree is left, and said so
+    rc, out = run(args, 'build:2e4,fail=0.01,seed=1')
+    expect(rc, out, EXIT_PARTIAL, '[failed/', 'Permission denied')
+
+
+def test_fail_nothing(args):
+    # the target can't even be opened, nothing deleted at all
+    rc, out = run(args, 'build:2e4,fail=1')
+    expect(rc, out, EXIT_NOTHING, '[failed/')
+
+
+def test_targets(args):
+    # the exit code covers all the targets
+    rc, out = run(args, 'wide:1000', paths=('/a', '/b'))
+    expect(rc, out, EXIT_OK, 'Total: 2 item(s)')
+    rc, out = run(args, 'wide:1000,fail=1', paths=('/a', '/b'))
+    expect(rc, out, EXIT_NOTHING, 'Total: 0 item(s)')
+
+
+def test_busy_retried(args):
+    # busy files go on the next pass
+    rc, out = run(args, 'build:2e4,busy=0.05')
+    expect(rc, out, EXIT_OK, 'retried')
+    rc, out = run(args, 'build:2e4,busy=0.05', ['--retries=0'])
+    expect(rc, out, EXIT_PARTIAL, 'busy')
+
+
+def errors(out):
+    m = re.search(r'(\d+) error\(s\)', out)
+    return int(m.group(1)) if m else 0
+
+
+def test_memory_cap(args):
+    # too little memory to queue all the subdirectories at once, and
+    # some of them stay for a file that can't go. Each is read once,
+    # whether the directory can seek back to the rest (Linux) or has to
+    # be read from the start (tell=0, like Windows).
+    opts = ['--max-memory=1M']
+    counts = []
+    for tell in ('1', '0'):
+        rc, out = run(args, 'fan:30000,locked=0.5,tell=' + tell, opts,
+                      timeout=20)
+        expect(rc, out, EXIT_PARTIAL, 'Permission denied')
+        counts.append(errors(out))
+    if counts[0] != counts[1]:
+        raise Failed('%d errors with seeking, %d without' % tuple(counts))
+    # nothing goes at all, another read won't do better
+    rc, out = run(args, 'fan:30000,locked=1', opts, timeout=20)
+    expect(rc, out, EXIT_NOTHING, 'Permission denied')
+
+
+def test_empty_dirs_capped(args):
+    # sweeping with too little memory for all the subdirectories, the
+    # ones kept for their file must not be queued again and again
+    # before the empty ones at the end are reached
+    for tell in ('1', '0'):
+        rc, out = run(args, 'fan:40000,empty=100,tell=' + tell,
+                      ['--max-memory=1M', '--empty-dirs'], timeout=20)
+        expect(rc, out, EXIT_OK, '100 empty dirs removed')
+
+
+def test_journal_resume(args):
+    # killed once it had time to note how far it got, the rerun seeks
+    # past that. The tree in memory is whole again, so it finds the
+    # directory not empty and reads it all after all.
+    rc, out = run(args, 'wide:1e5,unlink=50', kill_after=4)
+    if rc is not None:
+        raise Failed('finished before it was killed\n%s' % out)
+    rc, out = run(args, 'wide:1e5')
+    expect(rc, out, EXIT_OK, 'resumed')
+    rc, out = run(args, 'wide:1e5')
+    expect(rc, out, EXIT_OK, '[done]')
+    if 'resumed' in out:
+        raise Failed('journal still there after it was done\n%s' % out)
+
+
+def test_from(args):
+    # a listed file, whose directory ends up empty and goes too, and a
+    # listed directory. Newlines or NULs (-0) end the entries.
+    for sep, opts in (('\n', []), ('\0', ['-0'])):
+        lst = sep.join(['/t/d0/f0', '/t/d1']) + sep
+        rc, out = run(args, 'fan:5', ['--from=-'] + opts, stdin=lst)
+        expect(rc, out, EXIT_OK, '2 of 2 listed item(s) deleted, 0 missing',
+               '1 empty dir(s) removed')
+
+
+def test_from_stale(args):
+    # an entry that is gone already is missing, not deleted, and the
+    # empty directory it was in stays: it was none of ours
+    rc, out = run(args, 'fan:5,empty=3', ['-0', '--from=-'],
+                  stdin='/t/d5/nothere\0')
+    expect(rc, out, EXIT_OK, '0 of 1 listed item(s) deleted, 1 missing',
+           '0 empty dir(s) removed')
+
+
+def test_purge(args):
+    # the files over budget go, and with them the directories they
+    # leave empty, but never the top
+    rc, out = run(args, 'build:2000', ['--max-files=500'])
+    expect(rc, out, EXIT_OK, '[done] 1500 files', '500 kept')
+    rc, out = run(args, 'build:2000,size=1000', ['--max-size=1000000'])
+    expect(rc, out, EXIT_OK, '[done] 1000 files', '1000 kept')
+    rc, out = run(args, 'fan:100', ['--max-files=0'])
+    expect(rc, out, EXIT_OK, '[done] 100 files', '100 empty dirs removed')
+    # -n only counts them
+    rc, out = run(args, 'build:2000', ['-n', '--max-files=500'])
+    expect(rc, out, EXIT_OK, '[simulate] 1500 files', '500 kept')
+
+
+def test_rate_limit(args):
+    # 300 unlinks and an rmdir at 200 a second, less the burst it
+    # starts with. Lists and purges share the same limit.
+    (rc, out), secs = timed(run, args, 'wide:300', ['--max-ops=200'])
+    expect(rc, out, EXIT_OK, '[done]')
+    lst = ''.join('/t/f%d\n' % i for i in range(300))
+    (rc2, out2), secs2 = timed(run, args, 'wide:300',
+                               ['--max-ops=200', '--from=-'], stdin=lst)
+    expect(rc2, out2, EXIT_OK, '300 of 300 listed item(s) deleted')
+    (rc3, out3), secs3 = timed(run, args, 'wide:300',
+                               ['--max-ops=200', '--max-files=0'])
+    expect(rc3, out3, EXIT_OK, '[done] 300 files')
+    for what, s in (('delete', secs), ('list', secs2), ('purge', secs3)):
+        if s < 1.2:
+            raise Failed('%s of 300 files at 200/s took only %.2fs' %
+                         (what, s))
+
+
+def test_tombstone_reclaim(args):
+    # a reclaimer empties the tombstone directory but for its lock,
+    # and only one that is private to us. It leaves one that isn't.
+    scratch = tempfile.mkdtemp(prefix='deltree-tomb-', dir=args.state)
+    tomb = os.path.join(scratch, '.deltree-tombstones')
+    for mode in (0o755, 0o700):
+        for d in ('a/b', 'c'):
+            os.makedirs(os.path.join(tomb, d), exist_ok=True)
+        for f in ('a/b/f0', 'f1'):
+            open(os.path.join(tomb, f), 'w').close()
+        os.chmod(tomb, mode)
+        rc, out = run(args, None, ['--reclaim=' + tomb], paths=())
+        expect(rc, out, EXIT_OK)
+        left = sorted(os.listdir(tomb))
+        want = ['.lock'] if mode == 0o700 else ['a', 'c', 'f1']
+        if left != want:
+            raise Failed('mode %o: %s left in the tombstone directory, '
+                         'expected %s' % (mode, left, want))
+
+
+def test_exit_codes(args):
+    # 0 all of it, EXIT_PARTIAL some of it, EXIT_NOTHING none of it, for
+    # -n reading the tree, --from and purges too
+    cases = [
+        ('build:2000', ['-n'], EXIT_OK),
+        ('build:2000,fail=0.05,seed=1', ['-n'], EXIT_PARTIAL),
+        ('build:2000,fail=1', ['-n'], EXIT_NOTHING),
+        ('build:2000', ['--max-files=500'], EXIT_OK),
+        ('build:2000,locked=0.5,seed=2', ['--max-files=500'], EXIT_PARTIAL),
+        ('build:2000,locked=1', ['--max-files=500'], EXIT_NOTHING),
+    ]
+    for spec, opts, want in cases:
+        rc, out = run(args, spec, opts)
+        expect(rc, out, want)
+    lst = '/t/d0/f0\n/t/d1/f0\n/t/d2\n'
+    for spec, want in (('fan:5', EXIT_OK),
+                       ('fan:5,fail=0.3,seed=3', EXIT_PARTIAL),
+                       ('fan:5,locked=1', EXIT_NOTHING)):
+        rc, out = run(args, spec, ['--from=-'], stdin=lst)
+        expect(rc, out, want)
+
+
+TESTS = [(name[5:].replace('_', '-'), fn)
+         for name, fn in sorted(globals().items())
+         if name.startswith('test_')]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='deltree tests')
+    parser.add_argument('--deltree', required=True,
+                        help='deltree binary to test')
+    parser.add_argument('tests', nargs='*', metavar='TEST',
+                        help='tests to run [all]: %s' %
+                        ' '.join(name for name, _ in TESTS))
+    args = parser.parse_args()
+
+    unknown = set(args.tests) - set(name for name, _ in TESTS)
+    if unknown:
+        parser.error('no such test: %s' % ' '.join(sorted(unknown)))
+
+    state = tempfile.mkdtemp(prefix='deltree-test-')
+    args.state = state
+    args.env = dict(os.environ, XDG_STATE_HOME=state, LOCALAPPDATA=state)
+    failed = 0
+    try:
+        for name, fn in TESTS:
+            if args.tests and name not in args.tests:
+                continue
+            begin = time.time()
+            try:
+                fn(args)
+                log('PASS %-20s %6.2fs' % (name, time.time() - begin))
+            except Failed as e:
+                failed += 1
+                log('FAIL %-20s %6.2fs\n%s' % (name, time.time() - begin, e))
+    finally:
+        shutil.rmtree(state, ignore_errors=True)
+
+    if failed:
+        log('%d test(s) failed' % failed)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
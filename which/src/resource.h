@@ -19,6 +19,8 @@
 #define IDS_NOTFOUND5                   15
 #define IDS_NOTFOUND6                   16
 #define IDS_USER                        17
+#define IDS_SERVE_FAIL                  18
+#define IDS_SERVING                     19
 #define IDS_REMOVABLE                   32
 #define IDS_FIXED                       33
 #define IDS_REMOTE                      34
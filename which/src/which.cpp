@@ -13,8 +13,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <direct.h>
 #include <io.h>
+#include <fcntl.h>
 #include <time.h>
 #include <windows.h>
 #include <winver.h>
@@ -22,6 +24,7 @@
 #include <sys/stat.h>
 #include <tchar.h>
 #include <locale.h>
+#include <aclapi.h>
 
 #include "resource.h"
 
@@ -42,6 +45,24 @@
 #define DIR_SPACE   8        // entry has space at end
 #define DIR_NULL   16        // null entry
 #define DIR_NET    32        // network drive
+#define DIR_SLOW   64        // network dir that didn't answer in time
+
+#define PROBE_THREADS   8    // threads checking path dirs at once
+#define PROBE_MAX      64    // at most, with those stuck replaced
+#define PROBE_TIMEOUT 2000   // ms a network dir has to answer
+#define PROBE_TICK      50   // ms between looks at how they are doing
+
+#define SERVER_HELLO  _T("which 1")  // first string of every message
+#define SERVER_WAIT   500    // ms to wait for a busy server
+#define SERVER_TIMEOUT 5000  // ms a server has to answer, then we search
+#define SERVER_VIEWS   16    // paths a server keeps at once
+#define VIEW_TTL    60000    // ms before a kept path, or directory, is
+                             // looked at again
+#define MSG_MAX  16777216    // bytes in a message, at most
+
+#ifndef FILE_FLAG_FIRST_PIPE_INSTANCE
+#define FILE_FLAG_FIRST_PIPE_INSTANCE 0x00080000
+#endif
 
 #define TMP_SIZE    1024     // temp array string size
 #define ALIAS_SIZE 32768     // alias size
@@ -63,6 +84,16 @@ int rand_size;
 TCHAR szTmp[TMP_SIZE];
 TCHAR szTmp1[TMP_SIZE];
 
+struct dir_names;              // listing of a directory, see print_names()
+
+// what identifies a directory, and when its names last changed
+typedef struct {
+    DWORD volume;              // volume serial number
+    DWORD idHigh;              // file index on the volume
+    DWORD idLow;
+    FILETIME mtime;            // last write time
+} dir_stamp;
+
 // what we store with each directory in the path
 typedef struct {
     BOOL bValid;
@@ -71,8 +102,25 @@ typedef struct {
     TCHAR expanded[_MAX_PATH]; // the expanded version if applicable
     UINT type;                 // type, bit masked value
     INT value;                 // stores additional info if needed
+    BOOL bListed;              // names has been read
+    struct dir_names * names;  // what is in it, NULL if it can't be listed
+    BOOL bStamped;             // stamp is set, it can go in the index
+    dir_stamp stamp;
 } dir;
 
+// a directory which /serve has looked at, for all the paths it is in
+typedef struct {
+    LPTSTR path;               // full path, NULL if free
+    BOOL bProbed;              // type is set
+    UINT type;                 // DIR_NOEXIST and DIR_SLOW, as probed
+    DWORD built;               // tick count when first kept
+    BOOL bListed;              // names has been read
+    struct dir_names * names;  // what is in it, NULL if it can't be listed
+    HANDLE hChange;            // signaled when names change
+} served_dir;
+
+served_dir * find_served(LPCTSTR path, BOOL bAdd);
+
 typedef struct {
     BOOL bValid;
     INT id;
@@ -132,11 +180,25 @@ BOOL bSize = FALSE;
 BOOL bAliasOnly = FALSE;
 BOOL bUpdateAlias = FALSE;
 BOOL bMapping = FALSE;
+BOOL bBatch = FALSE;   // names from stdin, see batch_find()
+TCHAR cBatchEnd = _T('\n');  // what ends a name read, and a line printed
+LPCTSTR pBatchName;    // the name being looked for in batch mode
+BOOL bServe = FALSE;   // run as a server, see which_serve()
+BOOL bServing = FALSE; // answering a request, print_file() replies
+BOOL bNoServer = FALSE; // don't ask a server
 
 BOOL bIs4NT = FALSE;
 
 // 4nt alias related stuff
 TCHAR szAliasFile[_MAX_PATH];  // full path to the alias file
+
+// index of the names in the path directories, kept next to the alias
+// file, see open_index()
+TCHAR szIndexFile[_MAX_PATH];  // full path to the index file
+BOOL bRebuild = FALSE;         // don't use what is in the index
+BOOL bIndexDirty = FALSE;      // a directory was listed, write it out
+LPBYTE pIndex = NULL;          // the index mapped in, NULL if none
+DWORD nIndex;                  // its size
 TCHAR alias[ALIAS_SIZE];       // array holds alias keys
 LPCTSTR lpAlias[ALIAS_SIZE];   // pointer to alias
 INT nAlias;                    // number of alias found
@@ -160,6 +222,126 @@ INT MyLoadString(UINT nID,
 
 //////////////////////////////////////////////////////////////////////
 
+// messages between which and a which /serve, strings one after the
+// other, each with its EOS
+
+LPTSTR pSend;                  // the message being made
+INT nSend, nSendMax;           // in TCHARs
+BOOL bSendBad;                 // out of memory making it, don't send
+LPTSTR pRecv;                  // the message received, two EOS after
+INT nRecv;                     // in TCHARs, without those
+DWORD nRecvMax;                // bytes pRecv can take, without those
+INT nServeName;                // name being answered, see print_file()
+DWORD dwDeadline;              // the server has to answer by, see pipe_io()
+
+void msg_reset()
+{
+    nSend = 0;
+    bSendBad = FALSE;
+}
+
+// add a string to the message being made
+void msg_put(LPCTSTR str)
+{
+    INT n = lstrlen(str) + 1;
+    LPTSTR p;
+
+    if (nSend + n > nSendMax) {
+	nSendMax = (nSend + n) * 2;
+	if ((p = (LPTSTR) realloc(pSend, nSendMax * sizeof(TCHAR))) == NULL) {
+	    bSendBad = TRUE;
+	    nSendMax = nSend;
+	    return;
+	}
+	pSend = p;
+    }
+    lstrcpy(pSend + nSend, str);
+    nSend += n;
+}
+
+// the string after p in the message received, NULL if p was the last
+LPCTSTR msg_next(LPCTSTR p)
+{
+    p += lstrlen(p) + 1;
+    return (p < pRecv + nRecv) ? p : NULL;
+}
+
+// finish a ReadFile() or WriteFile() on hPipe that returned bOk. with
+// ov the pipe is overlapped and the call may still be going: it is
+// waited for until dwDeadline, and cancelled if it isn't done by then.
+// n gets the bytes it moved, the last error is as it would be without
+// ov, ERROR_TIMEOUT if it was cancelled.
+BOOL pipe_io(HANDLE hPipe, LPOVERLAPPED ov, BOOL bOk, LPDWORD n)
+{
+    DWORD dwErr;
+    LONG nLeft;
+
+    if (ov == NULL)
+	return bOk;
+    if (!bOk) {
+	dwErr = GetLastError();
+	if (dwErr != ERROR_IO_PENDING && dwErr != ERROR_MORE_DATA)
+	    return FALSE;
+	nLeft = (LONG) (dwDeadline - GetTickCount());
+	if (dwErr == ERROR_IO_PENDING &&
+	    WaitForSingleObject(ov->hEvent, nLeft > 0 ? nLeft : 0) !=
+	    WAIT_OBJECT_0) {
+	    CancelIo(hPipe);
+	    GetOverlappedResult(hPipe, ov, n, TRUE); // done with the buffer
+	    SetLastError(ERROR_TIMEOUT);
+	    return FALSE;
+	}
+    }
+    return GetOverlappedResult(hPipe, ov, n, FALSE);
+}
+
+// send the message made, ov as for pipe_io()
+BOOL msg_send(HANDLE hPipe, LPOVERLAPPED ov)
+{
+    DWORD n = 0;
+    BOOL bOk;
+
+    if (bSendBad)
+	return FALSE;
+    bOk = WriteFile(hPipe, pSend, nSend * sizeof(TCHAR), &n, ov);
+    return (pipe_io(hPipe, ov, bOk, &n) && n == nSend * sizeof(TCHAR));
+}
+
+// read a message into pRecv, ov as for pipe_io()
+BOOL msg_recv(HANDLE hPipe, LPOVERLAPPED ov)
+{
+    DWORD n, got = 0;
+    LPTSTR p;
+    BOOL bOk;
+
+    for (;;) {
+	if (got == nRecvMax) { // full, or nothing yet
+	    if (nRecvMax >= MSG_MAX)
+		return FALSE;
+	    nRecvMax = nRecvMax ? nRecvMax * 2 : 65536;
+	    p = (LPTSTR) realloc(pRecv, nRecvMax + 2 * sizeof(TCHAR));
+	    if (p == NULL)
+		return FALSE;
+	    pRecv = p;
+	}
+	n = 0;
+	bOk = ReadFile(hPipe, (LPBYTE) pRecv + got, nRecvMax - got, &n, ov);
+	if (pipe_io(hPipe, ov, bOk, &n)) {
+	    got += n;
+	    break;
+	}
+	got += n;
+	if (GetLastError() != ERROR_MORE_DATA)
+	    return FALSE;
+    }
+    nRecv = got / sizeof(TCHAR);
+    pRecv[nRecv] = EOS;
+    pRecv[nRecv + 1] = EOS;
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 // returns TRUE if the new path exist
 BOOL exist_path(LPCTSTR path)
 {
@@ -234,16 +416,12 @@ INT separate_path(LPCTSTR path)
 		    curr_first = FALSE; // will not insert current dir
 		}
 
-		// then check to see if it is a duplicate
+		// then check to see if it is a duplicate, whether it exists
+		// is checked for all of them at once by probe_path()
 		if ((nTmp = already_exist(sep_path, j, sep_path[j].orig)) != -1) {
 		    // copy attribute plus the dir dup attribute
 		    sep_path[j].type |= sep_path[nTmp].type | DIR_DUP;
 		    sep_path[j].value = nTmp;
-		} else { // only if not a duplicate do we check exist or not
-		    // finally check to see if it exist or not
-		    if (!exist_path(sep_path[j].orig)) { // if something & exist
-			sep_path[j].type |= DIR_NOEXIST;
-		    }
 		}
 	    } else { // a null entry
 		sep_path[j].type |= DIR_NULL;
@@ -304,6 +482,16 @@ void print_file(LPCTSTR path, LPCTSTR file, BOOL bNoEnding)
     struct _stat buf;
     struct tm * newtime;
 
+    // the server only says where, the one asking prints it
+    if (bServing) {
+	_stprintf(szTmp, _T("%d"), nServeName);
+	msg_put(szTmp);
+	msg_put(path);
+	msg_put(file);
+	msg_put(bNoEnding ? _T("1") : _T("0"));
+	return;
+    }
+
     // first generate the filename
     if (bNoEnding) {
 	_stprintf(szFilename, _T("%s\\%s"), path, file);
@@ -374,6 +562,13 @@ void print_file(LPCTSTR path, LPCTSTR file, BOOL bNoEnding)
 	}
     }
 
+    // batch mode is for programs, just the name and where it is
+    if (bBatch) {
+	_tprintf(_T("%s\t%s"), pBatchName, szFilename);
+	_puttchar(cBatchEnd);
+	return;
+    }
+
     // print out the requested info to the screen
     _tprintf(_T("%s%s%s%s%s\n"), szFileTime, szFileSize,
 	     (bTime || bSize) ? _T(" ") : _T(""),
@@ -392,6 +587,233 @@ BOOL EndInBackSlash(LPCTSTR szStr)
     return (lpLastChar && lpLastChar[0] == PATH_CHAR);
 }
 
+//////////////////////////////////////////////////////////////////////
+
+// checking the path directories
+//
+// each directory is checked on a thread of its own, PROBE_THREADS at a
+// time, so a dead network share in the path doesn't hold up the rest
+// for the whole network timeout. one on a network drive that hasn't
+// answered in PROBE_TIMEOUT is given up on and tagged DIR_SLOW, its
+// thread is left to it and another started in its place, up to
+// PROBE_MAX. those on
+// local drives are waited for, like before.
+//
+// the threads only make win32 calls, no c runtime ones, as it may be
+// the single threaded one.
+
+// checking one directory
+typedef struct {
+    INT index;                 // in sep_path
+    TCHAR path[_MAX_PATH];     // a copy, the thread may outlive sep_path
+    BOOL bUNC;                 // get its UNC name too
+    volatile LONG bStarted;    // a thread has picked it up
+    volatile LONG start;       // tick count when it did
+    volatile LONG bKnown;      // bRemote is set
+    volatile LONG bRemote;     // on a network drive
+    volatile LONG bDone;       // the below are set
+    BOOL bExist;
+    BOOL bNet;                 // what SetupUNC() tags DIR_NET
+    TCHAR expanded[_MAX_PATH]; // UNC name if bNet
+} probe_job;
+
+// the jobs of one probe_path() call, handed to its threads. one that
+// is stuck may outlive the call, so whoever lets go of it last frees
+// it. it comes from the process heap, as the threads can't free().
+typedef struct {
+    volatile LONG nRefs;       // the call's, and one per thread
+    volatile LONG nNext;       // the next job a thread picks up
+    LONG n;
+    probe_job jobs[1];         // one per directory to check
+} probe_set;
+
+// check one directory, see if it exists, and get its UNC name
+void probe_dir(probe_job * p)
+{
+    TCHAR szRoot[4];
+    BYTE cbBuf[1024];
+    UNIVERSAL_NAME_INFO * pName = (UNIVERSAL_NAME_INFO *) cbBuf;
+    DWORD dwLen = sizeof(cbBuf);
+    BOOL bDrive = (p->path[0] != EOS && p->path[1] == _T(':'));
+
+    InterlockedExchange((LPLONG) &p->start, (LONG) GetTickCount());
+    InterlockedExchange((LPLONG) &p->bStarted, TRUE);
+
+    // only those on the network get a deadline
+    if (p->path[0] == PATH_CHAR && p->path[1] == PATH_CHAR) {
+	p->bRemote = TRUE;
+    } else if (bDrive) {
+	szRoot[0] = p->path[0];
+	szRoot[1] = _T(':');
+	szRoot[2] = PATH_CHAR;
+	szRoot[3] = EOS;
+	p->bRemote = (GetDriveType(szRoot) == DRIVE_REMOTE);
+    } else { // relative to the current directory
+	p->bRemote = (GetDriveType(NULL) == DRIVE_REMOTE);
+    }
+    InterlockedExchange((LPLONG) &p->bKnown, TRUE);
+
+    p->bExist = (GetFileAttributes(p->path) != 0xFFFFFFFF);
+
+    // if has a drive letter, see if it is mapped, cannot extract out a
+    // drive letter, so UNC?
+    if (p->bUNC && p->bExist) {
+	if (bDrive) {
+	    szRoot[2] = EOS;
+	    if (WNetGetUniversalName(szRoot, // original name
+				     UNIVERSAL_NAME_INFO_LEVEL,
+				     cbBuf,
+				     &dwLen) == NO_ERROR) {
+		lstrcpyn(p->expanded, pName->lpUniversalName, _MAX_PATH);
+		p->bNet = TRUE;
+	    }
+	} else {
+	    p->bNet = TRUE;
+	}
+    }
+
+    InterlockedExchange((LPLONG) &p->bDone, TRUE);
+}
+
+void release_probes(probe_set * set)
+{
+    if (InterlockedDecrement((LPLONG) &set->nRefs) == 0)
+	HeapFree(GetProcessHeap(), 0, set);
+}
+
+DWORD WINAPI probe_thread(LPVOID arg)
+{
+    probe_set * set = (probe_set *) arg;
+    LONG i;
+    while ((i = InterlockedIncrement((LPLONG) &set->nNext) - 1) < set->n) {
+	probe_dir(&set->jobs[i]);
+    }
+    release_probes(set);
+    return 0;
+}
+
+BOOL start_probe_thread(probe_set * set)
+{
+    DWORD id;
+    HANDLE hThread;
+
+    InterlockedIncrement((LPLONG) &set->nRefs);
+    hThread = CreateThread(NULL, 0, probe_thread, set, 0, &id);
+    if (hThread == NULL) {
+	InterlockedDecrement((LPLONG) &set->nRefs);
+	return FALSE;
+    }
+    CloseHandle(hThread); // never waited on, it may never return
+    return TRUE;
+}
+
+// check all the path directories, and tag them in sep_path
+void probe_path(BOOL bUNC)
+{
+    probe_set * set;
+    probe_job * p, * jobs;
+    served_dir * s;
+    DWORD now;
+    INT i, n, nThreads = 0, nStuck;
+    BOOL bWaiting;
+
+    // everything but the duplicates, which get what the first has
+    set = (probe_set *) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+				  sizeof(probe_set) +
+				  p_size * sizeof(probe_job));
+    if (set == NULL)
+	return; // all taken to exist, they are looked at anyway
+    set->nRefs = 1;
+    jobs = set->jobs;
+    for (i = 0, n = 0; i < p_size; i++) {
+	if (sep_path[i].bValid &&
+	    sep_path[i].orig[0] != EOS &&
+	    !(sep_path[i].type & DIR_DUP)) {
+	    // the server may have checked it for another path already
+	    if (bServe && (s = find_served(sep_path[i].orig, FALSE)) != NULL &&
+		s->bProbed) {
+		sep_path[i].type |= s->type;
+		continue;
+	    }
+	    p = &jobs[n++];
+	    p->index = i;
+	    p->bUNC = bUNC;
+	    lstrcpyn(p->path, sep_path[i].orig, _MAX_PATH);
+	}
+    }
+
+    set->n = n;
+
+    for (i = 0; i < PROBE_THREADS && i < n; i++) {
+	if (start_probe_thread(set))
+	    nThreads++;
+    }
+    if (nThreads == 0) { // no threads, do them all here
+	InterlockedIncrement((LPLONG) &set->nRefs);
+	probe_thread(set);
+    }
+
+    for (;;) {
+	bWaiting = FALSE;
+	nStuck = 0;
+	now = GetTickCount();
+	for (i = 0; i < n; i++) {
+	    p = &jobs[i];
+	    if (p->bDone)
+		continue;
+	    if (p->bStarted && now - (DWORD) p->start >= PROBE_TIMEOUT &&
+		!(p->bKnown && !p->bRemote)) {
+		nStuck++;        // given up on, and its thread with it
+	    } else {
+		bWaiting = TRUE; // in time, local, or not picked up yet
+	    }
+	}
+	// keep PROBE_THREADS that aren't stuck going while there is more
+	while (set->nNext < n && nThreads - nStuck < PROBE_THREADS &&
+	       nThreads < PROBE_MAX && start_probe_thread(set)) {
+	    nThreads++;
+	}
+	if (!bWaiting || nThreads == nStuck)
+	    break;
+	Sleep(PROBE_TICK);
+    }
+
+    // tag them in path order
+    for (i = 0; i < n; i++) {
+	p = &jobs[i];
+	if (!p->bDone) {
+	    sep_path[p->index].type |= DIR_SLOW;
+	    continue;
+	}
+	if (!p->bExist) {
+	    sep_path[p->index].type |= DIR_NOEXIST;
+	}
+	if (p->bNet) {
+	    sep_path[p->index].type |= DIR_NET;
+	    lstrcpyn(sep_path[p->index].expanded, p->expanded, _MAX_PATH);
+	}
+    }
+
+    // the server keeps them for the other paths they are in
+    for (i = 0; bServe && i < n; i++) {
+	if ((s = find_served(jobs[i].path, TRUE)) != NULL) {
+	    s->type = sep_path[jobs[i].index].type & (DIR_NOEXIST | DIR_SLOW);
+	    s->bProbed = TRUE;
+	}
+    }
+
+    // the duplicates are as the first one
+    for (i = 0; i < p_size; i++) {
+	if (sep_path[i].bValid && (sep_path[i].type & DIR_DUP)) {
+	    sep_path[i].type |= sep_path[sep_path[i].value].type &
+		(DIR_NOEXIST | DIR_SLOW);
+	}
+    }
+
+    // threads still at it keep it until they are done, if ever
+    release_probes(set);
+}
+
 // print all files that matches the wild card, if used
 // version information is also printed here
 INT print_all(LPCTSTR file, LPCTSTR path)
@@ -448,6 +870,730 @@ INT has_extension(LPCTSTR file)
     return 0;
 }
 
+BOOL RegMatch(LPCTSTR lpA, LPCTSTR lpB);
+
+//////////////////////////////////////////////////////////////////////
+
+// directory listing cache
+//
+// instead of a _tfindfirst() for every extension in every directory,
+// which is a round trip each on a network drive, each directory is
+// listed once the first time it is searched and the names kept in a
+// hash set, so the extensions and any other names asked for in the
+// same run are looked up in memory.
+
+// the names in one directory
+struct dir_names {
+    INT count;                 // number of entries
+    LPTSTR pool;               // long name, then 8.3 name, of each entry
+    INT * entry;               // where each entry starts in pool
+    INT * table;               // hash table, entry index + 1, 0 if empty
+    UINT mask;                 // table size - 1, size is a power of 2
+    BOOL bMapped;              // the above point into the index file
+};
+
+// hash of a name, not case sensitive like the file system
+UINT name_hash(LPCTSTR name)
+{
+    UINT h = 2166136261u;      // fnv-1a
+    for (; name[0] != EOS; name++) {
+	h = (h ^ (UINT) _totupper(name[0])) * 16777619u;
+    }
+    return h;
+}
+
+// same name, not case sensitive
+BOOL name_equal(LPCTSTR a, LPCTSTR b)
+{
+    for (; a[0] != EOS; a++, b++) {
+	if (_totupper(a[0]) != _totupper(b[0]))
+	    return FALSE;
+    }
+    return (b[0] == EOS);
+}
+
+// the long and 8.3 name of an entry
+LPCTSTR long_name(const dir_names * d, INT i)
+{
+    return d->pool + d->entry[i];
+}
+
+LPCTSTR short_name(const dir_names * d, INT i)
+{
+    LPCTSTR p = long_name(d, i);
+    return p + lstrlen(p) + 1;
+}
+
+// add entry i to the hash table under key
+void insert_name(dir_names * d, INT i, LPCTSTR key)
+{
+    UINT h = name_hash(key) & d->mask;
+    while (d->table[h] != 0) {
+	h = (h + 1) & d->mask;
+    }
+    d->table[h] = i + 1;
+}
+
+// index of the entry named name, by its long or 8.3 name, -1 if none
+INT find_name(const dir_names * d, LPCTSTR name)
+{
+    UINT h = name_hash(name) & d->mask;
+    INT i;
+    while ((i = d->table[h]) != 0) {
+	if (name_equal(name, long_name(d, i - 1)) ||
+	    name_equal(name, short_name(d, i - 1)))
+	    return i - 1;
+	h = (h + 1) & d->mask;
+    }
+    return -1;
+}
+
+void free_names(dir_names * d)
+{
+    if (d) {
+	if (!d->bMapped) {
+	    free(d->pool);
+	    free(d->entry);
+	    free(d->table);
+	}
+	free(d);
+    }
+}
+
+// list a directory into a name set, NULL if it can't be listed
+dir_names * read_names(LPCTSTR path)
+{
+    TCHAR pattern[_MAX_PATH];
+    WIN32_FIND_DATA fd;
+    HANDLE hFind;
+    dir_names * d;
+    INT used = 0, size = 0, slots = 0, nLong, nShort, i;
+    LPTSTR pool;
+    INT * entry;
+    BOOL bFull = FALSE;
+
+    if ((d = (dir_names *) calloc(1, sizeof(dir_names))) == NULL)
+	return NULL;
+
+    make_file(pattern, path, _T("*"));
+    if ((hFind = FindFirstFile(pattern, &fd)) == INVALID_HANDLE_VALUE) {
+	if (GetLastError() != ERROR_FILE_NOT_FOUND) { // not just empty
+	    free(d);
+	    return NULL;
+	}
+    } else {
+	do {
+	    if (lstrcmp(fd.cFileName, _T(".")) == 0 ||
+		lstrcmp(fd.cFileName, _T("..")) == 0)
+		continue;
+	    nLong = lstrlen(fd.cFileName) + 1;
+	    nShort = lstrlen(fd.cAlternateFileName) + 1;
+	    while (!bFull && used + nLong + nShort > size) {
+		size = size ? size * 2 : 4096;
+		pool = (LPTSTR) realloc(d->pool, size * sizeof(TCHAR));
+		if (pool == NULL)
+		    bFull = TRUE;
+		else
+		    d->pool = pool;
+	    }
+	    if (!bFull && d->count == slots) {
+		slots = slots ? slots * 2 : 256;
+		entry = (INT *) realloc(d->entry, slots * sizeof(INT));
+		if (entry == NULL)
+		    bFull = TRUE;
+		else
+		    d->entry = entry;
+	    }
+	    if (bFull)
+		break;
+	    d->entry[d->count++] = used;
+	    lstrcpy(d->pool + used, fd.cFileName);
+	    lstrcpy(d->pool + used + nLong, fd.cAlternateFileName);
+	    used += nLong + nShort;
+	} while (FindNextFile(hFind, &fd));
+	i = GetLastError();
+	FindClose(hFind);
+	if (bFull || i != ERROR_NO_MORE_FILES) { // out of memory or listing failed
+	    free_names(d);
+	    return NULL;
+	}
+    }
+
+    // table at most half full, with both names of every entry in it
+    for (d->mask = 15; d->mask + 1 < (UINT) d->count * 4; ) {
+	d->mask = d->mask * 2 + 1;
+    }
+    if ((d->table = (INT *) calloc(d->mask + 1, sizeof(INT))) == NULL) {
+	free_names(d);
+	return NULL;
+    }
+    for (i = 0; i < d->count; i++) {
+	insert_name(d, i, long_name(d, i));
+	if (short_name(d, i)[0] != EOS)
+	    insert_name(d, i, short_name(d, i));
+    }
+    return d;
+}
+
+// names the listing can't answer the way _tfindfirst() would: those
+// with a sub directory in them, and those ending in a dot or space,
+// which windows strips before looking
+BOOL needs_probe(LPCTSTR file)
+{
+    INT n = lstrlen(file);
+    if (n == 0 || file[n - 1] == EXT_CHAR || file[n - 1] == _T(' '))
+	return TRUE;
+    for (; file[0] != EOS; file++) {
+	if (file[0] == PATH_CHAR || file[0] == _T('/'))
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+// persistent index
+//
+// the names listed in each directory are kept in which.idx, next to
+// the alias file, for the next run. each directory in it has its
+// stamp: the volume and file index say it is the same directory, the
+// last write time, which changes when a name in it is added, removed
+// or renamed, says its names are still good. a directory whose stamp
+// matches isn't listed again, its names are used right out of the
+// mapped file, laid out the same as a dir_names. only NTFS and ReFS
+// are trusted to keep that time, directories on anything else are
+// listed every time.
+//
+// the file is only ever replaced whole, by renaming a new one over
+// it, so any number of which can read it at the same time without
+// locking, and a reader never sees one half written.
+
+#define INDEX_MAGIC   0x58444957  // "WIDX"
+#define INDEX_VERSION 1
+#define INDEX_DIRS    256         // most directories kept in the index
+
+typedef struct {
+    DWORD magic;
+    DWORD version;
+    DWORD tchar;               // sizeof(TCHAR) of the which that wrote it
+    DWORD size;                // of the whole file
+    DWORD ndirs;               // index_dir following this
+} index_header;
+
+// one directory, offsets are from the start of the file
+typedef struct {
+    dir_stamp stamp;
+    DWORD path;                // the directory as it is in the path
+    DWORD pool;                // dir_names.pool
+    DWORD poolLen;             // in TCHARs, ends in two EOS
+    DWORD entry;               // dir_names.entry
+    DWORD count;
+    DWORD table;               // dir_names.table
+    DWORD mask;
+} index_dir;
+
+// the index being written
+LPBYTE pOut;
+DWORD nOut, nOutMax;
+
+// get the stamp of a directory, FALSE if it can't be had
+BOOL get_stamp(LPCTSTR path, dir_stamp * s)
+{
+    BY_HANDLE_FILE_INFORMATION fi;
+    HANDLE hDir;
+    BOOL bOk;
+
+    hDir = CreateFile(path, 0,
+		      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		      NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (hDir == INVALID_HANDLE_VALUE)
+	return FALSE;
+    bOk = GetFileInformationByHandle(hDir, &fi);
+    CloseHandle(hDir);
+    if (!bOk)
+	return FALSE;
+
+    s->volume = fi.dwVolumeSerialNumber;
+    s->idHigh = fi.nFileIndexHigh;
+    s->idLow = fi.nFileIndexLow;
+    s->mtime = fi.ftLastWriteTime;
+    return TRUE;
+}
+
+// does the file system path is on update a directory's last write time
+// whenever a name in it changes. FAT doesn't for directories, and
+// other file systems and redirectors may not either, so only NTFS and
+// ReFS are taken at their word.
+BOOL mtime_kept(LPCTSTR path)
+{
+    static TCHAR szRoot[_MAX_PATH];   // the volume last asked about
+    static BOOL bKept;
+    TCHAR szName[_MAX_PATH], szFs[MAX_PATH + 1];
+
+    if (!GetVolumePathName(path, szName, _MAX_PATH))
+	return FALSE;
+    if (szRoot[0] == EOS || lstrcmpi(szName, szRoot) != 0) {
+	bKept = (GetVolumeInformation(szName, NULL, 0, NULL, NULL, NULL,
+				      szFs, MAX_PATH + 1) &&
+		 (lstrcmpi(szFs, _T("NTFS")) == 0 ||
+		  lstrcmpi(szFs, _T("ReFS")) == 0));
+	lstrcpy(szRoot, szName);
+    }
+    return bKept;
+}
+
+BOOL same_stamp(const dir_stamp * a, const dir_stamp * b)
+{
+    return (a->volume == b->volume &&
+	    a->idHigh == b->idHigh &&
+	    a->idLow == b->idLow &&
+	    a->mtime.dwHighDateTime == b->mtime.dwHighDateTime &&
+	    a->mtime.dwLowDateTime == b->mtime.dwLowDateTime);
+}
+
+// map the index in, if there is a good one
+void open_index()
+{
+    const index_header * h;
+    HANDLE hFile, hMap;
+    DWORD size;
+
+    hFile = CreateFile(szIndexFile, GENERIC_READ,
+		       FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		       OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+	return;
+    size = GetFileSize(hFile, NULL);
+    if (size != 0xFFFFFFFF && size >= sizeof(index_header)) {
+	hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hMap) {
+	    pIndex = (LPBYTE) MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	    CloseHandle(hMap); // the view keeps it
+	}
+    }
+    CloseHandle(hFile);
+    if (pIndex == NULL)
+	return;
+
+    h = (const index_header *) pIndex;
+    if (h->magic != INDEX_MAGIC ||
+	h->version != INDEX_VERSION ||
+	h->tchar != sizeof(TCHAR) ||
+	h->size != size ||
+	h->ndirs > (size - sizeof(index_header)) / sizeof(index_dir)) {
+	UnmapViewOfFile(pIndex);
+	pIndex = NULL;
+	return;
+    }
+    nIndex = size;
+}
+
+void close_index()
+{
+    if (pIndex) {
+	UnmapViewOfFile(pIndex);
+	pIndex = NULL;
+    }
+}
+
+const index_dir * index_dirs(DWORD * ndirs)
+{
+    *ndirs = ((const index_header *) pIndex)->ndirs;
+    return (const index_dir *) (pIndex + sizeof(index_header));
+}
+
+// is n items of size bytes at off inside the index, and aligned
+BOOL index_has(DWORD off, DWORD n, DWORD size)
+{
+    return ((off & 3) == 0 && off <= nIndex &&
+	    n <= (nIndex - off) / size);
+}
+
+// the path of a directory in the index, NULL if it is bad
+LPCTSTR index_path(const index_dir * x)
+{
+    LPCTSTR p = (LPCTSTR) (pIndex + x->path);
+    DWORD i, n;
+
+    if (!index_has(x->path, 0, sizeof(TCHAR)))
+	return NULL;
+    n = (nIndex - x->path) / sizeof(TCHAR);
+    for (i = 0; i < n; i++) {
+	if (p[i] == EOS)
+	    return p;
+    }
+    return NULL;
+}
+
+// the names of a directory in the index, NULL if they are bad. it only
+// takes a bad disk to get one, but it mustn't take which down.
+dir_names * index_names(const index_dir * x)
+{
+    dir_names * d;
+    LPCTSTR pool;
+    const INT * entry, * table;
+    DWORD i, nEmpty = 0;
+
+    if (x->mask > nIndex / sizeof(INT) ||
+	(x->mask & (x->mask + 1)) != 0 ||            // power of 2
+	x->count >= (x->mask + 1) / 2 ||             // room for misses
+	x->poolLen < 2 ||
+	!index_has(x->pool, x->poolLen, sizeof(TCHAR)) ||
+	!index_has(x->entry, x->count, sizeof(INT)) ||
+	!index_has(x->table, x->mask + 1, sizeof(INT)))
+	return NULL;
+
+    pool = (LPCTSTR) (pIndex + x->pool);
+    entry = (const INT *) (pIndex + x->entry);
+    table = (const INT *) (pIndex + x->table);
+    if (pool[x->poolLen - 1] != EOS || pool[x->poolLen - 2] != EOS)
+	return NULL;
+    for (i = 0; i < x->count; i++) {
+	if (entry[i] < 0 || (DWORD) entry[i] >= x->poolLen - 1)
+	    return NULL;
+    }
+    for (i = 0; i <= x->mask; i++) {
+	if (table[i] < 0 || (DWORD) table[i] > x->count)
+	    return NULL;
+	if (table[i] == 0)
+	    nEmpty++;
+    }
+    if (nEmpty == 0)  // find_name() would never stop
+	return NULL;
+
+    if ((d = (dir_names *) calloc(1, sizeof(dir_names))) == NULL)
+	return NULL;
+    d->count = x->count;
+    d->pool = (LPTSTR) pool;
+    d->entry = (INT *) entry;
+    d->table = (INT *) table;
+    d->mask = x->mask;
+    d->bMapped = TRUE;
+    return d;
+}
+
+// names of directory path from the index, NULL if it isn't there or
+// has changed since
+dir_names * index_find(LPCTSTR path, const dir_stamp * s)
+{
+    const index_dir * x;
+    LPCTSTR p;
+    DWORD i, n;
+
+    if (pIndex == NULL)
+	return NULL;
+    x = index_dirs(&n);
+    for (i = 0; i < n; i++) {
+	if ((p = index_path(x + i)) != NULL && lstrcmpi(p, path) == 0) {
+	    if (!same_stamp(&x[i].stamp, s))
+		return NULL;
+	    return index_names(x + i);
+	}
+    }
+    return NULL;
+}
+
+// get the names in path directory j, from the index if they are still
+// good there, otherwise by listing it
+void list_dir(INT j)
+{
+    LPCTSTR path = sep_path[j].orig;
+    served_dir * s;
+
+    sep_path[j].bListed = TRUE;
+
+    // the server keeps them until told they changed, not in the index,
+    // for every path the directory is in. told from before listing, so
+    // a change while we list is caught.
+    if (bServing) {
+	if ((s = find_served(path, TRUE)) == NULL)
+	    return; // out of memory, looked for with _tfindfirst()
+	if (!s->bListed) {
+	    s->bListed = TRUE;
+	    if (s->hChange == NULL) {
+		s->hChange =
+		    FindFirstChangeNotification(path, FALSE,
+						FILE_NOTIFY_CHANGE_FILE_NAME |
+						FILE_NOTIFY_CHANGE_DIR_NAME);
+		if (s->hChange == INVALID_HANDLE_VALUE)
+		    s->hChange = NULL;
+	    }
+	    s->names = read_names(path);
+	}
+	sep_path[j].names = s->names;
+	return;
+    }
+
+    // the stamp is taken before listing, so a change made while we list
+    // leaves the index out of date, and the next run lists it again
+    if (mtime_kept(path) && get_stamp(path, &sep_path[j].stamp)) {
+	sep_path[j].bStamped = TRUE;
+	if (!bRebuild &&
+	    (sep_path[j].names = index_find(path, &sep_path[j].stamp)) != NULL)
+	    return;
+	bIndexDirty = TRUE;
+    }
+    sep_path[j].names = read_names(path);
+}
+
+// append len bytes to the index being written, 4 byte aligned, returns
+// where they went, 0 if out of memory
+DWORD index_put(LPCVOID data, DWORD len)
+{
+    DWORD off = (nOut + 3) & ~3;
+    LPBYTE p;
+
+    if (off + len > nOutMax) {
+	nOutMax = (off + len) * 2;
+	if ((p = (LPBYTE) realloc(pOut, nOutMax)) == NULL)
+	    return 0;
+	pOut = p;
+    }
+    memset(pOut + nOut, 0, off - nOut);
+    memcpy(pOut + off, data, len);
+    nOut = off + len;
+    return off;
+}
+
+// add a directory and its names to the index being written, as the
+// k'th one
+BOOL index_add(DWORD k, LPCTSTR path, const dir_stamp * s,
+	       const dir_names * d)
+{
+    static const TCHAR pad[2] = {EOS, EOS};
+    index_dir x;
+    DWORD used = 0;
+
+    // the pool is as long as the end of the last entry's 8.3 name
+    if (d->count > 0) {
+	LPCTSTR last = short_name(d, d->count - 1);
+	used = (DWORD) (last - d->pool) + lstrlen(last) + 1;
+    }
+
+    x.stamp = *s;
+    x.path = index_put(path, (lstrlen(path) + 1) * sizeof(TCHAR));
+    x.pool = index_put(d->pool, used * sizeof(TCHAR));
+    if (index_put(pad, sizeof(pad)) == 0) // two EOS after, see index_names()
+	return FALSE;
+    x.poolLen = used + 2;
+    x.entry = index_put(d->entry, d->count * sizeof(INT));
+    x.count = d->count;
+    x.table = index_put(d->table, (d->mask + 1) * sizeof(INT));
+    x.mask = d->mask;
+    if (!x.path || !x.pool || !x.entry || !x.table)
+	return FALSE;
+
+    memcpy(pOut + sizeof(index_header) + k * sizeof(index_dir), &x,
+	   sizeof(x));
+    return TRUE;
+}
+
+// is path one of the directories stamped in this run
+BOOL stamped_now(LPCTSTR path)
+{
+    INT j;
+    for (j = 0; j < p_size; j++) {
+	if (sep_path[j].bStamped && lstrcmpi(sep_path[j].orig, path) == 0)
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+// write the index out if a directory was listed: the directories of
+// this run, then those of other paths that were in the old one
+void write_index()
+{
+    TCHAR szNew[_MAX_PATH + 16];
+    const index_dir * x = NULL;
+    index_header h;
+    dir_names * d;
+    LPCTSTR p;
+    DWORD i, n = 0, k = 0, nOld = 0;
+    HANDLE hFile;
+    BOOL bOk;
+    INT j;
+
+    if (!bIndexDirty)
+	return;
+
+    for (j = 0; j < p_size; j++) {
+	if (sep_path[j].bStamped && sep_path[j].names)
+	    n++;
+    }
+    if (pIndex) {
+	x = index_dirs(&nOld);
+	n += nOld;
+    }
+    if (n > INDEX_DIRS)
+	n = INDEX_DIRS;
+
+    // the header and the directories first, filled in as we go
+    nOut = sizeof(index_header) + n * sizeof(index_dir);
+    nOutMax = nOut + 65536;
+    bOk = ((pOut = (LPBYTE) calloc(nOutMax, 1)) != NULL);
+    for (j = 0; bOk && j < p_size && k < n; j++) {
+	if (sep_path[j].bStamped && sep_path[j].names) {
+	    bOk = index_add(k++, sep_path[j].orig, &sep_path[j].stamp,
+			    sep_path[j].names);
+	}
+    }
+    for (i = 0; bOk && i < nOld && k < n; i++) {
+	if ((p = index_path(x + i)) != NULL && !stamped_now(p) &&
+	    (d = index_names(x + i)) != NULL) {
+	    bOk = index_add(k++, p, &x[i].stamp, d);
+	    free_names(d);
+	}
+    }
+
+    // the names of this run may point into the old index, done with it
+    close_index();
+
+    if (bOk) {
+	h.magic = INDEX_MAGIC;
+	h.version = INDEX_VERSION;
+	h.tchar = sizeof(TCHAR);
+	h.size = nOut;
+	h.ndirs = k;
+	memcpy(pOut, &h, sizeof(h));
+
+	// write it next to the old one, then rename it over
+	_stprintf(szNew, _T("%s.%lu"), szIndexFile,
+		  (unsigned long) GetCurrentProcessId());
+	hFile = CreateFile(szNew, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			   FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile != INVALID_HANDLE_VALUE) {
+	    bOk = (WriteFile(hFile, pOut, nOut, &i, NULL) && i == nOut);
+	    CloseHandle(hFile);
+	    // fails if another which has the old one open, it is written
+	    // again by the next run that lists something
+	    if (!bOk || !MoveFileEx(szNew, szIndexFile,
+				    MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFile(szNew);
+	    }
+	}
+    }
+    free(pOut);
+    pOut = NULL;
+}
+
+// does the name have * or ?
+BOOL has_wildcard(LPCTSTR file)
+{
+    for (; file[0] != EOS; file++) {
+	if (file[0] == _T('*') || file[0] == _T('?'))
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+// FindFirstFile() doesn't take * and ? the way RegMatch() does: it
+// turns them into these first (see dos_pattern()), so that *.* also
+// matches names without a dot, and ? matches nothing only at a dot or
+// at the end of the name
+#define DOS_STAR _T('<')  // up to the last dot of the name
+#define DOS_QM   _T('>')  // one char, or none at a dot or the end
+#define DOS_DOT  _T('"')  // a dot, or nothing at the end
+
+// file with its wild cards the way FindFirstFile() reads them
+void dos_pattern(LPTSTR target, LPCTSTR file)
+{
+    if (lstrcmp(file, _T("*.*")) == 0) {
+	lstrcpy(target, _T("*"));
+	return;
+    }
+    for (; file[0] != EOS; file++, target++) {
+	if (file[0] == _T('?')) {
+	    target[0] = DOS_QM;
+	} else if (file[0] == EXT_CHAR &&
+		   (file[1] == _T('?') || file[1] == _T('*') || file[1] == EOS)) {
+	    target[0] = DOS_DOT;
+	} else if (file[0] == _T('*') && file[1] == EXT_CHAR) {
+	    target[0] = DOS_STAR;
+	} else {
+	    target[0] = file[0];
+	}
+    }
+    target[0] = EOS;
+}
+
+// does name match the pattern from dos_pattern(), the way
+// FindFirstFile() would find it
+BOOL dos_match(LPCTSTR lpPat, LPCTSTR lpName)
+{
+    LPCTSTR lpDot;
+
+    switch (lpPat[0]) {
+    case EOS:
+	return lpName[0] == EOS;
+    case _T('*'):
+	for (;; lpName++) {
+	    if (dos_match(lpPat + 1, lpName))
+		return TRUE;
+	    if (lpName[0] == EOS)
+		return FALSE;
+	}
+    case DOS_STAR:
+	lpDot = _tcsrchr(lpName, EXT_CHAR);
+	for (;; lpName++) {
+	    if (dos_match(lpPat + 1, lpName))
+		return TRUE;
+	    if (lpName[0] == EOS || lpName == lpDot)
+		return FALSE;
+	}
+    case DOS_QM:
+	if (lpName[0] == EOS || lpName[0] == EXT_CHAR)
+	    return dos_match(lpPat + 1, lpName);
+	return dos_match(lpPat + 1, lpName + 1);
+    case DOS_DOT:
+	if (lpName[0] == EXT_CHAR)
+	    return dos_match(lpPat + 1, lpName + 1);
+	return lpName[0] == EOS && dos_match(lpPat + 1, lpName);
+    default:
+	return _totupper(lpPat[0]) == _totupper(lpName[0]) &&
+	    dos_match(lpPat + 1, lpName + 1);
+    }
+}
+
+// print all files in path directory j matching file, which may have
+// wild cards. same as print_all(), but out of the listing of j.
+INT print_names(INT j, LPCTSTR file)
+{
+    TCHAR filename[_MAX_PATH];
+    LPCTSTR path = sep_path[j].orig;
+    dir_names * d;
+    BOOL no_ending = !EndInBackSlash(path);
+    INT i, found = 0;
+
+    if (!sep_path[j].bListed) {
+	list_dir(j);
+    }
+    if ((d = sep_path[j].names) == NULL || needs_probe(file)) {
+	make_file(filename, path, file);
+	return print_all(filename, path);
+    }
+
+    if (!has_wildcard(file)) {
+	if ((i = find_name(d, file)) == -1)
+	    return 0;
+	bFound = TRUE;
+	print_file(path, long_name(d, i), no_ending);
+	return 1;
+    }
+
+    // wild cards, go through the names in the order they were listed
+    dos_pattern(filename, file);
+    for (i = 0; i < d->count; i++) {
+	if (dos_match(filename, long_name(d, i)) ||
+	    (short_name(d, i)[0] != EOS &&
+	     dos_match(filename, short_name(d, i)))) {
+	    bFound = TRUE;
+	    print_file(path, long_name(d, i), no_ending);
+	    found = 1;
+	}
+    }
+    return found;
+}
+
 // this file looks into the path to see where the file is
 void path_find(LPCTSTR file)
 {
@@ -461,9 +1607,9 @@ void path_find(LPCTSTR file)
 	    if (sep_path[j].bValid &&                // if valid
 		sep_path[j].orig[0] != EOS &&       // has something
 		!(sep_path[j].type & DIR_DUP) &&     // not duplicated
+		!(sep_path[j].type & DIR_SLOW) &&    // answered in time
 		!(sep_path[j].type & DIR_NOEXIST)) { // and exist
-		make_file(filename, sep_path[j].orig, file);
-		print_all(filename, sep_path[j].orig);
+		print_names(j, file);
 	    }
 	}
 
@@ -475,9 +1621,12 @@ void path_find(LPCTSTR file)
 		if (sep_path[j].bValid &&                // if valid
 		    sep_path[j].orig[0] != EOS &&       // has something
 		    !(sep_path[j].type & DIR_DUP) &&     // not duplicated
+		    !(sep_path[j].type & DIR_SLOW) &&    // answered in time
 		    !(sep_path[j].type & DIR_NOEXIST)) { // and exist
-		    make_file(filename, sep_path[j].orig, file, order[i]);
-		    print_all(filename, sep_path[j].orig);
+		    lstrcpyn(filename, file, _MAX_PATH - 5);
+		    lstrcat(filename, _T("."));
+		    lstrcat(filename, order[i]);
+		    print_names(j, filename);
 		}
 	    }
 	}
@@ -504,7 +1653,7 @@ void print_path(void)
 	    } else {
 		sTmp[0] = EOS;
 	    }
-	    _tprintf(_T("[%*d] %c%c%c%c%c%c  %s%s\n"),
+	    _tprintf(_T("[%*d] %c%c%c%c%c%c%c  %s%s\n"),
 		     nWidth,
 		     j++,
 		     (sep_path[i].type & DIR_CWD) ? _T('*') : _T('_'),
@@ -513,6 +1662,7 @@ void print_path(void)
 		     (sep_path[i].type & DIR_DUP) ? _T('D') : _T('_'),
 		     (sep_path[i].type & DIR_NULL) ? _T('E') : _T('_'),
 		     (sep_path[i].type & DIR_SPACE) ? _T('S') : _T('_'),
+		     (sep_path[i].type & DIR_SLOW) ? _T('T') : _T('_'),
 		     sep_path[i].orig,
 		     sTmp);
 	}
@@ -530,6 +1680,49 @@ void setup_path(LPCTSTR p)
     }
 }
 
+// parse the path into sep_path, using cwd, bIs4NT, bPath and bCurDir,
+// and check its directories
+void build_path(LPCTSTR pVal, BOOL bUNC)
+{
+    INT i, nDirs;  // number of directories in path
+
+    curr_first = TRUE;
+    if (pVal) { // if env var found
+	nDirs = GetNumDirInPath(pVal) + 1;
+    } else { // no PATH env defined, so just current dir
+	nDirs = 1;
+    }
+    sep_path = new dir[nDirs]; // might insert current dir
+    for (i = 0; i < nDirs; i++) {
+	sep_path[i].bListed = FALSE;
+	sep_path[i].names = NULL;
+	sep_path[i].bStamped = FALSE;
+	sep_path[i].expanded[0] = EOS;
+    }
+
+    if (bIs4NT || !bPath) {   // if is 4nt, just reserve space
+	sep_path[0].bValid = FALSE;
+    } else {        // if not 4nt, then first is always current dir
+	sep_path[0].bValid = TRUE;   // tag it valid
+	if (bAliasOnly)
+	    bAliasOnly = FALSE; // alias only search not applicable
+    }
+    sep_path[0].type = DIR_CWD;  // first dir, can't be dup or invalid
+    lstrcpyn(sep_path[0].orig, cwd, _MAX_PATH);
+
+    p_size = 1; // reserve space for the curr dir if need insert
+
+    // setup the sep_path array
+    if (!bCurDir) {         // if not only current dir
+	setup_path(pVal);
+    } else if (!sep_path[0].bValid) { // only if first pos is still not valid
+	sep_path[0].bValid = TRUE;   // tag it valid
+    }
+
+    // see which dirs exist, and their UNC names if printing the path
+    probe_path(bUNC);
+}
+
 // this function detects to see if 4nt is running
 int Is4NT()
 {
@@ -574,6 +1767,7 @@ void AliasFile()
 
     // build the filename
     make_file(szAliasFile, szTemp, _T("which.tmp"));
+    make_file(szIndexFile, szTemp, _T("which.idx"));
 
 }
 
@@ -691,6 +1885,426 @@ void FindAliasMatch(LPCTSTR lpFile)
     }
 }
 
+// look for one name in batch mode, a name that isn't found is printed
+// with nothing after the tab, so every name gets an answer
+void batch_name(LPCTSTR name)
+{
+    bFound = FALSE;
+    pBatchName = name;
+    path_find(name);
+    if (!bFound) {
+	_tprintf(_T("%s\t"), name);
+	_puttchar(cBatchEnd);
+    }
+    fflush(stdout); // the caller may be waiting for it
+}
+
+// batch mode, look for the names read from stdin, one per line or
+// separated by nul, using the path as parsed and listed once for all.
+// each is answered as soon as it is read, so a program can keep which
+// running on a pipe and ask as it goes.
+void batch_find()
+{
+    char line[_MAX_PATH];
+    TCHAR name[_MAX_PATH];
+    INT c, n = 0;
+
+    _setmode(_fileno(stdin), _O_BINARY); // keep any \r, dropped below
+    do {
+	c = getchar();
+	if (c != EOF && c != (INT) cBatchEnd) {
+	    if (n < _MAX_PATH - 1) // too long to be a name, cut
+		line[n++] = (char) c;
+	    continue;
+	}
+	if (n > 0 && line[n - 1] == '\r')
+	    n--;
+	if (n == 0) // blank line
+	    continue;
+	line[n] = '\0';
+	n = 0;
+#ifdef UNICODE
+	if (MultiByteToWideChar(CP_ACP, 0, line, -1, name, _MAX_PATH) == 0)
+	    continue;
+#else
+	lstrcpyn(name, line, _MAX_PATH);
+#endif
+	batch_name(name);
+    } while (c != EOF);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+// which /serve
+//
+// a which left running, answering the searches of the others over a
+// named pipe, so they skip parsing and checking the path, and listing
+// its directories. it keeps a parsed path for each environment that
+// asks, and for every directory in any of them whether it is there and
+// the names in it, watching each one listed for names added, removed
+// or renamed, to list again only those. a which asking gets back where
+// the files are, and prints them itself, with /v /t /s as usual. if
+// there is no server, or it doesn't answer in SERVER_TIMEOUT, which
+// searches by itself as always.
+
+// a path kept by the server, as parsed for one environment
+typedef struct {
+    LPTSTR key;                // flags and the path, NULL if free
+    TCHAR cwd[_MAX_PATH];      // the current directory it was parsed in
+    dir * path;                // its sep_path
+    INT size;                  // and p_size
+    DWORD built;               // tick count when parsed
+    DWORD used;                // last asked for
+} path_view;
+
+path_view views[SERVER_VIEWS];
+
+// the directories of all the views, each once
+served_dir * served;
+INT nServed, nServedMax;
+
+TCHAR szServeDir[_MAX_PATH];   // current directory between requests
+
+// the pipe, one per user
+void pipe_name(LPTSTR szPipe)
+{
+    TCHAR szName[256];
+    DWORD n = 256;
+
+    if (!GetUserName(szName, &n)) {
+	lstrcpy(szName, _T("which"));
+    }
+    _stprintf(szPipe, _T("\\\\.\\pipe\\which-%s"), szName);
+}
+
+// was the pipe made by one running as us, so nobody else can answer
+// in place of the server
+BOOL own_pipe(HANDLE hPipe)
+{
+    PSID pOwner;
+    PSECURITY_DESCRIPTOR pSD;
+    HANDLE hToken;
+    BYTE cbOwner[256];
+    DWORD n;
+    BOOL bOk = FALSE;
+
+    if (GetSecurityInfo(hPipe, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION,
+			&pOwner, NULL, NULL, NULL, &pSD) != ERROR_SUCCESS)
+	return FALSE;
+    if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken)) {
+	if (GetTokenInformation(hToken, TokenOwner, cbOwner,
+				sizeof(cbOwner), &n)) {
+	    bOk = EqualSid(pOwner, ((TOKEN_OWNER *) cbOwner)->Owner);
+	}
+	CloseHandle(hToken);
+    }
+    LocalFree(pSD);
+    return bOk;
+}
+
+// ask a which /serve for the names, FALSE if there is none or it
+// didn't answer. the answers are then in pRecv, for print_served().
+BOOL ask_server(LPCTSTR pVal, TCHAR * argv[], INT * nSearchArray,
+		INT nSearch)
+{
+    TCHAR szPipe[_MAX_PATH];
+    HANDLE hPipe;
+    OVERLAPPED ov;
+    DWORD dwMode = PIPE_READMODE_MESSAGE;
+    BOOL bOk;
+    INT i;
+
+    // overlapped, so a server that hangs can be given up on
+    pipe_name(szPipe);
+    hPipe = CreateFile(szPipe, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		       OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY &&
+	WaitNamedPipe(szPipe, SERVER_WAIT)) {
+	hPipe = CreateFile(szPipe, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			   OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    }
+    if (hPipe == INVALID_HANDLE_VALUE)
+	return FALSE;
+    ZeroMemory(&ov, sizeof(ov));
+    if (!own_pipe(hPipe) ||
+	!SetNamedPipeHandleState(hPipe, &dwMode, NULL, NULL) ||
+	(ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL) {
+	CloseHandle(hPipe);
+	return FALSE;
+    }
+
+    msg_reset();
+    msg_put(SERVER_HELLO);
+    _stprintf(szTmp, _T("%d%d%d%d"), bIs4NT ? 1 : 0, bPath ? 1 : 0,
+	      bCurDir ? 1 : 0, pVal ? 1 : 0);
+    msg_put(szTmp);
+    msg_put(cwd);
+    msg_put(pVal ? pVal : _T(""));
+    _stprintf(szTmp, _T("%d"), nSearch);
+    msg_put(szTmp);
+    for (i = 0; i < nSearch; i++) {
+	msg_put(argv[nSearchArray[i]]);
+    }
+
+    dwDeadline = GetTickCount() + SERVER_TIMEOUT;
+    bOk = (msg_send(hPipe, &ov) && msg_recv(hPipe, &ov) &&
+	   nRecv > 0 && lstrcmp(pRecv, SERVER_HELLO) == 0);
+    CloseHandle(ov.hEvent);
+    CloseHandle(hPipe);
+    return bOk;
+}
+
+// print what the server found for the i'th name
+void print_served(INT i)
+{
+    LPCTSTR p = msg_next(pRecv), path, file, end;
+
+    while (p && p[0] != EOS) {
+	if ((path = msg_next(p)) == NULL ||
+	    (file = msg_next(path)) == NULL ||
+	    (end = msg_next(file)) == NULL)
+	    return;
+	if (_ttoi(p) == i && lstrlen(path) + lstrlen(file) < _MAX_PATH - 1) {
+	    bFound = TRUE;
+	    print_file(path, file, end[0] == _T('1'));
+	}
+	p = msg_next(end);
+    }
+}
+
+// the names are in served, not the view's
+void free_view(path_view * v)
+{
+    delete [] v->path;
+    free(v->key);
+    v->key = NULL;
+}
+
+// the directory path, made full from the current directory, as kept by
+// the server. added if it isn't there and bAdd, NULL if it isn't, or
+// out of memory.
+served_dir * find_served(LPCTSTR path, BOOL bAdd)
+{
+    TCHAR szFull[_MAX_PATH];
+    served_dir * s;
+    INT i, n, nFree = -1;
+
+    n = GetFullPathName(path, _MAX_PATH, szFull, NULL);
+    if (n == 0 || n >= _MAX_PATH) {
+	lstrcpyn(szFull, path, _MAX_PATH);
+    }
+    for (i = 0; i < nServed; i++) {
+	if (served[i].path == NULL) {
+	    if (nFree == -1)
+		nFree = i;
+	} else if (lstrcmpi(served[i].path, szFull) == 0) {
+	    return &served[i];
+	}
+    }
+    if (!bAdd)
+	return NULL;
+
+    if (nFree == -1) {
+	if (nServed == nServedMax) {
+	    n = nServedMax ? nServedMax * 2 : 64;
+	    s = (served_dir *) realloc(served, n * sizeof(served_dir));
+	    if (s == NULL)
+		return NULL;
+	    served = s;
+	    nServedMax = n;
+	}
+	nFree = nServed++;
+    }
+    s = &served[nFree];
+    ZeroMemory(s, sizeof(served_dir));
+    if ((s->path = (LPTSTR) malloc((lstrlen(szFull) + 1) *
+				   sizeof(TCHAR))) == NULL)
+	return NULL;
+    lstrcpy(s->path, szFull);
+    s->built = GetTickCount();
+    return s;
+}
+
+// forget the directories checked too long ago, to check them again for
+// being there, and the names of those that changed since they were
+// listed, or can't be watched
+void refresh_served(DWORD now)
+{
+    served_dir * s;
+    INT i;
+
+    for (i = 0; i < nServed; i++) {
+	s = &served[i];
+	if (s->path == NULL)
+	    continue;
+	if (now - s->built >= VIEW_TTL) { // back when next in a path
+	    free_names(s->names);
+	    if (s->hChange) {
+		FindCloseChangeNotification(s->hChange);
+	    }
+	    free(s->path);
+	    ZeroMemory(s, sizeof(served_dir));
+	} else if (s->bListed &&
+		   (s->hChange == NULL ||
+		    WaitForSingleObject(s->hChange, 0) == WAIT_OBJECT_0)) {
+	    if (s->hChange) {
+		FindNextChangeNotification(s->hChange);
+	    }
+	    free_names(s->names);
+	    s->names = NULL;
+	    s->bListed = FALSE;
+	}
+    }
+}
+
+// answer the request in pRecv, into pSend. the answer is where each
+// name was found, as print_file() would be called for it.
+void serve_request()
+{
+    LPCTSTR flags, szCwd, pVal, count, name;
+    LPTSTR key;
+    path_view * v = NULL;
+    DWORD now = GetTickCount();
+    INT i, n;
+
+    msg_reset();
+    if (nRecv == 0 || lstrcmp(pRecv, SERVER_HELLO) != 0 ||
+	(flags = msg_next(pRecv)) == NULL || lstrlen(flags) != 4 ||
+	(szCwd = msg_next(flags)) == NULL ||
+	(pVal = msg_next(szCwd)) == NULL ||
+	(count = msg_next(pVal)) == NULL ||
+	lstrlen(szCwd) >= _MAX_PATH ||
+	!SetCurrentDirectory(szCwd)) { // relative entries are from there
+	msg_put(_T("")); // not answered, it searches itself
+	return;
+    }
+
+    // be the which asking
+    lstrcpyn(cwd, szCwd, _MAX_PATH);
+    bIs4NT = (flags[0] == _T('1'));
+    order = bIs4NT ? order1 : order2;
+    order_len = bIs4NT ? 5 : 4;
+    bPath = (flags[1] == _T('1'));
+    bCurDir = (flags[2] == _T('1'));
+    if (flags[3] != _T('1')) {
+	pVal = NULL;
+    }
+
+    // directories checked a while ago are checked again, for those that
+    // came or went, and those that changed since they were listed are
+    // listed again
+    refresh_served(now);
+
+    // its path, as kept or parsed now. parsing it again for another
+    // current directory only checks that one, and any relative entries,
+    // the others are in served already
+    n = lstrlen(flags) + (pVal ? lstrlen(pVal) : 0) + 2;
+    if ((key = (LPTSTR) malloc(n * sizeof(TCHAR))) == NULL) {
+	msg_put(_T(""));
+	return;
+    }
+    _stprintf(key, _T("%s\n%s"), flags, pVal ? pVal : _T(""));
+    for (i = 0; i < SERVER_VIEWS; i++) {
+	if (views[i].key && lstrcmp(views[i].key, key) == 0) {
+	    v = &views[i];
+	    break;
+	}
+    }
+    if (v && (now - v->built >= VIEW_TTL || lstrcmpi(v->cwd, szCwd) != 0)) {
+	free_view(v);
+    }
+    if (v && v->key) {
+	free(key);
+    } else {
+	if (v == NULL) { // a free one, or the one not asked for longest
+	    for (v = &views[0], i = 1; i < SERVER_VIEWS && v->key; i++) {
+		if (!views[i].key || now - views[i].used > now - v->used)
+		    v = &views[i];
+	    }
+	    if (v->key) {
+		free_view(v);
+	    }
+	}
+	build_path(pVal, FALSE);
+	v->key = key;
+	lstrcpy(v->cwd, szCwd);
+	v->path = sep_path;
+	v->size = p_size;
+	v->built = now;
+    }
+    v->used = now;
+    sep_path = v->path;
+    p_size = v->size;
+    for (i = 0; i < p_size; i++) { // names from served, for this request
+	sep_path[i].bListed = FALSE;
+	sep_path[i].names = NULL;
+    }
+
+    bServing = TRUE;
+    msg_put(SERVER_HELLO);
+    n = _ttoi(count);
+    for (i = 0, name = count; i < n && (name = msg_next(name)); i++) {
+	nServeName = i;
+	path_find(name);
+    }
+    msg_put(_T("")); // the end
+    bServing = FALSE;
+
+    // the view has it, and served the names
+    sep_path = NULL;
+    p_size = 0;
+}
+
+// run as a server until killed
+INT which_serve()
+{
+    TCHAR szPipe[_MAX_PATH];
+    HANDLE hPipe;
+    UINT n;
+
+    // match names the same way as the which asking
+    _tsetlocale(LC_ALL, _T(""));
+
+    // each request is answered from the directory of the which asking,
+    // and we go back here after, so as not to keep that one in use
+    n = GetSystemDirectory(szServeDir, _MAX_PATH);
+    if (n == 0 || n >= _MAX_PATH || !SetCurrentDirectory(szServeDir)) {
+	GetCurrentDirectory(_MAX_PATH, szServeDir); // stay where we are
+    }
+
+    pipe_name(szPipe);
+    hPipe = CreateNamedPipe(szPipe,
+			    PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			    PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE |
+			    PIPE_WAIT,
+			    1,          // one at a time, each takes no time
+			    65536, 65536, 0, NULL);
+    if (hPipe == INVALID_HANDLE_VALUE) {
+	// %s: can't create %s, is another which serving?\n
+	MyLoadString(IDS_SERVE_FAIL);
+	_ftprintf(stderr, szTmp1, pEXE, szPipe);
+	return 1;
+    }
+
+    // Serving searches on %s.\n
+    MyLoadString(IDS_SERVING);
+    _tprintf(szTmp1, szPipe);
+    fflush(stdout);
+
+    for (;;) {
+	if (ConnectNamedPipe(hPipe, NULL) ||
+	    GetLastError() == ERROR_PIPE_CONNECTED) {
+	    if (msg_recv(hPipe, NULL)) {
+		serve_request();
+		SetCurrentDirectory(szServeDir);
+		msg_send(hPipe, NULL);
+		FlushFileBuffers(hPipe);
+	    }
+	}
+	DisconnectNamedPipe(hPipe);
+    }
+}
+
 void print_help(LPCTSTR szMsg = NULL)
 {
 
@@ -760,16 +2374,10 @@ void SetupUNC()
 
     INT i;
 
-    TCHAR szDrive[_MAX_DRIVE];
-    TCHAR szDir[_MAX_DIR];
-    TCHAR szFname[_MAX_FNAME];
-    TCHAR szExt[_MAX_EXT];
-
-    // for each thing in the path array
+    // the directories themselves got their UNC names in probe_path(),
+    // so only the duplicates are left
     for (i = 0; i < p_size; i++) {
 
-	sep_path[i].expanded[0] = EOS;           // nuke the exp string
-
 	if (sep_path[i].bValid &&
 	    sep_path[i].orig[0] != EOS &&        // has something
 	    !(sep_path[i].type & DIR_NOEXIST)) { // and exist
@@ -781,29 +2389,6 @@ void SetupUNC()
 		lstrcpyn(sep_path[i].expanded, // copy net path
 			 sep_path[sep_path[i].value].expanded,
 			 _MAX_PATH);
-		continue;
-	    }
-
-	    // get the drive letter
-	    _tsplitpath(sep_path[i].orig,
-			szDrive,
-			szDir,
-			szFname,
-			szExt);
-
-	    // if has a drive letter, then
-	    if (szDrive[0] != EOS) {
-		if (WNetGetUniversalName(szDrive, // original name
-					 UNIVERSAL_NAME_INFO_LEVEL,
-					 cbTmp,
-					 &dwSize) == NO_ERROR) {
-		    lstrcpyn(sep_path[i].expanded,
-			     uName->lpUniversalName,
-			     _MAX_PATH);
-		    sep_path[i].type |= DIR_NET;
-		}
-	    } else { // cannot extract out drive letter, so UNC?
-		sep_path[i].type |= DIR_NET;
 	    }
 
 	}
@@ -1034,6 +2619,17 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
 		bAliasOnly = TRUE; // search only alias
 	    } else if (lstrcmpi(argv[i] + 1, _T("w")) == 0) {
 		bUpdateAlias = TRUE; // update alias file
+	    } else if (lstrcmpi(argv[i] + 1, _T("r")) == 0) {
+		bRebuild = TRUE; // list directories again
+	    } else if (lstrcmpi(argv[i] + 1, _T("b")) == 0) {
+		bBatch = TRUE; // names from stdin
+	    } else if (lstrcmpi(argv[i] + 1, _T("serve")) == 0) {
+		bServe = TRUE; // answer other which
+	    } else if (lstrcmpi(argv[i] + 1, _T("n")) == 0) {
+		bNoServer = TRUE; // search here
+	    } else if (lstrcmpi(argv[i] + 1, _T("0")) == 0) {
+		bBatch = TRUE; // names from stdin, separated by nul
+		cBatchEnd = EOS;
 	    } else if (lstrcmpi(argv[i] + 1, _T("j")) == 0) {
 		ListJokes();
 		return 0;
@@ -1059,6 +2655,10 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
 	// return 0;
     }
 
+    if (bServe) {
+	return which_serve();
+    }
+
     // if user did not specify a env var, set it to path
     if (pEnv == NULL) {
 	pEnv = _T("Path"); // the default environment var to use
@@ -1068,7 +2668,8 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
 	    bPath = TRUE;
     }
 
-    if (bIs4NT && bPath) { // if in 4nt mode and searching path
+    // no aliases in batch mode
+    if (bIs4NT && bPath && !bBatch) { // if in 4nt mode and searching path
 	// if alias file does not exist, or forced mode, then update it
 	if (!exist_path(szAliasFile) || bUpdateAlias) {
 	    MakeAliasFile();
@@ -1085,8 +2686,8 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
 
     // now all set, do the important stuff
 
-    INT nDirs;     // number of directories in path
     LPCTSTR pVal;  // value of env var
+    BOOL bServed = FALSE;  // answers came from a which /serve
 
     // get the environment variable pointed by pEnv
     pVal = _tgetenv(pEnv);
@@ -1098,34 +2699,16 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
 	exit(1);
     }
 
-    if (pVal) { // if env var found
-	nDirs = GetNumDirInPath(pVal) + 1;
-    } else { // no PATH env defined, so just current dir
-	nDirs = 1;
+    // ask a which /serve first, it has the path ready
+    if (nSearch > 0 && !bBatch && !bAliasOnly && !bNoServer && !bRebuild) {
+	bServed = ask_server(pVal, argv, nSearchArray, nSearch);
     }
-    sep_path = new dir[nDirs]; // might insert current dir
-
-    if (bIs4NT || !bPath) {   // if is 4nt, just reserve space
-	sep_path[0].bValid = FALSE;
-    } else {        // if not 4nt, then first is always current dir
-	sep_path[0].bValid = TRUE;   // tag it valid
-	if (bAliasOnly)
-	    bAliasOnly = FALSE; // alias only search not applicable
-    }
-    sep_path[0].type = DIR_CWD;  // first dir, can't be dup or invalid
-    lstrcpyn(sep_path[0].orig, cwd, _MAX_PATH);
-
-    p_size = 1; // reserve space for the curr dir if need insert
-
-    // setup the sep_path array
-    if (!bCurDir) {         // if not only current dir
-	setup_path(pVal);
-    } else if (!sep_path[0].bValid) { // only if first pos is still not valid
-	sep_path[0].bValid = TRUE;   // tag it valid
+    if (!bServed) {
+	build_path(pVal, nSearch == 0 && !bBatch);
     }
 
     // if no arg, then just print the path
-    if (nSearch == 0) {
+    if (nSearch == 0 && !bBatch) {
 
 	// expand any path to UNC if applicable
 	SetupUNC();
@@ -1143,10 +2726,13 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
     nDTsize = GetDTSize();
 
     // read in the alias list if running under 4nt
-    if (bIs4NT && bPath) {
+    if (bIs4NT && bPath && !bBatch) {
 	ReadAliasList();
     }
 
+    // names of the path directories from the last run
+    open_index();
+
     LPCTSTR pSearch;
 
     // the search array contains integer corresponding to the
@@ -1154,10 +2740,16 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
     for (i = 0; i < nSearch; i++) {
 	bFound = FALSE;
 	pSearch = argv[nSearchArray[i]]; // file to look for
+	if (bBatch) {
+	    batch_name(pSearch);
+	    continue;
+	}
 	if (bIs4NT && bPath) {
 	    FindAliasMatch(pSearch);
 	}
-	if (!bAliasOnly) {
+	if (bServed) {
+	    print_served(i);
+	} else if (!bAliasOnly) {
 	    path_find(pSearch);
 	}
 	if (!bFound) {
@@ -1201,6 +2793,15 @@ extern "C" int _tmain(int argc, TCHAR *argv[], TCHAR *env[])
 	}
     }
 
+    // then the ones piped in
+    if (bBatch) {
+	batch_find();
+    }
+
+    write_index();
+    for (i = 0; i < p_size; i++) {
+	free_names(sep_path[i].names);
+    }
     delete [] sep_path;
     delete [] nSearchArray;
 